@@ -0,0 +1,416 @@
+/*
+ * Copyright (c) 2019-2026 Anatol Belski
+ * All rights reserved.
+ *
+ * Author: Anatol Belski <ab@php.net>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *	notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *	notice, this list of conditions and the following disclaimer in the
+ *	documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+/* The library is built from the same source as the tool, without its
+ * main(). The options parsed by convey_open() end up in the global conf
+ * as they do for the tool, so the opens take turns; once open, a session
+ * only uses its own handles. */
+#define CONVEY_LIBRARY
+#include "main.cxx"
+#include "libconvey.h"
+
+struct convey_session {
+	convey_serve_spec spec;
+	SOCKET lsock;
+	HANDLE h;
+	bool is_socket;
+	bool serial;
+	int family;	/* of the last connect, tried first */
+	convey_tcp_opts tcp;	/* for the client a listen session takes */
+	bool hex;
+	bool timestamps;
+	size_t hex_offset;	/* of the --hex display, across runs */
+	bool line_start;	/* for --timestamps */
+	HANDLE log;
+	HANDLE log_recv;
+	HANDLE log_send;
+#ifdef _WIN32
+	HANDLE ev;
+#endif
+};
+
+static std::mutex lib_lock;
+
+/* What is left of the timeout, -1 for none. */
+static int convey_lib_left(std::chrono::steady_clock::time_point end, int timeout_ms)
+{/*{{{*/
+	if (timeout_ms < 0) {
+		return -1;
+	}
+	auto left = std::chrono::duration_cast<std::chrono::milliseconds>(end - std::chrono::steady_clock::now()).count();
+	return left > 0 ? static_cast<int>(left) : 0;
+}/*}}}*/
+
+static void convey_lib_free(convey_session* s)
+{/*{{{*/
+	convey_serve_close(s->h, s->is_socket);
+	if (INVALID_SOCKET != s->lsock) {
+		closesocket(s->lsock);
+		if (convey_tp_unix_server == s->spec.lts.kind) {
+			DeleteFileA(s->spec.lts.path.c_str());
+		}
+	}
+	convey_serve_close(s->log, false);
+	convey_serve_close(s->log_recv, false);
+	convey_serve_close(s->log_send, false);
+#ifdef _WIN32
+	if (s->ev) {
+		CloseHandle(s->ev);
+	}
+#endif
+	delete s;
+}/*}}}*/
+
+#ifndef _WIN32
+/* A write to a pipe or fifo whose reader is gone raises SIGPIPE, and that
+ * would end the host. Where the descriptor can't be told not to, it is
+ * held back on this thread for the write and taken off again. */
+static ssize_t convey_lib_write_fd(int fd, const char* p, size_t n)
+{/*{{{*/
+#ifdef F_SETNOSIGPIPE
+	return write(fd, p, n);
+#else
+	sigset_t pipe_set, old, pending;
+	sigemptyset(&pipe_set);
+	sigaddset(&pipe_set, SIGPIPE);
+	pthread_sigmask(SIG_BLOCK, &pipe_set, &old);
+	sigpending(&pending);
+	bool was_pending = sigismember(&pending, SIGPIPE);
+
+	ssize_t w = write(fd, p, n);
+	int er = errno;
+	if (w < 0 && EPIPE == er && !was_pending) {
+		struct timespec zero = {0, 0};
+		while (-1 == sigtimedwait(&pipe_set, nullptr, &zero) && EINTR == errno) {
+		}
+	}
+
+	pthread_sigmask(SIG_SETMASK, &old, nullptr);
+	errno = er;
+	return w;
+#endif
+}/*}}}*/
+#endif
+
+static void convey_lib_log(convey_session* s, const char* buf, size_t len, bool sent)
+{/*{{{*/
+	convey_log_to(sent ? s->log_send : s->log_recv, buf, static_cast<DWORD>(len));
+	if (INVALID_HANDLE_VALUE != s->log) {
+		std::string rec(len + 2, '\0');
+		convey_log_to(s->log, &rec[0], convey_log_session_record(&rec[0], buf, static_cast<DWORD>(len), sent));
+	}
+}/*}}}*/
+
+/* A listen endpoint takes its client with the first I/O. 1 when there is
+ * one, 0 on a timeout, -1 on an error. */
+static int convey_lib_accept(convey_session* s, int timeout_ms)
+{/*{{{*/
+	if (INVALID_HANDLE_VALUE != s->h) {
+		return 1;
+	}
+	if (INVALID_SOCKET == s->lsock) {
+		return -1;
+	}
+
+	struct pollfd pfd = { s->lsock, POLLIN, 0 };
+	int n = WSAPoll(&pfd, 1, timeout_ms);
+	if (n <= 0) {
+		return n;
+	}
+
+	SOCKET c = accept(s->lsock, nullptr, nullptr);
+	if (INVALID_SOCKET == c) {
+		return -1;
+	}
+#ifndef _WIN32
+	fcntl(c, F_SETFD, FD_CLOEXEC);
+	convey_set_nonblocking(c, true);
+#endif
+	if (convey_tp_tcp_server == s->spec.lts.kind) {
+		convey_tcp_tune(c, s->tcp);
+	}
+	s->h = reinterpret_cast<HANDLE>(c);
+	s->is_socket = true;
+
+	return 1;
+}/*}}}*/
+
+const char* convey_version(void)
+{/*{{{*/
+	return VERSION;
+}/*}}}*/
+
+convey_session* convey_open(const char* endpoint, int argc, const char* const* argv)
+{/*{{{*/
+	std::lock_guard<std::mutex> lk(lib_lock);
+
+	std::vector<char*> args;
+	args.push_back(const_cast<char*>("convey"));
+	for (int i = 0; i < argc; i++) {
+		args.push_back(const_cast<char*>(argv[i]));
+	}
+	args.push_back(const_cast<char*>(endpoint));
+	conf = convey_conf{};
+	if (convey_setup_ok != convey_conf_setup(static_cast<int>(args.size()), args.data())) {
+		return nullptr;
+	}
+	restart_on_exit = false;
+	if (conf.gdb || conf.kd || !conf.mux.empty() || conf.resume || !conf.pty_link.empty()
+			|| !conf.zsend_files.empty() || !conf.zrecv_dir.empty() || !conf.send_file.empty() || !conf.recv_file.empty()) {
+		std::cerr << "convey: --gdb, --kd, --mux, --resume, --pty-link and transfers don't apply to a library session" << std::endl;
+		return nullptr;
+	}
+	if (conf.bridge || conf.read_only || conf.queue_limit) {
+		std::cerr << "convey: the console, bridge and server options don't apply to a library session" << std::endl;
+		return nullptr;
+	}
+	if (convey_tp_shm == conf.transport || convey_tp_rfc2217 == conf.transport || convey_tp_ws_server == conf.transport
+			|| convey_tp_udp_client == conf.transport || convey_tp_udp_server == conf.transport) {
+		std::cerr << "convey: shm:, rfc2217:, ws-listen: and udp endpoints don't apply to a library session" << std::endl;
+		return nullptr;
+	}
+	if (!convey_wsa_init()) {
+		return nullptr;
+	}
+
+	convey_session* s = new convey_session();
+	s->spec.endpoint = endpoint;
+	s->spec.ets = convey_parse_transport(endpoint);
+	s->lsock = INVALID_SOCKET;
+	s->family = AF_UNSPEC;
+	s->tcp = convey_tcp_opts_conf();
+	s->hex = conf.hex;
+	s->timestamps = conf.timestamps;
+	s->line_start = true;
+	s->h = s->log = s->log_recv = s->log_send = INVALID_HANDLE_VALUE;
+#ifdef _WIN32
+	s->ev = CreateEvent(nullptr, true, false, nullptr);
+#endif
+
+	DWORD err = 0;
+	if (convey_tp_tcp_server == s->spec.ets.kind || convey_tp_unix_server == s->spec.ets.kind || convey_tp_vsock_server == s->spec.ets.kind) {
+		s->spec.listen = endpoint;
+		s->spec.lts = s->spec.ets;
+		s->lsock = convey_serve_listen_socket(s->spec, err);
+		if (INVALID_SOCKET == s->lsock) {
+			std::cerr << "convey: can't listen on '" << endpoint << "'" << std::endl;
+			convey_error(err);
+			convey_lib_free(s);
+			return nullptr;
+		}
+	} else {
+		/* Give a VM that is still starting up the --poll seconds to
+		 * create its pipe. */
+		size_t elapsed = 0, step = 300 /* milliseconds*/;
+		while (INVALID_HANDLE_VALUE == (s->h = convey_serve_open(s->spec, s->family, err)) && elapsed/1000 < conf.pipe_poll) {
+			std::this_thread::sleep_for(std::chrono::milliseconds(step));
+			elapsed += step;
+		}
+		if (INVALID_HANDLE_VALUE == s->h) {
+			std::cerr << "convey: can't open '" << endpoint << "'" << std::endl;
+			convey_error(err);
+			convey_lib_free(s);
+			return nullptr;
+		}
+		s->is_socket = convey_tp_tcp_client == s->spec.ets.kind || convey_tp_unix_client == s->spec.ets.kind
+			|| convey_tp_vsock_client == s->spec.ets.kind;
+		s->serial = !s->is_socket && convey_is_serial(s->h);
+#ifndef _WIN32
+		convey_set_nonblocking(s->h, true);
+#ifdef F_SETNOSIGPIPE
+		fcntl(s->h, F_SETNOSIGPIPE, 1);
+#endif
+#endif
+	}
+
+	if (!convey_open_log(conf.log_path, s->log)
+			|| !convey_open_log(conf.log_recv_path, s->log_recv)
+			|| !convey_open_log(conf.log_send_path, s->log_send)) {
+		convey_error();
+		convey_lib_free(s);
+		return nullptr;
+	}
+
+	return s;
+}/*}}}*/
+
+int convey_write(convey_session* s, const void* buf, size_t len, int timeout_ms)
+{/*{{{*/
+	auto end = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+	int rc = convey_lib_accept(s, timeout_ms);
+	if (rc <= 0) {
+		return rc;
+	}
+
+	const char* p = static_cast<const char*>(buf);
+	size_t off = 0;
+	while (off < len) {
+		int left = convey_lib_left(end, timeout_ms);
+		DWORD chunk = (len - off > RECV_BUF_SIZE) ? RECV_BUF_SIZE : static_cast<DWORD>(len - off);
+		DWORD n = 0;
+#ifdef _WIN32
+		OVERLAPPED ov;
+		memset(&ov, 0, sizeof ov);
+		ov.hEvent = s->ev;
+		if (!WriteFile(s->h, p + off, chunk, &n, &ov)) {
+			if (ERROR_IO_PENDING != GetLastError()) {
+				return -1;
+			}
+			if (WAIT_TIMEOUT == WaitForSingleObject(s->ev, static_cast<DWORD>(left))) {
+				CancelIoEx(s->h, &ov);
+			}
+			if (!GetOverlappedResult(s->h, &ov, &n, TRUE) && ERROR_OPERATION_ABORTED != GetLastError()) {
+				return -1;
+			}
+		}
+#else
+		struct pollfd pfd = { s->h, POLLOUT, 0 };
+		int pn = poll(&pfd, 1, left);
+		if (pn < 0 && EINTR != errno) {
+			return -1;
+		}
+		if (pn > 0) {
+			ssize_t w = s->is_socket ? send(s->h, p + off, chunk, MSG_NOSIGNAL) : convey_lib_write_fd(s->h, p + off, chunk);
+			if (w < 0 && EINTR != errno && EAGAIN != errno && EWOULDBLOCK != errno) {
+				return -1;
+			}
+			n = (w > 0) ? static_cast<DWORD>(w) : 0;
+		}
+#endif
+		if (n) {
+			convey_lib_log(s, p + off, n, true);
+			off += n;
+		} else if (0 == convey_lib_left(end, timeout_ms)) {
+			break;
+		}
+	}
+
+	return static_cast<int>(off);
+}/*}}}*/
+
+int convey_read(convey_session* s, void* buf, size_t len, int timeout_ms)
+{/*{{{*/
+	auto end = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+	int rc = convey_lib_accept(s, timeout_ms);
+	if (rc <= 0) {
+		return rc;
+	}
+
+	char* p = static_cast<char*>(buf);
+	DWORD want = (len > RECV_BUF_SIZE) ? RECV_BUF_SIZE : static_cast<DWORD>(len);
+	while (true) {
+		int left = convey_lib_left(end, timeout_ms);
+		DWORD n = 0;
+#ifdef _WIN32
+		OVERLAPPED ov;
+		memset(&ov, 0, sizeof ov);
+		ov.hEvent = s->ev;
+		if (!ReadFile(s->h, p, want, &n, &ov)) {
+			if (ERROR_IO_PENDING != GetLastError()) {
+				return -1;
+			}
+			if (WAIT_TIMEOUT == WaitForSingleObject(s->ev, static_cast<DWORD>(left))) {
+				CancelIoEx(s->h, &ov);
+			}
+			if (!GetOverlappedResult(s->h, &ov, &n, TRUE)) {
+				return (ERROR_OPERATION_ABORTED == GetLastError()) ? 0 : -1;
+			}
+		}
+		/* An idle serial port completes empty after a while. */
+		if (!n && !s->serial) {
+			return -1;
+		}
+#else
+		struct pollfd pfd = { s->h, POLLIN, 0 };
+		int pn = poll(&pfd, 1, left);
+		if (pn < 0 && EINTR != errno) {
+			return -1;
+		}
+		if (pn > 0) {
+			ssize_t r = read(s->h, p, want);
+			if (0 == r) {
+				return -1;
+			}
+			if (r < 0 && EINTR != errno && EAGAIN != errno && EWOULDBLOCK != errno) {
+				return -1;
+			}
+			n = (r > 0) ? static_cast<DWORD>(r) : 0;
+		}
+#endif
+		if (n) {
+			convey_lib_log(s, p, n, false);
+			return static_cast<int>(n);
+		}
+		if (0 == convey_lib_left(end, timeout_ms)) {
+			return 0;
+		}
+	}
+}/*}}}*/
+
+int convey_run(convey_session* s, convey_data_cb cb, void* ctx, int timeout_ms)
+{/*{{{*/
+	auto end = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+	std::vector<char> buf(RECV_BUF_SIZE);
+
+	while (true) {
+		int n = convey_read(s, buf.data(), buf.size(), convey_lib_left(end, timeout_ms));
+		if (n < 0) {
+			return -1;
+		}
+		if (n > 0) {
+			/* Shown as the console would show it. */
+			const char* p = buf.data();
+			DWORD len = static_cast<DWORD>(n);
+			std::string hexbuf, tsbuf;
+			if (s->hex) {
+				convey_hexdump(p, len, s->hex_offset, hexbuf);
+				p = hexbuf.data();
+				len = static_cast<DWORD>(hexbuf.size());
+			}
+			if (s->timestamps) {
+				convey_stamp_lines(p, len, s->line_start, tsbuf);
+				p = tsbuf.data();
+				len = static_cast<DWORD>(tsbuf.size());
+			}
+			if (cb(ctx, p, len)) {
+				return 1;
+			}
+		}
+		if (0 == convey_lib_left(end, timeout_ms)) {
+			return 0;
+		}
+	}
+}/*}}}*/
+
+void convey_close(convey_session* s)
+{/*{{{*/
+	if (s) {
+		convey_lib_free(s);
+	}
+}/*}}}*/
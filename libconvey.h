@@ -0,0 +1,100 @@
+/*
+ * Copyright (c) 2019-2026 Anatol Belski
+ * All rights reserved.
+ *
+ * Author: Anatol Belski <ab@php.net>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *	notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *	notice, this list of conditions and the following disclaimer in the
+ *	documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+/* libconvey, the convey transports and their logging and display
+ * formats behind a C API. The relay between two endpoints, the bridge
+ * with its --gdb and --kd handling, stays in the tool; a host relays by
+ * reading from one session and writing to the other.
+ *
+ * A session is one endpoint, named as on the convey command line:
+ * \\.\pipe\<name>, a device like COM1 or /dev/ttyS0, tcp:<host>:<port>,
+ * tcp-listen:<port>, unix:<path> or unix-listen:<path>. A listen endpoint
+ * takes its client on the first read or write. The data is read either
+ * into a buffer with convey_read(), or handed to a callback by
+ * convey_run(). A session is used from one thread at a time, different
+ * sessions may run in parallel. */
+
+#ifndef LIBCONVEY_H
+#define LIBCONVEY_H
+
+#include <stddef.h>
+
+#if defined(_WIN32)
+# if defined(CONVEY_BUILD_DLL)
+#  define CONVEY_API __declspec(dllexport)
+# elif defined(CONVEY_DLL)
+#  define CONVEY_API __declspec(dllimport)
+# else
+#  define CONVEY_API
+# endif
+#else
+# define CONVEY_API __attribute__((visibility("default")))
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct convey_session convey_session;
+
+/* Return nonzero to stop convey_run(). */
+typedef int (*convey_data_cb)(void* ctx, const char* buf, size_t len);
+
+/* The version of the library, as printed by convey --version. */
+CONVEY_API const char* convey_version(void);
+
+/* Open an endpoint. The options are those of the command line, for
+ * example { "--baud", "9600", "--log", "session.log" }, argc may be
+ * 0. --hex and --timestamps format what convey_run() hands on. The
+ * console, bridge and server options don't apply, nor do --gdb,
+ * --kd, --mux, --resume, --pty-link and the transfers. NULL on error,
+ * the reason goes to stderr. */
+CONVEY_API convey_session* convey_open(const char* endpoint, int argc, const char* const* argv);
+
+/* Write all of buf. The number of bytes written, less on a timeout, or
+ * -1 once the endpoint is gone. A negative timeout waits forever. */
+CONVEY_API int convey_write(convey_session* s, const void* buf, size_t len, int timeout_ms);
+
+/* Read what is there, waiting up to the timeout for the first byte. The
+ * number of bytes read, 0 on a timeout, or -1 once the endpoint is gone.
+ * The bytes are as they came, --hex and --timestamps don't apply. */
+CONVEY_API int convey_read(convey_session* s, void* buf, size_t len, int timeout_ms);
+
+/* Pass everything read to the callback until it returns nonzero (1), the
+ * timeout passes (0), or the endpoint is gone (-1). With --hex or
+ * --timestamps the callback gets it formatted as the console shows it. */
+CONVEY_API int convey_run(convey_session* s, convey_data_cb cb, void* ctx, int timeout_ms);
+
+CONVEY_API void convey_close(convey_session* s);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -28,27 +28,176 @@
  */
 
 /* {{{ Includes */
+#ifdef _WIN32
 #define NOMINMAX
 #include <winsock2.h>
 #include <ws2tcpip.h>
+#include <mstcpip.h>
+#include <mswsock.h>
+#include <afunix.h>
+#include <hvsocket.h>
 #include <windows.h>
 #include <conio.h>
 #include <fcntl.h>
 #include <io.h>
+#else
+#include <sys/types.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <strings.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include <cerrno>
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/inotify.h>
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+#endif
+#if defined(__linux__) && __has_include(<linux/vm_sockets.h>)
+#include <linux/vm_sockets.h>
+#define CONVEY_HAVE_VSOCK 1
+#endif
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+/* Headers from Linux 6.0 and up, with provided buffer rings and
+ * multishot receive; older ones can't build the engine. */
+#ifdef IORING_RECV_MULTISHOT
+#define CONVEY_HAVE_URING 1
+#endif
+#endif
+#endif
 
 #include <cstring>
 #include <cstdlib>
 #include <iostream>
 #include <thread>
 #include <atomic>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <vector>
+#include <map>
+#include <random>
+#include <memory>
+#include <fstream>
+#include <sstream>
 
 #include "CLI11.hpp"
 
 #include "config.h"
 /* }}} */
 
+/* {{{ Platform layer */
+#ifndef _WIN32
+/* The code speaks Win32, on POSIX a handle and a socket both are a file
+ * descriptor. The serial parameter codes keep their Win32 values, so the
+ * option parsers are shared and only the termios setup differs. */
+typedef int HANDLE;
+typedef int SOCKET;
+typedef int BOOL;
+typedef uint32_t DWORD;
+typedef unsigned long ULONG;
+typedef unsigned long long ULONGLONG;
+
+#define INVALID_HANDLE_VALUE (-1)
+#define INVALID_SOCKET (-1)
+#define SOCKET_ERROR (-1)
+#define TRUE 1
+
+#define CBR_110 110
+#define CBR_300 300
+#define CBR_600 600
+#define CBR_1200 1200
+#define CBR_2400 2400
+#define CBR_4800 4800
+#define CBR_9600 9600
+#define CBR_14400 14400
+#define CBR_19200 19200
+#define CBR_38400 38400
+#define CBR_57600 57600
+#define CBR_115200 115200
+#define CBR_128000 128000
+#define CBR_256000 256000
+
+#define NOPARITY 0
+#define ODDPARITY 1
+#define EVENPARITY 2
+#define MARKPARITY 3
+#define SPACEPARITY 4
+
+#define ONESTOPBIT 0
+#define ONE5STOPBITS 1
+#define TWOSTOPBITS 2
+
+#define ERROR_BROKEN_PIPE EPIPE
+#define ERROR_NETNAME_DELETED ECONNRESET
+#define ERROR_CONNECTION_ABORTED ECONNABORTED
+#define ERROR_OPERATION_ABORTED ECANCELED
+#define ERROR_INVALID_PARAMETER EINVAL
+#define ERROR_PIPE_BUSY EBUSY
+#define SD_BOTH SHUT_RDWR
+#define WSAEWOULDBLOCK EWOULDBLOCK
+#define WSAEINPROGRESS EINPROGRESS
+#define WSAETIMEDOUT ETIMEDOUT
+#define WSAECONNREFUSED ECONNREFUSED
+#define WSAEADDRINUSE EADDRINUSE
+
+static inline DWORD GetLastError(void)
+{
+	return errno;
+}
+
+static inline int WSAGetLastError(void)
+{
+	return errno;
+}
+
+static inline BOOL CloseHandle(HANDLE h)
+{
+	return 0 == close(h);
+}
+
+static inline int closesocket(SOCKET s)
+{
+	return close(s);
+}
+
+static inline int WSAPoll(struct pollfd* fds, ULONG n, int timeout)
+{
+	return poll(fds, n, timeout);
+}
+
+static inline BOOL DeleteFileA(const char* path)
+{
+	return 0 == unlink(path);
+}
+
+static inline ULONGLONG GetTickCount64(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return static_cast<ULONGLONG>(ts.tv_sec) * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Written to cancel the blocking I/O of a session, the per-direction
+ * events are duplicates of its read end and so all wake up at once. */
+static int session_wake[2] = { -1, -1 };
+#endif
+/* }}} */
+
 /* {{{ Global decls */
-static HANDLE pipe{INVALID_HANDLE_VALUE},
+static HANDLE epipe{INVALID_HANDLE_VALUE},
 			bpipe{INVALID_HANDLE_VALUE},
 			in{INVALID_HANDLE_VALUE},
 			out{INVALID_HANDLE_VALUE},
@@ -56,10 +205,15 @@ static HANDLE pipe{INVALID_HANDLE_VALUE},
 			e_pipe_r{INVALID_HANDLE_VALUE},
 			e_in{INVALID_HANDLE_VALUE},
 			e_out{INVALID_HANDLE_VALUE};
+#ifdef _WIN32
 static DWORD orig_ccp{0},
 			 orig_cocp{0},
 			 orig_in_cmode{0},
 			 orig_out_cmode{0};
+#else
+static struct termios orig_tattr;
+static bool tattr_saved{false};
+#endif
 static bool is_console{false},
 			in_is_pipe{false},
 			out_is_pipe{false};
@@ -68,12 +222,26 @@ static std::atomic<bool> shutting_down{false};
 static std::atomic<bool> ctrl_mode{false};
 static bool restart_on_exit = false;
 static SOCKET listen_sock{INVALID_SOCKET};
+static std::string listen_path;
+#ifdef _WIN32
 static HANDLE stdin_thread{INVALID_HANDLE_VALUE};
+#endif
 static HANDLE log_handle{INVALID_HANDLE_VALUE};
 static HANDLE log_recv_handle{INVALID_HANDLE_VALUE};
 static HANDLE log_send_handle{INVALID_HANDLE_VALUE};
+/* Sizes of the datagrams in the last udp: read, the session log keeps
+ * them apart. */
+static std::vector<DWORD> log_recv_dgrams;
+static std::atomic<ULONGLONG> bridge_last_rx{0};
 
 #define BUF_SIZE 4096
+/* Endpoint reads, so a fast link isn't capped by the per-read overhead. */
+#define RECV_BUF_SIZE 65536
+
+/* --sndbuf/--rcvbuf value asking for sizes from the measured bandwidth-delay product. */
+#define SOCKBUF_AUTO -1
+#define SOCKBUF_AUTO_MIN (64 * 1024)
+#define SOCKBUF_AUTO_MAX (16 * 1024 * 1024)
 
 enum convey_flow_control {
 	convey_flow_control_none,
@@ -82,34 +250,132 @@ enum convey_flow_control {
 	convey_flow_control_dsrdtr
 };
 
+enum convey_queue_drop {
+	convey_queue_drop_block,
+	convey_queue_drop_oldest,
+	convey_queue_drop_newest
+};
+
+enum convey_io_engine {
+	convey_io_engine_auto,
+	convey_io_engine_threads,
+	convey_io_engine_uring
+};
+
+enum convey_xfer_proto {
+	convey_xfer_zmodem,
+	convey_xfer_ymodem,
+	convey_xfer_xmodem
+};
+
 enum convey_transport {
 	convey_tp_pipe,
 	convey_tp_serial,
 	convey_tp_tcp_client,
-	convey_tp_tcp_server
+	convey_tp_tcp_server,
+	convey_tp_unix_client,
+	convey_tp_unix_server,
+	convey_tp_shm,
+	convey_tp_rfc2217,
+	convey_tp_ws_server,
+	convey_tp_vsock_client,
+	convey_tp_vsock_server,
+	convey_tp_udp_client,
+	convey_tp_udp_server
 };
 
 struct convey_transport_spec {
 	convey_transport kind;
 	std::string host;
 	std::string port;
+	std::string path;
 	bool ok;
 };
 
+/* A vsock port is a plain 32 bit number, there are no service names. */
+static bool convey_vsock_port(const std::string& s, uint32_t& port)
+{/*{{{*/
+	if (s.empty() || s.size() > 10 || std::string::npos != s.find_first_not_of("0123456789")) {
+		return false;
+	}
+	unsigned long long v = std::stoull(s);
+	if (v > 0xffffffffULL) {
+		return false;
+	}
+	port = static_cast<uint32_t>(v);
+	return true;
+}/*}}}*/
+
 static convey_transport_spec convey_parse_transport(const std::string& spec)
 {/*{{{*/
-	convey_transport_spec r{convey_tp_pipe, "", "", true};
+	convey_transport_spec r{convey_tp_pipe, "", "", "", true};
+	uint32_t port;
 
 	const std::string tcp_pfx = "tcp:";
 	const std::string tcpl_pfx = "tcp-listen:";
-
-	if (0 == spec.compare(0, tcpl_pfx.size(), tcpl_pfx)) {
+	const std::string unix_pfx = "unix:";
+	const std::string unixl_pfx = "unix-listen:";
+	const std::string shm_pfx = "shm:";
+	const std::string rfc2217_pfx = "rfc2217:";
+	const std::string wsl_pfx = "ws-listen:";
+	const std::string vsock_pfx = "vsock:";
+	const std::string vsockl_pfx = "vsock-listen:";
+	const std::string udp_pfx = "udp:";
+	const std::string udpl_pfx = "udp-listen:";
+
+	if (0 == spec.compare(0, shm_pfx.size(), shm_pfx)) {
+		r.kind = convey_tp_shm;
+		r.path = spec.substr(shm_pfx.size());
+		r.ok = !r.path.empty() && r.path.size() <= 200 && std::string::npos == r.path.find_first_of("/\\");
+	} else if (0 == spec.compare(0, unixl_pfx.size(), unixl_pfx)) {
+		r.kind = convey_tp_unix_server;
+		r.path = spec.substr(unixl_pfx.size());
+		r.ok = !r.path.empty() && r.path.size() < sizeof(((struct sockaddr_un *)nullptr)->sun_path);
+	} else if (0 == spec.compare(0, unix_pfx.size(), unix_pfx)) {
+		r.kind = convey_tp_unix_client;
+		r.path = spec.substr(unix_pfx.size());
+		r.ok = !r.path.empty() && r.path.size() < sizeof(((struct sockaddr_un *)nullptr)->sun_path);
+	} else if (0 == spec.compare(0, vsockl_pfx.size(), vsockl_pfx)) {
+		r.kind = convey_tp_vsock_server;
+		r.port = spec.substr(vsockl_pfx.size());
+		r.ok = convey_vsock_port(r.port, port);
+	} else if (0 == spec.compare(0, vsock_pfx.size(), vsock_pfx)) {
+		/* The CID is a number, on Windows also the GUID of a VM. */
+		r.kind = convey_tp_vsock_client;
+		std::string cp = spec.substr(vsock_pfx.size());
+		auto pos = cp.rfind(':');
+		if (std::string::npos == pos || 0 == pos) {
+			r.ok = false;
+		} else {
+			r.host = cp.substr(0, pos);
+			r.port = cp.substr(pos + 1);
+			r.ok = convey_vsock_port(r.port, port);
+		}
+	} else if (0 == spec.compare(0, wsl_pfx.size(), wsl_pfx)) {
+		r.kind = convey_tp_ws_server;
+		r.port = spec.substr(wsl_pfx.size());
+		r.ok = !r.port.empty();
+	} else if (0 == spec.compare(0, tcpl_pfx.size(), tcpl_pfx)) {
 		r.kind = convey_tp_tcp_server;
 		r.port = spec.substr(tcpl_pfx.size());
 		r.ok = !r.port.empty();
-	} else if (0 == spec.compare(0, tcp_pfx.size(), tcp_pfx)) {
+	} else if (0 == spec.compare(0, udpl_pfx.size(), udpl_pfx)) {
+		r.kind = convey_tp_udp_server;
+		r.port = spec.substr(udpl_pfx.size());
+		r.ok = !r.port.empty();
+	} else if (0 == spec.compare(0, tcp_pfx.size(), tcp_pfx) || 0 == spec.compare(0, rfc2217_pfx.size(), rfc2217_pfx)
+			|| 0 == spec.compare(0, udp_pfx.size(), udp_pfx)) {
+		/* RFC 2217 is Telnet over a TCP connection. */
+		size_t pfx = tcp_pfx.size();
 		r.kind = convey_tp_tcp_client;
-		std::string hp = spec.substr(tcp_pfx.size());
+		if (0 == spec.compare(0, rfc2217_pfx.size(), rfc2217_pfx)) {
+			pfx = rfc2217_pfx.size();
+			r.kind = convey_tp_rfc2217;
+		} else if (0 == spec.compare(0, udp_pfx.size(), udp_pfx)) {
+			pfx = udp_pfx.size();
+			r.kind = convey_tp_udp_client;
+		}
+		std::string hp = spec.substr(pfx);
 		auto pos = hp.rfind(':');
 		if (std::string::npos == pos || 0 == pos || pos + 1 == hp.size()) {
 			r.ok = false;
@@ -122,6 +388,34 @@ static convey_transport_spec convey_parse_transport(const std::string& spec)
 	return r;
 }/*}}}*/
 
+/* One line of the --serve file. A client of the listen side gets linked
+ * to a freshly opened endpoint, one client at a time. */
+struct convey_serve_spec {
+	std::string listen;
+	std::string endpoint;
+	convey_transport_spec lts;
+	convey_transport_spec ets;
+};
+
+/* The local end of a --mux channel. A listen endpoint takes a client at
+ * a time, a pty is always there, and an endpoint to connect to is opened
+ * when data for it comes from the other end. */
+#define MUX_CHANNELS 16
+
+/* Payload of a --resume data frame at most, the buffer holds one. */
+#define RESUME_FRAME 16384
+
+enum convey_mux_kind {
+	convey_mux_listen,
+	convey_mux_connect,
+	convey_mux_pty
+};
+
+struct convey_mux_spec {
+	convey_mux_kind kind;
+	convey_serve_spec sp;	/* listen or endpoint, by the kind */
+};
+
 static DWORD convey_trim_crlf(const char* buf, DWORD bytes)
 {/*{{{*/
 	if (bytes >= 2 && '\n' == buf[bytes - 1] && '\r' == buf[bytes - 2]) {
@@ -146,16 +440,138 @@ struct convey_conf {
 	convey_transport transport;
 	std::string tcp_host;
 	std::string tcp_port;
+	std::string unix_path;
+	std::string shm_name;
+	std::string rfc2217_port;
 	bool bridge;
+	bool gdb;
+	bool gdb_cache;
+	bool gdb_widen;
+	bool kd;
 	std::string bridge_pipe_name;
+	std::string pty_link;
 	std::string log_path;
 	std::string log_recv_path;
 	std::string log_send_path;
 	bool log_append;
+	double connect_timeout;
+	double dns_ttl;
+	uint32_t keepalive_idle;
+	uint32_t keepalive_interval;
+	uint32_t keepalive_count;
+	uint32_t user_timeout;
+	uint32_t silence_timeout;
+	int sndbuf;
+	int rcvbuf;
+	size_t queue_limit;
+	convey_queue_drop queue_drop;
+	convey_io_engine io_engine;
+	std::vector<std::string> zsend_files;
+	std::string zrecv_dir;
+	convey_xfer_proto xfer_proto;
+	std::string send_file;
+	std::string recv_file;
+	std::vector<convey_mux_spec> mux;
+	bool compress;
+	bool resume;
+	size_t resume_buffer;
+	std::vector<convey_serve_spec> serve;
+	uint32_t serve_workers;
+	std::string serve_control;
 };
 
 static convey_conf conf{0};
 
+/* Input waiting to be sent to the endpoint. The stdin reader fills it
+ * independently of the session, so typed or piped input survives a
+ * reconnect and goes out in order once the link is back. */
+struct convey_outq {
+	std::mutex lock;
+	std::condition_variable cv;
+	std::deque<std::string> chunks;
+	size_t bytes{0};
+	size_t limit{0};
+	convey_queue_drop drop{convey_queue_drop_block};
+	uint64_t dropped{0};
+	bool eof{false};
+	bool kick{false};	/* wake the sender, with --resume for an ack */
+};
+
+static convey_outq outq;
+static bool stdin_pump_started = false;
+
+/* Address family that won the last connect of the console session, tried
+ * first on reconnect. The --serve, --mux and library sessions keep their
+ * own. */
+static int tcp_family_hint = AF_UNSPEC;
+
+/* A resolved address, copied out of the getaddrinfo() result. */
+struct convey_addr {
+	int family;
+	int socktype;
+	int protocol;
+	struct sockaddr_storage addr;
+	int addrlen;
+};
+
+/* Addresses of the tcp: targets, by host and port, kept across
+ * reconnects. Past the TTL they're still used while a background lookup
+ * refreshes them, so a reconnect never waits on DNS once the target was
+ * resolved. */
+struct convey_resolve_entry {
+	std::vector<convey_addr> addrs;
+	std::chrono::steady_clock::time_point resolved_at;
+	bool refreshing{false};
+	bool stale{false};
+};
+
+struct convey_resolve_cache {
+	std::mutex lock;
+	std::map<std::pair<std::string, std::string>, convey_resolve_entry> entries;
+};
+
+static convey_resolve_cache resolve_cache;
+
+/* Counters printed with --verbose when a session ends. */
+struct convey_stats {
+	std::atomic<uint64_t> resolves{0};
+	std::atomic<uint64_t> resolve_hits{0};
+	std::atomic<uint64_t> resolve_last_ms{0};
+	std::atomic<uint64_t> resolve_total_ms{0};
+	std::atomic<int> sndbuf{0};
+	std::atomic<int> rcvbuf{0};
+	std::atomic<uint64_t> uring_enters{0};
+	std::atomic<uint64_t> uring_cqes{0};
+	std::atomic<uint64_t> rsp_packets{0};
+	std::atomic<uint64_t> rsp_bad{0};
+	std::atomic<uint64_t> rsp_resends{0};
+	std::atomic<uint64_t> rsp_cache_hits{0};
+	std::atomic<uint64_t> kd_packets{0};
+	std::atomic<uint64_t> kd_bad{0};
+	std::atomic<uint64_t> kd_resends{0};
+	std::atomic<uint64_t> kd_repeats{0};
+	std::atomic<uint64_t> kd_breakins{0};
+	std::atomic<uint64_t> kd_acks{0};
+	std::atomic<uint64_t> kd_ack_us_total{0};
+	std::atomic<uint64_t> kd_ack_us_max{0};
+	std::atomic<uint64_t> mux_frames_in{0};
+	std::atomic<uint64_t> mux_frames_out{0};
+	std::atomic<uint64_t> mux_bad{0};
+	std::atomic<uint64_t> mux_lost{0};
+	std::atomic<uint64_t> lz_raw_out{0};
+	std::atomic<uint64_t> lz_wire_out{0};
+	std::atomic<uint64_t> lz_raw_in{0};
+	std::atomic<uint64_t> lz_wire_in{0};
+	std::atomic<uint64_t> lz_bad{0};
+	std::atomic<uint64_t> resume_replayed{0};
+	std::atomic<uint64_t> resume_dropped{0};
+};
+
+static convey_stats stats;
+
+/* RFC 8305 "Connection Attempt Delay", before racing the next address. */
+#define CONVEY_CONNECT_ATTEMPT_DELAY 250
+
 enum convey_setup_status {
 	convey_setup_ok,
 	convey_setup_exit_ok,
@@ -165,10 +581,18 @@ enum convey_setup_status {
 /* }}} */
 
 /* {{{ Helper routines */
+static bool convey_same_path(const std::string& a, const std::string& b)
+{/*{{{*/
+#ifdef _WIN32
+	return 0 == lstrcmpiA(a.c_str(), b.c_str());
+#else
+	return a == b;
+#endif
+}/*}}}*/
+
 static void convey_error(DWORD c = -1)
 {/*{{{*/
-	char *buf{nullptr};
-	DWORD err_code = (-1 == c) ? GetLastError() : c;
+	DWORD err_code = ((DWORD)-1 == c) ? GetLastError() : c;
 
 	if (!conf.verbose && (ERROR_BROKEN_PIPE == err_code
 			|| ERROR_NETNAME_DELETED == err_code
@@ -177,6 +601,8 @@ static void convey_error(DWORD c = -1)
 		return;
 	}
 
+#ifdef _WIN32
+	char *buf{nullptr};
 	DWORD ret = FormatMessage(
 		FORMAT_MESSAGE_ALLOCATE_BUFFER | FORMAT_MESSAGE_FROM_SYSTEM | FORMAT_MESSAGE_IGNORE_INSERTS,
 		NULL, err_code, MAKELANGID(LANG_NEUTRAL, SUBLANG_DEFAULT), (LPSTR)&buf, 0, nullptr
@@ -187,8 +613,14 @@ static void convey_error(DWORD c = -1)
 
 		LocalFree(buf);
 	}
+#else
+	/* Resolver failures come as the negative EAI_* codes of glibc. */
+	int e = static_cast<int>(err_code);
+	std::cerr << "convey: " << e << ": " << (e < 0 ? gai_strerror(e) : strerror(e)) << std::endl;
+#endif
 }/*}}}*/
 
+#ifdef _WIN32
 static DWORD convey_get_ov_result(HANDLE h, OVERLAPPED* ov, DWORD* bytes, bool& rc, DWORD& er)
 {/*{{{*/
 	if (!rc) {
@@ -223,6 +655,7 @@ static DWORD convey_get_ov_result(HANDLE h, OVERLAPPED* ov, DWORD* bytes, bool&
 
 	return true;
 }/*}}}*/
+#endif
 
 static bool convey_baud_is_valid(uint32_t b)
 {
@@ -295,31 +728,364 @@ static convey_flow_control convey_flow_control_from_string(std::string p)
 	return ((convey_flow_control)-1);
 }
 
+/* Parse a socket buffer size: empty keeps the OS default (0), "auto"
+ * gives SOCKBUF_AUTO, otherwise bytes with an optional k or m suffix. */
+static bool convey_sockbuf_from_string(std::string p, int& size)
+{
+	for (size_t i = 0; i < p.size(); i++) {
+		p[i] = std::tolower(p[i]);
+	}
+	if (p.empty()) {
+		size = 0;
+		return true;
+	} else if (!p.compare("auto")) {
+		size = SOCKBUF_AUTO;
+		return true;
+	}
+
+	unsigned long long mul = 1;
+	if ('k' == p.back()) {
+		mul = 1024;
+		p.pop_back();
+	} else if ('m' == p.back()) {
+		mul = 1024 * 1024;
+		p.pop_back();
+	}
+	if (p.empty() || std::string::npos != p.find_first_not_of("0123456789") || p.size() > 9) {
+		return false;
+	}
+	unsigned long long v = std::stoull(p) * mul;
+	if (!v || v > 0x7fffffffULL) {
+		return false;
+	}
+	size = static_cast<int>(v);
+	return true;
+}
+
+static convey_queue_drop convey_queue_drop_from_string(std::string p)
+{
+	for (size_t i = 0; i < p.size(); i++) {
+		p[i] = std::tolower(p[i]);
+	}
+	if (!p.compare("block")) {
+		return convey_queue_drop_block;
+	} else if (!p.compare("oldest")) {
+		return convey_queue_drop_oldest;
+	} else if (!p.compare("newest")) {
+		return convey_queue_drop_newest;
+	}
+	return ((convey_queue_drop)-1);
+}
+
+static convey_io_engine convey_io_engine_from_string(std::string p)
+{
+	for (size_t i = 0; i < p.size(); i++) {
+		p[i] = std::tolower(p[i]);
+	}
+	if (!p.compare("auto")) {
+		return convey_io_engine_auto;
+	} else if (!p.compare("threads")) {
+		return convey_io_engine_threads;
+	} else if (!p.compare("io_uring")) {
+		return convey_io_engine_uring;
+	}
+	return ((convey_io_engine)-1);
+}
+
+static convey_xfer_proto convey_xfer_proto_from_string(std::string p)
+{
+	for (size_t i = 0; i < p.size(); i++) {
+		p[i] = std::tolower(p[i]);
+	}
+	if (!p.compare("zmodem")) {
+		return convey_xfer_zmodem;
+	} else if (!p.compare("ymodem")) {
+		return convey_xfer_ymodem;
+	} else if (!p.compare("xmodem")) {
+		return convey_xfer_xmodem;
+	}
+	return ((convey_xfer_proto)-1);
+}
+
+static bool convey_is_pipe_name(std::string p)
+{/*{{{*/
+	for (size_t i = 0; i < p.size(); i++) {
+		p[i] = std::tolower(p[i]);
+	}
+	return 0 == p.compare(0, 9, "\\\\.\\pipe\\") && p.size() > 9;
+}/*}}}*/
+
+/* Resolve the transports of a session, whether the listener can accept
+ * clients and the endpoint can be opened for them. */
+static bool convey_serve_check(convey_serve_spec& sp, std::string& err)
+{/*{{{*/
+	sp.lts = convey_parse_transport(sp.listen);
+	sp.ets = convey_parse_transport(sp.endpoint);
+	bool pipe_server = convey_tp_pipe == sp.lts.kind && convey_is_pipe_name(sp.listen);
+	bool listens = convey_tp_tcp_server == sp.lts.kind || convey_tp_unix_server == sp.lts.kind || convey_tp_vsock_server == sp.lts.kind;
+#ifdef _WIN32
+	listens = listens || pipe_server;
+#else
+	if (pipe_server) {
+		err = "named pipe servers are only available on Windows";
+		return false;
+	}
+#endif
+	if (!sp.lts.ok || !listens) {
+		err = "'" + sp.listen + "' is not a listen endpoint";
+		return false;
+	}
+	if (!sp.ets.ok || convey_tp_tcp_server == sp.ets.kind || convey_tp_unix_server == sp.ets.kind || convey_tp_vsock_server == sp.ets.kind
+			|| convey_tp_shm == sp.ets.kind || convey_tp_rfc2217 == sp.ets.kind || convey_tp_ws_server == sp.ets.kind
+			|| convey_tp_udp_client == sp.ets.kind || convey_tp_udp_server == sp.ets.kind) {
+		err = "'" + sp.endpoint + "' is not an endpoint to connect to";
+		return false;
+	}
+
+	return true;
+}/*}}}*/
+
+/* The --serve file has one "<listen> <endpoint>" pair per line, blank
+ * lines and lines starting with # are skipped. */
+static bool convey_serve_parse(std::istream& is, std::vector<convey_serve_spec>& out, std::string& err)
+{/*{{{*/
+	std::string line;
+	size_t n = 0;
+
+	while (std::getline(is, line)) {
+		n++;
+		std::istringstream ls(line);
+		convey_serve_spec sp;
+		std::string extra;
+		if (!(ls >> sp.listen) || '#' == sp.listen[0]) {
+			continue;
+		}
+		if (!(ls >> sp.endpoint) || ((ls >> extra) && '#' != extra[0])) {
+			err = "line " + std::to_string(n) + ": expected '<listen> <endpoint>'";
+			return false;
+		}
+
+		if (!convey_serve_check(sp, err)) {
+			err = "line " + std::to_string(n) + ": " + err;
+			return false;
+		}
+		for (const convey_serve_spec& o : out) {
+			if (convey_same_path(o.listen, sp.listen)) {
+				err = "line " + std::to_string(n) + ": '" + sp.listen + "' is used twice";
+				return false;
+			}
+		}
+
+		out.push_back(sp);
+	}
+
+	if (out.empty()) {
+		err = "no sessions";
+		return false;
+	}
+
+	return true;
+}/*}}}*/
+
+static bool convey_mux_check(const std::string& local, convey_mux_spec& ms, std::string& err)
+{/*{{{*/
+	const std::string pty_pfx = "pty:";
+	ms = convey_mux_spec{};
+	if (0 == local.compare(0, pty_pfx.size(), pty_pfx)) {
+#ifdef _WIN32
+		err = "ptys are only available on POSIX, use a pipe name";
+		return false;
+#else
+		ms.kind = convey_mux_pty;
+		ms.sp.listen = local.substr(pty_pfx.size());
+		if (ms.sp.listen.empty()) {
+			err = "'" + local + "' has no path";
+			return false;
+		}
+		return true;
+#endif
+	}
+	convey_transport_spec ts = convey_parse_transport(local);
+	if (convey_tp_tcp_server == ts.kind || convey_tp_unix_server == ts.kind || convey_tp_vsock_server == ts.kind
+			|| (convey_tp_pipe == ts.kind && convey_is_pipe_name(local))) {
+#ifndef _WIN32
+		if (convey_tp_pipe == ts.kind) {
+			err = "named pipe servers are only available on Windows, use pty:<path>";
+			return false;
+		}
+#endif
+		ms.kind = convey_mux_listen;
+		ms.sp.listen = local;
+		ms.sp.lts = ts;
+		if (!ts.ok) {
+			err = "'" + local + "' is no channel endpoint";
+		}
+		return ts.ok;
+	}
+	/* Anything that a --serve session could connect to. */
+	ms.kind = convey_mux_connect;
+	ms.sp.endpoint = local;
+	ms.sp.ets = ts;
+	if (!ts.ok || convey_tp_shm == ts.kind || convey_tp_rfc2217 == ts.kind || convey_tp_ws_server == ts.kind
+			|| convey_tp_udp_client == ts.kind || convey_tp_udp_server == ts.kind) {
+		err = "'" + local + "' is no channel endpoint";
+		return false;
+	}
+	return true;
+}/*}}}*/
+
+/* Append a chunk to the queue, the caller holds the lock. Returns false
+ * when the chunk doesn't fit and the policy is to block. */
+static bool convey_outq_put_locked(convey_outq& q, const char* buf, DWORD bytes)
+{/*{{{*/
+	size_t len = bytes;
+
+	if (!len) {
+		return true;
+	}
+
+	if (q.bytes + len > q.limit) {
+		switch (q.drop) {
+		case convey_queue_drop_block:
+			/* An empty queue takes anything, a chunk over the limit can't stall it. */
+			if (q.bytes) {
+				return false;
+			}
+			break;
+		case convey_queue_drop_newest:
+			{
+				size_t room = (q.limit > q.bytes) ? q.limit - q.bytes : 0;
+				q.dropped += len - room;
+				len = room;
+			}
+			break;
+		case convey_queue_drop_oldest:
+			while (!q.chunks.empty() && q.bytes + len > q.limit) {
+				q.bytes -= q.chunks.front().size();
+				q.dropped += q.chunks.front().size();
+				q.chunks.pop_front();
+			}
+			break;
+		}
+	}
+
+	if (!len) {
+		return true;
+	}
+
+	/* Coalesce keystrokes, so they go out in as few writes as possible. */
+	if (!q.chunks.empty() && q.chunks.back().size() + len <= BUF_SIZE) {
+		q.chunks.back().append(buf, len);
+	} else {
+		q.chunks.emplace_back(buf, len);
+	}
+	q.bytes += len;
+
+	return true;
+}/*}}}*/
+
+static void convey_outq_push(convey_outq& q, const char* buf, DWORD bytes)
+{/*{{{*/
+	std::unique_lock<std::mutex> lk(q.lock);
+	q.cv.wait(lk, [&]() { return convey_outq_put_locked(q, buf, bytes); });
+	q.cv.notify_all();
+}/*}}}*/
+
+/* Wait for queued input. Returns false when the session is going down,
+ * or stdin is at EOF and everything was sent. */
+static bool convey_outq_pop(convey_outq& q, std::string& chunk)
+{/*{{{*/
+	std::unique_lock<std::mutex> lk(q.lock);
+	q.cv.wait(lk, [&]() { return !q.chunks.empty() || q.eof || q.kick || is_error || shutting_down; });
+	if (is_error || shutting_down) {
+		return false;
+	}
+	if (q.kick) {
+		/* An empty chunk, the sender has frames of its own to send. */
+		q.kick = false;
+		chunk.clear();
+		return true;
+	}
+	if (q.chunks.empty()) {
+		return false;
+	}
+	chunk.swap(q.chunks.front());
+	q.chunks.pop_front();
+	q.bytes -= chunk.size();
+	q.cv.notify_all();
+	return true;
+}/*}}}*/
+
+/* Put back what a failed write didn't send, it goes out first after the reconnect. */
+static void convey_outq_unget(convey_outq& q, std::string&& chunk)
+{/*{{{*/
+	std::lock_guard<std::mutex> lk(q.lock);
+	if (!chunk.empty()) {
+		q.bytes += chunk.size();
+		q.chunks.push_front(std::move(chunk));
+	}
+	q.cv.notify_all();
+}/*}}}*/
+
+static void convey_outq_wake(convey_outq& q)
+{/*{{{*/
+	/* Taking the lock orders this with a waiter checking its predicate. */
+	std::lock_guard<std::mutex> lk(q.lock);
+	q.cv.notify_all();
+}/*}}}*/
+
 static convey_setup_status convey_conf_setup(int argc, char **argv)
 {/*{{{*/
-	CLI::App app{"IPC through a named pipe, a serial port or a TCP endpoint.", "convey"};
+	CLI::App app{"IPC through a named pipe, a serial port, a TCP or a Unix socket endpoint.", "convey"};
 	app.usage(
 		"Usage: convey [options] \\\\.\\pipe\\<pipe name>\n"
 		"       convey [options] \\\\.\\COM<num>\n"
 		"       convey [options] tcp:<host>:<port>\n"
 		"       convey [options] tcp-listen:<port>\n"
-		"       convey --bridge --pipe-server \\\\.\\pipe\\<name> tcp:<host>:<port>");
+		"       convey [options] unix:<path>\n"
+		"       convey [options] unix-listen:<path>\n"
+		"       convey [options] shm:<name>\n"
+		"       convey [options] rfc2217:<host>:<port>\n"
+		"       convey [options] ws-listen:<port>\n"
+		"       convey [options] vsock:<cid>:<port>\n"
+		"       convey [options] vsock-listen:<port>\n"
+		"       convey [options] udp:<host>:<port>\n"
+		"       convey [options] udp-listen:<port>\n"
+		"       convey --bridge --pipe-server \\\\.\\pipe\\<name> tcp:<host>:<port>\n"
+		"       convey [options] --rfc2217-listen <port> \\\\.\\COM<num>\n"
+		"       convey [options] --serve <file>");
 	app.get_formatter()->column_width(40);
 
 	std::string target;
 	std::string dev;
-	std::string log_path, log_recv_path, log_send_path, pipe_server;
-	std::string parity = "no", stop_bits = "1", flow_control = "none";
-	uint32_t baud = CBR_115200, byte_size = 8;
-	double poll = 0.0;
-	bool bridge = false, reconnect = false, no_xterm = false, read_only = false, timestamps = false, hex = false, log_append = false, verbose = false;
+	std::string log_path, log_recv_path, log_send_path, pipe_server, pty_link, serve_path, control_path, rfc2217_port;
+	std::string parity = "no", stop_bits = "1", flow_control = "none", queue_drop = "block", io_engine = "auto", sndbuf, rcvbuf;
+	std::string zrecv, xfer_protocol = "zmodem", send_file, recv_file;
+	std::vector<std::string> zsend, mux;
+	uint32_t baud = CBR_115200, byte_size = 8, workers = 2;
+	size_t queue_limit = 0, resume_buffer = 1024 * 1024;
+	uint32_t keepalive_idle = 0, keepalive_interval = 1, keepalive_count = 5, user_timeout = 0, silence_timeout = 0;
+	double poll = 0.0, connect_timeout = 10.0, dns_ttl = 30.0;
+	bool bridge = false, gdb = false, gdb_no_cache = false, gdb_widen = false, kd = false, compress = false, resume = false, reconnect = false, no_xterm = false, read_only = false, timestamps = false, hex = false, log_append = false, verbose = false;
 
 	// Endpoint given as the first positional argument; --dev is an alias.
 	app.add_option("target", target, "")->group("");
 
 	app.add_option("-d,--dev", dev, "Path to the named pipe or COM device.")->group("Connection")->type_name("PATH");
 	app.add_option("-p,--poll", poll, "Poll pipe for N seconds on startup.")->group("Connection")->capture_default_str()->type_name("SECONDS");
+	app.add_option("--connect-timeout", connect_timeout, "Give up on a single TCP or unix connect attempt after N seconds.")->group("Connection")->capture_default_str()->type_name("SECONDS");
+	app.add_option("--dns-ttl", dns_ttl, "Reuse the resolved tcp: addresses for N seconds, 0 resolves on every connect.")->group("Connection")->capture_default_str()->type_name("SECONDS");
+	app.add_option("--keepalive", keepalive_idle, "Send TCP keepalive probes after N idle seconds, 0 disables.")->group("Connection")->capture_default_str()->type_name("SECONDS");
+	app.add_option("--keepalive-interval", keepalive_interval, "Seconds between unanswered TCP keepalive probes.")->group("Connection")->capture_default_str()->type_name("SECONDS");
+	app.add_option("--keepalive-count", keepalive_count, "Drop the connection after N unanswered TCP keepalive probes.")->group("Connection")->capture_default_str()->type_name("COUNT");
+	app.add_option("--user-timeout", user_timeout, "Drop the connection when sent data stays unacknowledged for N seconds, 0 keeps the OS default.")->group("Connection")->capture_default_str()->type_name("SECONDS");
+	app.add_option("--sndbuf", sndbuf, "TCP send buffer size in bytes (with an optional k or m suffix), or auto.")->group("Connection")->type_name("SIZE");
+	app.add_option("--rcvbuf", rcvbuf, "TCP receive buffer size in bytes (with an optional k or m suffix), or auto.")->group("Connection")->type_name("SIZE");
 	app.add_flag("--reconnect", reconnect, "Try to reconnect after connection loss.")->group("Connection");
+	app.add_option("--queue-limit", queue_limit, "Queue up to N bytes of input while the link is down, 0 disables.")->group("Connection")->capture_default_str()->type_name("BYTES");
+	app.add_option("--queue-drop", queue_drop, "What to do with input on a full queue (block, oldest, newest).")->group("Connection")->capture_default_str()->type_name("POLICY");
+	app.add_flag("--resume", resume, "Resume the stream where it broke off after a reconnect, between a tcp: and a tcp-listen: convey both with --resume.")->group("Connection");
+	app.add_option("--resume-buffer", resume_buffer, "Keep up to N bytes sent for --resume until the other end has them.")->group("Connection")->capture_default_str()->type_name("BYTES");
 
 	app.add_option("-b,--baud", baud, "Baud rate in bps, only relevant for serial communication.")->group("Serial")->capture_default_str()->type_name("RATE");
 	app.add_option("--byte-size", byte_size, "The number of bits in a byte.")->group("Serial")->capture_default_str()->type_name("BITS");
@@ -329,16 +1095,36 @@ static convey_setup_status convey_conf_setup(int argc, char **argv)
 
 	app.add_flag("--bridge", bridge, "Bridge mode: pump raw bytes between a pipe server and the endpoint.")->group("Bridge");
 	app.add_option("--pipe-server", pipe_server, "Create a named pipe server with this name (bridge mode).")->group("Bridge")->type_name("NAME");
+	app.add_option("--pty-link", pty_link, "Bridge to a pseudo terminal, linked to from this path (not on Windows).")->group("Bridge")->type_name("PATH");
+	app.add_option("--rfc2217-listen", rfc2217_port, "Serve the endpoint, a serial port or pty, to RFC 2217 clients on this TCP port.")->group("Bridge")->type_name("PORT");
+	app.add_flag("--gdb", gdb, "Relay GDB remote protocol packets, acked and checked here, no-ack mode toward gdb.")->group("Bridge");
+	app.add_flag("--gdb-no-cache", gdb_no_cache, "With --gdb, pass every memory and register read on to the stub, no cache or widened reads.")->group("Bridge");
+	app.add_flag("--gdb-widen", gdb_widen, "With --gdb, widen small memory reads to whole blocks up to the end of the page, and cache those.")->group("Bridge");
+	app.add_flag("--kd", kd, "Relay Windows kernel debugger packets whole, count resends, breakins and ack latency.")->group("Bridge");
+	app.add_option("--silence-timeout", silence_timeout, "Reconnect when the endpoint sent nothing for N seconds, 0 disables.")->group("Bridge")->capture_default_str()->type_name("SECONDS");
+
+	app.add_option("--serve", serve_path, "Serve the sessions listed in a file, one '<listen> <endpoint>' per line.")->group("Server")->type_name("FILE");
+	app.add_option("--workers", workers, "Worker threads moving the data of all --serve sessions.")->group("Server")->capture_default_str()->type_name("COUNT");
+	app.add_option("--control", control_path, "Take commands to add, remove and inspect --serve sessions on this socket or pipe.")->group("Server")->type_name("PATH");
 
 	app.add_option("--log", log_path, "Log the full session to a file, each block marked > (sent) or < (received).")->group("Logging")->type_name("FILE");
 	app.add_option("--log-recv", log_recv_path, "Log only the received stream to a file.")->group("Logging")->type_name("FILE");
 	app.add_option("--log-send", log_send_path, "Log only the sent stream to a file.")->group("Logging")->type_name("FILE");
+	app.add_option("--zsend", zsend, "Send files with ZMODEM, or YMODEM or XMODEM when the receiver asks so, then exit.")->group("Transfer")->type_name("FILE")->allow_extra_args(false);
+	app.add_option("--zrecv", zrecv, "Receive files with ZMODEM, YMODEM or XMODEM into this directory, then exit.")->group("Transfer")->type_name("DIR");
+	app.add_option("--xfer-protocol", xfer_protocol, "The protocol to start with (zmodem, ymodem, xmodem).")->group("Transfer")->capture_default_str()->type_name("PROTOCOL");
+	app.add_option("--send-file", send_file, "Send a file as it is, paced to the baud rate on a serial line, then exit.")->group("Transfer")->type_name("FILE");
+	app.add_option("--recv-file", recv_file, "Save what the endpoint sends to a file until it closes or --silence-timeout passes, then exit.")->group("Transfer")->type_name("FILE");
+	app.add_option("--mux", mux, "Carry a channel to this local endpoint over the endpoint, to a convey with --mux at the other end. Repeat for more, the first has the highest priority.")->group("Multiplexer")->type_name("ENDPOINT")->allow_extra_args(false);
+	app.add_flag("--compress", compress, "Compress the --mux link, to a convey with --compress at the other end.")->group("Multiplexer");
+
 	app.add_flag("--log-append", log_append, "Append to the log files instead of overwriting them.")->group("Logging");
 
 	app.add_flag("--no-xterm", no_xterm, "Disable xterm support.")->group("General");
 	app.add_flag("--read-only", read_only, "Monitor only and do not send anything to the endpoint.")->group("General");
 	app.add_flag("--timestamps", timestamps, "Prefix each received line with a local time stamp.")->group("General");
 	app.add_flag("--hex", hex, "Show the received stream as a hex dump instead of text.")->group("General");
+	app.add_option("--io-engine", io_engine, "How the data is moved (auto, threads, io_uring).")->group("General")->capture_default_str()->type_name("ENGINE");
 	app.set_help_flag("-h,--help", "Display this help message and exit.")->group("General");
 	app.set_version_flag("-V,--version", std::string(VERSION), "Output version information and exit.")->group("General");
 	app.add_flag("-v,--verbose", verbose, "Print some additional messages.")->group("General");
@@ -362,7 +1148,44 @@ static convey_setup_status convey_conf_setup(int argc, char **argv)
 
 	conf.verbose = verbose;
 
-	if (!dev.empty()) {
+	if (!serve_path.empty()) {
+		if (!dev.empty() || !target.empty()) {
+			std::cerr << argv[0] << ": --serve takes the endpoints from the file" << std::endl;
+			return convey_setup_exit_err;
+		}
+		if (bridge || !pty_link.empty() || !pipe_server.empty() || !rfc2217_port.empty() || read_only || timestamps || hex
+				|| !log_path.empty() || !log_recv_path.empty() || !log_send_path.empty() || queue_limit || !zsend.empty() || !zrecv.empty()
+				|| !send_file.empty() || !recv_file.empty() || !mux.empty()) {
+			std::cerr << argv[0] << ": --serve only links raw bytes, the bridge, log, queue, display and transfer options don't apply" << std::endl;
+			return convey_setup_exit_err;
+		}
+		if (!workers || workers > 64) {
+			std::cerr << "convey: the number of workers must be between 1 and 64" << std::endl;
+			return convey_setup_exit_err;
+		}
+		std::ifstream f(serve_path);
+		if (!f) {
+			std::cerr << "convey: can't read '" << serve_path << "'" << std::endl;
+			return convey_setup_exit_err;
+		}
+		std::string err;
+		conf.serve.clear();
+		if (!convey_serve_parse(f, conf.serve, err)) {
+			std::cerr << "convey: " << serve_path << ": " << err << std::endl;
+			return convey_setup_exit_err;
+		}
+		conf.serve_workers = workers;
+#ifdef _WIN32
+		if (!control_path.empty() && !convey_is_pipe_name(control_path)) {
+			std::cerr << "convey: --control takes a pipe name like \\\\.\\pipe\\convey" << std::endl;
+			return convey_setup_exit_err;
+		}
+#endif
+		conf.serve_control = control_path;
+	} else if (!control_path.empty()) {
+		std::cerr << argv[0] << ": --control needs --serve" << std::endl;
+		return convey_setup_exit_err;
+	} else if (!dev.empty()) {
 		conf.pipe_path = dev;
 	} else if (!target.empty()) {
 		conf.pipe_path = target;
@@ -374,31 +1197,100 @@ static convey_setup_status convey_conf_setup(int argc, char **argv)
 
 	convey_transport_spec ts = convey_parse_transport(conf.pipe_path);
 	if (!ts.ok) {
-		if (convey_tp_tcp_server == ts.kind) {
+		switch (ts.kind) {
+		case convey_tp_tcp_server:
 			std::cerr << argv[0] << ": invalid listen endpoint '" << conf.pipe_path << "', expected tcp-listen:PORT" << std::endl;
-		} else {
+			break;
+		case convey_tp_unix_client:
+			std::cerr << argv[0] << ": invalid unix endpoint '" << conf.pipe_path << "', expected unix:PATH" << std::endl;
+			break;
+		case convey_tp_unix_server:
+			std::cerr << argv[0] << ": invalid listen endpoint '" << conf.pipe_path << "', expected unix-listen:PATH" << std::endl;
+			break;
+		case convey_tp_shm:
+			std::cerr << argv[0] << ": invalid shared memory endpoint '" << conf.pipe_path << "', expected shm:NAME" << std::endl;
+			break;
+		case convey_tp_rfc2217:
+			std::cerr << argv[0] << ": invalid RFC 2217 endpoint '" << conf.pipe_path << "', expected rfc2217:HOST:PORT" << std::endl;
+			break;
+		case convey_tp_ws_server:
+			std::cerr << argv[0] << ": invalid listen endpoint '" << conf.pipe_path << "', expected ws-listen:PORT" << std::endl;
+			break;
+		case convey_tp_vsock_client:
+			std::cerr << argv[0] << ": invalid vsock endpoint '" << conf.pipe_path << "', expected vsock:CID:PORT" << std::endl;
+			break;
+		case convey_tp_vsock_server:
+			std::cerr << argv[0] << ": invalid listen endpoint '" << conf.pipe_path << "', expected vsock-listen:PORT" << std::endl;
+			break;
+		case convey_tp_udp_client:
+			std::cerr << argv[0] << ": invalid udp endpoint '" << conf.pipe_path << "', expected udp:HOST:PORT" << std::endl;
+			break;
+		case convey_tp_udp_server:
+			std::cerr << argv[0] << ": invalid listen endpoint '" << conf.pipe_path << "', expected udp-listen:PORT" << std::endl;
+			break;
+		default:
 			std::cerr << argv[0] << ": invalid tcp endpoint '" << conf.pipe_path << "', expected tcp:HOST:PORT" << std::endl;
+			break;
 		}
 		return convey_setup_exit_err;
 	}
 	conf.transport = ts.kind;
 	conf.tcp_host = ts.host;
 	conf.tcp_port = ts.port;
+	conf.unix_path = ts.path;
+	conf.shm_name = (convey_tp_shm == ts.kind) ? ts.path : std::string();
+#if !defined(_WIN32) && !defined(CONVEY_HAVE_VSOCK)
+	if (convey_tp_vsock_client == ts.kind || convey_tp_vsock_server == ts.kind) {
+		std::cerr << argv[0] << ": vsock endpoints are only available on Linux and Windows" << std::endl;
+		return convey_setup_exit_err;
+	}
+#endif
 
 	conf.pipe_poll = poll;
-	conf.no_xterm = no_xterm;
-	conf.read_only = read_only;
-	conf.timestamps = timestamps;
-	conf.hex = hex;
 
-	if (!convey_baud_is_valid(baud)) {
-		std::cerr << "convey: unsupported baud rate '" << baud << "'" << std::endl;
+	if (connect_timeout <= 0.0) {
+		std::cerr << "convey: the connect timeout must be positive" << std::endl;
 		return convey_setup_exit_err;
 	}
-	conf.baud = baud;
+	conf.connect_timeout = connect_timeout;
 
-	uint8_t par = convey_parity_from_string(parity);
-	if (((uint8_t)-1) == par) {
+	if (dns_ttl < 0.0) {
+		std::cerr << "convey: the DNS TTL must not be negative" << std::endl;
+		return convey_setup_exit_err;
+	}
+	conf.dns_ttl = dns_ttl;
+
+	if (keepalive_idle && (!keepalive_interval || !keepalive_count)) {
+		std::cerr << "convey: the keepalive interval and count must be positive" << std::endl;
+		return convey_setup_exit_err;
+	}
+	conf.keepalive_idle = keepalive_idle;
+	conf.keepalive_interval = keepalive_interval;
+	conf.keepalive_count = keepalive_count;
+	conf.user_timeout = user_timeout;
+	conf.silence_timeout = silence_timeout;
+
+	if (!convey_sockbuf_from_string(sndbuf, conf.sndbuf)) {
+		std::cerr << "convey: invalid send buffer size '" << sndbuf << "'" << std::endl;
+		return convey_setup_exit_err;
+	}
+	if (!convey_sockbuf_from_string(rcvbuf, conf.rcvbuf)) {
+		std::cerr << "convey: invalid receive buffer size '" << rcvbuf << "'" << std::endl;
+		return convey_setup_exit_err;
+	}
+	conf.no_xterm = no_xterm;
+	conf.read_only = read_only;
+	conf.timestamps = timestamps;
+	conf.hex = hex;
+
+	if (!convey_baud_is_valid(baud)) {
+		std::cerr << "convey: unsupported baud rate '" << baud << "'" << std::endl;
+		return convey_setup_exit_err;
+	}
+	conf.baud = baud;
+
+	uint8_t par = convey_parity_from_string(parity);
+	if (((uint8_t)-1) == par) {
 		std::cerr << "convey: unsupported parity '" << parity << "'" << std::endl;
 		return convey_setup_exit_err;
 	}
@@ -420,19 +1312,175 @@ static convey_setup_status convey_conf_setup(int argc, char **argv)
 
 	conf.byte_size = byte_size;
 
+	convey_queue_drop qd = convey_queue_drop_from_string(queue_drop);
+	if (((convey_queue_drop)-1) == qd) {
+		std::cerr << "convey: unsupported queue drop policy '" << queue_drop << "'" << std::endl;
+		return convey_setup_exit_err;
+	}
+	conf.queue_limit = queue_limit;
+	conf.queue_drop = qd;
+
+	convey_io_engine ie = convey_io_engine_from_string(io_engine);
+	if (((convey_io_engine)-1) == ie) {
+		std::cerr << "convey: unsupported io engine '" << io_engine << "'" << std::endl;
+		return convey_setup_exit_err;
+	}
+#ifndef CONVEY_HAVE_URING
+	if (convey_io_engine_uring == ie) {
+		std::cerr << "convey: io_uring is not available in this build" << std::endl;
+		return convey_setup_exit_err;
+	}
+#endif
+	conf.io_engine = ie;
+
 	if (reconnect) {
 		restart_on_exit = true;
 	}
 
-	if (bridge) {
+	if (!pty_link.empty()) {
+#ifdef _WIN32
+		std::cerr << argv[0] << ": --pty-link is not available on Windows, use --bridge --pipe-server" << std::endl;
+		return convey_setup_exit_err;
+#else
+		if (!pipe_server.empty()) {
+			std::cerr << argv[0] << ": --pty-link and --pipe-server are mutually exclusive" << std::endl;
+			return convey_setup_exit_err;
+		}
+		/* The pty is just another bridge peer. */
+		bridge = true;
+		pipe_server = pty_link;
+		conf.pty_link = pty_link;
+#endif
+	}
+
+	if (!rfc2217_port.empty()) {
+		if (bridge || !pipe_server.empty() || !conf.pty_link.empty()) {
+			std::cerr << argv[0] << ": --rfc2217-listen is a bridge of its own, --bridge, --pipe-server and --pty-link don't apply" << std::endl;
+			return convey_setup_exit_err;
+		}
+		if (convey_tp_pipe != conf.transport) {
+			std::cerr << argv[0] << ": --rfc2217-listen serves a serial port or pty, not '" << conf.pipe_path << "'" << std::endl;
+			return convey_setup_exit_err;
+		}
+		/* The accepted client is the bridge peer, one at a time. */
+		conf.bridge = true;
+		conf.bridge_pipe_name = "rfc2217-listen:" + rfc2217_port;
+		conf.rfc2217_port = rfc2217_port;
+		restart_on_exit = true;
+	} else if (bridge) {
 		conf.bridge = true;
 		if (pipe_server.empty()) {
 			std::cerr << argv[0] << ": --bridge requires --pipe-server <name>" << std::endl;
 			return convey_setup_exit_err;
 		}
+#ifndef _WIN32
+		if (conf.pty_link.empty()) {
+			std::cerr << argv[0] << ": named pipe servers are only available on Windows, use --pty-link" << std::endl;
+			return convey_setup_exit_err;
+		}
+#endif
 		conf.bridge_pipe_name = pipe_server;
 		restart_on_exit = true;
+	} else if (silence_timeout && recv_file.empty()) {
+		std::cerr << argv[0] << ": --silence-timeout requires --bridge or --recv-file" << std::endl;
+		return convey_setup_exit_err;
+	}
+	if (gdb && (!conf.bridge || !conf.rfc2217_port.empty())) {
+		std::cerr << argv[0] << ": --gdb relays to a gdb on --pty-link or --pipe-server" << std::endl;
+		return convey_setup_exit_err;
+	}
+	conf.gdb = gdb;
+	if (gdb_no_cache && !gdb) {
+		std::cerr << argv[0] << ": --gdb-no-cache requires --gdb" << std::endl;
+		return convey_setup_exit_err;
+	}
+	conf.gdb_cache = !gdb_no_cache;
+	if (gdb_widen && (!gdb || gdb_no_cache)) {
+		std::cerr << argv[0] << ": --gdb-widen requires --gdb and the cache" << std::endl;
+		return convey_setup_exit_err;
+	}
+	conf.gdb_widen = gdb_widen;
+	if (kd && (!conf.bridge || !conf.rfc2217_port.empty())) {
+		std::cerr << argv[0] << ": --kd relays to a debugger on --pty-link or --pipe-server" << std::endl;
+		return convey_setup_exit_err;
+	}
+	if (kd && gdb) {
+		std::cerr << argv[0] << ": --kd and --gdb can't be used together" << std::endl;
+		return convey_setup_exit_err;
+	}
+	conf.kd = kd;
+
+	if (!zsend.empty() || !zrecv.empty() || !send_file.empty() || !recv_file.empty()) {
+		if (!zsend.empty() && !zrecv.empty()) {
+			std::cerr << argv[0] << ": --zsend and --zrecv can't be used together" << std::endl;
+			return convey_setup_exit_err;
+		}
+		if ((!zsend.empty() || !zrecv.empty()) + !send_file.empty() + !recv_file.empty() > 1) {
+			std::cerr << argv[0] << ": one transfer at a time, --send-file, --recv-file and ZMODEM don't mix" << std::endl;
+			return convey_setup_exit_err;
+		}
+		if (conf.bridge || read_only) {
+			std::cerr << argv[0] << ": a transfer takes the endpoint for itself, the bridge and --read-only don't apply" << std::endl;
+			return convey_setup_exit_err;
+		}
+	}
+	convey_xfer_proto xp = convey_xfer_proto_from_string(xfer_protocol);
+	if (((convey_xfer_proto)-1) == xp) {
+		std::cerr << "convey: unsupported transfer protocol '" << xfer_protocol << "'" << std::endl;
+		return convey_setup_exit_err;
+	}
+	conf.zsend_files = zsend;
+	conf.zrecv_dir = zrecv;
+	conf.xfer_proto = xp;
+	conf.send_file = send_file;
+	conf.recv_file = recv_file;
+
+	conf.mux.clear();
+	if (!mux.empty()) {
+		if (conf.bridge || read_only || !zsend.empty() || !zrecv.empty() || !send_file.empty() || !recv_file.empty()) {
+			std::cerr << argv[0] << ": --mux takes the endpoint for itself, the bridge, transfers and --read-only don't apply" << std::endl;
+			return convey_setup_exit_err;
+		}
+		if (mux.size() > MUX_CHANNELS) {
+			std::cerr << argv[0] << ": --mux carries up to " << MUX_CHANNELS << " channels" << std::endl;
+			return convey_setup_exit_err;
+		}
+		for (const std::string& m : mux) {
+			convey_mux_spec ms;
+			std::string err;
+			if (!convey_mux_check(m, ms, err)) {
+				std::cerr << argv[0] << ": --mux: " << err << std::endl;
+				return convey_setup_exit_err;
+			}
+			conf.mux.push_back(ms);
+		}
+	}
+	if (compress && mux.empty()) {
+		std::cerr << argv[0] << ": --compress works on the --mux link, to a convey with --compress at the other end" << std::endl;
+		return convey_setup_exit_err;
+	}
+	conf.compress = compress;
+
+	if (resume) {
+		if (!reconnect || (convey_tp_tcp_client != conf.transport && convey_tp_tcp_server != conf.transport)) {
+			std::cerr << argv[0] << ": --resume works between a tcp: and a tcp-listen: convey, both with --reconnect" << std::endl;
+			return convey_setup_exit_err;
+		}
+		if (conf.bridge || !conf.mux.empty() || !zsend.empty() || !zrecv.empty() || !send_file.empty() || !recv_file.empty()) {
+			std::cerr << argv[0] << ": --resume is for the console session, the bridge, --mux and transfers don't apply" << std::endl;
+			return convey_setup_exit_err;
+		}
+		if (resume_buffer < RESUME_FRAME) {
+			std::cerr << argv[0] << ": the --resume buffer must hold " << RESUME_FRAME << " bytes at least" << std::endl;
+			return convey_setup_exit_err;
+		}
+		/* The input waits in the queue while the link is down. */
+		if (!conf.queue_limit) {
+			conf.queue_limit = resume_buffer;
+		}
 	}
+	conf.resume = resume;
+	conf.resume_buffer = resume_buffer;
 
 	conf.log_path = log_path;
 	conf.log_recv_path = log_recv_path;
@@ -446,7 +1494,7 @@ static convey_setup_status convey_conf_setup(int argc, char **argv)
 	const std::string* log_paths[] = { &conf.log_path, &conf.log_recv_path, &conf.log_send_path };
 	for (size_t i = 0; i < 3; ++i) {
 		for (size_t j = i + 1; j < 3; ++j) {
-			if (!log_paths[i]->empty() && 0 == lstrcmpiA(log_paths[i]->c_str(), log_paths[j]->c_str())) {
+			if (!log_paths[i]->empty() && convey_same_path(*log_paths[i], *log_paths[j])) {
 				std::cerr << argv[0] << ": the log options must each use a different file" << std::endl;
 				return convey_setup_exit_err;
 			}
@@ -463,6 +1511,7 @@ static bool convey_conf_shutdown()
 
 static void convey_shutdown(void);
 
+#ifdef _WIN32
 static void restore_console(void)
 {/*{{{*/
 	SetConsoleOutputCP(orig_cocp);
@@ -520,36 +1569,118 @@ static void setup_console(void)
 		}
 	}
 }/*}}}*/
+#else
+static void restore_console(void)
+{/*{{{*/
+	if (tattr_saved) {
+		tcsetattr(in, TCSAFLUSH, &orig_tattr);
+		tattr_saved = false;
+	}
+}/*}}}*/
+
+static bool is_console_handle(HANDLE h)
+{/*{{{*/
+	return isatty(h);
+}/*}}}*/
+
+/* Raw mode, so ctrl-c and friends reach the target. Output processing
+ * is off as well, the target sends its own line endings. */
+static void setup_console(void)
+{/*{{{*/
+	if (conf.no_xterm) {
+		return;
+	}
+
+	if (0 != tcgetattr(in, &orig_tattr)) {
+		if (conf.verbose) {
+			convey_error();
+		}
+		return;
+	}
+
+	struct termios t = orig_tattr;
+	cfmakeraw(&t);
+	if (0 != tcsetattr(in, TCSAFLUSH, &t)) {
+		if (conf.verbose) {
+			convey_error();
+		}
+		return;
+	}
+	tattr_saved = true;
+}/*}}}*/
+#endif
 
 static bool convey_transport_is_tcp(void)
 {/*{{{*/
-	return convey_tp_tcp_client == conf.transport || convey_tp_tcp_server == conf.transport;
+	return convey_tp_tcp_client == conf.transport || convey_tp_tcp_server == conf.transport
+		|| convey_tp_rfc2217 == conf.transport || convey_tp_ws_server == conf.transport;
+}/*}}}*/
+
+/* Socket transports share the data path, a zero byte read is the peer closing. */
+static bool convey_transport_is_socket(void)
+{/*{{{*/
+	return convey_transport_is_tcp() || convey_tp_unix_client == conf.transport || convey_tp_unix_server == conf.transport
+		|| convey_tp_vsock_client == conf.transport || convey_tp_vsock_server == conf.transport
+		|| convey_tp_udp_client == conf.transport || convey_tp_udp_server == conf.transport;
+}/*}}}*/
+
+#ifdef _WIN32
+static void convey_cancel_io(HANDLE h)
+{/*{{{*/
+	CancelIoEx(h, nullptr);
+}/*}}}*/
+#else
+/* There is no per-handle cancel, wake every reader and writer of the session. */
+static void convey_cancel_io(HANDLE)
+{/*{{{*/
+	if (-1 != session_wake[1]) {
+		char c = 0;
+		if (write(session_wake[1], &c, 1)) {
+			/* Level triggered, once is enough. */
+		}
+	}
+}/*}}}*/
+#endif
+
+/* Whether a read of no bytes from the endpoint means it went away. A
+ * Windows serial port returns none when idle. */
+static bool convey_endpoint_eof(DWORD bytes)
+{/*{{{*/
+#ifdef _WIN32
+	return (convey_transport_is_socket() || convey_tp_shm == conf.transport) && 0 == bytes;
+#else
+	return 0 == bytes;
+#endif
 }/*}}}*/
 
 static void convey_bridge_fail(void)
 {/*{{{*/
 	is_error = true;
-	if (INVALID_HANDLE_VALUE != pipe) {
-		CancelIoEx(pipe, nullptr);
+	if (INVALID_HANDLE_VALUE != epipe) {
+		convey_cancel_io(epipe);
 	}
 	if (INVALID_HANDLE_VALUE != bpipe) {
-		CancelIoEx(bpipe, nullptr);
+		convey_cancel_io(bpipe);
 	}
 }/*}}}*/
 
 static void convey_console_fail(void)
 {/*{{{*/
 	is_error = true;
+#ifdef _WIN32
 	/* Unblock the stdin reader so the join and any reconnect proceed at once. */
 	if (INVALID_HANDLE_VALUE != stdin_thread) {
 		CancelSynchronousIo(stdin_thread);
 	}
-	if (INVALID_HANDLE_VALUE != in) {
-		CancelIoEx(in, nullptr);
+#endif
+	/* The queued stdin reader outlives the session, only wake the sender. */
+	if (INVALID_HANDLE_VALUE != in && !stdin_pump_started) {
+		convey_cancel_io(in);
 	}
-	if (INVALID_HANDLE_VALUE != pipe) {
-		CancelIoEx(pipe, nullptr);
+	if (INVALID_HANDLE_VALUE != epipe) {
+		convey_cancel_io(epipe);
 	}
+	convey_outq_wake(outq);
 }/*}}}*/
 
 static bool wsa_started = false;
@@ -559,18 +1690,251 @@ static bool convey_wsa_init(void)
 	if (wsa_started) {
 		return true;
 	}
+#ifdef _WIN32
 	WSADATA wsa;
 	int r = WSAStartup(MAKEWORD(2, 2), &wsa);
 	if (0 != r) {
 		std::cerr << "convey: WSAStartup failed with " << r << std::endl;
 		return false;
 	}
+#endif
 	wsa_started = true;
 	return true;
 }/*}}}*/
 
+/* Per direction I/O event. On POSIX a duplicate of the session wake
+ * pipe, polled alongside the handle to cancel a blocking call. */
+static HANDLE convey_event_create(void)
+{/*{{{*/
+#ifdef _WIN32
+	return CreateEvent(nullptr, false, false, nullptr);
+#else
+	return fcntl(session_wake[0], F_DUPFD_CLOEXEC, 0);
+#endif
+}/*}}}*/
+
+/* Sockets are read and written like the other endpoint handles, so on
+ * Windows they need the overlapped flag. */
+static SOCKET convey_socket(int family, int type, int protocol)
+{/*{{{*/
+#ifdef _WIN32
+	return WSASocketW(family, type, protocol, nullptr, 0, WSA_FLAG_OVERLAPPED);
+#else
+	return socket(family, type | SOCK_CLOEXEC, protocol);
+#endif
+}/*}}}*/
+
+static void convey_set_nonblocking(SOCKET s, bool on)
+{/*{{{*/
+#ifdef _WIN32
+	u_long nb = on ? 1 : 0;
+	ioctlsocket(s, FIONBIO, &nb);
+#else
+	int fl = fcntl(s, F_GETFL);
+	fcntl(s, F_SETFL, on ? (fl | O_NONBLOCK) : (fl & ~O_NONBLOCK));
+#endif
+}/*}}}*/
+
+#ifndef _WIN32
+/* The pty outlives the endpoint sessions, so gdb keeps its device open
+ * across endpoint reconnects and never sees it vanish. */
+static int pty_master{-1};
+static int pty_slave{-1};
+static std::string pty_link_path;
+/* Of the --mux channels, their ptys live as long as the process. */
+static std::vector<std::string> pty_mux_links;
+
+#ifdef __linux__
+/* With the slave held open, what the target printed while no client was
+ * attached would wait in the pty and the next client, say a gdb, would
+ * read it as a stale reply. Linux tells when the slave is opened and
+ * closed, and the relay drops what it has for the pty while nobody else
+ * has it open. The way back only holds what the new client wrote. */
+struct convey_pty_watcher {
+	int master;
+	int slave;
+	int fd;
+	int clients;
+};
+
+static std::mutex pty_watch_lock;
+static std::vector<convey_pty_watcher> pty_watchers;
+static std::atomic<bool> pty_watching{false};
+
+static void convey_pty_watch(const char* name, int master, int slave)
+{/*{{{*/
+	int fd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+	if (-1 == fd) {
+		return;
+	}
+	if (-1 == inotify_add_watch(fd, name, IN_OPEN | IN_CLOSE)) {
+		close(fd);
+		return;
+	}
+	std::lock_guard<std::mutex> lk(pty_watch_lock);
+	pty_watchers.push_back(convey_pty_watcher{master, slave, fd, 0});
+	pty_watching = true;
+}/*}}}*/
+
+/* Before a write to a pty master, on the thread that writes. False when
+ * no client has the slave open, the data is to be dropped then. */
+static bool convey_pty_attached(HANDLE h)
+{/*{{{*/
+	std::lock_guard<std::mutex> lk(pty_watch_lock);
+	for (convey_pty_watcher& w : pty_watchers) {
+		if (w.master != h) {
+			continue;
+		}
+		alignas(struct inotify_event) char buf[16 * (sizeof(struct inotify_event) + NAME_MAX + 1)];
+		ssize_t n;
+		while ((n = read(w.fd, buf, sizeof buf)) > 0) {
+			for (ssize_t off = 0; off < n; ) {
+				const struct inotify_event* ev = reinterpret_cast<const struct inotify_event*>(buf + off);
+				if (ev->mask & IN_Q_OVERFLOW) {
+					/* Lost count, better a stale byte than a lost one. */
+					w.clients = 1;
+				} else if (ev->mask & IN_OPEN) {
+					w.clients++;
+				} else if (ev->mask & (IN_CLOSE_WRITE | IN_CLOSE_NOWRITE) && w.clients > 0) {
+					/* Nobody reads what the last one left, before the
+					 * next client opens it. */
+					if (0 == --w.clients) {
+						tcflush(w.slave, TCIFLUSH);
+					}
+				}
+				off += sizeof(struct inotify_event) + ev->len;
+			}
+		}
+		return w.clients > 0;
+	}
+	return true;
+}/*}}}*/
+#endif
+
+/* A raw pty with its slave held open, linked at link. */
+static bool convey_pty_make(const std::string& link, int& master, int& slave)
+{/*{{{*/
+	/* Not all systems take O_CLOEXEC here. */
+	int m = posix_openpt(O_RDWR | O_NOCTTY);
+	if (-1 == m || 0 != grantpt(m) || 0 != unlockpt(m)) {
+		convey_error(errno);
+		if (-1 != m) {
+			close(m);
+		}
+		return false;
+	}
+	fcntl(m, F_SETFD, FD_CLOEXEC);
+
+	/* ptsname_r is a GNU extension, the buffer of ptsname is shared. */
+	static std::mutex name_lock;
+	std::string pts;
+	{
+		std::lock_guard<std::mutex> lk(name_lock);
+		const char* n = ptsname(m);
+		if (n) {
+			pts = n;
+		}
+	}
+	if (pts.empty()) {
+		convey_error(errno);
+		close(m);
+		return false;
+	}
+	const char* name = pts.c_str();
+
+	/* Holding the slave open keeps the master readable while no client
+	 * is attached, instead of failing with EIO each time gdb detaches. */
+	int sl = open(name, O_RDWR | O_NOCTTY | O_CLOEXEC);
+	if (-1 == sl) {
+		convey_error(errno);
+		close(m);
+		return false;
+	}
+
+	struct termios t;
+	if (0 == tcgetattr(sl, &t)) {
+		cfmakeraw(&t);
+		tcsetattr(sl, TCSANOW, &t);
+	}
+
+	/* Replace a link left over by a previous run, but nothing else. */
+	struct stat st;
+	if (0 == lstat(link.c_str(), &st)) {
+		if (!S_ISLNK(st.st_mode)) {
+			std::cerr << "convey: '" << link << "' exists and is not a symbolic link" << std::endl;
+			close(sl);
+			close(m);
+			return false;
+		}
+		unlink(link.c_str());
+	}
+	if (0 != symlink(name, link.c_str())) {
+		convey_error(errno);
+		close(sl);
+		close(m);
+		return false;
+	}
+
+	if (conf.verbose) {
+		std::cout << "Linked '" << link << "' to '" << name << "'" << std::endl;
+	}
+#ifdef __linux__
+	convey_pty_watch(name, m, sl);
+#endif
+
+	master = m;
+	slave = sl;
+	return true;
+}/*}}}*/
+
+static bool convey_pty_open(const std::string& link)
+{/*{{{*/
+	if (-1 != pty_master) {
+		return true;
+	}
+	if (!convey_pty_make(link, pty_master, pty_slave)) {
+		return false;
+	}
+	pty_link_path = link;
+
+	return true;
+}/*}}}*/
+
+static void convey_pty_close(void)
+{/*{{{*/
+#ifdef __linux__
+	{
+		std::lock_guard<std::mutex> lk(pty_watch_lock);
+		for (const convey_pty_watcher& w : pty_watchers) {
+			close(w.fd);
+		}
+		pty_watchers.clear();
+	}
+#endif
+	for (const std::string& l : pty_mux_links) {
+		unlink(l.c_str());
+	}
+	pty_mux_links.clear();
+	if (!pty_link_path.empty()) {
+		unlink(pty_link_path.c_str());
+		pty_link_path.clear();
+	}
+	if (-1 != pty_slave) {
+		close(pty_slave);
+		pty_slave = -1;
+	}
+	if (-1 != pty_master) {
+		close(pty_master);
+		pty_master = -1;
+	}
+}/*}}}*/
+#endif
+
 static void convey_final_cleanup(void)
 {/*{{{*/
+#ifndef _WIN32
+	convey_pty_close();
+#endif
 	if (INVALID_HANDLE_VALUE != log_handle) {
 		CloseHandle(log_handle);
 		log_handle = INVALID_HANDLE_VALUE;
@@ -587,8 +1951,14 @@ static void convey_final_cleanup(void)
 		closesocket(listen_sock);
 		listen_sock = INVALID_SOCKET;
 	}
+	if (!listen_path.empty()) {
+		DeleteFileA(listen_path.c_str());
+		listen_path.clear();
+	}
 	if (wsa_started) {
+#ifdef _WIN32
 		WSACleanup();
+#endif
 		wsa_started = false;
 	}
 }/*}}}*/
@@ -596,8 +1966,14 @@ static void convey_final_cleanup(void)
 static void convey_log_to(HANDLE h, const char* buf, DWORD bytes)
 {/*{{{*/
 	if (INVALID_HANDLE_VALUE != h && bytes) {
+#ifdef _WIN32
 		DWORD written = 0;
 		WriteFile(h, buf, bytes, &written, nullptr);
+#else
+		if (write(h, buf, bytes) < 0) {
+			/* A failing log never stops the session. */
+		}
+#endif
 	}
 }/*}}}*/
 
@@ -613,8 +1989,17 @@ static void convey_log_recv(const char* buf, DWORD bytes)
 {/*{{{*/
 	convey_log_to(log_recv_handle, buf, bytes);
 	if (INVALID_HANDLE_VALUE != log_handle && bytes) {
-		char rec[BUF_SIZE + 2];
-		convey_log_to(log_handle, rec, convey_log_session_record(rec, buf, bytes, false));
+		char rec[RECV_BUF_SIZE + 2];
+		if (log_recv_dgrams.empty()) {
+			convey_log_to(log_handle, rec, convey_log_session_record(rec, buf, bytes, false));
+			return;
+		}
+		/* A record per datagram. */
+		DWORD off = 0;
+		for (DWORD n : log_recv_dgrams) {
+			convey_log_to(log_handle, rec, convey_log_session_record(rec, buf + off, n, false));
+			off += n;
+		}
 	}
 }/*}}}*/
 
@@ -632,12 +2017,44 @@ static bool convey_open_log(const std::string& path, HANDLE& h)
 	if (path.empty() || INVALID_HANDLE_VALUE != h) {
 		return true;
 	}
+#ifdef _WIN32
 	DWORD disp = conf.log_append ? OPEN_ALWAYS : CREATE_ALWAYS;
 	h = CreateFile(path.c_str(), FILE_APPEND_DATA, FILE_SHARE_READ, nullptr, disp, FILE_ATTRIBUTE_NORMAL, nullptr);
+#else
+	int flags = O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC | (conf.log_append ? 0 : O_TRUNC);
+	h = open(path.c_str(), flags, 0644);
+#endif
 	return INVALID_HANDLE_VALUE != h;
 }/*}}}*/
 
-static SOCKET convey_tcp_connect(const std::string& host, const std::string& port, DWORD& err)
+/* Interleave the address families as in RFC 8305 section 4, starting
+ * with the given one, or with the first resolved one for AF_UNSPEC. */
+static void convey_connect_order(std::vector<convey_addr>& addrs, int first)
+{/*{{{*/
+	if (addrs.empty()) {
+		return;
+	}
+	if (AF_UNSPEC == first) {
+		first = addrs[0].family;
+	}
+
+	std::vector<convey_addr> a, b;
+	for (const convey_addr& ca : addrs) {
+		(first == ca.family ? a : b).push_back(ca);
+	}
+
+	addrs.clear();
+	for (size_t i = 0; i < a.size() || i < b.size(); ++i) {
+		if (i < a.size()) {
+			addrs.push_back(a[i]);
+		}
+		if (i < b.size()) {
+			addrs.push_back(b[i]);
+		}
+	}
+}/*}}}*/
+
+static bool convey_resolve_now(const std::string& host, const std::string& port, std::vector<convey_addr>& addrs, DWORD& err)
 {/*{{{*/
 	struct addrinfo hints;
 	struct addrinfo *res = nullptr;
@@ -646,413 +2063,9031 @@ static SOCKET convey_tcp_connect(const std::string& host, const std::string& por
 	hints.ai_socktype = SOCK_STREAM;
 	hints.ai_protocol = IPPROTO_TCP;
 
+	auto t0 = std::chrono::steady_clock::now();
 	int gai = getaddrinfo(host.c_str(), port.c_str(), &hints, &res);
+	uint64_t ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - t0).count();
+	stats.resolves++;
+	stats.resolve_last_ms = ms;
+	stats.resolve_total_ms += ms;
 	if (0 != gai) {
 		err = static_cast<DWORD>(gai);
-		return INVALID_SOCKET;
+		return false;
 	}
 
-	SOCKET s = INVALID_SOCKET;
+	addrs.clear();
 	for (struct addrinfo *ai = res; nullptr != ai; ai = ai->ai_next) {
-		s = WSASocketW(ai->ai_family, ai->ai_socktype, ai->ai_protocol, nullptr, 0, WSA_FLAG_OVERLAPPED);
-		if (INVALID_SOCKET == s) {
-			err = WSAGetLastError();
-			continue;
-		}
-		if (0 == connect(s, ai->ai_addr, static_cast<int>(ai->ai_addrlen))) {
-			break;
-		}
-		err = WSAGetLastError();
-		closesocket(s);
-		s = INVALID_SOCKET;
+		convey_addr ca;
+		memset(&ca, 0, sizeof ca);
+		ca.family = ai->ai_family;
+		ca.socktype = ai->ai_socktype;
+		ca.protocol = ai->ai_protocol;
+		ca.addrlen = static_cast<int>(ai->ai_addrlen);
+		memcpy(&ca.addr, ai->ai_addr, ai->ai_addrlen);
+		addrs.push_back(ca);
 	}
 	freeaddrinfo(res);
 
-	if (INVALID_SOCKET != s) {
-		BOOL nodelay = TRUE;
-		setsockopt(s, IPPROTO_TCP, TCP_NODELAY, reinterpret_cast<const char *>(&nodelay), sizeof nodelay);
-	}
-
-	return s;
+	return true;
 }/*}}}*/
 
-static SOCKET convey_tcp_accept(const std::string& port, DWORD& err)
+static void convey_resolve_refresh(std::string host, std::string port)
 {/*{{{*/
-	if (INVALID_SOCKET == listen_sock) {
-		struct addrinfo hints;
-		struct addrinfo *res = nullptr;
-		memset(&hints, 0, sizeof hints);
-		hints.ai_family = AF_INET6;
-		hints.ai_socktype = SOCK_STREAM;
-		hints.ai_protocol = IPPROTO_TCP;
-		hints.ai_flags = AI_PASSIVE;
-
-		int gai = getaddrinfo(nullptr, port.c_str(), &hints, &res);
-		if (0 != gai) {
-			err = static_cast<DWORD>(gai);
-			return INVALID_SOCKET;
-		}
+	std::vector<convey_addr> addrs;
+	DWORD err = 0;
+	bool ok = convey_resolve_now(host, port, addrs, err);
+
+	/* A failed lookup keeps the stale addresses, DNS tends to be down
+	 * exactly when the target is. Gone meanwhile, they're not put back. */
+	std::lock_guard<std::mutex> lk(resolve_cache.lock);
+	auto it = resolve_cache.entries.find(std::make_pair(host, port));
+	if (resolve_cache.entries.end() == it) {
+		return;
+	}
+	if (ok) {
+		it->second.addrs = addrs;
+		it->second.resolved_at = std::chrono::steady_clock::now();
+		it->second.stale = false;
+	}
+	it->second.refreshing = false;
+}/*}}}*/
 
-		listen_sock = WSASocketW(res->ai_family, res->ai_socktype, res->ai_protocol, nullptr, 0, WSA_FLAG_OVERLAPPED);
-		if (INVALID_SOCKET == listen_sock) {
-			err = WSAGetLastError();
-			freeaddrinfo(res);
-			return INVALID_SOCKET;
+static bool convey_resolve(const std::string& host, const std::string& port, std::vector<convey_addr>& addrs, DWORD& err)
+{/*{{{*/
+	std::vector<convey_addr> old;
+	if (conf.dns_ttl > 0.0) {
+		std::lock_guard<std::mutex> lk(resolve_cache.lock);
+		auto it = resolve_cache.entries.find(std::make_pair(host, port));
+		if (resolve_cache.entries.end() != it && !it->second.addrs.empty()) {
+			convey_resolve_entry& e = it->second;
+			if (!e.stale) {
+				std::chrono::duration<double> age = std::chrono::steady_clock::now() - e.resolved_at;
+				if (age.count() >= conf.dns_ttl && !e.refreshing) {
+					e.refreshing = true;
+					std::thread(convey_resolve_refresh, host, port).detach();
+				}
+				addrs = e.addrs;
+				stats.resolve_hits++;
+				return true;
+			}
+			old = e.addrs;
 		}
+	}
 
-		BOOL reuse = TRUE;
-		setsockopt(listen_sock, SOL_SOCKET, SO_REUSEADDR, reinterpret_cast<const char *>(&reuse), sizeof reuse);
-
-		/* Accept both IPv6 and IPv4 (mapped) connections. */
-		DWORD v6only = 0;
-		setsockopt(listen_sock, IPPROTO_IPV6, IPV6_V6ONLY, reinterpret_cast<const char *>(&v6only), sizeof v6only);
-
-		if (0 != bind(listen_sock, res->ai_addr, static_cast<int>(res->ai_addrlen))) {
-			err = WSAGetLastError();
-			freeaddrinfo(res);
-			closesocket(listen_sock);
-			listen_sock = INVALID_SOCKET;
-			return INVALID_SOCKET;
+	if (!convey_resolve_now(host, port, addrs, err)) {
+		/* The old addresses are all there is while DNS is down, the
+		 * target may well come back on one of them. */
+		if (old.empty()) {
+			return false;
 		}
-		freeaddrinfo(res);
+		addrs = old;
+		return true;
+	}
 
-		if (0 != listen(listen_sock, 1)) {
-			err = WSAGetLastError();
-			closesocket(listen_sock);
-			listen_sock = INVALID_SOCKET;
-			return INVALID_SOCKET;
-		}
+	if (conf.dns_ttl > 0.0) {
+		std::lock_guard<std::mutex> lk(resolve_cache.lock);
+		convey_resolve_entry& e = resolve_cache.entries[std::make_pair(host, port)];
+		e.addrs = addrs;
+		e.resolved_at = std::chrono::steady_clock::now();
+		e.stale = false;
 	}
 
-	SOCKET s = accept(listen_sock, nullptr, nullptr);
-	if (INVALID_SOCKET == s) {
-		err = WSAGetLastError();
-		return INVALID_SOCKET;
+	return true;
+}/*}}}*/
+
+/* None of the cached addresses worked, the next connect resolves again
+ * before it tries, and falls back to them if that lookup fails. */
+static void convey_resolve_expire(const std::string& host, const std::string& port)
+{/*{{{*/
+	std::lock_guard<std::mutex> lk(resolve_cache.lock);
+	auto it = resolve_cache.entries.find(std::make_pair(host, port));
+	if (resolve_cache.entries.end() != it) {
+		it->second.stale = true;
 	}
+}/*}}}*/
+
+/* Keepalive and the user timeout, a library session keeps its own since
+ * conf belongs to whoever opens next. */
+struct convey_tcp_opts {
+	uint32_t keepalive_idle;
+	uint32_t keepalive_interval;
+	uint32_t keepalive_count;
+	uint32_t user_timeout;
+};
+
+static convey_tcp_opts convey_tcp_opts_conf(void)
+{/*{{{*/
+	return convey_tcp_opts{conf.keepalive_idle, conf.keepalive_interval, conf.keepalive_count, conf.user_timeout};
+}/*}}}*/
 
+/* Options for every connected TCP socket. Keepalive and the user timeout
+ * catch a peer that vanished without a FIN, which otherwise takes hours. */
+static void convey_tcp_tune(SOCKET s, const convey_tcp_opts& o)
+{/*{{{*/
 	BOOL nodelay = TRUE;
 	setsockopt(s, IPPROTO_TCP, TCP_NODELAY, reinterpret_cast<const char *>(&nodelay), sizeof nodelay);
 
-	return s;
+	if (o.keepalive_idle) {
+		BOOL on = TRUE;
+		setsockopt(s, SOL_SOCKET, SO_KEEPALIVE, reinterpret_cast<const char *>(&on), sizeof on);
+
+		DWORD idle = o.keepalive_idle, intvl = o.keepalive_interval, cnt = o.keepalive_count;
+		if (0 != setsockopt(s, IPPROTO_TCP, TCP_KEEPIDLE, reinterpret_cast<const char *>(&idle), sizeof idle)
+				|| 0 != setsockopt(s, IPPROTO_TCP, TCP_KEEPINTVL, reinterpret_cast<const char *>(&intvl), sizeof intvl)) {
+#ifdef _WIN32
+			/* Older Windows only takes the times, in milliseconds, through the ioctl. */
+			struct tcp_keepalive ka;
+			DWORD ret = 0;
+			ka.onoff = 1;
+			ka.keepalivetime = idle * 1000;
+			ka.keepaliveinterval = intvl * 1000;
+			WSAIoctl(s, SIO_KEEPALIVE_VALS, &ka, sizeof ka, nullptr, 0, &ret, nullptr, nullptr);
+#endif
+		}
+		/* Not settable before Windows 10 1703, the probe count is fixed to 10 there. */
+		setsockopt(s, IPPROTO_TCP, TCP_KEEPCNT, reinterpret_cast<const char *>(&cnt), sizeof cnt);
+	}
+
+	if (o.user_timeout) {
+#ifdef _WIN32
+		/* The Windows counterpart to TCP_USER_TIMEOUT, in seconds. */
+		DWORD maxrt = o.user_timeout;
+		setsockopt(s, IPPROTO_TCP, TCP_MAXRT, reinterpret_cast<const char *>(&maxrt), sizeof maxrt);
+#else
+		DWORD ms = o.user_timeout * 1000;
+		setsockopt(s, IPPROTO_TCP, TCP_USER_TIMEOUT, reinterpret_cast<const char *>(&ms), sizeof ms);
+#endif
+	}
 }/*}}}*/
 
-static convey_setup_status convey_startup(int argc, char **argv)
+#ifndef __linux__
+/* Buffer size for a measured rate and round trip: twice the
+ * bandwidth-delay product, to a power of two within the auto bounds. */
+static int convey_sockbuf_for_bdp(uint64_t bytes_per_sec, uint64_t rtt_us)
 {/*{{{*/
-	DWORD rc;
+	uint64_t want = 2 * bytes_per_sec * rtt_us / 1000000;
+	uint64_t size = SOCKBUF_AUTO_MIN;
+	while (size < want && size < SOCKBUF_AUTO_MAX) {
+		size <<= 1;
+	}
+	return static_cast<int>(size);
+}/*}}}*/
+#endif
 
-	_setmode(_fileno(stdin), _O_BINARY);
-	_setmode(_fileno(stdout), _O_BINARY);
-	_setmode(_fileno(stderr), _O_BINARY);
+/* Explicit buffer sizes go on the socket before connect() or listen(),
+ * so the window scale offered in the handshake covers them. */
+static void convey_tcp_set_bufs(SOCKET s)
+{/*{{{*/
+	if (conf.sndbuf > 0) {
+		setsockopt(s, SOL_SOCKET, SO_SNDBUF, reinterpret_cast<const char *>(&conf.sndbuf), sizeof conf.sndbuf);
+	}
+	if (conf.rcvbuf > 0) {
+		setsockopt(s, SOL_SOCKET, SO_RCVBUF, reinterpret_cast<const char *>(&conf.rcvbuf), sizeof conf.rcvbuf);
+	}
+}/*}}}*/
 
-	convey_setup_status _rc = convey_conf_setup(argc, argv);
-	if(convey_setup_ok != _rc) {
-		return _rc;
+/* Throughput seen in one direction of a socket, for --sndbuf/--rcvbuf auto. */
+struct convey_autotune {
+	ULONGLONG since;
+	uint64_t bytes;
+	int size;
+};
+
+/* Account the bytes just moved and, about once a second, grow the
+ * buffer when the measured bandwidth-delay product outgrew it. Linux
+ * grows both buffers itself, up to tcp_rmem and tcp_wmem, and stops
+ * doing so for a socket once they were set, so there it only watches. */
+static void convey_tcp_autotune(HANDLE h, int opt, convey_autotune& at, DWORD bytes)
+{/*{{{*/
+	if (SOCKBUF_AUTO != (SO_RCVBUF == opt ? conf.rcvbuf : conf.sndbuf) || !convey_transport_is_tcp()) {
+		return;
 	}
 
-	if (convey_transport_is_tcp()) {
-		if (!convey_wsa_init()) {
-			restart_on_exit = false;
-			return convey_setup_exit_err;
-		}
+	ULONGLONG now = GetTickCount64();
+	if (!at.since) {
+		at.since = now;
+	}
+	at.bytes += bytes;
+	if (now - at.since < 1000) {
+		return;
 	}
 
-	if (conf.verbose) {
-		std::cout << "Polling the pipe '" << conf.pipe_path << "' for " << conf.pipe_poll << " seconds" << std::endl;
+	SOCKET s = reinterpret_cast<SOCKET>(h);
+#ifdef __linux__
+	int size = 0;
+	socklen_t len = sizeof size;
+	if (0 == getsockopt(s, SOL_SOCKET, opt, reinterpret_cast<char *>(&size), &len)) {
+		(SO_RCVBUF == opt ? stats.rcvbuf : stats.sndbuf) = size;
 	}
-	size_t elapsed = 0,
-		   step = 300 /* milliseconds*/;
-	bool conn_error;
-	do {
-		if (convey_tp_tcp_client == conf.transport) {
-			SOCKET s = convey_tcp_connect(conf.tcp_host, conf.tcp_port, rc);
-			pipe = (INVALID_SOCKET == s) ? INVALID_HANDLE_VALUE : reinterpret_cast<HANDLE>(s);
-			conn_error = INVALID_HANDLE_VALUE == pipe;
-		} else if (convey_tp_tcp_server == conf.transport) {
-			SOCKET s = convey_tcp_accept(conf.tcp_port, rc);
-			pipe = (INVALID_SOCKET == s) ? INVALID_HANDLE_VALUE : reinterpret_cast<HANDLE>(s);
-			conn_error = INVALID_HANDLE_VALUE == pipe;
-		} else {
-			pipe = CreateFile(conf.pipe_path.c_str(), GENERIC_READ | GENERIC_WRITE, 0, nullptr, OPEN_EXISTING, FILE_FLAG_OVERLAPPED, nullptr);
-			rc = GetLastError();
-			conn_error = INVALID_HANDLE_VALUE == pipe || ERROR_PIPE_BUSY == rc || ERROR_FILE_NOT_FOUND == rc;
-		}
-		if (conn_error) {
-			if (elapsed/1000 < conf.pipe_poll) {
-				std::this_thread::sleep_for(std::chrono::milliseconds(step));
-				elapsed += step;
-				continue;
+#else
+#ifdef _WIN32
+	DWORD ver = 0, ret = 0;
+	TCP_INFO_v0 ti;
+	bool have_rtt = 0 == WSAIoctl(s, SIO_TCP_INFO, &ver, sizeof ver, &ti, sizeof ti, &ret, nullptr, nullptr);
+	uint64_t rtt_us = have_rtt ? ti.RttUs : 0;
+#else
+	struct tcp_info ti;
+	socklen_t len = sizeof ti;
+	bool have_rtt = 0 == getsockopt(s, IPPROTO_TCP, TCP_INFO, &ti, &len);
+	uint64_t rtt_us = have_rtt ? ti.tcpi_rtt : 0;
+#endif
+	if (have_rtt) {
+		int size = convey_sockbuf_for_bdp(at.bytes * 1000 / (now - at.since), rtt_us);
+		if (size > at.size) {
+			if (0 == setsockopt(s, SOL_SOCKET, opt, reinterpret_cast<const char *>(&size), sizeof size)) {
+				at.size = size;
+				(SO_RCVBUF == opt ? stats.rcvbuf : stats.sndbuf) = size;
 			}
 		}
-		break;
-	} while (true);
-	if (conn_error) {
-		convey_error(rc);
-		restart_on_exit = false;
-		return convey_setup_exit_err;
-	}
-	if (conf.verbose) {
-		std::cout << "Connection established in " << (elapsed/1000) << " seconds" << std::endl;
 	}
+#endif
+	at.since = now;
+	at.bytes = 0;
+}/*}}}*/
 
-	/* TODO Expand on this handling. */
-	DWORD t = GetFileType(pipe);
-	if (FILE_TYPE_CHAR == t) {
-		DCB dcb = {0};
-		dcb.DCBlength = sizeof(DCB);
-
-		if (!::GetCommState(pipe, &dcb)) {
-			convey_error();
-			return convey_setup_exit_err;
-		}
+struct convey_connect_attempt {
+	SOCKET s;
+	int family;
+	ULONGLONG started;
+};
 
-		dcb.fBinary = true;
-		dcb.fNull = false;
-		dcb.fErrorChar = false;
-		dcb.fAbortOnError = false;
-		dcb.BaudRate = conf.baud;
-		dcb.ByteSize = conf.byte_size;
-		dcb.Parity = conf.parity;
-		dcb.StopBits = conf.stop_bits;
-
-		dcb.fOutxCtsFlow = false;
-		dcb.fRtsControl = RTS_CONTROL_ENABLE;
-		dcb.fOutxDsrFlow = false;
-		dcb.fDtrControl = DTR_CONTROL_ENABLE;
-		dcb.fTXContinueOnXoff = false;
-		dcb.fOutX = false;
-		dcb.fInX = false;
-		dcb.fDsrSensitivity = false;
-		if (convey_flow_control_rtscts == conf.flow_control) {
-			dcb.fOutxCtsFlow = true;
-			dcb.fRtsControl = RTS_CONTROL_HANDSHAKE;
-		} else if (convey_flow_control_dsrdtr == conf.flow_control) {
-			dcb.fOutxDsrFlow = true;
-			dcb.fDtrControl = DTR_CONTROL_HANDSHAKE;
-		} else if (convey_flow_control_xonxoff == conf.flow_control) {
-			dcb.fOutX = true;
-			dcb.fInX = true;
-		} else if (((decltype(conf.flow_control))-1) == conf.flow_control) {
-			return convey_setup_exit_err;
+/* The family is the hint of the session, the one that won is left there. */
+static SOCKET convey_tcp_connect(const std::string& host, const std::string& port, int& family, DWORD& err)
+{/*{{{*/
+	std::vector<convey_addr> addrs;
+	if (!convey_resolve(host, port, addrs, err)) {
+		return INVALID_SOCKET;
+	}
+	convey_connect_order(addrs, family);
+
+	/* Race non-blocking connects, starting the next address once the
+	 * previous one failed or after the attempt delay, whichever comes
+	 * first. A dead address so costs a few hundred milliseconds instead
+	 * of the full SYN timeout. */
+	const ULONGLONG timeout = static_cast<ULONGLONG>(conf.connect_timeout * 1000);
+	std::vector<convey_connect_attempt> live;
+	SOCKET s = INVALID_SOCKET;
+	size_t next = 0;
+	ULONGLONG next_start = GetTickCount64();
+	err = WSAETIMEDOUT;
+
+	while (INVALID_SOCKET == s) {
+		ULONGLONG now = GetTickCount64();
+
+		if (next < addrs.size() && (live.empty() || now >= next_start)) {
+			const convey_addr& ca = addrs[next++];
+			SOCKET c = convey_socket(ca.family, ca.socktype, ca.protocol);
+			if (INVALID_SOCKET == c) {
+				err = WSAGetLastError();
+				continue;
+			}
+			convey_tcp_set_bufs(c);
+			convey_set_nonblocking(c, true);
+			if (0 == connect(c, reinterpret_cast<const struct sockaddr *>(&ca.addr), ca.addrlen)) {
+				s = c;
+				family = ca.family;
+				break;
+			}
+			int e = WSAGetLastError();
+			if (WSAEWOULDBLOCK != e && WSAEINPROGRESS != e) {
+				err = e;
+				closesocket(c);
+				continue;
+			}
+			live.push_back({c, ca.family, now});
+			next_start = now + CONVEY_CONNECT_ATTEMPT_DELAY;
+			continue;
 		}
 
-		if (!::SetCommState(pipe, &dcb)) {
-			convey_error();
-			return convey_setup_exit_err;
+		/* Drop the attempts that ran out of time. */
+		for (size_t i = 0; i < live.size();) {
+			if (now - live[i].started >= timeout) {
+				closesocket(live[i].s);
+				live.erase(live.begin() + i);
+				err = WSAETIMEDOUT;
+			} else {
+				++i;
+			}
 		}
-
-		COMMTIMEOUTS timeouts = {0};
-		timeouts.ReadIntervalTimeout = MAXDWORD;
-		timeouts.ReadTotalTimeoutMultiplier = 0;
-		timeouts.ReadTotalTimeoutConstant = 0;
-		timeouts.WriteTotalTimeoutMultiplier = 0;
-		timeouts.WriteTotalTimeoutConstant = 0;
-		if (!SetCommTimeouts(pipe, &timeouts)) {
-			convey_error();
-			return convey_setup_exit_err;
+		if (live.empty()) {
+			if (next >= addrs.size()) {
+				break;
+			}
+			continue;
 		}
-	}
 
-	if (conf.bridge) {
-		bpipe = CreateNamedPipe(conf.bridge_pipe_name.c_str(),
-			PIPE_ACCESS_DUPLEX | FILE_FLAG_OVERLAPPED,
-			PIPE_TYPE_BYTE | PIPE_READMODE_BYTE | PIPE_WAIT,
-			1, BUF_SIZE, BUF_SIZE, 0, nullptr);
-		if (INVALID_HANDLE_VALUE == bpipe) {
-			convey_error();
-			convey_shutdown();
-			return convey_setup_exit_err;
+		ULONGLONG wait = timeout;
+		for (const convey_connect_attempt& a : live) {
+			ULONGLONG left = a.started + timeout - now;
+			wait = (left < wait) ? left : wait;
 		}
-
-		if (conf.verbose) {
-			std::cout << "Waiting for a client on '" << conf.bridge_pipe_name << "'" << std::endl;
+		if (next < addrs.size() && next_start > now && next_start - now < wait) {
+			wait = next_start - now;
 		}
 
-		OVERLAPPED ov;
-		memset(&ov, 0, sizeof ov);
-		ov.hEvent = CreateEvent(nullptr, true, false, nullptr);
-		BOOL connected = ConnectNamedPipe(bpipe, &ov);
-		DWORD cer = GetLastError();
-		if (!connected) {
-			if (ERROR_IO_PENDING == cer) {
-				WaitForSingleObject(ov.hEvent, INFINITE);
-				connected = TRUE;
-			} else if (ERROR_PIPE_CONNECTED == cer) {
-				connected = TRUE;
-			}
-		}
-		CloseHandle(ov.hEvent);
-		if (!connected) {
-			convey_error(cer);
-			convey_shutdown();
-			return convey_setup_exit_err;
+		std::vector<struct pollfd> pfd(live.size());
+		for (size_t i = 0; i < live.size(); i++) {
+			pfd[i].fd = live[i].s;
+			pfd[i].events = POLLOUT;
+			pfd[i].revents = 0;
 		}
-	} else {
-		/* This could be something else, too. */
-		in = GetStdHandle(STD_INPUT_HANDLE);
-		if (INVALID_HANDLE_VALUE == in) {
-			convey_error();
-			convey_shutdown();
-			return convey_setup_exit_err;
+		if (SOCKET_ERROR == WSAPoll(pfd.data(), static_cast<ULONG>(pfd.size()), static_cast<int>(wait))) {
+			err = WSAGetLastError();
+			break;
 		}
-		in_is_pipe = GetFileType(in) == FILE_TYPE_PIPE;
 
-		/* This could be something else, too. */
-		out = GetStdHandle(STD_OUTPUT_HANDLE);
-		if (INVALID_HANDLE_VALUE == out) {
-			convey_error();
-			convey_shutdown();
-			return convey_setup_exit_err;
+		/* A failed connect shows up as an error or hangup, or as writable
+		 * with a pending socket error. Either way, the next address starts
+		 * now. */
+		for (size_t i = 0, k = 0; i < live.size(); k++) {
+			SOCKET c = live[i].s;
+			short ev = pfd[k].revents;
+			if (ev & (POLLOUT | POLLERR | POLLHUP)) {
+				int so_err = 0;
+				socklen_t len = sizeof so_err;
+				getsockopt(c, SOL_SOCKET, SO_ERROR, reinterpret_cast<char *>(&so_err), &len);
+				if (0 == so_err && (ev & POLLOUT)) {
+					s = c;
+					family = live[i].family;
+					live.erase(live.begin() + i);
+					break;
+				}
+				err = so_err ? so_err : WSAECONNREFUSED;
+				closesocket(c);
+				live.erase(live.begin() + i);
+				next_start = now;
+			} else {
+				++i;
+			}
 		}
-		out_is_pipe = GetFileType(out) == FILE_TYPE_PIPE;
 	}
-
-	e_pipe_w = CreateEvent(nullptr, false, false, nullptr);
-	e_pipe_r = CreateEvent(nullptr, false, false, nullptr);
-	e_in = CreateEvent(nullptr, false, false, nullptr);
-	e_out = CreateEvent(nullptr, false, false, nullptr);
-
-	if (!convey_open_log(conf.log_path, log_handle)
-			|| !convey_open_log(conf.log_recv_path, log_recv_handle)
-			|| !convey_open_log(conf.log_send_path, log_send_handle)) {
-		convey_error();
-		convey_shutdown();
-		return convey_setup_exit_err;
+	for (const convey_connect_attempt& a : live) {
+		closesocket(a.s);
 	}
 
-	if (!conf.bridge) {
-		is_console = is_console_handle(in) && is_console_handle(out);
+	if (INVALID_SOCKET == s) {
+		convey_resolve_expire(host, port);
+	}
 
-		if (is_console) {
-			setup_console();
+	if (INVALID_SOCKET != s) {
+		convey_set_nonblocking(s, false);
+		convey_tcp_tune(s, convey_tcp_opts_conf());
+		if (conf.verbose) {
+			std::cerr << "Connected over " << (AF_INET6 == family ? "IPv6" : "IPv4") << std::endl;
 		}
 	}
 
-	return convey_setup_ok;
+	return s;
 }/*}}}*/
 
-
-#define CLOSE_HANDLE(h) do { \
-	if (INVALID_HANDLE_VALUE != h) { \
-		CloseHandle(h); \
-		h = INVALID_HANDLE_VALUE; \
-	} \
-} while (0)
-static void convey_shutdown(void)
+static SOCKET convey_tcp_listen(const std::string& port, DWORD& err)
 {/*{{{*/
-	shutting_down = true;
+	struct addrinfo hints;
+	struct addrinfo *res = nullptr;
+	memset(&hints, 0, sizeof hints);
+	hints.ai_family = AF_INET6;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_protocol = IPPROTO_TCP;
+	hints.ai_flags = AI_PASSIVE;
 
-	if (is_console) {
-		restore_console();
+	int gai = getaddrinfo(nullptr, port.c_str(), &hints, &res);
+	if (0 != gai) {
+		err = static_cast<DWORD>(gai);
+		return INVALID_SOCKET;
 	}
 
-	if (convey_tp_tcp_client == conf.transport || convey_tp_tcp_server == conf.transport) {
-		if (INVALID_HANDLE_VALUE != pipe) {
-			closesocket(reinterpret_cast<SOCKET>(pipe));
-			pipe = INVALID_HANDLE_VALUE;
-		}
-	} else {
-		CLOSE_HANDLE(pipe);
+	SOCKET s = convey_socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+	if (INVALID_SOCKET == s) {
+		err = WSAGetLastError();
+		freeaddrinfo(res);
+		return INVALID_SOCKET;
 	}
-	CLOSE_HANDLE(bpipe);
-	/* in/out are the process standard handles; never close them, or a
-	 * redirected stdio pipe would break across a --reconnect restart. */
-	CLOSE_HANDLE(e_pipe_w);
-	CLOSE_HANDLE(e_pipe_r);
-	CLOSE_HANDLE(e_in);
-	CLOSE_HANDLE(e_out);
 
-	convey_conf_shutdown();
-}
-#undef CLOSE_HANDLE
-/*}}}*/
+	BOOL reuse = TRUE;
+	setsockopt(s, SOL_SOCKET, SO_REUSEADDR, reinterpret_cast<const char *>(&reuse), sizeof reuse);
 
-#define OV_E(e) { 0, 0, {{0, 0}}, e }
-static bool convey_read_pipe(HANDLE h, char (& buf)[BUF_SIZE], DWORD* bytes, HANDLE e, DWORD& er)
-{
-	OVERLAPPED ov = OV_E(e);
-	bool rc = ReadFile(h, buf, sizeof buf, bytes, &ov);
-	er = GetLastError();
-	rc = convey_get_ov_result(h, &ov, bytes, rc, er);
+	convey_tcp_set_bufs(s);
 
-	return rc;
-}
+	/* Accept both IPv6 and IPv4 (mapped) connections. */
+	DWORD v6only = 0;
+	setsockopt(s, IPPROTO_IPV6, IPV6_V6ONLY, reinterpret_cast<const char *>(&v6only), sizeof v6only);
 
-static bool convey_write_pipe(HANDLE h, const char* buf, DWORD* bytes, HANDLE e, DWORD& er)
-{
-	DWORD total = *bytes, off = 0;
+	if (0 != bind(s, res->ai_addr, static_cast<int>(res->ai_addrlen))) {
+		err = WSAGetLastError();
+		freeaddrinfo(res);
+		closesocket(s);
+		return INVALID_SOCKET;
+	}
+	freeaddrinfo(res);
 
-	while (off < total) {
-		OVERLAPPED ov = OV_E(e);
-		DWORD written = 0;
-		bool rc = WriteFile(h, buf + off, total - off, &written, &ov);
-		er = GetLastError();
-		rc = convey_get_ov_result(h, &ov, &written, rc, er);
-		if (!rc) {
-			*bytes = off;
-			return false;
-		}
-		if (0 == written) {
-			break;
+	if (0 != listen(s, 1)) {
+		err = WSAGetLastError();
+		closesocket(s);
+		return INVALID_SOCKET;
+	}
+
+	return s;
+}/*}}}*/
+
+static SOCKET convey_tcp_accept(const std::string& port, DWORD& err)
+{/*{{{*/
+	if (INVALID_SOCKET == listen_sock) {
+		listen_sock = convey_tcp_listen(port, err);
+		if (INVALID_SOCKET == listen_sock) {
+			return INVALID_SOCKET;
+		}
+	}
+
+	SOCKET s = accept(listen_sock, nullptr, nullptr);
+	if (INVALID_SOCKET == s) {
+		err = WSAGetLastError();
+		return INVALID_SOCKET;
+	}
+
+	convey_tcp_tune(s, convey_tcp_opts_conf());
+
+	return s;
+}/*}}}*/
+
+static bool convey_unix_addr(const std::string& path, struct sockaddr_un& sa)
+{/*{{{*/
+	if (path.size() >= sizeof sa.sun_path) {
+		return false;
+	}
+	memset(&sa, 0, sizeof sa);
+	sa.sun_family = AF_UNIX;
+	memcpy(sa.sun_path, path.c_str(), path.size());
+	return true;
+}/*}}}*/
+
+static SOCKET convey_unix_connect(const std::string& path, DWORD& err)
+{/*{{{*/
+	struct sockaddr_un sa;
+	if (!convey_unix_addr(path, sa)) {
+		err = ERROR_INVALID_PARAMETER;
+		return INVALID_SOCKET;
+	}
+
+	SOCKET s = convey_socket(AF_UNIX, SOCK_STREAM, 0);
+	if (INVALID_SOCKET == s) {
+		err = WSAGetLastError();
+		return INVALID_SOCKET;
+	}
+	/* A listener with a full backlog keeps the connect waiting, on Linux
+	 * up to the send timeout, which gets --connect-timeout meanwhile.
+	 * Windows refuses such a connect at once. */
+#ifndef _WIN32
+	struct timeval tv;
+	tv.tv_sec = static_cast<time_t>(conf.connect_timeout);
+	tv.tv_usec = static_cast<suseconds_t>((conf.connect_timeout - tv.tv_sec) * 1000000);
+	setsockopt(s, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof tv);
+#endif
+	if (0 != connect(s, reinterpret_cast<const struct sockaddr *>(&sa), sizeof sa)) {
+		err = WSAGetLastError();
+		if (WSAEWOULDBLOCK == err) {
+			err = WSAETIMEDOUT;
+		}
+		closesocket(s);
+		return INVALID_SOCKET;
+	}
+#ifndef _WIN32
+	tv.tv_sec = tv.tv_usec = 0;
+	setsockopt(s, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof tv);
+#endif
+
+	return s;
+}/*}}}*/
+
+/* The caller removes the socket file once done. */
+/* Connects to the socket file without waiting, 0 when a listener is
+ * there, even one with a full backlog, otherwise why not. */
+static DWORD convey_unix_probe(const struct sockaddr_un& sa)
+{/*{{{*/
+	SOCKET p = convey_socket(AF_UNIX, SOCK_STREAM, 0);
+	if (INVALID_SOCKET == p) {
+		return WSAGetLastError();
+	}
+	convey_set_nonblocking(p, true);
+	DWORD er = 0;
+	if (0 != connect(p, reinterpret_cast<const struct sockaddr *>(&sa), sizeof sa)) {
+		er = WSAGetLastError();
+		if (WSAEWOULDBLOCK == er || WSAEINPROGRESS == er) {
+			er = 0;
+		}
+	}
+	closesocket(p);
+	return er;
+}/*}}}*/
+
+static SOCKET convey_unix_listen(const std::string& path, DWORD& err)
+{/*{{{*/
+	struct sockaddr_un sa;
+	if (!convey_unix_addr(path, sa)) {
+		err = ERROR_INVALID_PARAMETER;
+		return INVALID_SOCKET;
+	}
+
+	SOCKET s = convey_socket(AF_UNIX, SOCK_STREAM, 0);
+	if (INVALID_SOCKET == s) {
+		err = WSAGetLastError();
+		return INVALID_SOCKET;
+	}
+
+	/* A socket file left over by a killed run would fail the bind, anything
+	 * else at the path isn't ours to remove, nor is a socket someone still
+	 * listens on. Only a refused connect tells it's left over. */
+	bool taken, stale;
+#ifdef _WIN32
+	DWORD attr = GetFileAttributesA(path.c_str());
+	taken = INVALID_FILE_ATTRIBUTES != attr;
+	stale = taken && (attr & FILE_ATTRIBUTE_REPARSE_POINT);
+#else
+	struct stat st;
+	taken = 0 == lstat(path.c_str(), &st);
+	stale = taken && S_ISSOCK(st.st_mode);
+#endif
+	if (taken && !stale) {
+		err = WSAEADDRINUSE;
+		closesocket(s);
+		return INVALID_SOCKET;
+	}
+	if (stale) {
+		DWORD probe = convey_unix_probe(sa);
+		if (WSAECONNREFUSED != probe) {
+			err = probe ? probe : WSAEADDRINUSE;
+			closesocket(s);
+			return INVALID_SOCKET;
+		}
+		DeleteFileA(path.c_str());
+	}
+	if (0 != bind(s, reinterpret_cast<const struct sockaddr *>(&sa), sizeof sa)) {
+		err = WSAGetLastError();
+		closesocket(s);
+		return INVALID_SOCKET;
+	}
+
+	if (0 != listen(s, 1)) {
+		err = WSAGetLastError();
+		closesocket(s);
+		DeleteFileA(path.c_str());
+		return INVALID_SOCKET;
+	}
+
+	return s;
+}/*}}}*/
+
+static SOCKET convey_unix_accept(const std::string& path, DWORD& err)
+{/*{{{*/
+	if (INVALID_SOCKET == listen_sock) {
+		listen_sock = convey_unix_listen(path, err);
+		if (INVALID_SOCKET == listen_sock) {
+			return INVALID_SOCKET;
+		}
+		listen_path = path;
+	}
+
+	SOCKET s = accept(listen_sock, nullptr, nullptr);
+	if (INVALID_SOCKET == s) {
+		err = WSAGetLastError();
+		return INVALID_SOCKET;
+	}
+
+	return s;
+}/*}}}*/
+
+/* vsock:<cid>:<port> talks to a console agent in a VM over virtio-vsock,
+ * or Hyper-V sockets on Windows, at memory speed instead of the baud
+ * rate of an emulated UART. CID 1 is the local loopback, 2 the host. */
+#ifdef _WIN32
+#define CONVEY_AF_VSOCK AF_HYPERV
+#define CONVEY_VSOCK_PROTO HV_PROTOCOL_RAW
+typedef SOCKADDR_HV convey_vsock_sa;
+
+/* Hyper-V maps vsock port N of a Linux guest to the service
+ * N-facb-11e6-bd58-64006a7986d3. */
+static const GUID convey_hv_vsock_template = {0x00000000, 0xfacb, 0x11e6, {0xbd, 0x58, 0x64, 0x00, 0x6a, 0x79, 0x86, 0xd3}};
+static const GUID convey_hv_loopback = {0xe0e16197, 0xdd56, 0x4a10, {0x91, 0x95, 0x5e, 0xe7, 0xa1, 0x55, 0xa8, 0x38}};
+static const GUID convey_hv_parent = {0xa42e7cda, 0xd03f, 0x480c, {0x9c, 0xc2, 0xa4, 0xde, 0x20, 0xab, 0xb8, 0x78}};
+
+/* A VM id as Get-VM prints it, braces optional. */
+static bool convey_guid_parse(const std::string& str, GUID& g)
+{/*{{{*/
+	std::string t = (str.size() == 38 && '{' == str.front() && '}' == str.back()) ? str.substr(1, 36) : str;
+	uint8_t b[16];
+	size_t n = 0;
+
+	if (36 != t.size()) {
+		return false;
+	}
+	for (size_t i = 0; i < t.size(); i++) {
+		if (8 == i || 13 == i || 18 == i || 23 == i) {
+			if ('-' != t[i]) {
+				return false;
+			}
+			continue;
+		}
+		char c = static_cast<char>(tolower(static_cast<unsigned char>(t[i])));
+		int v = (c >= '0' && c <= '9') ? c - '0' : (c >= 'a' && c <= 'f') ? c - 'a' + 10 : -1;
+		if (v < 0) {
+			return false;
+		}
+		b[n / 2] = static_cast<uint8_t>((n & 1) ? (b[n / 2] | v) : (v << 4));
+		n++;
+	}
+
+	g.Data1 = (static_cast<unsigned long>(b[0]) << 24) | (b[1] << 16) | (b[2] << 8) | b[3];
+	g.Data2 = static_cast<unsigned short>((b[4] << 8) | b[5]);
+	g.Data3 = static_cast<unsigned short>((b[6] << 8) | b[7]);
+	memcpy(g.Data4, b + 8, 8);
+	return true;
+}/*}}}*/
+
+static bool convey_vsock_addr(const std::string& cid, const std::string& port, convey_vsock_sa& sa)
+{/*{{{*/
+	uint32_t p;
+	if (!convey_vsock_port(port, p)) {
+		return false;
+	}
+	memset(&sa, 0, sizeof sa);
+	sa.Family = AF_HYPERV;
+	sa.ServiceId = convey_hv_vsock_template;
+	sa.ServiceId.Data1 = p;
+	/* No CID is a listener, for any VM; the wildcard is all zeros. */
+	if ("1" == cid) {
+		sa.VmId = convey_hv_loopback;
+	} else if ("2" == cid) {
+		sa.VmId = convey_hv_parent;
+	} else if (!cid.empty() && !convey_guid_parse(cid, sa.VmId)) {
+		return false;
+	}
+	return true;
+}/*}}}*/
+
+static void convey_vsock_timeout(SOCKET s)
+{/*{{{*/
+	DWORD ms = static_cast<DWORD>(conf.connect_timeout * 1000.0);
+	setsockopt(s, HV_PROTOCOL_RAW, HVSOCKET_CONNECT_TIMEOUT, reinterpret_cast<const char *>(&ms), sizeof ms);
+}/*}}}*/
+#elif defined(CONVEY_HAVE_VSOCK)
+#define CONVEY_AF_VSOCK AF_VSOCK
+#define CONVEY_VSOCK_PROTO 0
+typedef struct sockaddr_vm convey_vsock_sa;
+
+static bool convey_vsock_addr(const std::string& cid, const std::string& port, convey_vsock_sa& sa)
+{/*{{{*/
+	uint32_t p, c = VMADDR_CID_ANY;
+	if (!convey_vsock_port(port, p) || (!cid.empty() && !convey_vsock_port(cid, c))) {
+		return false;
+	}
+	memset(&sa, 0, sizeof sa);
+	sa.svm_family = AF_VSOCK;
+	sa.svm_cid = c;
+	sa.svm_port = p;
+	return true;
+}/*}}}*/
+
+/* The kernel gives a connect 2 seconds otherwise. */
+static void convey_vsock_timeout(SOCKET s)
+{/*{{{*/
+	struct timeval tv;
+	tv.tv_sec = static_cast<time_t>(conf.connect_timeout);
+	tv.tv_usec = static_cast<suseconds_t>((conf.connect_timeout - tv.tv_sec) * 1000000.0);
+	setsockopt(s, AF_VSOCK, SO_VM_SOCKETS_CONNECT_TIMEOUT, &tv, sizeof tv);
+}/*}}}*/
+#endif
+
+#if defined(_WIN32) || defined(CONVEY_HAVE_VSOCK)
+static SOCKET convey_vsock_connect(const std::string& cid, const std::string& port, DWORD& err)
+{/*{{{*/
+	convey_vsock_sa sa;
+	if (!convey_vsock_addr(cid, port, sa)) {
+		err = ERROR_INVALID_PARAMETER;
+		return INVALID_SOCKET;
+	}
+
+	SOCKET s = convey_socket(CONVEY_AF_VSOCK, SOCK_STREAM, CONVEY_VSOCK_PROTO);
+	if (INVALID_SOCKET == s) {
+		err = WSAGetLastError();
+		return INVALID_SOCKET;
+	}
+	convey_vsock_timeout(s);
+	if (0 != connect(s, reinterpret_cast<const struct sockaddr *>(&sa), sizeof sa)) {
+		err = WSAGetLastError();
+		closesocket(s);
+		return INVALID_SOCKET;
+	}
+
+	return s;
+}/*}}}*/
+
+static SOCKET convey_vsock_listen(const std::string& port, DWORD& err)
+{/*{{{*/
+	convey_vsock_sa sa;
+	if (!convey_vsock_addr("", port, sa)) {
+		err = ERROR_INVALID_PARAMETER;
+		return INVALID_SOCKET;
+	}
+
+	SOCKET s = convey_socket(CONVEY_AF_VSOCK, SOCK_STREAM, CONVEY_VSOCK_PROTO);
+	if (INVALID_SOCKET == s) {
+		err = WSAGetLastError();
+		return INVALID_SOCKET;
+	}
+	if (0 != bind(s, reinterpret_cast<const struct sockaddr *>(&sa), sizeof sa) || 0 != listen(s, 1)) {
+		err = WSAGetLastError();
+		closesocket(s);
+		return INVALID_SOCKET;
+	}
+
+	return s;
+}/*}}}*/
+#else
+static SOCKET convey_vsock_connect(const std::string&, const std::string&, DWORD& err)
+{/*{{{*/
+	err = EAFNOSUPPORT;
+	return INVALID_SOCKET;
+}/*}}}*/
+
+static SOCKET convey_vsock_listen(const std::string&, DWORD& err)
+{/*{{{*/
+	err = EAFNOSUPPORT;
+	return INVALID_SOCKET;
+}/*}}}*/
+#endif
+
+static SOCKET convey_vsock_accept(const std::string& port, DWORD& err)
+{/*{{{*/
+	if (INVALID_SOCKET == listen_sock) {
+		listen_sock = convey_vsock_listen(port, err);
+		if (INVALID_SOCKET == listen_sock) {
+			return INVALID_SOCKET;
+		}
+	}
+
+	SOCKET s = accept(listen_sock, nullptr, nullptr);
+	if (INVALID_SOCKET == s) {
+		err = WSAGetLastError();
+		return INVALID_SOCKET;
+	}
+
+	return s;
+}/*}}}*/
+
+/* udp:HOST:PORT and udp-listen:PORT carry datagrams, netconsole and
+ * the like. A read takes all datagrams queued by then in one system
+ * call, recvmmsg() on Linux, and hands them on as one chunk. */
+#define UDP_BATCH 16
+#define UDP_SLOT 65536
+/* The largest payload of a datagram, writes are cut to it. */
+#define UDP_MAX_PAYLOAD 65507
+
+struct convey_udp_conn {
+	std::vector<char> slots;	/* UDP_BATCH datagrams of UDP_SLOT bytes */
+	DWORD lens[UDP_BATCH];
+	struct sockaddr_storage from[UDP_BATCH];
+	socklen_t from_len[UDP_BATCH];
+	size_t count;	/* datagrams in the slots */
+	size_t next;	/* the next one to hand out */
+	DWORD next_off;	/* into a datagram larger than the reader's buffer */
+	/* udp-listen: answers the peer it heard from last. */
+	std::mutex lock;
+	struct sockaddr_storage peer;
+	socklen_t peer_len;
+};
+
+static convey_udp_conn udp_ep;
+
+static void convey_udp_reset(void)
+{/*{{{*/
+	udp_ep.slots.resize(UDP_BATCH * UDP_SLOT);
+	udp_ep.count = udp_ep.next = 0;
+	udp_ep.next_off = 0;
+	std::lock_guard<std::mutex> lk(udp_ep.lock);
+	udp_ep.peer_len = 0;
+}/*}}}*/
+
+static void convey_udp_tune(SOCKET s)
+{/*{{{*/
+	/* A burst has to fit the receive buffer, or it is dropped. */
+	convey_tcp_set_bufs(s);
+#ifdef _WIN32
+	/* Otherwise an ICMP port unreachable for an earlier datagram fails
+	 * the next receive. */
+	BOOL off = FALSE;
+	DWORD got = 0;
+	WSAIoctl(s, SIO_UDP_CONNRESET, &off, sizeof off, nullptr, 0, &got, nullptr, nullptr);
+#endif
+}/*}}}*/
+
+/* A connected socket, the kernel drops datagrams from anyone else. */
+static SOCKET convey_udp_connect(const std::string& host, const std::string& port, DWORD& err)
+{/*{{{*/
+	std::vector<convey_addr> addrs;
+	if (!convey_resolve(host, port, addrs, err)) {
+		return INVALID_SOCKET;
+	}
+
+	for (const convey_addr& ca : addrs) {
+		SOCKET s = convey_socket(ca.family, SOCK_DGRAM, IPPROTO_UDP);
+		if (INVALID_SOCKET == s) {
+			err = WSAGetLastError();
+			continue;
+		}
+		convey_udp_tune(s);
+		if (0 == connect(s, reinterpret_cast<const struct sockaddr *>(&ca.addr), ca.addrlen)) {
+			return s;
+		}
+		err = WSAGetLastError();
+		closesocket(s);
+	}
+
+	return INVALID_SOCKET;
+}/*}}}*/
+
+static SOCKET convey_udp_bind(const std::string& port, DWORD& err)
+{/*{{{*/
+	struct addrinfo hints;
+	struct addrinfo *res = nullptr;
+	memset(&hints, 0, sizeof hints);
+	hints.ai_family = AF_INET6;
+	hints.ai_socktype = SOCK_DGRAM;
+	hints.ai_protocol = IPPROTO_UDP;
+	hints.ai_flags = AI_PASSIVE;
+
+	int gai = getaddrinfo(nullptr, port.c_str(), &hints, &res);
+	if (0 != gai) {
+		err = static_cast<DWORD>(gai);
+		return INVALID_SOCKET;
+	}
+
+	SOCKET s = convey_socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+	if (INVALID_SOCKET == s) {
+		err = WSAGetLastError();
+		freeaddrinfo(res);
+		return INVALID_SOCKET;
+	}
+	convey_udp_tune(s);
+
+	/* Take IPv4 (mapped) datagrams as well. */
+	DWORD v6only = 0;
+	setsockopt(s, IPPROTO_IPV6, IPV6_V6ONLY, reinterpret_cast<const char *>(&v6only), sizeof v6only);
+
+	if (0 != bind(s, res->ai_addr, static_cast<int>(res->ai_addrlen))) {
+		err = WSAGetLastError();
+		freeaddrinfo(res);
+		closesocket(s);
+		return INVALID_SOCKET;
+	}
+	freeaddrinfo(res);
+
+	return s;
+}/*}}}*/
+
+/* shm:<name> is a pair of rings in shared memory, one per direction.
+ * The first to open a name creates it, the second attaches, and from
+ * then on the data moves with plain loads and stores. A side only makes
+ * a system call to sleep on an empty or full ring, or to wake the other
+ * side when that one sleeps. */
+#define CONVEY_SHM_RING (1 << 18)
+#define CONVEY_SHM_MAGIC 0x59564e43
+#define CONVEY_SHM_WAIT_MS 100
+
+struct convey_shm_ring {
+	std::atomic<uint32_t> head;	/* bytes written, moved by the producer */
+	std::atomic<uint32_t> tail;	/* bytes read, moved by the consumer */
+	std::atomic<uint32_t> data_seq;	/* futex words, bumped on each wake */
+	std::atomic<uint32_t> space_seq;
+	std::atomic<uint32_t> reader_waits;
+	std::atomic<uint32_t> writer_waits;
+	char data[CONVEY_SHM_RING];
+};
+
+enum convey_shm_side_state {
+	convey_shm_side_unused,
+	convey_shm_side_attached,
+	convey_shm_side_gone
+};
+
+struct convey_shm_region {
+	uint32_t magic;
+	std::atomic<uint32_t> ready;
+	std::atomic<uint32_t> side[2];
+	int64_t creator_pid;
+	convey_shm_ring ring[2];	/* written by side 0 and side 1 */
+};
+
+struct convey_shm {
+	convey_shm_region* region;
+	/* Unmapped with the next open, a session thread may still look at
+	 * it while the process exits. */
+	convey_shm_region* stale;
+	int me;
+	HANDLE h;
+	std::string name;
+#ifdef _WIN32
+	HANDLE ev[2][2];	/* per ring, data and space */
+#endif
+};
+
+static convey_shm shm_ep{nullptr, nullptr, 0, INVALID_HANDLE_VALUE, ""};
+
+static bool convey_shm_is(HANDLE h)
+{/*{{{*/
+	return nullptr != shm_ep.region && h == shm_ep.h;
+}/*}}}*/
+
+static void convey_shm_unmap(convey_shm_region* r)
+{/*{{{*/
+	if (r) {
+#ifdef _WIN32
+		UnmapViewOfFile(r);
+#else
+		munmap(r, sizeof(convey_shm_region));
+#endif
+	}
+}/*}}}*/
+
+/* Sleep until the word moves on, or the wait times out. */
+static void convey_shm_wait(std::atomic<uint32_t>& word, uint32_t seen, HANDLE ev)
+{/*{{{*/
+#ifdef _WIN32
+	(void)word;
+	(void)seen;
+	WaitForSingleObject(ev, CONVEY_SHM_WAIT_MS);
+#elif defined(__linux__)
+	(void)ev;
+	struct timespec ts = { 0, CONVEY_SHM_WAIT_MS * 1000 * 1000 };
+	syscall(SYS_futex, reinterpret_cast<uint32_t*>(&word), FUTEX_WAIT, seen, &ts, nullptr, 0);
+#else
+	(void)word;
+	(void)seen;
+	(void)ev;
+	usleep(1000);
+#endif
+}/*}}}*/
+
+static void convey_shm_wake(std::atomic<uint32_t>& word, HANDLE ev)
+{/*{{{*/
+	word++;
+#ifdef _WIN32
+	SetEvent(ev);
+#elif defined(__linux__)
+	(void)ev;
+	syscall(SYS_futex, reinterpret_cast<uint32_t*>(&word), FUTEX_WAKE, 1, nullptr, nullptr, 0);
+#else
+	(void)ev;
+#endif
+}/*}}}*/
+
+static HANDLE convey_shm_event(int ring, int which)
+{/*{{{*/
+#ifdef _WIN32
+	return shm_ep.ev[ring][which];
+#else
+	(void)ring;
+	(void)which;
+	return INVALID_HANDLE_VALUE;
+#endif
+}/*}}}*/
+
+#ifndef _WIN32
+/* A region whose creator died without closing it is left over. */
+static bool convey_shm_is_stale(const convey_shm_region* r)
+{/*{{{*/
+	return convey_shm_side_gone == r->side[0]
+		|| (r->creator_pid > 0 && 0 != kill(static_cast<pid_t>(r->creator_pid), 0) && ESRCH == errno);
+}/*}}}*/
+#endif
+
+static HANDLE convey_shm_open(const std::string& name, DWORD& err)
+{/*{{{*/
+	convey_shm_unmap(shm_ep.stale);
+	shm_ep.stale = nullptr;
+
+	bool created = false;
+	void* map = nullptr;
+#ifdef _WIN32
+	std::string obj = "Local\\convey-shm-" + name;
+	HANDLE h = CreateFileMapping(INVALID_HANDLE_VALUE, nullptr, PAGE_READWRITE, 0, sizeof(convey_shm_region), obj.c_str());
+	if (!h) {
+		err = GetLastError();
+		return INVALID_HANDLE_VALUE;
+	}
+	created = ERROR_ALREADY_EXISTS != GetLastError();
+	map = MapViewOfFile(h, FILE_MAP_ALL_ACCESS, 0, 0, sizeof(convey_shm_region));
+	if (!map) {
+		err = GetLastError();
+		CloseHandle(h);
+		return INVALID_HANDLE_VALUE;
+	}
+#else
+	std::string obj = "/convey-shm-" + name;
+	HANDLE h;
+	for (int attempt = 0; ; attempt++) {
+		h = shm_open(obj.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+		created = INVALID_HANDLE_VALUE != h;
+		if (!created && EEXIST == errno) {
+			h = shm_open(obj.c_str(), O_RDWR | O_CLOEXEC, 0600);
+		}
+		if (INVALID_HANDLE_VALUE == h) {
+			err = errno;
+			return INVALID_HANDLE_VALUE;
+		}
+		if (created && 0 != ftruncate(h, sizeof(convey_shm_region))) {
+			err = errno;
+			close(h);
+			shm_unlink(obj.c_str());
+			return INVALID_HANDLE_VALUE;
+		}
+		/* The creator may not have sized it yet. */
+		struct stat st;
+		for (int i = 0; i < 100 && 0 == fstat(h, &st) && st.st_size < static_cast<off_t>(sizeof(convey_shm_region)); i++) {
+			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+		}
+		map = mmap(nullptr, sizeof(convey_shm_region), PROT_READ | PROT_WRITE, MAP_SHARED, h, 0);
+		if (MAP_FAILED == map) {
+			err = errno;
+			close(h);
+			return INVALID_HANDLE_VALUE;
+		}
+		convey_shm_region* r = static_cast<convey_shm_region*>(map);
+		if (created || attempt || !r->ready || !convey_shm_is_stale(r)) {
+			break;
+		}
+		/* Left over, start over with a fresh one. */
+		munmap(map, sizeof(convey_shm_region));
+		close(h);
+		shm_unlink(obj.c_str());
+	}
+#endif
+
+	convey_shm_region* r = static_cast<convey_shm_region*>(map);
+	if (created) {
+		/* Fresh mappings are zeroed, which is an empty ring. */
+		r->magic = CONVEY_SHM_MAGIC;
+#ifdef _WIN32
+		r->creator_pid = GetCurrentProcessId();
+#else
+		r->creator_pid = getpid();
+#endif
+		r->side[0] = convey_shm_side_attached;
+		r->ready = 1;
+	} else {
+		for (int i = 0; i < 100 && !r->ready; i++) {
+			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+		}
+		uint32_t unused = convey_shm_side_unused;
+		if (CONVEY_SHM_MAGIC != r->magic || convey_shm_side_attached != r->side[0]
+				|| !r->side[1].compare_exchange_strong(unused, convey_shm_side_attached)) {
+			/* Two sides are there already, or one is just leaving. */
+			convey_shm_unmap(r);
+			CloseHandle(h);
+			err = ERROR_PIPE_BUSY;
+			return INVALID_HANDLE_VALUE;
+		}
+	}
+
+	shm_ep.region = r;
+	shm_ep.me = created ? 0 : 1;
+	shm_ep.h = h;
+	shm_ep.name = obj;
+#ifdef _WIN32
+	for (int i = 0; i < 2; i++) {
+		for (int j = 0; j < 2; j++) {
+			std::string ev = obj + "-" + std::to_string(i) + (j ? "-space" : "-data");
+			shm_ep.ev[i][j] = CreateEvent(nullptr, false, false, ev.c_str());
+		}
+	}
+#endif
+	return h;
+}/*}}}*/
+
+/* Leave the region, the other side reads the end of the stream. */
+static void convey_shm_close(void)
+{/*{{{*/
+	convey_shm_region* r = shm_ep.region;
+	if (!r) {
+		return;
+	}
+	r->side[shm_ep.me] = convey_shm_side_gone;
+	for (int i = 0; i < 2; i++) {
+		convey_shm_wake(r->ring[i].data_seq, convey_shm_event(i, 0));
+		convey_shm_wake(r->ring[i].space_seq, convey_shm_event(i, 1));
+	}
+#ifdef _WIN32
+	for (int i = 0; i < 2; i++) {
+		for (int j = 0; j < 2; j++) {
+			CloseHandle(shm_ep.ev[i][j]);
+		}
+	}
+#else
+	if (0 == shm_ep.me) {
+		/* Whoever comes next makes a fresh one. */
+		shm_unlink(shm_ep.name.c_str());
+	}
+#endif
+	CloseHandle(shm_ep.h);
+	shm_ep.h = INVALID_HANDLE_VALUE;
+	shm_ep.stale = r;
+	shm_ep.region = nullptr;
+}/*}}}*/
+
+/* Read what's there, waiting for the first byte. No bytes and true is
+ * the end of the stream. */
+static bool convey_shm_read(char* buf, DWORD len, DWORD* bytes, DWORD& er)
+{/*{{{*/
+	convey_shm_region* reg = shm_ep.region;
+	int peer = 1 - shm_ep.me;
+	convey_shm_ring& r = reg->ring[peer];
+
+	*bytes = 0;
+	er = 0;
+	while (true) {
+		uint32_t tail = r.tail.load(std::memory_order_relaxed);
+		uint32_t avail = r.head - tail;
+		if (avail) {
+			uint32_t n = (avail < len) ? avail : len;
+			uint32_t at = tail & (CONVEY_SHM_RING - 1);
+			uint32_t first = (n < CONVEY_SHM_RING - at) ? n : CONVEY_SHM_RING - at;
+			memcpy(buf, r.data + at, first);
+			memcpy(buf + first, r.data, n - first);
+			r.tail = tail + n;
+			if (r.writer_waits) {
+				convey_shm_wake(r.space_seq, convey_shm_event(peer, 1));
+			}
+			*bytes = n;
+			return true;
+		}
+		if (convey_shm_side_gone == reg->side[peer]) {
+			return true;
+		}
+		if (is_error || shutting_down) {
+			er = ERROR_OPERATION_ABORTED;
+			return false;
+		}
+
+		/* Announce the sleep before the last look, a producer either
+		 * sees it or the data is there already. */
+		uint32_t seq = r.data_seq;
+		r.reader_waits = 1;
+		if (r.head == tail && convey_shm_side_gone != reg->side[peer]) {
+			convey_shm_wait(r.data_seq, seq, convey_shm_event(peer, 0));
+		}
+		r.reader_waits = 0;
+	}
+}/*}}}*/
+
+static bool convey_shm_write(const char* buf, DWORD* bytes, DWORD& er)
+{/*{{{*/
+	convey_shm_region* reg = shm_ep.region;
+	int me = shm_ep.me;
+	convey_shm_ring& r = reg->ring[me];
+	DWORD total = *bytes, off = 0;
+
+	er = 0;
+	while (off < total) {
+		if (convey_shm_side_gone == reg->side[1 - me]) {
+			er = ERROR_BROKEN_PIPE;
+			*bytes = off;
+			return false;
+		}
+		uint32_t head = r.head.load(std::memory_order_relaxed);
+		uint32_t room = CONVEY_SHM_RING - (head - r.tail);
+		if (room) {
+			uint32_t n = (room < total - off) ? room : total - off;
+			uint32_t at = head & (CONVEY_SHM_RING - 1);
+			uint32_t first = (n < CONVEY_SHM_RING - at) ? n : CONVEY_SHM_RING - at;
+			memcpy(r.data + at, buf + off, first);
+			memcpy(r.data, buf + off + first, n - first);
+			r.head = head + n;
+			if (r.reader_waits) {
+				convey_shm_wake(r.data_seq, convey_shm_event(me, 0));
+			}
+			off += n;
+			continue;
+		}
+		if (is_error || shutting_down) {
+			er = ERROR_OPERATION_ABORTED;
+			*bytes = off;
+			return false;
+		}
+
+		uint32_t seq = r.space_seq;
+		r.writer_waits = 1;
+		if (head - r.tail == CONVEY_SHM_RING && convey_shm_side_gone != reg->side[1 - me]) {
+			convey_shm_wait(r.space_seq, seq, convey_shm_event(me, 1));
+		}
+		r.writer_waits = 0;
+	}
+
+	*bytes = off;
+	return true;
+}/*}}}*/
+
+#ifdef _WIN32
+static bool convey_is_serial(HANDLE h)
+{/*{{{*/
+	/* TODO Expand on this handling. */
+	return FILE_TYPE_CHAR == GetFileType(h);
+}/*}}}*/
+
+static bool convey_serial_setup(HANDLE h)
+{/*{{{*/
+	DCB dcb = {0};
+	dcb.DCBlength = sizeof(DCB);
+
+	if (!::GetCommState(h, &dcb)) {
+		convey_error();
+		return false;
+	}
+
+	dcb.fBinary = true;
+	dcb.fNull = false;
+	dcb.fErrorChar = false;
+	dcb.fAbortOnError = false;
+	dcb.BaudRate = conf.baud;
+	dcb.ByteSize = conf.byte_size;
+	dcb.Parity = conf.parity;
+	dcb.StopBits = conf.stop_bits;
+
+	dcb.fOutxCtsFlow = false;
+	dcb.fRtsControl = RTS_CONTROL_ENABLE;
+	dcb.fOutxDsrFlow = false;
+	dcb.fDtrControl = DTR_CONTROL_ENABLE;
+	dcb.fTXContinueOnXoff = false;
+	dcb.fOutX = false;
+	dcb.fInX = false;
+	dcb.fDsrSensitivity = false;
+	if (convey_flow_control_rtscts == conf.flow_control) {
+		dcb.fOutxCtsFlow = true;
+		dcb.fRtsControl = RTS_CONTROL_HANDSHAKE;
+	} else if (convey_flow_control_dsrdtr == conf.flow_control) {
+		dcb.fOutxDsrFlow = true;
+		dcb.fDtrControl = DTR_CONTROL_HANDSHAKE;
+	} else if (convey_flow_control_xonxoff == conf.flow_control) {
+		dcb.fOutX = true;
+		dcb.fInX = true;
+	} else if (((decltype(conf.flow_control))-1) == conf.flow_control) {
+		return false;
+	}
+
+	if (!::SetCommState(h, &dcb)) {
+		convey_error();
+		return false;
+	}
+
+	COMMTIMEOUTS timeouts = {0};
+	timeouts.ReadIntervalTimeout = MAXDWORD;
+	timeouts.ReadTotalTimeoutMultiplier = 0;
+	timeouts.ReadTotalTimeoutConstant = 0;
+	timeouts.WriteTotalTimeoutMultiplier = 0;
+	timeouts.WriteTotalTimeoutConstant = 0;
+	if (!SetCommTimeouts(h, &timeouts)) {
+		convey_error();
+		return false;
+	}
+
+	return true;
+}/*}}}*/
+#else
+static bool convey_is_serial(HANDLE h)
+{/*{{{*/
+	return isatty(h);
+}/*}}}*/
+
+static speed_t convey_baud_to_speed(uint32_t b)
+{/*{{{*/
+	switch (b) {
+		case CBR_110: return B110;
+		case CBR_300: return B300;
+		case CBR_600: return B600;
+		case CBR_1200: return B1200;
+		case CBR_2400: return B2400;
+		case CBR_4800: return B4800;
+		case CBR_9600: return B9600;
+		case CBR_19200: return B19200;
+		case CBR_38400: return B38400;
+		case CBR_57600: return B57600;
+		case CBR_115200: return B115200;
+		default: return B0;
+	}
+}/*}}}*/
+
+/* The termios counterpart of the DCB setup. Reads block until at least
+ * a byte arrived, the data path polls before reading anyway. */
+static bool convey_serial_setup(HANDLE h)
+{/*{{{*/
+	struct termios t;
+	if (0 != tcgetattr(h, &t)) {
+		convey_error();
+		return false;
+	}
+	cfmakeraw(&t);
+
+	speed_t sp = convey_baud_to_speed(conf.baud);
+	if (B0 == sp) {
+		std::cerr << "convey: baud rate " << conf.baud << " is not supported on this system" << std::endl;
+		return false;
+	}
+	cfsetispeed(&t, sp);
+	cfsetospeed(&t, sp);
+
+	t.c_cflag |= CLOCAL | CREAD;
+	t.c_cflag &= ~(CSIZE | PARENB | PARODD | CSTOPB | CRTSCTS);
+	switch (conf.byte_size) {
+		case 5: t.c_cflag |= CS5; break;
+		case 6: t.c_cflag |= CS6; break;
+		case 7: t.c_cflag |= CS7; break;
+		default: t.c_cflag |= CS8; break;
+	}
+
+	switch (conf.parity) {
+		case NOPARITY:
+			break;
+		case ODDPARITY:
+			t.c_cflag |= PARENB | PARODD;
+			break;
+		case EVENPARITY:
+			t.c_cflag |= PARENB;
+			break;
+#ifdef CMSPAR
+		case MARKPARITY:
+			t.c_cflag |= PARENB | PARODD | CMSPAR;
+			break;
+		case SPACEPARITY:
+			t.c_cflag |= PARENB | CMSPAR;
+			break;
+#endif
+		default:
+			std::cerr << "convey: parity is not supported on this system" << std::endl;
+			return false;
+	}
+
+	if (TWOSTOPBITS == conf.stop_bits) {
+		t.c_cflag |= CSTOPB;
+	} else if (ONESTOPBIT != conf.stop_bits) {
+		std::cerr << "convey: 1.5 stop bits are not supported on this system" << std::endl;
+		return false;
+	}
+
+	t.c_iflag &= ~(IXON | IXOFF | IXANY);
+	if (convey_flow_control_rtscts == conf.flow_control) {
+		t.c_cflag |= CRTSCTS;
+	} else if (convey_flow_control_xonxoff == conf.flow_control) {
+		t.c_iflag |= IXON | IXOFF;
+	} else if (convey_flow_control_dsrdtr == conf.flow_control) {
+		std::cerr << "convey: DSR/DTR flow control is not supported on this system" << std::endl;
+		return false;
+	} else if (((decltype(conf.flow_control))-1) == conf.flow_control) {
+		return false;
+	}
+
+	t.c_cc[VMIN] = 1;
+	t.c_cc[VTIME] = 0;
+	if (0 != tcsetattr(h, TCSANOW, &t)) {
+		convey_error();
+		return false;
+	}
+
+	return true;
+}/*}}}*/
+#endif
+
+/* Telnet (RFC 854) with the COM port control option (RFC 2217). The
+ * client sends the SET commands below, the server answers each with the
+ * command plus RFC2217_REPLY carrying the value in effect. */
+#define TELNET_SE 240
+#define TELNET_SB 250
+#define TELNET_WILL 251
+#define TELNET_WONT 252
+#define TELNET_DO 253
+#define TELNET_DONT 254
+#define TELNET_IAC 255
+
+#define TELNET_OPT_BINARY 0
+#define TELNET_OPT_SGA 3
+#define TELNET_OPT_COM_PORT 44
+
+/* Longer subnegotiations aren't RFC 2217 ones, the rest is dropped. */
+#define TELNET_SB_MAX 64
+
+#define RFC2217_SET_BAUDRATE 1
+#define RFC2217_SET_DATASIZE 2
+#define RFC2217_SET_PARITY 3
+#define RFC2217_SET_STOPSIZE 4
+#define RFC2217_SET_CONTROL 5
+#define RFC2217_REPLY 100
+
+/* The SET-CONTROL values this side acts on. */
+#define RFC2217_FLOW_QUERY 0
+#define RFC2217_FLOW_NONE 1
+#define RFC2217_FLOW_XONXOFF 2
+#define RFC2217_FLOW_HARDWARE 3
+#define RFC2217_BREAK_QUERY 4
+#define RFC2217_BREAK_ON 5
+#define RFC2217_BREAK_OFF 6
+#define RFC2217_DTR_QUERY 7
+#define RFC2217_DTR_ON 8
+#define RFC2217_DTR_OFF 9
+#define RFC2217_RTS_QUERY 10
+#define RFC2217_RTS_ON 11
+#define RFC2217_RTS_OFF 12
+#define RFC2217_INFLOW_QUERY 13
+#define RFC2217_INFLOW_NONE 14
+#define RFC2217_INFLOW_XONXOFF 15
+#define RFC2217_INFLOW_HARDWARE 16
+#define RFC2217_INFLOW_DTR 18
+#define RFC2217_FLOW_DSR 19
+
+/* Serial settings as they travel over RFC 2217, in the conf encoding. */
+struct convey_rfc2217_line {
+	uint32_t baud;
+	uint8_t byte_size;
+	uint8_t parity;
+	uint8_t stop_bits;
+	convey_flow_control flow_control;
+	bool brk;
+	bool dtr;
+	bool rts;
+	/* A BREAK, DTR or RTS SET-CONTROL value left for the caller to apply. */
+	uint8_t signal;
+};
+
+enum convey_telnet_state {
+	convey_telnet_data,
+	convey_telnet_iac,
+	/* In the order of the command bytes, WILL to DONT. */
+	convey_telnet_will,
+	convey_telnet_wont,
+	convey_telnet_do,
+	convey_telnet_dont,
+	convey_telnet_sb,
+	convey_telnet_sb_iac
+};
+
+/* Parser state of one Telnet connection, kept across reads, so a command
+ * may be split anywhere. */
+struct convey_telnet {
+	convey_telnet_state state;
+	bool server;
+	/* Options enabled on this and the other side, by option number. */
+	uint64_t us;
+	uint64_t him;
+	convey_rfc2217_line line;
+	bool line_sent;
+	std::string sb;
+	/* Negotiation to send back, and the COM port subnegotiations read. */
+	std::string reply;
+	std::vector<std::string> commands;
+};
+
+static convey_rfc2217_line convey_rfc2217_line_from_conf(void)
+{/*{{{*/
+	return convey_rfc2217_line{conf.baud, conf.byte_size, conf.parity, conf.stop_bits, conf.flow_control, false, true, true, 0};
+}/*}}}*/
+
+static void convey_telnet_cmd(std::string& out, uint8_t verb, uint8_t opt)
+{/*{{{*/
+	out += static_cast<char>(TELNET_IAC);
+	out += static_cast<char>(verb);
+	out += static_cast<char>(opt);
+}/*}}}*/
+
+static void convey_rfc2217_put(std::string& out, uint8_t cmd, const uint8_t* v, size_t n)
+{/*{{{*/
+	out += static_cast<char>(TELNET_IAC);
+	out += static_cast<char>(TELNET_SB);
+	out += static_cast<char>(TELNET_OPT_COM_PORT);
+	out += static_cast<char>(cmd);
+	for (size_t i = 0; i < n; i++) {
+		out += static_cast<char>(v[i]);
+		if (TELNET_IAC == v[i]) {
+			out += static_cast<char>(TELNET_IAC);
+		}
+	}
+	out += static_cast<char>(TELNET_IAC);
+	out += static_cast<char>(TELNET_SE);
+}/*}}}*/
+
+static uint8_t convey_rfc2217_flow_code(convey_flow_control fc, bool inbound)
+{/*{{{*/
+	switch (fc) {
+		case convey_flow_control_xonxoff: return inbound ? RFC2217_INFLOW_XONXOFF : RFC2217_FLOW_XONXOFF;
+		case convey_flow_control_rtscts: return inbound ? RFC2217_INFLOW_HARDWARE : RFC2217_FLOW_HARDWARE;
+		case convey_flow_control_dsrdtr: return inbound ? RFC2217_INFLOW_DTR : RFC2217_FLOW_DSR;
+		default: return inbound ? RFC2217_INFLOW_NONE : RFC2217_FLOW_NONE;
+	}
+}/*}}}*/
+
+/* All the line settings, as SET commands from a client or, with
+ * RFC2217_REPLY as base, as the answers of a server. */
+static void convey_rfc2217_settings(const convey_rfc2217_line& line, uint8_t base, std::string& out)
+{/*{{{*/
+	uint8_t baud[4] = {
+		static_cast<uint8_t>(line.baud >> 24), static_cast<uint8_t>(line.baud >> 16),
+		static_cast<uint8_t>(line.baud >> 8), static_cast<uint8_t>(line.baud)
+	};
+	uint8_t stop = (TWOSTOPBITS == line.stop_bits) ? 2 : (ONE5STOPBITS == line.stop_bits) ? 3 : 1;
+	uint8_t parity = line.parity + 1;
+	uint8_t flow = convey_rfc2217_flow_code(line.flow_control, false);
+
+	convey_rfc2217_put(out, base + RFC2217_SET_BAUDRATE, baud, 4);
+	convey_rfc2217_put(out, base + RFC2217_SET_DATASIZE, &line.byte_size, 1);
+	convey_rfc2217_put(out, base + RFC2217_SET_PARITY, &parity, 1);
+	convey_rfc2217_put(out, base + RFC2217_SET_STOPSIZE, &stop, 1);
+	convey_rfc2217_put(out, base + RFC2217_SET_CONTROL, &flow, 1);
+}/*}}}*/
+
+/* What either side says first: binary both ways, no go-ahead, and the
+ * COM port option offered by the client, asked for by the server. The
+ * options count as on already, the answers then need no answer. */
+static void convey_telnet_init(convey_telnet& t, bool server, const convey_rfc2217_line& line)
+{/*{{{*/
+	t = convey_telnet{};
+	t.state = convey_telnet_data;
+	t.server = server;
+	t.line = line;
+
+	const uint8_t opts[] = { TELNET_OPT_BINARY, TELNET_OPT_SGA };
+	for (uint8_t opt : opts) {
+		convey_telnet_cmd(t.reply, TELNET_WILL, opt);
+		convey_telnet_cmd(t.reply, TELNET_DO, opt);
+		t.us |= 1ULL << opt;
+		t.him |= 1ULL << opt;
+	}
+	if (server) {
+		convey_telnet_cmd(t.reply, TELNET_DO, TELNET_OPT_COM_PORT);
+		t.him |= 1ULL << TELNET_OPT_COM_PORT;
+	} else {
+		convey_telnet_cmd(t.reply, TELNET_WILL, TELNET_OPT_COM_PORT);
+		t.us |= 1ULL << TELNET_OPT_COM_PORT;
+	}
+}/*}}}*/
+
+/* Answer a WILL, WONT, DO or DONT. Only a change of state is answered,
+ * so two sides never talk in circles (RFC 1143). */
+static void convey_telnet_negotiate(convey_telnet& t, uint8_t verb, uint8_t opt)
+{/*{{{*/
+	bool ours = TELNET_DO == verb || TELNET_DONT == verb;
+	bool on = TELNET_WILL == verb || TELNET_DO == verb;
+	/* The client offers the COM port option, the server uses it. */
+	bool wanted = TELNET_OPT_BINARY == opt || TELNET_OPT_SGA == opt
+		|| (TELNET_OPT_COM_PORT == opt && ours != t.server);
+	uint64_t& mask = ours ? t.us : t.him;
+	uint64_t bit = (opt < 64) ? 1ULL << opt : 0;
+
+	/* The server agreed, the line settings may go now. */
+	if (!t.server && ours && on && TELNET_OPT_COM_PORT == opt && !t.line_sent) {
+		convey_rfc2217_settings(t.line, 0, t.reply);
+		t.line_sent = true;
+	}
+
+	if (on && wanted) {
+		if (mask & bit) {
+			return;
+		}
+		mask |= bit;
+		convey_telnet_cmd(t.reply, ours ? TELNET_WILL : TELNET_DO, opt);
+	} else {
+		if (!on && !(mask & bit)) {
+			return;
+		}
+		mask &= ~bit;
+		convey_telnet_cmd(t.reply, ours ? TELNET_WONT : TELNET_DONT, opt);
+	}
+}/*}}}*/
+
+/* Strip the Telnet layer off received bytes in place and return how many
+ * data bytes are left. Answers go to t.reply, COM port subnegotiations
+ * to t.commands. */
+static DWORD convey_telnet_decode(convey_telnet& t, char* buf, DWORD bytes)
+{/*{{{*/
+	/* Most chunks have no IAC at all and stay as they are. */
+	if (convey_telnet_data == t.state && !memchr(buf, TELNET_IAC, bytes)) {
+		return bytes;
+	}
+
+	DWORD out = 0, i = 0;
+	while (i < bytes) {
+		if (convey_telnet_data == t.state) {
+			/* Move the run up to the next IAC at once. */
+			const char* p = static_cast<const char*>(memchr(buf + i, TELNET_IAC, bytes - i));
+			DWORD n = p ? static_cast<DWORD>(p - (buf + i)) : bytes - i;
+			memmove(buf + out, buf + i, n);
+			out += n;
+			i += n;
+			if (p) {
+				t.state = convey_telnet_iac;
+				i++;
+			}
+			continue;
+		}
+
+		uint8_t c = static_cast<uint8_t>(buf[i++]);
+		switch (t.state) {
+			case convey_telnet_iac:
+				t.state = convey_telnet_data;
+				if (TELNET_IAC == c) {
+					buf[out++] = static_cast<char>(c);
+				} else if (c >= TELNET_WILL) {
+					t.state = static_cast<convey_telnet_state>(convey_telnet_will + (c - TELNET_WILL));
+				} else if (TELNET_SB == c) {
+					t.state = convey_telnet_sb;
+					t.sb.clear();
+				}
+				/* NOP, GA and the like mean nothing to a byte stream. */
+				break;
+			case convey_telnet_will:
+			case convey_telnet_wont:
+			case convey_telnet_do:
+			case convey_telnet_dont:
+				convey_telnet_negotiate(t, static_cast<uint8_t>(TELNET_WILL + (t.state - convey_telnet_will)), c);
+				t.state = convey_telnet_data;
+				break;
+			case convey_telnet_sb:
+				if (TELNET_IAC == c) {
+					t.state = convey_telnet_sb_iac;
+				} else if (t.sb.size() < TELNET_SB_MAX) {
+					t.sb += static_cast<char>(c);
+				}
+				break;
+			case convey_telnet_sb_iac:
+				if (TELNET_IAC == c) {
+					t.state = convey_telnet_sb;
+					if (t.sb.size() < TELNET_SB_MAX) {
+						t.sb += static_cast<char>(c);
+					}
+					break;
+				}
+				if (TELNET_SE == c && t.sb.size() > 1 && TELNET_OPT_COM_PORT == static_cast<uint8_t>(t.sb[0])) {
+					t.commands.push_back(t.sb.substr(1));
+				}
+				t.state = convey_telnet_data;
+				break;
+			default:
+				break;
+		}
+	}
+
+	return out;
+}/*}}}*/
+
+/* Double each IAC of outgoing data. False when there is none, the bytes
+ * go out as they are then. */
+static bool convey_telnet_escape(const char* buf, DWORD bytes, std::string& out)
+{/*{{{*/
+	const char* end = buf + bytes;
+	const char* p = static_cast<const char*>(memchr(buf, TELNET_IAC, bytes));
+	if (!p) {
+		return false;
+	}
+
+	out.clear();
+	out.reserve(bytes + 64);
+	while (p) {
+		out.append(buf, p + 1);
+		out += static_cast<char>(TELNET_IAC);
+		buf = p + 1;
+		p = static_cast<const char*>(memchr(buf, TELNET_IAC, end - buf));
+	}
+	out.append(buf, end);
+
+	return true;
+}/*}}}*/
+
+/* Carry out one COM port command from a client on the line settings and
+ * answer it. True when a setting changed and the port needs a setup. A
+ * value this side can't take is answered with the one in effect. */
+static bool convey_rfc2217_command(convey_rfc2217_line& line, const std::string& sb, std::string& reply)
+{/*{{{*/
+	uint8_t cmd = static_cast<uint8_t>(sb[0]);
+	const uint8_t* v = reinterpret_cast<const uint8_t*>(sb.data()) + 1;
+	size_t n = sb.size() - 1;
+	uint8_t val = n ? v[0] : 0;
+	uint8_t ans = val;
+	convey_rfc2217_line was = line;
+
+	line.signal = 0;
+	switch (cmd) {
+		case RFC2217_SET_BAUDRATE: {
+			uint32_t b = (n >= 4) ? (uint32_t(v[0]) << 24 | uint32_t(v[1]) << 16 | uint32_t(v[2]) << 8 | v[3]) : 0;
+			if (convey_baud_is_valid(b)) {
+				line.baud = b;
+			}
+			uint8_t cur[4] = {
+				static_cast<uint8_t>(line.baud >> 24), static_cast<uint8_t>(line.baud >> 16),
+				static_cast<uint8_t>(line.baud >> 8), static_cast<uint8_t>(line.baud)
+			};
+			convey_rfc2217_put(reply, RFC2217_REPLY + cmd, cur, 4);
+			return line.baud != was.baud;
+		}
+		case RFC2217_SET_DATASIZE:
+			if (val >= 5 && val <= 8) {
+				line.byte_size = val;
+			}
+			ans = line.byte_size;
+			break;
+		case RFC2217_SET_PARITY:
+			if (val >= 1 && val <= 5) {
+				line.parity = val - 1;
+			}
+			ans = line.parity + 1;
+			break;
+		case RFC2217_SET_STOPSIZE:
+			if (val >= 1 && val <= 3) {
+				line.stop_bits = (2 == val) ? TWOSTOPBITS : (3 == val) ? ONE5STOPBITS : ONESTOPBIT;
+			}
+			ans = (TWOSTOPBITS == line.stop_bits) ? 2 : (ONE5STOPBITS == line.stop_bits) ? 3 : 1;
+			break;
+		case RFC2217_SET_CONTROL:
+			switch (val) {
+				case RFC2217_FLOW_NONE:
+				case RFC2217_INFLOW_NONE:
+					line.flow_control = convey_flow_control_none;
+					break;
+				case RFC2217_FLOW_XONXOFF:
+				case RFC2217_INFLOW_XONXOFF:
+					line.flow_control = convey_flow_control_xonxoff;
+					break;
+				case RFC2217_FLOW_HARDWARE:
+				case RFC2217_INFLOW_HARDWARE:
+					line.flow_control = convey_flow_control_rtscts;
+					break;
+				case RFC2217_FLOW_DSR:
+				case RFC2217_INFLOW_DTR:
+					line.flow_control = convey_flow_control_dsrdtr;
+					break;
+				case RFC2217_BREAK_ON:
+				case RFC2217_BREAK_OFF:
+					line.brk = RFC2217_BREAK_ON == val;
+					line.signal = val;
+					break;
+				case RFC2217_DTR_ON:
+				case RFC2217_DTR_OFF:
+					line.dtr = RFC2217_DTR_ON == val;
+					line.signal = val;
+					break;
+				case RFC2217_RTS_ON:
+				case RFC2217_RTS_OFF:
+					line.rts = RFC2217_RTS_ON == val;
+					line.signal = val;
+					break;
+				default:
+					break;
+			}
+			if (RFC2217_BREAK_QUERY <= val && val <= RFC2217_BREAK_OFF) {
+				ans = line.brk ? RFC2217_BREAK_ON : RFC2217_BREAK_OFF;
+			} else if (RFC2217_DTR_QUERY <= val && val <= RFC2217_DTR_OFF) {
+				ans = line.dtr ? RFC2217_DTR_ON : RFC2217_DTR_OFF;
+			} else if (RFC2217_RTS_QUERY <= val && val <= RFC2217_RTS_OFF) {
+				ans = line.rts ? RFC2217_RTS_ON : RFC2217_RTS_OFF;
+			} else if (RFC2217_INFLOW_QUERY <= val && val <= RFC2217_INFLOW_DTR) {
+				ans = convey_rfc2217_flow_code(line.flow_control, true);
+			} else {
+				ans = convey_rfc2217_flow_code(line.flow_control, false);
+			}
+			break;
+		default:
+			/* The notification masks, flow suspend and purge are only
+			 * acknowledged. */
+			convey_rfc2217_put(reply, RFC2217_REPLY + cmd, v, n);
+			return false;
+	}
+
+	convey_rfc2217_put(reply, RFC2217_REPLY + cmd, &ans, 1);
+	return line.byte_size != was.byte_size || line.parity != was.parity
+		|| line.stop_bits != was.stop_bits || line.flow_control != was.flow_control;
+}/*}}}*/
+
+/* WebSocket (RFC 6455) endpoint of ws-listen:, for browser terminals.
+ * Frames from the browser are masked, the ones to it are not. */
+#define WS_OP_CONT 0x0
+#define WS_OP_TEXT 0x1
+#define WS_OP_BINARY 0x2
+#define WS_OP_CLOSE 0x8
+#define WS_OP_PING 0x9
+#define WS_OP_PONG 0xa
+/* The close code for a client breaking the protocol. */
+#define WS_CLOSE_PROTOCOL 1002
+
+/* The longest HTTP upgrade request taken. */
+#define WS_REQUEST_MAX 8192
+/* Data queued for the browser before the writer waits. */
+#define WS_QUEUE_LIMIT (1024 * 1024)
+
+/* Frame parser state of one connection, kept across reads. */
+struct convey_ws {
+	uint8_t hdr[14];
+	size_t hdr_len;
+	bool in_payload;
+	uint8_t opcode;
+	uint64_t left;
+	uint8_t mask[4];
+	size_t mask_at;
+	/* The payload of a control frame, 125 bytes at most. */
+	std::string ctl;
+	bool closed;
+	/* Control frames to send back. */
+	std::string reply;
+};
+
+/* SHA-1 (RFC 3174), only for the Sec-WebSocket-Accept of the handshake. */
+static void convey_sha1(const std::string& in, uint8_t out[20])
+{/*{{{*/
+	uint32_t h[5] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0 };
+	uint64_t bits = static_cast<uint64_t>(in.size()) * 8;
+	std::string m = in;
+	m += '\x80';
+	while (56 != m.size() % 64) {
+		m += '\0';
+	}
+	for (int i = 7; i >= 0; i--) {
+		m += static_cast<char>(bits >> (i * 8));
+	}
+
+	for (size_t off = 0; off < m.size(); off += 64) {
+		const uint8_t* p = reinterpret_cast<const uint8_t*>(m.data()) + off;
+		uint32_t w[80];
+		for (int i = 0; i < 16; i++) {
+			w[i] = uint32_t(p[4 * i]) << 24 | uint32_t(p[4 * i + 1]) << 16 | uint32_t(p[4 * i + 2]) << 8 | p[4 * i + 3];
+		}
+		for (int i = 16; i < 80; i++) {
+			uint32_t x = w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16];
+			w[i] = (x << 1) | (x >> 31);
+		}
+		uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+		for (int i = 0; i < 80; i++) {
+			uint32_t f, k;
+			if (i < 20) {
+				f = (b & c) | (~b & d);
+				k = 0x5a827999;
+			} else if (i < 40) {
+				f = b ^ c ^ d;
+				k = 0x6ed9eba1;
+			} else if (i < 60) {
+				f = (b & c) | (b & d) | (c & d);
+				k = 0x8f1bbcdc;
+			} else {
+				f = b ^ c ^ d;
+				k = 0xca62c1d6;
+			}
+			uint32_t t = ((a << 5) | (a >> 27)) + f + e + k + w[i];
+			e = d;
+			d = c;
+			c = (b << 30) | (b >> 2);
+			b = a;
+			a = t;
+		}
+		h[0] += a;
+		h[1] += b;
+		h[2] += c;
+		h[3] += d;
+		h[4] += e;
+	}
+
+	for (int i = 0; i < 5; i++) {
+		out[4 * i] = static_cast<uint8_t>(h[i] >> 24);
+		out[4 * i + 1] = static_cast<uint8_t>(h[i] >> 16);
+		out[4 * i + 2] = static_cast<uint8_t>(h[i] >> 8);
+		out[4 * i + 3] = static_cast<uint8_t>(h[i]);
+	}
+}/*}}}*/
+
+static std::string convey_base64(const uint8_t* p, size_t n)
+{/*{{{*/
+	static const char abc[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	std::string out;
+	for (size_t i = 0; i < n; i += 3) {
+		uint32_t v = uint32_t(p[i]) << 16 | ((i + 1 < n) ? uint32_t(p[i + 1]) << 8 : 0) | ((i + 2 < n) ? p[i + 2] : 0);
+		out += abc[(v >> 18) & 63];
+		out += abc[(v >> 12) & 63];
+		out += (i + 1 < n) ? abc[(v >> 6) & 63] : '=';
+		out += (i + 2 < n) ? abc[v & 63] : '=';
+	}
+	return out;
+}/*}}}*/
+
+/* The value of a header in an HTTP request, empty when it's missing. */
+static std::string convey_http_header(const std::string& req, const std::string& name)
+{/*{{{*/
+	size_t at = req.find("\r\n");
+	while (std::string::npos != at && at + 2 < req.size()) {
+		size_t start = at + 2;
+		size_t end = req.find("\r\n", start);
+		if (std::string::npos == end) {
+			end = req.size();
+		}
+		size_t colon = req.find(':', start);
+		bool same = colon < end && colon - start == name.size();
+		for (size_t i = 0; same && i < name.size(); i++) {
+			same = std::tolower(req[start + i]) == std::tolower(name[i]);
+		}
+		if (same) {
+			size_t b = req.find_first_not_of(" \t", colon + 1);
+			size_t e = req.find_last_not_of(" \t", end - 1);
+			return (b < end && e >= b) ? req.substr(b, e - b + 1) : std::string();
+		}
+		at = end;
+	}
+	return std::string();
+}/*}}}*/
+
+/* Answer an HTTP request, with the switch to the WebSocket protocol when
+ * it asks for one. */
+static bool convey_ws_handshake(const std::string& req, std::string& answer)
+{/*{{{*/
+	std::string upgrade = convey_http_header(req, "Upgrade");
+	std::string key = convey_http_header(req, "Sec-WebSocket-Key");
+	for (size_t i = 0; i < upgrade.size(); i++) {
+		upgrade[i] = std::tolower(upgrade[i]);
+	}
+	if (0 != req.compare(0, 4, "GET ") || std::string::npos == upgrade.find("websocket") || key.empty()) {
+		answer = "HTTP/1.1 400 Bad Request\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+		return false;
+	}
+
+	uint8_t sha[20];
+	convey_sha1(key + "258EAFA5-E914-47DA-95CA-C5AB0DC85B11", sha);
+	answer = "HTTP/1.1 101 Switching Protocols\r\n"
+		"Upgrade: websocket\r\n"
+		"Connection: Upgrade\r\n"
+		"Sec-WebSocket-Accept: " + convey_base64(sha, sizeof sha) + "\r\n\r\n";
+	return true;
+}/*}}}*/
+
+static void convey_ws_frame_header(std::string& out, uint8_t opcode, uint64_t len)
+{/*{{{*/
+	out += static_cast<char>(0x80 | opcode);
+	if (len < 126) {
+		out += static_cast<char>(len);
+	} else if (len <= 0xffff) {
+		out += static_cast<char>(126);
+		out += static_cast<char>(len >> 8);
+		out += static_cast<char>(len);
+	} else {
+		out += static_cast<char>(127);
+		for (int i = 7; i >= 0; i--) {
+			out += static_cast<char>(len >> (i * 8));
+		}
+	}
+}/*}}}*/
+
+static void convey_ws_init(convey_ws& w)
+{/*{{{*/
+	w = convey_ws{};
+}/*}}}*/
+
+/* A frame is complete, act on a control frame. */
+static void convey_ws_frame_done(convey_ws& w)
+{/*{{{*/
+	if (WS_OP_PING == w.opcode) {
+		convey_ws_frame_header(w.reply, WS_OP_PONG, w.ctl.size());
+		w.reply += w.ctl;
+	} else if (WS_OP_CLOSE == w.opcode) {
+		/* Echo the status code, then the stream is over. */
+		std::string code = w.ctl.substr(0, 2);
+		convey_ws_frame_header(w.reply, WS_OP_CLOSE, code.size());
+		w.reply += code;
+		w.closed = true;
+	}
+	w.hdr_len = 0;
+	w.in_payload = false;
+	w.ctl.clear();
+}/*}}}*/
+
+/* Take the frame headers off received bytes and unmask the payload, in
+ * place. Returns how many data bytes are left, text and binary frames
+ * alike. Answers to control frames go to w.reply. */
+static DWORD convey_ws_decode(convey_ws& w, char* buf, DWORD bytes)
+{/*{{{*/
+	DWORD out = 0, i = 0;
+
+	while (i < bytes && !w.closed) {
+		if (!w.in_payload) {
+			w.hdr[w.hdr_len++] = static_cast<uint8_t>(buf[i++]);
+			if (w.hdr_len < 2) {
+				continue;
+			}
+			if (!(w.hdr[1] & 0x80)) {
+				/* A client must mask its frames (RFC 6455 5.1), fail
+				 * the connection with a protocol error. */
+				convey_ws_frame_header(w.reply, WS_OP_CLOSE, 2);
+				w.reply += static_cast<char>(WS_CLOSE_PROTOCOL >> 8);
+				w.reply += static_cast<char>(WS_CLOSE_PROTOCOL & 0xff);
+				w.closed = true;
+				break;
+			}
+			uint8_t len7 = w.hdr[1] & 0x7f;
+			size_t ext = (126 == len7) ? 2 : (127 == len7) ? 8 : 0;
+			if (w.hdr_len < 2 + ext + 4) {
+				continue;
+			}
+
+			w.opcode = w.hdr[0] & 0x0f;
+			w.left = len7;
+			if (ext) {
+				w.left = 0;
+				for (size_t k = 0; k < ext; k++) {
+					w.left = (w.left << 8) | w.hdr[2 + k];
+				}
+			}
+			memcpy(w.mask, w.hdr + 2 + ext, 4);
+			w.mask_at = 0;
+			w.in_payload = true;
+			if (w.opcode >= WS_OP_CLOSE && w.left > 125) {
+				/* A broken control frame, end the stream. */
+				w.opcode = WS_OP_CLOSE;
+				w.left = 0;
+			}
+			if (!w.left) {
+				convey_ws_frame_done(w);
+			}
+			continue;
+		}
+
+		DWORD n = (w.left < bytes - i) ? static_cast<DWORD>(w.left) : bytes - i;
+		if (w.opcode < WS_OP_CLOSE) {
+			for (DWORD k = 0; k < n; k++) {
+				buf[out + k] = static_cast<char>(buf[i + k] ^ w.mask[(w.mask_at + k) & 3]);
+			}
+			out += n;
+		} else {
+			for (DWORD k = 0; k < n; k++) {
+				w.ctl += static_cast<char>(buf[i + k] ^ w.mask[(w.mask_at + k) & 3]);
+			}
+		}
+		i += n;
+		w.left -= n;
+		w.mask_at += n;
+		if (!w.left) {
+			convey_ws_frame_done(w);
+		}
+	}
+
+	return out;
+}/*}}}*/
+
+/* Take what came of the HTTP request, and nothing of the first frame
+ * behind it: what is there is peeked at, and only the request taken.
+ * 1 once it's complete, 0 while more is to come, -1 when the client went
+ * away or the request is too long. */
+static int convey_ws_read_request(SOCKET s, std::string& req)
+{/*{{{*/
+	char buf[WS_REQUEST_MAX];
+	int n = recv(s, buf, static_cast<int>(WS_REQUEST_MAX - req.size()), MSG_PEEK);
+	if (n <= 0) {
+		return -1;
+	}
+	size_t from = (req.size() < 3) ? 0 : req.size() - 3;
+	size_t end = (req + std::string(buf, n)).find("\r\n\r\n", from);
+	int take = (std::string::npos == end) ? n : static_cast<int>(end + 4 - req.size());
+	if (take != recv(s, buf, take, 0)) {
+		return -1;
+	}
+	req.append(buf, take);
+	if (std::string::npos != end) {
+		return 1;
+	}
+	return (req.size() < WS_REQUEST_MAX) ? 0 : -1;
+}/*}}}*/
+
+static bool convey_send_all(SOCKET s, const std::string& data)
+{/*{{{*/
+	size_t off = 0;
+	while (off < data.size()) {
+		int n = send(s, data.data() + off, static_cast<int>(data.size() - off), 0);
+		if (n <= 0) {
+			return false;
+		}
+		off += static_cast<size_t>(n);
+	}
+	return true;
+}/*}}}*/
+
+/* A client that has yet to send all of its upgrade request. */
+struct convey_ws_pending {
+	SOCKET s;
+	ULONGLONG deadline;
+	std::string req;
+};
+
+/* Accept clients until one asks for a WebSocket. Their requests are read
+ * side by side, each with --connect-timeout to arrive, so a client that
+ * sends nothing doesn't hold up the next. Anything else, like a browser
+ * after the page, is answered 400 and dropped. */
+static SOCKET convey_ws_accept(const std::string& port, DWORD& err)
+{/*{{{*/
+	if (INVALID_SOCKET == listen_sock) {
+		listen_sock = convey_tcp_listen(port, err);
+		if (INVALID_SOCKET == listen_sock) {
+			return INVALID_SOCKET;
+		}
+	}
+
+	const ULONGLONG timeout = static_cast<ULONGLONG>(conf.connect_timeout * 1000);
+	std::vector<convey_ws_pending> pending;
+	std::vector<struct pollfd> pfd;
+	SOCKET won = INVALID_SOCKET;
+	while (INVALID_SOCKET == won) {
+		ULONGLONG now = GetTickCount64();
+		int wait = -1;
+		pfd.assign(1 + pending.size(), pollfd{});
+		pfd[0].fd = listen_sock;
+		pfd[0].events = POLLIN;
+		for (size_t i = 0; i < pending.size(); i++) {
+			pfd[i + 1].fd = pending[i].s;
+			pfd[i + 1].events = POLLIN;
+			int left = (pending[i].deadline > now) ? static_cast<int>(pending[i].deadline - now) : 0;
+			wait = (wait < 0 || left < wait) ? left : wait;
+		}
+		if (SOCKET_ERROR == WSAPoll(pfd.data(), static_cast<ULONG>(pfd.size()), wait)) {
+			err = WSAGetLastError();
+			break;
+		}
+
+		now = GetTickCount64();
+		for (size_t i = pending.size(); i-- > 0;) {
+			convey_ws_pending& p = pending[i];
+			int rc = pfd[i + 1].revents ? convey_ws_read_request(p.s, p.req) : 0;
+			if (0 == rc && now < p.deadline) {
+				continue;
+			}
+			std::string answer;
+			bool ok = 1 == rc && convey_ws_handshake(p.req, answer);
+			if (!answer.empty() && convey_send_all(p.s, answer) && ok) {
+				won = p.s;
+			} else {
+				if (conf.verbose) {
+					std::cerr << "convey: dropped a client without a WebSocket request" << std::endl;
+				}
+				closesocket(p.s);
+			}
+			pending.erase(pending.begin() + i);
+			if (INVALID_SOCKET != won) {
+				break;
+			}
+		}
+		if (INVALID_SOCKET != won || !(pfd[0].revents & POLLIN)) {
+			continue;
+		}
+
+		SOCKET s = accept(listen_sock, nullptr, nullptr);
+		if (INVALID_SOCKET == s) {
+			err = WSAGetLastError();
+			break;
+		}
+		convey_tcp_tune(s, convey_tcp_opts_conf());
+		pending.push_back({s, now + timeout, std::string()});
+	}
+
+	for (const convey_ws_pending& p : pending) {
+		closesocket(p.s);
+	}
+	return won;
+}/*}}}*/
+
+/* The Telnet side of the session, the rfc2217: endpoint or the client of
+ * --rfc2217-listen. Data and answers to the peer take turns on the lock. */
+static convey_telnet rfc2217;
+static std::mutex rfc2217_lock;
+
+static bool convey_rfc2217_is(HANDLE h)
+{/*{{{*/
+	return INVALID_HANDLE_VALUE != h
+		&& ((convey_tp_rfc2217 == conf.transport && h == epipe) || (!conf.rfc2217_port.empty() && h == bpipe));
+}/*}}}*/
+
+static bool convey_rfc2217_start(HANDLE h, HANDLE e, DWORD& er);
+static bool convey_ws_is(HANDLE h);
+static void convey_ws_start(HANDLE h, HANDLE e);
+static void convey_ws_stop(HANDLE h);
+
+static convey_setup_status convey_startup(int argc, char **argv)
+{/*{{{*/
+	DWORD rc;
+
+#ifdef _WIN32
+	_setmode(_fileno(stdin), _O_BINARY);
+	_setmode(_fileno(stdout), _O_BINARY);
+	_setmode(_fileno(stderr), _O_BINARY);
+#else
+	/* A write to a closed peer must fail, not kill the process. */
+	signal(SIGPIPE, SIG_IGN);
+#endif
+
+	convey_setup_status _rc = convey_conf_setup(argc, argv);
+	if(convey_setup_ok != _rc) {
+		return _rc;
+	}
+
+	if (convey_transport_is_socket() || !conf.serve.empty() || !conf.rfc2217_port.empty()) {
+		if (!convey_wsa_init()) {
+			restart_on_exit = false;
+			return convey_setup_exit_err;
+		}
+	}
+
+	/* The server opens its sessions on its own. */
+	if (!conf.serve.empty()) {
+		return convey_setup_ok;
+	}
+
+	if (conf.verbose) {
+		std::cout << "Polling the pipe '" << conf.pipe_path << "' for " << conf.pipe_poll << " seconds" << std::endl;
+	}
+	size_t elapsed = 0,
+		   step = 300 /* milliseconds*/;
+	bool conn_error;
+	do {
+		if (convey_tp_tcp_client == conf.transport || convey_tp_rfc2217 == conf.transport) {
+			SOCKET s = convey_tcp_connect(conf.tcp_host, conf.tcp_port, tcp_family_hint, rc);
+			epipe = (INVALID_SOCKET == s) ? INVALID_HANDLE_VALUE : reinterpret_cast<HANDLE>(s);
+			conn_error = INVALID_HANDLE_VALUE == epipe;
+		} else if (convey_tp_tcp_server == conf.transport) {
+			SOCKET s = convey_tcp_accept(conf.tcp_port, rc);
+			epipe = (INVALID_SOCKET == s) ? INVALID_HANDLE_VALUE : reinterpret_cast<HANDLE>(s);
+			conn_error = INVALID_HANDLE_VALUE == epipe;
+		} else if (convey_tp_ws_server == conf.transport) {
+			SOCKET s = convey_ws_accept(conf.tcp_port, rc);
+			epipe = (INVALID_SOCKET == s) ? INVALID_HANDLE_VALUE : reinterpret_cast<HANDLE>(s);
+			conn_error = INVALID_HANDLE_VALUE == epipe;
+		} else if (convey_tp_unix_client == conf.transport) {
+			SOCKET s = convey_unix_connect(conf.unix_path, rc);
+			epipe = (INVALID_SOCKET == s) ? INVALID_HANDLE_VALUE : reinterpret_cast<HANDLE>(s);
+			conn_error = INVALID_HANDLE_VALUE == epipe;
+		} else if (convey_tp_unix_server == conf.transport) {
+			SOCKET s = convey_unix_accept(conf.unix_path, rc);
+			epipe = (INVALID_SOCKET == s) ? INVALID_HANDLE_VALUE : reinterpret_cast<HANDLE>(s);
+			conn_error = INVALID_HANDLE_VALUE == epipe;
+		} else if (convey_tp_udp_client == conf.transport || convey_tp_udp_server == conf.transport) {
+			convey_udp_reset();
+			SOCKET s = (convey_tp_udp_client == conf.transport) ? convey_udp_connect(conf.tcp_host, conf.tcp_port, rc)
+				: convey_udp_bind(conf.tcp_port, rc);
+			epipe = (INVALID_SOCKET == s) ? INVALID_HANDLE_VALUE : reinterpret_cast<HANDLE>(s);
+			conn_error = INVALID_HANDLE_VALUE == epipe;
+		} else if (convey_tp_vsock_client == conf.transport) {
+			SOCKET s = convey_vsock_connect(conf.tcp_host, conf.tcp_port, rc);
+			epipe = (INVALID_SOCKET == s) ? INVALID_HANDLE_VALUE : reinterpret_cast<HANDLE>(s);
+			conn_error = INVALID_HANDLE_VALUE == epipe;
+		} else if (convey_tp_vsock_server == conf.transport) {
+			SOCKET s = convey_vsock_accept(conf.tcp_port, rc);
+			epipe = (INVALID_SOCKET == s) ? INVALID_HANDLE_VALUE : reinterpret_cast<HANDLE>(s);
+			conn_error = INVALID_HANDLE_VALUE == epipe;
+		} else if (convey_tp_shm == conf.transport) {
+			epipe = convey_shm_open(conf.shm_name, rc);
+			conn_error = INVALID_HANDLE_VALUE == epipe;
+		} else {
+#ifdef _WIN32
+			epipe = CreateFile(conf.pipe_path.c_str(), GENERIC_READ | GENERIC_WRITE, 0, nullptr, OPEN_EXISTING, FILE_FLAG_OVERLAPPED, nullptr);
+			rc = GetLastError();
+			conn_error = INVALID_HANDLE_VALUE == epipe || ERROR_PIPE_BUSY == rc || ERROR_FILE_NOT_FOUND == rc;
+#else
+			/* A serial device, a FIFO or the slave end of a pty. */
+			epipe = open(conf.pipe_path.c_str(), O_RDWR | O_NOCTTY | O_CLOEXEC);
+			rc = errno;
+			conn_error = INVALID_HANDLE_VALUE == epipe;
+#endif
+		}
+		if (conn_error) {
+			if (elapsed/1000 < conf.pipe_poll) {
+				std::this_thread::sleep_for(std::chrono::milliseconds(step));
+				elapsed += step;
+				continue;
+			}
+		}
+		break;
+	} while (true);
+	if (conn_error) {
+		convey_error(rc);
+		restart_on_exit = false;
+		return convey_setup_exit_err;
+	}
+	if (conf.verbose) {
+		std::cout << "Connection established in " << (elapsed/1000) << " seconds" << std::endl;
+	}
+
+	if (convey_is_serial(epipe) && !convey_serial_setup(epipe)) {
+		return convey_setup_exit_err;
+	}
+
+	if (!conf.rfc2217_port.empty()) {
+		if (conf.verbose) {
+			std::cout << "Waiting for an RFC 2217 client on port " << conf.rfc2217_port << std::endl;
+		}
+		SOCKET s = convey_tcp_accept(conf.rfc2217_port, rc);
+		if (INVALID_SOCKET == s) {
+			convey_error(rc);
+			convey_shutdown();
+			restart_on_exit = false;
+			return convey_setup_exit_err;
+		}
+		bpipe = reinterpret_cast<HANDLE>(s);
+	} else if (conf.bridge && !conf.pty_link.empty()) {
+#ifndef _WIN32
+		if (!convey_pty_open(conf.pty_link)) {
+			convey_shutdown();
+			return convey_setup_exit_err;
+		}
+		bpipe = pty_master;
+#endif
+#ifdef _WIN32
+	} else if (conf.bridge) {
+		bpipe = CreateNamedPipe(conf.bridge_pipe_name.c_str(),
+			PIPE_ACCESS_DUPLEX | FILE_FLAG_OVERLAPPED,
+			PIPE_TYPE_BYTE | PIPE_READMODE_BYTE | PIPE_WAIT,
+			1, RECV_BUF_SIZE, BUF_SIZE, 0, nullptr);
+		if (INVALID_HANDLE_VALUE == bpipe) {
+			convey_error();
+			convey_shutdown();
+			return convey_setup_exit_err;
+		}
+
+		if (conf.verbose) {
+			std::cout << "Waiting for a client on '" << conf.bridge_pipe_name << "'" << std::endl;
+		}
+
+		OVERLAPPED ov;
+		memset(&ov, 0, sizeof ov);
+		ov.hEvent = CreateEvent(nullptr, true, false, nullptr);
+		BOOL connected = ConnectNamedPipe(bpipe, &ov);
+		DWORD cer = GetLastError();
+		if (!connected) {
+			if (ERROR_IO_PENDING == cer) {
+				WaitForSingleObject(ov.hEvent, INFINITE);
+				connected = TRUE;
+			} else if (ERROR_PIPE_CONNECTED == cer) {
+				connected = TRUE;
+			}
+		}
+		CloseHandle(ov.hEvent);
+		if (!connected) {
+			convey_error(cer);
+			convey_shutdown();
+			return convey_setup_exit_err;
+		}
+	} else {
+		/* This could be something else, too. */
+		in = GetStdHandle(STD_INPUT_HANDLE);
+		if (INVALID_HANDLE_VALUE == in) {
+			convey_error();
+			convey_shutdown();
+			return convey_setup_exit_err;
+		}
+		in_is_pipe = GetFileType(in) == FILE_TYPE_PIPE;
+
+		/* This could be something else, too. */
+		out = GetStdHandle(STD_OUTPUT_HANDLE);
+		if (INVALID_HANDLE_VALUE == out) {
+			convey_error();
+			convey_shutdown();
+			return convey_setup_exit_err;
+		}
+		out_is_pipe = GetFileType(out) == FILE_TYPE_PIPE;
+	}
+#else
+	} else {
+		in = STDIN_FILENO;
+		out = STDOUT_FILENO;
+		/* Every descriptor is read and written through poll(). */
+		in_is_pipe = out_is_pipe = true;
+	}
+
+	if (0 != ::pipe2(session_wake, O_CLOEXEC)) {
+		convey_error();
+		convey_shutdown();
+		return convey_setup_exit_err;
+	}
+#endif
+
+	e_pipe_w = convey_event_create();
+	e_pipe_r = convey_event_create();
+	e_in = convey_event_create();
+	e_out = convey_event_create();
+
+	if (convey_rfc2217_is(epipe) || convey_rfc2217_is(bpipe)) {
+		if (!convey_rfc2217_start(convey_rfc2217_is(epipe) ? epipe : bpipe, e_pipe_w, rc)) {
+			convey_error(rc);
+			convey_shutdown();
+			return convey_setup_exit_err;
+		}
+	}
+	if (convey_ws_is(epipe)) {
+		convey_ws_start(epipe, e_pipe_w);
+	}
+
+	if (!convey_open_log(conf.log_path, log_handle)
+			|| !convey_open_log(conf.log_recv_path, log_recv_handle)
+			|| !convey_open_log(conf.log_send_path, log_send_handle)) {
+		convey_error();
+		convey_shutdown();
+		return convey_setup_exit_err;
+	}
+
+	if (!conf.bridge) {
+		is_console = is_console_handle(in) && is_console_handle(out);
+
+		if (is_console) {
+			setup_console();
+		}
+	}
+
+	return convey_setup_ok;
+}/*}}}*/
+
+
+#define CLOSE_HANDLE(h) do { \
+	if (INVALID_HANDLE_VALUE != h) { \
+		CloseHandle(h); \
+		h = INVALID_HANDLE_VALUE; \
+	} \
+} while (0)
+static void convey_shutdown(void)
+{/*{{{*/
+	shutting_down = true;
+
+	if (is_console) {
+		restore_console();
+	}
+
+	if (convey_transport_is_socket()) {
+		if (INVALID_HANDLE_VALUE != epipe) {
+			if (convey_ws_is(epipe)) {
+				convey_ws_stop(epipe);
+			}
+			closesocket(reinterpret_cast<SOCKET>(epipe));
+			epipe = INVALID_HANDLE_VALUE;
+		}
+	} else if (convey_shm_is(epipe)) {
+		convey_shm_close();
+		epipe = INVALID_HANDLE_VALUE;
+	} else {
+		CLOSE_HANDLE(epipe);
+	}
+	if (!conf.rfc2217_port.empty()) {
+		if (INVALID_HANDLE_VALUE != bpipe) {
+			closesocket(reinterpret_cast<SOCKET>(bpipe));
+			bpipe = INVALID_HANDLE_VALUE;
+		}
+	} else if (conf.pty_link.empty()) {
+		CLOSE_HANDLE(bpipe);
+	} else {
+		/* Owned by the pty, which stays across reconnects. */
+		bpipe = INVALID_HANDLE_VALUE;
+	}
+	/* in/out are the process standard handles; never close them, or a
+	 * redirected stdio pipe would break across a --reconnect restart. */
+	CLOSE_HANDLE(e_pipe_w);
+	CLOSE_HANDLE(e_pipe_r);
+	CLOSE_HANDLE(e_in);
+	CLOSE_HANDLE(e_out);
+#ifndef _WIN32
+	CLOSE_HANDLE(session_wake[0]);
+	CLOSE_HANDLE(session_wake[1]);
+#endif
+
+	convey_conf_shutdown();
+}
+#undef CLOSE_HANDLE
+/*}}}*/
+
+#ifdef _WIN32
+#define OV_E(e) { 0, 0, {{0, 0}}, e }
+static bool convey_read_raw(HANDLE h, char* buf, DWORD len, DWORD* bytes, HANDLE e, DWORD& er)
+{
+	OVERLAPPED ov = OV_E(e);
+	bool rc = ReadFile(h, buf, len, bytes, &ov);
+	er = GetLastError();
+	rc = convey_get_ov_result(h, &ov, bytes, rc, er);
+
+	return rc;
+}
+
+static bool convey_write_raw(HANDLE h, const char* buf, DWORD* bytes, HANDLE e, DWORD& er)
+{
+	DWORD total = *bytes, off = 0;
+
+	while (off < total) {
+		OVERLAPPED ov = OV_E(e);
+		DWORD written = 0;
+		bool rc = WriteFile(h, buf + off, total - off, &written, &ov);
+		er = GetLastError();
+		rc = convey_get_ov_result(h, &ov, &written, rc, er);
+		if (!rc) {
+			*bytes = off;
+			return false;
+		}
+		if (0 == written) {
+			break;
+		}
+		off += written;
+	}
+
+	*bytes = off;
+	return true;
+}
+#else
+/* Wait for the handle, the wake pipe passed as the event cancels the wait. */
+static bool convey_poll(HANDLE h, short events, HANDLE e, DWORD& er)
+{
+	struct pollfd pfd[2] = { { h, events, 0 }, { e, POLLIN, 0 } };
+
+	while (true) {
+		int n = poll(pfd, (INVALID_HANDLE_VALUE == e) ? 1 : 2, -1);
+		if (n < 0) {
+			if (EINTR == errno) {
+				continue;
+			}
+			er = errno;
+			return false;
+		}
+		if (pfd[1].revents) {
+			er = ERROR_OPERATION_ABORTED;
+			return false;
+		}
+		/* Hangups and errors are for the read or write to report. */
+		return true;
+	}
+}
+
+static bool convey_read_raw(HANDLE h, char* buf, DWORD len, DWORD* bytes, HANDLE e, DWORD& er)
+{
+	*bytes = 0;
+	if (!convey_poll(h, POLLIN, e, er)) {
+		return false;
+	}
+
+	ssize_t n;
+	do {
+		n = read(h, buf, len);
+	} while (n < 0 && EINTR == errno);
+	if (n < 0) {
+		er = errno;
+		return EAGAIN == er || EWOULDBLOCK == er;
+	}
+	er = 0;
+	*bytes = static_cast<DWORD>(n);
+
+	return true;
+}
+
+static bool convey_write_raw(HANDLE h, const char* buf, DWORD* bytes, HANDLE e, DWORD& er)
+{
+	DWORD total = *bytes, off = 0;
+
+#ifdef __linux__
+	if (pty_watching && !convey_pty_attached(h)) {
+		return true;
+	}
+#endif
+	while (off < total) {
+		if (!convey_poll(h, POLLOUT, e, er)) {
+			*bytes = off;
+			return false;
+		}
+		ssize_t n = write(h, buf + off, total - off);
+		if (n < 0) {
+			if (EINTR == errno || EAGAIN == errno || EWOULDBLOCK == errno) {
+				continue;
+			}
+			er = errno;
+			*bytes = off;
+			return false;
+		}
+		off += static_cast<DWORD>(n);
+	}
+
+	er = 0;
+	*bytes = off;
+	return true;
+}
+#endif
+
+static bool convey_rfc2217_send(HANDLE h, HANDLE e, DWORD& er)
+{/*{{{*/
+	std::lock_guard<std::mutex> lk(rfc2217_lock);
+	DWORD bytes = static_cast<DWORD>(rfc2217.reply.size());
+	bool rc = convey_write_raw(h, rfc2217.reply.data(), &bytes, e, er);
+	rfc2217.reply.clear();
+	return rc;
+}/*}}}*/
+
+/* Open the negotiation, the client sends its line settings once the
+ * server took the COM port option. */
+static bool convey_rfc2217_start(HANDLE h, HANDLE e, DWORD& er)
+{/*{{{*/
+	convey_telnet_init(rfc2217, h == bpipe, convey_rfc2217_line_from_conf());
+	return convey_rfc2217_send(h, e, er);
+}/*}}}*/
+
+static bool convey_rfc2217_apply(const convey_rfc2217_line& line)
+{/*{{{*/
+	conf.baud = line.baud;
+	conf.byte_size = line.byte_size;
+	conf.parity = line.parity;
+	conf.stop_bits = line.stop_bits;
+	conf.flow_control = line.flow_control;
+	return !convey_is_serial(epipe) || convey_serial_setup(epipe);
+}/*}}}*/
+
+/* BREAK, DTR and RTS. A pty has none of them, so failures are ignored. */
+static void convey_rfc2217_signal(uint8_t val)
+{/*{{{*/
+#ifdef _WIN32
+	DWORD fn = 0;
+	switch (val) {
+		case RFC2217_BREAK_ON: fn = SETBREAK; break;
+		case RFC2217_BREAK_OFF: fn = CLRBREAK; break;
+		case RFC2217_DTR_ON: fn = SETDTR; break;
+		case RFC2217_DTR_OFF: fn = CLRDTR; break;
+		case RFC2217_RTS_ON: fn = SETRTS; break;
+		case RFC2217_RTS_OFF: fn = CLRRTS; break;
+		default: return;
+	}
+	EscapeCommFunction(epipe, fn);
+#else
+	int bits = 0;
+	switch (val) {
+		case RFC2217_BREAK_ON: ioctl(epipe, TIOCSBRK); return;
+		case RFC2217_BREAK_OFF: ioctl(epipe, TIOCCBRK); return;
+		case RFC2217_DTR_ON: bits = TIOCM_DTR; ioctl(epipe, TIOCMBIS, &bits); return;
+		case RFC2217_DTR_OFF: bits = TIOCM_DTR; ioctl(epipe, TIOCMBIC, &bits); return;
+		case RFC2217_RTS_ON: bits = TIOCM_RTS; ioctl(epipe, TIOCMBIS, &bits); return;
+		case RFC2217_RTS_OFF: bits = TIOCM_RTS; ioctl(epipe, TIOCMBIC, &bits); return;
+		default: return;
+	}
+#endif
+}/*}}}*/
+
+/* Strip the Telnet layer off a read, answer the negotiation and, on the
+ * server, carry out the client's commands on the port. A setting the port
+ * refuses is rolled back and the client told the settings in effect. */
+static DWORD convey_rfc2217_input(HANDLE h, char* buf, DWORD bytes, HANDLE e)
+{/*{{{*/
+	DWORD n = convey_telnet_decode(rfc2217, buf, bytes);
+
+	if (rfc2217.server) {
+		for (const std::string& cmd : rfc2217.commands) {
+			convey_rfc2217_line was = rfc2217.line;
+			if (convey_rfc2217_command(rfc2217.line, cmd, rfc2217.reply) && !convey_rfc2217_apply(rfc2217.line)) {
+				rfc2217.line = was;
+				convey_rfc2217_apply(was);
+				convey_rfc2217_settings(was, RFC2217_REPLY, rfc2217.reply);
+			}
+			if (rfc2217.line.signal) {
+				convey_rfc2217_signal(rfc2217.line.signal);
+			}
+		}
+	}
+	/* The answers of a server need nothing from a client. */
+	rfc2217.commands.clear();
+
+	if (!rfc2217.reply.empty()) {
+		/* A failure shows up on the next read or write as well. */
+		DWORD er;
+		convey_rfc2217_send(h, e, er);
+	}
+
+	return n;
+}/*}}}*/
+
+/* Data out through the Telnet layer, the count is of the caller's bytes. */
+static bool convey_rfc2217_write(HANDLE h, const char* buf, DWORD* bytes, HANDLE e, DWORD& er)
+{/*{{{*/
+	std::string esc;
+	std::lock_guard<std::mutex> lk(rfc2217_lock);
+	if (!convey_telnet_escape(buf, *bytes, esc)) {
+		return convey_write_raw(h, buf, bytes, e, er);
+	}
+
+	DWORD sent = static_cast<DWORD>(esc.size());
+	bool rc = convey_write_raw(h, esc.data(), &sent, e, er);
+	DWORD done = 0;
+	for (DWORD i = 0; i < sent; i++, done++) {
+		if (TELNET_IAC == static_cast<uint8_t>(esc[i])) {
+			i++;
+		}
+	}
+	*bytes = done;
+	return rc;
+}/*}}}*/
+
+/* The ws-listen: connection. The writers only queue, a sender thread
+ * takes all that piled up while the last frame went out as one frame,
+ * so a busy link sends few big frames and a keystroke on an idle one
+ * still leaves at once. */
+struct convey_ws_conn {
+	convey_ws parser;
+	convey_outq q;
+	/* Control frames, under q.lock, they go out before the data. */
+	std::string ctl;
+	bool failed{false};
+	DWORD failed_er{0};
+	std::thread sender;
+};
+
+static convey_ws_conn ws_ep;
+
+static bool convey_ws_is(HANDLE h)
+{/*{{{*/
+	return INVALID_HANDLE_VALUE != h && convey_tp_ws_server == conf.transport && h == epipe;
+}/*}}}*/
+
+static void convey_ws_send_loop(HANDLE h, HANDLE e)
+{/*{{{*/
+	std::string frame;
+	while (true) {
+		{
+			std::unique_lock<std::mutex> lk(ws_ep.q.lock);
+			ws_ep.q.cv.wait(lk, []() { return !ws_ep.q.chunks.empty() || !ws_ep.ctl.empty() || ws_ep.q.eof; });
+			if (ws_ep.q.eof) {
+				return;
+			}
+			frame.swap(ws_ep.ctl);
+			if (ws_ep.q.bytes) {
+				convey_ws_frame_header(frame, WS_OP_BINARY, ws_ep.q.bytes);
+				for (const std::string& c : ws_ep.q.chunks) {
+					frame += c;
+				}
+				ws_ep.q.chunks.clear();
+				ws_ep.q.bytes = 0;
+			}
+			ws_ep.q.cv.notify_all();
+		}
+
+		DWORD bytes = static_cast<DWORD>(frame.size()), er = 0;
+		if (!convey_write_raw(h, frame.data(), &bytes, e, er)) {
+			std::lock_guard<std::mutex> lk(ws_ep.q.lock);
+			if (ERROR_OPERATION_ABORTED == er) {
+				/* The session is ending, the stop sends the rest. */
+				ws_ep.ctl.insert(0, frame, bytes, std::string::npos);
+				ws_ep.q.cv.notify_all();
+				return;
+			}
+			ws_ep.failed = true;
+			ws_ep.failed_er = er;
+			ws_ep.q.cv.notify_all();
+			/* The reader sees the end and takes the session down. */
+			shutdown(reinterpret_cast<SOCKET>(h), SD_BOTH);
+			return;
+		}
+		frame.clear();
+	}
+}/*}}}*/
+
+static void convey_ws_start(HANDLE h, HANDLE e)
+{/*{{{*/
+	convey_ws_init(ws_ep.parser);
+	ws_ep.q.chunks.clear();
+	ws_ep.q.bytes = 0;
+	ws_ep.q.limit = WS_QUEUE_LIMIT;
+	ws_ep.q.drop = convey_queue_drop_block;
+	ws_ep.q.eof = false;
+	ws_ep.ctl.clear();
+	ws_ep.failed = false;
+	ws_ep.sender = std::thread(convey_ws_send_loop, h, e);
+}/*}}}*/
+
+/* Stop the sender and hand what is still queued to the socket, as far as
+ * it takes it without waiting. The close frame goes out this way, too. */
+static void convey_ws_stop(HANDLE h)
+{/*{{{*/
+	if (!ws_ep.sender.joinable()) {
+		return;
+	}
+	{
+		std::lock_guard<std::mutex> lk(ws_ep.q.lock);
+		ws_ep.q.eof = true;
+		ws_ep.q.cv.notify_all();
+	}
+	convey_cancel_io(h);
+	ws_ep.sender.join();
+
+	if (!ws_ep.failed) {
+		std::string rest;
+		rest.swap(ws_ep.ctl);
+		if (ws_ep.q.bytes) {
+			convey_ws_frame_header(rest, WS_OP_BINARY, ws_ep.q.bytes);
+			for (const std::string& c : ws_ep.q.chunks) {
+				rest += c;
+			}
+		}
+		convey_set_nonblocking(reinterpret_cast<SOCKET>(h), true);
+		convey_send_all(reinterpret_cast<SOCKET>(h), rest);
+	}
+	ws_ep.q.chunks.clear();
+	ws_ep.q.bytes = 0;
+}/*}}}*/
+
+/* Queue data for the browser, waiting only while the queue is full. */
+static bool convey_ws_write(const char* buf, DWORD* bytes, DWORD& er)
+{/*{{{*/
+	std::unique_lock<std::mutex> lk(ws_ep.q.lock);
+	ws_ep.q.cv.wait(lk, [&]() {
+		return ws_ep.failed || is_error || shutting_down || convey_outq_put_locked(ws_ep.q, buf, *bytes);
+	});
+	if (ws_ep.failed || is_error || shutting_down) {
+		er = ws_ep.failed ? ws_ep.failed_er : ERROR_OPERATION_ABORTED;
+		*bytes = 0;
+		return false;
+	}
+	ws_ep.q.cv.notify_all();
+	er = 0;
+	return true;
+}/*}}}*/
+
+/* Unframe a read, control frames are answered through the sender. */
+static DWORD convey_ws_input(char* buf, DWORD bytes)
+{/*{{{*/
+	DWORD n = convey_ws_decode(ws_ep.parser, buf, bytes);
+	if (!ws_ep.parser.reply.empty()) {
+		std::lock_guard<std::mutex> lk(ws_ep.q.lock);
+		ws_ep.ctl += ws_ep.parser.reply;
+		ws_ep.parser.reply.clear();
+		ws_ep.q.cv.notify_all();
+	}
+	return n;
+}/*}}}*/
+
+static bool convey_udp_is(HANDLE h)
+{/*{{{*/
+	return INVALID_HANDLE_VALUE != h && h == epipe
+		&& (convey_tp_udp_client == conf.transport || convey_tp_udp_server == conf.transport);
+}/*}}}*/
+
+#ifdef _WIN32
+static bool convey_udp_recv(HANDLE h, size_t i, HANDLE e, DWORD& er)
+{/*{{{*/
+	WSABUF wb = { UDP_SLOT, &udp_ep.slots[i * UDP_SLOT] };
+	DWORD got = 0, flags = 0;
+	OVERLAPPED ov = OV_E(e);
+
+	udp_ep.from_len[i] = sizeof udp_ep.from[i];
+	bool rc = 0 == WSARecvFrom(reinterpret_cast<SOCKET>(h), &wb, 1, &got, &flags,
+		reinterpret_cast<struct sockaddr *>(&udp_ep.from[i]), &udp_ep.from_len[i], &ov, nullptr);
+	er = rc ? 0 : WSAGetLastError();
+	rc = convey_get_ov_result(h, &ov, &got, rc, er);
+	udp_ep.lens[i] = got;
+
+	return rc;
+}/*}}}*/
+#endif
+
+/* Wait for a datagram, then take the ones queued behind it too. */
+static bool convey_udp_fill(HANDLE h, HANDLE e, DWORD& er)
+{/*{{{*/
+	udp_ep.count = udp_ep.next = 0;
+	udp_ep.next_off = 0;
+
+#ifdef _WIN32
+	/* No recvmmsg() here, the ones after the first complete at once. */
+	if (!convey_udp_recv(h, 0, e, er)) {
+		return false;
+	}
+	udp_ep.count = 1;
+	u_long pending = 0;
+	while (udp_ep.count < UDP_BATCH && 0 == ioctlsocket(reinterpret_cast<SOCKET>(h), FIONREAD, &pending) && pending
+			&& convey_udp_recv(h, udp_ep.count, e, er)) {
+		udp_ep.count++;
+	}
+#else
+	while (!udp_ep.count) {
+		if (!convey_poll(h, POLLIN, e, er)) {
+			return false;
+		}
+#ifdef __linux__
+		struct mmsghdr msgs[UDP_BATCH];
+		struct iovec iov[UDP_BATCH];
+		memset(msgs, 0, sizeof msgs);
+		for (size_t i = 0; i < UDP_BATCH; i++) {
+			iov[i].iov_base = &udp_ep.slots[i * UDP_SLOT];
+			iov[i].iov_len = UDP_SLOT;
+			msgs[i].msg_hdr.msg_iov = &iov[i];
+			msgs[i].msg_hdr.msg_iovlen = 1;
+			msgs[i].msg_hdr.msg_name = &udp_ep.from[i];
+			msgs[i].msg_hdr.msg_namelen = sizeof udp_ep.from[i];
+		}
+		int n = recvmmsg(h, msgs, UDP_BATCH, MSG_DONTWAIT, nullptr);
+		for (int i = 0; i < n; i++) {
+			udp_ep.lens[i] = msgs[i].msg_len;
+			udp_ep.from_len[i] = msgs[i].msg_hdr.msg_namelen;
+		}
+#else
+		int n = 0;
+		while (n < UDP_BATCH) {
+			udp_ep.from_len[n] = sizeof udp_ep.from[n];
+			ssize_t got = recvfrom(h, &udp_ep.slots[n * UDP_SLOT], UDP_SLOT, MSG_DONTWAIT,
+				reinterpret_cast<struct sockaddr *>(&udp_ep.from[n]), &udp_ep.from_len[n]);
+			if (got < 0) {
+				n = n ? n : -1;
+				break;
+			}
+			udp_ep.lens[n++] = static_cast<DWORD>(got);
+		}
+#endif
+		if (n < 0) {
+			/* A refused earlier datagram is no reason to stop listening. */
+			if (EINTR == errno || EAGAIN == errno || EWOULDBLOCK == errno || ECONNREFUSED == errno) {
+				continue;
+			}
+			er = errno;
+			return false;
+		}
+		udp_ep.count = static_cast<size_t>(n);
+	}
+#endif
+
+	if (convey_tp_udp_server == conf.transport) {
+		std::lock_guard<std::mutex> lk(udp_ep.lock);
+		udp_ep.peer = udp_ep.from[udp_ep.count - 1];
+		udp_ep.peer_len = udp_ep.from_len[udp_ep.count - 1];
+	}
+	return true;
+}/*}}}*/
+
+/* Hand out as many datagrams as fit, a larger one than the buffer is
+ * split. Empty ones are skipped, they'd read as the end of the stream. */
+static bool convey_udp_read(HANDLE h, char* buf, DWORD len, DWORD* bytes, HANDLE e, DWORD& er)
+{/*{{{*/
+	DWORD out = 0;
+
+	log_recv_dgrams.clear();
+	while (!out) {
+		if (udp_ep.next == udp_ep.count && !convey_udp_fill(h, e, er)) {
+			*bytes = 0;
+			return false;
+		}
+		while (udp_ep.next < udp_ep.count) {
+			DWORD left = udp_ep.lens[udp_ep.next] - udp_ep.next_off;
+			if (left > len - out) {
+				if (out) {
+					break;
+				}
+				left = len;
+			}
+			memcpy(buf + out, &udp_ep.slots[udp_ep.next * UDP_SLOT] + udp_ep.next_off, left);
+			if (left) {
+				log_recv_dgrams.push_back(left);
+			}
+			out += left;
+			udp_ep.next_off += left;
+			if (udp_ep.next_off == udp_ep.lens[udp_ep.next]) {
+				udp_ep.next++;
+				udp_ep.next_off = 0;
+			}
+		}
+	}
+
+	*bytes = out;
+	er = 0;
+	return true;
+}/*}}}*/
+
+/* Each write goes out as datagrams of at most UDP_MAX_PAYLOAD bytes. A
+ * udp-listen: endpoint sends to the peer it heard from last, and drops
+ * what comes before anybody was heard from. */
+static bool convey_udp_write(HANDLE h, const char* buf, DWORD* bytes, HANDLE e, DWORD& er)
+{/*{{{*/
+	struct sockaddr_storage to;
+	socklen_t to_len = 0;
+	DWORD total = *bytes, off = 0;
+
+	if (convey_tp_udp_server == conf.transport) {
+		std::lock_guard<std::mutex> lk(udp_ep.lock);
+		to = udp_ep.peer;
+		to_len = udp_ep.peer_len;
+		if (!to_len) {
+			er = 0;
+			return true;
+		}
+	}
+
+	while (off < total) {
+		DWORD chunk = (total - off > UDP_MAX_PAYLOAD) ? UDP_MAX_PAYLOAD : total - off;
+#ifdef _WIN32
+		WSABUF wb = { chunk, const_cast<char *>(buf + off) };
+		DWORD sent = 0;
+		OVERLAPPED ov = OV_E(e);
+		bool rc = 0 == WSASendTo(reinterpret_cast<SOCKET>(h), &wb, 1, &sent, 0,
+			to_len ? reinterpret_cast<const struct sockaddr *>(&to) : nullptr, to_len, &ov, nullptr);
+		er = rc ? 0 : WSAGetLastError();
+		rc = convey_get_ov_result(h, &ov, &sent, rc, er);
+		if (!rc) {
+			*bytes = off;
+			return false;
+		}
+#else
+		if (!convey_poll(h, POLLOUT, e, er)) {
+			*bytes = off;
+			return false;
+		}
+		ssize_t n = sendto(h, buf + off, chunk, MSG_DONTWAIT, to_len ? reinterpret_cast<const struct sockaddr *>(&to) : nullptr, to_len);
+		if (n < 0) {
+			if (EINTR == errno || EAGAIN == errno || EWOULDBLOCK == errno) {
+				continue;
+			}
+			/* The target isn't up (yet), the datagram is lost as any other. */
+			if (ECONNREFUSED != errno) {
+				er = errno;
+				*bytes = off;
+				return false;
+			}
+		}
+#endif
+		off += chunk;
+	}
+
+	er = 0;
+	*bytes = off;
+	return true;
+}/*}}}*/
+
+/* A zero byte read with true returned is the end of the stream. */
+template <size_t N>
+static bool convey_read_pipe(HANDLE h, char (& buf)[N], DWORD* bytes, HANDLE e, DWORD& er)
+{
+	if (convey_shm_is(h)) {
+		return convey_shm_read(buf, sizeof buf, bytes, er);
+	}
+	if (convey_rfc2217_is(h)) {
+		/* A read of only negotiation is no end of the stream, read on. */
+		bool rc;
+		do {
+			rc = convey_read_raw(h, buf, sizeof buf, bytes, e, er);
+		} while (rc && *bytes && 0 == (*bytes = convey_rfc2217_input(h, buf, *bytes, e)));
+		return rc;
+	}
+	if (convey_udp_is(h)) {
+		return convey_udp_read(h, buf, sizeof buf, bytes, e, er);
+	}
+	if (convey_ws_is(h)) {
+		/* The same for control frames, until the browser closes. */
+		if (ws_ep.parser.closed) {
+			*bytes = 0;
+			er = 0;
+			return true;
+		}
+		bool rc;
+		do {
+			rc = convey_read_raw(h, buf, sizeof buf, bytes, e, er);
+		} while (rc && *bytes && 0 == (*bytes = convey_ws_input(buf, *bytes)) && !ws_ep.parser.closed);
+		return rc;
+	}
+	return convey_read_raw(h, buf, sizeof buf, bytes, e, er);
+}
+
+static bool convey_write_pipe(HANDLE h, const char* buf, DWORD* bytes, HANDLE e, DWORD& er)
+{
+	if (convey_shm_is(h)) {
+		return convey_shm_write(buf, bytes, er);
+	}
+	if (convey_rfc2217_is(h)) {
+		return convey_rfc2217_write(h, buf, bytes, e, er);
+	}
+	if (convey_ws_is(h)) {
+		return convey_ws_write(buf, bytes, er);
+	}
+	if (convey_udp_is(h)) {
+		return convey_udp_write(h, buf, bytes, e, er);
+	}
+	return convey_write_raw(h, buf, bytes, e, er);
+}
+
+/* The GDB remote serial protocol, for --gdb. A packet is $data#cc, cc
+ * the modulo 256 sum of data in hex, and answered with + or - unless
+ * both sides agreed on no-ack mode. A single 0x03 interrupts. Over a slow
+ * serial line the relay acks and checks packets itself on either side,
+ * so gdb sees neither the ack round trips nor a resend it didn't need.
+ * gdb in no-ack mode never resends, so a packet to the stub that got lost
+ * on the line is sent again by the relay when no ack came in time. */
+#define RSP_INTERRUPT 0x03
+#define RSP_ACK_TIMEOUT_MS 1000
+#define RSP_ACK_RETRIES 5
+
+enum convey_rsp_state {
+	convey_rsp_idle,
+	convey_rsp_data,
+	convey_rsp_sum_hi,
+	convey_rsp_sum_lo
+};
+
+/* A packet, +, -, the interrupt or bytes outside of packets, like the
+ * console output of a kernel before kgdb took over. */
+struct convey_rsp_item {
+	char kind;	/* '$', '+', '-', RSP_INTERRUPT or 0 */
+	std::string data;
+	bool ok;	/* the checksum of a packet matched */
+};
+
+struct convey_rsp_parser {
+	convey_rsp_state state;
+	std::string data;
+	uint8_t sum;
+	int want;
+};
+
+static uint8_t convey_rsp_sum(const std::string& data)
+{/*{{{*/
+	uint8_t sum = 0;
+	for (char c : data) {
+		sum = static_cast<uint8_t>(sum + static_cast<uint8_t>(c));
+	}
+	return sum;
+}/*}}}*/
+
+static std::string convey_rsp_packet(const std::string& data)
+{/*{{{*/
+	static const char hex[] = "0123456789abcdef";
+	uint8_t sum = convey_rsp_sum(data);
+	std::string out;
+	out.reserve(data.size() + 4);
+	out += '$';
+	out += data;
+	out += '#';
+	out += hex[sum >> 4];
+	out += hex[sum & 0xf];
+	return out;
+}/*}}}*/
+
+static int convey_rsp_hex(char c)
+{/*{{{*/
+	if (c >= '0' && c <= '9') {
+		return c - '0';
+	}
+	c = static_cast<char>(tolower(static_cast<unsigned char>(c)));
+	return (c >= 'a' && c <= 'f') ? c - 'a' + 10 : -1;
+}/*}}}*/
+
+/* Packets may be split across reads, the parser keeps its place. */
+static void convey_rsp_parse(convey_rsp_parser& p, const char* buf, DWORD bytes, std::vector<convey_rsp_item>& out)
+{/*{{{*/
+	for (DWORD i = 0; i < bytes; i++) {
+		char c = buf[i];
+		switch (p.state) {
+		case convey_rsp_idle:
+			if ('$' == c) {
+				p.state = convey_rsp_data;
+				p.data.clear();
+				p.sum = 0;
+			} else if ('+' == c || '-' == c || RSP_INTERRUPT == c) {
+				out.push_back(convey_rsp_item{c, std::string(), true});
+			} else if (!out.empty() && 0 == out.back().kind) {
+				out.back().data += c;
+			} else {
+				out.push_back(convey_rsp_item{0, std::string(1, c), true});
+			}
+			break;
+		case convey_rsp_data:
+			if ('#' == c) {
+				p.state = convey_rsp_sum_hi;
+			} else if ('$' == c) {
+				/* The # got lost, start over with the new packet. */
+				p.data.clear();
+				p.sum = 0;
+			} else {
+				p.data += c;
+				p.sum = static_cast<uint8_t>(p.sum + static_cast<uint8_t>(c));
+			}
+			break;
+		case convey_rsp_sum_hi:
+			p.want = convey_rsp_hex(c);
+			p.state = convey_rsp_sum_lo;
+			break;
+		case convey_rsp_sum_lo: {
+			int lo = convey_rsp_hex(c);
+			bool ok = p.want >= 0 && lo >= 0 && ((p.want << 4) | lo) == p.sum;
+			out.push_back(convey_rsp_item{'$', std::move(p.data), ok});
+			p.data.clear();
+			p.state = convey_rsp_idle;
+			break;
+		}
+		}
+	}
+}/*}}}*/
+
+/* gdb only asks for no-ack mode when the stub offers it in its qSupported
+ * reply, kgdb doesn't. The relay offers it on the stub's behalf. */
+static std::string convey_rsp_offer_noack(const std::string& reply)
+{/*{{{*/
+	std::string out = reply;
+	size_t pos = out.find("QStartNoAckMode");
+	if (std::string::npos != pos) {
+		if (pos + 15 < out.size()) {
+			out[pos + 15] = '+';
+		}
+		return out;
+	}
+	return out.empty() ? "QStartNoAckMode+" : out + ";QStartNoAckMode+";
+}/*}}}*/
+
+/* While the target is stopped, gdb reads the same memory and registers
+ * over and over, unwinding stacks and printing structures. The replies
+ * are kept until the target runs or anything is written, each read as
+ * gdb sent it. With --gdb-widen, memory is kept in blocks and a small
+ * read is widened to whole blocks up to the end of its page, so the reads
+ * of neighbouring words that follow are answered here; that reads memory
+ * gdb didn't, so it's not the default. --gdb-no-cache passes every read
+ * on as it is, for device memory that clears on read or changes while
+ * the target is stopped. */
+#define RSP_CACHE_BLOCK 64
+#define RSP_CACHE_PAGE 4096
+#define RSP_DEFAULT_READ 256
+
+/* The read the stub is answering. */
+struct convey_rsp_pending {
+	char kind;	/* 'm', 'g', 'p' or 0 */
+	std::string req;	/* as gdb sent it */
+	uint64_t addr;
+	uint64_t len;
+	uint64_t start;	/* of the widened read, or addr */
+	uint64_t span;
+};
+
+struct convey_rsp_cache {
+	std::map<uint64_t, std::string> mem;	/* RSP_CACHE_BLOCK bytes by address */
+	std::string regs;	/* the g reply */
+	std::map<std::string, std::string> reg;	/* p replies by request */
+	std::map<std::string, std::string> reads;	/* m replies by request, unwidened */
+	uint64_t max_read;	/* bytes in one m reply the stub can send */
+	convey_rsp_pending pending;
+	bool off;
+	bool widen;
+};
+
+static void convey_rsp_invalidate(convey_rsp_cache& c)
+{/*{{{*/
+	c.mem.clear();
+	c.reads.clear();
+	c.regs.clear();
+	c.reg.clear();
+}/*}}}*/
+
+/* The stub's PacketSize limits the reads, two hex digits a byte. */
+static void convey_rsp_packet_size(convey_rsp_cache& c, const std::string& supported)
+{/*{{{*/
+	size_t pos = supported.find("PacketSize=");
+	c.max_read = RSP_DEFAULT_READ;
+	if (std::string::npos != pos) {
+		uint64_t size = strtoull(supported.c_str() + pos + 11, nullptr, 16);
+		if (size > 64) {
+			c.max_read = (size - 16) / 2 / RSP_CACHE_BLOCK * RSP_CACHE_BLOCK;
+		}
+	}
+}/*}}}*/
+
+/* Undo the run-length encoding a stub may use, X*n repeats X n - 29 times. */
+static std::string convey_rsp_expand(const std::string& in)
+{/*{{{*/
+	std::string out;
+	out.reserve(in.size());
+	for (size_t i = 0; i < in.size(); i++) {
+		if ('*' == in[i] && i + 1 < in.size() && !out.empty()) {
+			out.append(static_cast<size_t>(std::max(0, in[i + 1] - 29)), out.back());
+			i++;
+		} else {
+			out += in[i];
+		}
+	}
+	return out;
+}/*}}}*/
+
+static bool convey_rsp_unhex(const std::string& hex, std::string& out)
+{/*{{{*/
+	if (hex.size() & 1) {
+		return false;
+	}
+	out.resize(hex.size() / 2);
+	for (size_t i = 0; i < out.size(); i++) {
+		int hi = convey_rsp_hex(hex[2 * i]), lo = convey_rsp_hex(hex[2 * i + 1]);
+		if (hi < 0 || lo < 0) {
+			return false;
+		}
+		out[i] = static_cast<char>((hi << 4) | lo);
+	}
+	return true;
+}/*}}}*/
+
+static std::string convey_rsp_tohex(const char* p, size_t n)
+{/*{{{*/
+	static const char hex[] = "0123456789abcdef";
+	std::string out(2 * n, '0');
+	for (size_t i = 0; i < n; i++) {
+		out[2 * i] = hex[static_cast<uint8_t>(p[i]) >> 4];
+		out[2 * i + 1] = hex[static_cast<uint8_t>(p[i]) & 0xf];
+	}
+	return out;
+}/*}}}*/
+
+/* m addr,len, both in hex. */
+static bool convey_rsp_parse_read(const std::string& req, uint64_t& addr, uint64_t& len)
+{/*{{{*/
+	const char* p = req.c_str() + 1;
+	char* end;
+	addr = strtoull(p, &end, 16);
+	if (end == p || ',' != *end) {
+		return false;
+	}
+	p = end + 1;
+	len = strtoull(p, &end, 16);
+	return end != p && !*end && len > 0;
+}/*}}}*/
+
+/* All of [addr, addr + len) from the cached blocks, or nothing. */
+static bool convey_rsp_cache_get(const convey_rsp_cache& c, uint64_t addr, uint64_t len, std::string& out)
+{/*{{{*/
+	out.clear();
+	for (uint64_t b = addr - addr % RSP_CACHE_BLOCK; b < addr + len; b += RSP_CACHE_BLOCK) {
+		auto it = c.mem.find(b);
+		if (c.mem.end() == it) {
+			return false;
+		}
+		uint64_t from = (b < addr) ? addr - b : 0;
+		uint64_t to = std::min<uint64_t>(RSP_CACHE_BLOCK, addr + len - b);
+		out.append(it->second, static_cast<size_t>(from), static_cast<size_t>(to - from));
+	}
+	return true;
+}/*}}}*/
+
+/* A request from gdb. Returns what to ask the stub, or nothing with the
+ * answer in answer. Anything that may change the target drops the cache. */
+static std::string convey_rsp_request(convey_rsp_cache& c, const std::string& req, std::string& answer)
+{/*{{{*/
+	char k = req.empty() ? 0 : req[0];
+	uint64_t addr, len;
+
+	answer.clear();
+	c.pending = convey_rsp_pending{};
+	if (c.off) {
+		return req;
+	}
+	if ('m' == k && convey_rsp_parse_read(req, addr, len)) {
+		std::string bytes;
+		if (convey_rsp_cache_get(c, addr, len, bytes)) {
+			answer = convey_rsp_tohex(bytes.data(), bytes.size());
+			return std::string();
+		}
+		c.pending = convey_rsp_pending{'m', req, addr, len, addr, len};
+		if (!c.widen) {
+			auto it = c.reads.find(req);
+			if (c.reads.end() != it) {
+				c.pending = convey_rsp_pending{};
+				answer = it->second;
+				return std::string();
+			}
+			return req;
+		}
+		/* Widen to whole blocks, on to the end of the page. */
+		uint64_t start = addr - addr % RSP_CACHE_BLOCK;
+		uint64_t page_end = addr - addr % RSP_CACHE_PAGE + RSP_CACHE_PAGE;
+		uint64_t end = std::min(page_end, start + c.max_read);
+		if (end < addr + len) {
+			end = addr + len + (RSP_CACHE_BLOCK - (addr + len) % RSP_CACHE_BLOCK) % RSP_CACHE_BLOCK;
+		}
+		if (end - start > c.max_read) {
+			return req;
+		}
+		c.pending.start = start;
+		c.pending.span = end - start;
+		char buf[64];
+		snprintf(buf, sizeof buf, "m%llx,%llx", static_cast<unsigned long long>(start), static_cast<unsigned long long>(end - start));
+		return buf;
+	}
+	if ('g' == k && 1 == req.size()) {
+		if (!c.regs.empty()) {
+			answer = c.regs;
+			return std::string();
+		}
+		c.pending.kind = 'g';
+		c.pending.req = req;
+		return req;
+	}
+	if ('p' == k) {
+		auto it = c.reg.find(req);
+		if (c.reg.end() != it) {
+			answer = it->second;
+			return std::string();
+		}
+		c.pending.kind = 'p';
+		c.pending.req = req;
+		return req;
+	}
+	/* Queries only read; H picks the thread whose registers g reads. */
+	if (('q' == k && 0 != req.compare(0, 5, "qRcmd")) || '?' == k || 'T' == k) {
+		return req;
+	}
+	if ('H' == k) {
+		c.regs.clear();
+		c.reg.clear();
+		return req;
+	}
+	convey_rsp_invalidate(c);
+	return req;
+}/*}}}*/
+
+/* A reply of the stub. Returns what goes to gdb, or nothing with the
+ * request to send the stub again in retry, when a widened read failed
+ * where gdb's own might not. */
+static std::string convey_rsp_reply(convey_rsp_cache& c, const std::string& reply, std::string& retry)
+{/*{{{*/
+	convey_rsp_pending pend = c.pending;
+	bool error = reply.empty() || 'E' == reply[0];
+
+	retry.clear();
+	c.pending = convey_rsp_pending{};
+	if (!pend.kind) {
+		/* A stop reply, or anything else not asked for, the target ran. */
+		convey_rsp_invalidate(c);
+	} else if ('g' == pend.kind && !error) {
+		c.regs = reply;
+	} else if ('p' == pend.kind && !error) {
+		c.reg[pend.req] = reply;
+	} else if ('m' == pend.kind) {
+		bool widened = pend.start != pend.addr || pend.span != pend.len;
+		std::string bytes;
+		if (error || !convey_rsp_unhex(convey_rsp_expand(reply), bytes)) {
+			if (widened) {
+				retry = pend.req;
+				c.pending = convey_rsp_pending{'m', pend.req, pend.addr, pend.len, pend.addr, pend.len};
+				return std::string();
+			}
+			return reply;
+		}
+		/* The stub may send less than asked for, keep the whole blocks. */
+		for (uint64_t off = (RSP_CACHE_BLOCK - pend.start % RSP_CACHE_BLOCK) % RSP_CACHE_BLOCK;
+				off + RSP_CACHE_BLOCK <= bytes.size(); off += RSP_CACHE_BLOCK) {
+			c.mem[pend.start + off] = bytes.substr(static_cast<size_t>(off), RSP_CACHE_BLOCK);
+		}
+		if (widened) {
+			if (pend.addr - pend.start + pend.len <= bytes.size()) {
+				return convey_rsp_tohex(bytes.data() + (pend.addr - pend.start), static_cast<size_t>(pend.len));
+			}
+			retry = pend.req;
+			c.pending = convey_rsp_pending{'m', pend.req, pend.addr, pend.len, pend.addr, pend.len};
+			return std::string();
+		}
+		c.reads[pend.req] = reply;
+	}
+	return reply;
+}/*}}}*/
+
+/* The last packet to the stub, until it's acked. */
+struct convey_rsp_unacked {
+	ULONGLONG sent_at;
+	uint32_t tries;	/* resends after a timeout */
+	bool waiting;
+};
+
+struct convey_rsp_relay {
+	convey_rsp_parser from_gdb;
+	convey_rsp_parser from_target;
+	/* Between the gdb thread asking and the endpoint thread answering. */
+	std::mutex cache_lock;
+	convey_rsp_cache cache;
+	std::atomic<bool> gdb_noack{false};
+	std::atomic<bool> qsupported{false};	/* a qSupported awaits its reply */
+	/* Either thread writes to either side, each side has its lock and
+	 * the last packet sent to it, for a resend on -. */
+	std::mutex gdb_lock;
+	std::mutex target_lock;
+	std::string gdb_last;
+	std::string target_last;
+	convey_rsp_unacked target_unacked;
+};
+
+static convey_rsp_relay rsp;
+
+/* A new gdb starts in ack mode. One on a kept pty stays in no-ack mode
+ * across endpoint reconnects. */
+static void convey_rsp_reset(bool keep_gdb)
+{/*{{{*/
+	rsp.from_gdb = convey_rsp_parser{};
+	rsp.from_target = convey_rsp_parser{};
+	rsp.qsupported = false;
+	if (!keep_gdb) {
+		rsp.gdb_noack = false;
+	}
+	{
+		std::lock_guard<std::mutex> lk(rsp.cache_lock);
+		convey_rsp_invalidate(rsp.cache);
+		rsp.cache.pending = convey_rsp_pending{};
+		rsp.cache.max_read = RSP_DEFAULT_READ;
+		rsp.cache.off = !conf.gdb_cache;
+		rsp.cache.widen = conf.gdb_widen;
+	}
+	std::lock_guard<std::mutex> lg(rsp.gdb_lock);
+	std::lock_guard<std::mutex> lt(rsp.target_lock);
+	rsp.gdb_last.clear();
+	rsp.target_last.clear();
+	rsp.target_unacked = convey_rsp_unacked{};
+}/*}}}*/
+
+/* The side's unacked packet, when it has one to track, restarts its
+ * timeout with what is written. */
+static bool convey_rsp_write(HANDLE h, std::mutex& lock, std::string& last, convey_rsp_unacked* unacked, bool resend, const std::string& data, const std::string& pkt, HANDLE e, DWORD& er)
+{/*{{{*/
+	std::lock_guard<std::mutex> lk(lock);
+	std::string out = resend ? last + data : data;
+	if (resend) {
+		stats.rsp_resends++;
+	}
+	if (!pkt.empty()) {
+		last = pkt;
+	}
+	if (unacked && !pkt.empty()) {
+		*unacked = convey_rsp_unacked{GetTickCount64(), 0, true};
+	} else if (unacked && resend) {
+		unacked->sent_at = GetTickCount64();
+	}
+	if (out.empty()) {
+		return true;
+	}
+	DWORD bytes = static_cast<DWORD>(out.size());
+	return convey_write_pipe(h, out.data(), &bytes, e, er);
+}/*}}}*/
+
+/* From gdb: ack it here, answer QStartNoAckMode here, forward the rest
+ * to the stub in one write. */
+static bool convey_rsp_from_gdb(const char* buf, DWORD bytes, DWORD& er)
+{/*{{{*/
+	std::vector<convey_rsp_item> items;
+	std::string to_gdb, to_target, gdb_pkt, target_pkt;
+	bool gdb_resend = false;
+
+	convey_rsp_parse(rsp.from_gdb, buf, bytes, items);
+	for (convey_rsp_item& it : items) {
+		if ('+' == it.kind) {
+			continue;
+		}
+		if ('-' == it.kind) {
+			gdb_resend = true;
+			continue;
+		}
+		if ('$' != it.kind) {
+			to_target += it.kind ? std::string(1, it.kind) : it.data;
+			continue;
+		}
+		if (!it.ok) {
+			stats.rsp_bad++;
+			if (!rsp.gdb_noack) {
+				to_gdb += '-';
+			}
+			continue;
+		}
+		stats.rsp_packets++;
+		if (!rsp.gdb_noack) {
+			to_gdb += '+';
+		}
+		if ("QStartNoAckMode" == it.data) {
+			gdb_pkt = convey_rsp_packet("OK");
+			to_gdb += gdb_pkt;
+			rsp.gdb_noack = true;
+			continue;
+		}
+		if (0 == it.data.compare(0, 10, "qSupported")) {
+			rsp.qsupported = true;
+		}
+		std::string answer, req;
+		{
+			std::lock_guard<std::mutex> lk(rsp.cache_lock);
+			req = convey_rsp_request(rsp.cache, it.data, answer);
+		}
+		if (req.empty()) {
+			stats.rsp_cache_hits++;
+			gdb_pkt = convey_rsp_packet(answer);
+			to_gdb += gdb_pkt;
+			continue;
+		}
+		target_pkt = convey_rsp_packet(req);
+		to_target += target_pkt;
+	}
+
+	return convey_rsp_write(bpipe, rsp.gdb_lock, rsp.gdb_last, nullptr, gdb_resend, to_gdb, gdb_pkt, e_out, er)
+		&& convey_rsp_write(epipe, rsp.target_lock, rsp.target_last, &rsp.target_unacked, false, to_target, target_pkt, e_pipe_w, er);
+}/*}}}*/
+
+/* From the stub: ack it here, ask for a resend of a broken packet here,
+ * and pass on only the good ones. */
+static bool convey_rsp_from_target(const char* buf, DWORD bytes, DWORD& er)
+{/*{{{*/
+	std::vector<convey_rsp_item> items;
+	std::string to_gdb, to_target, gdb_pkt, target_pkt;
+	bool target_resend = false;
+
+	convey_rsp_parse(rsp.from_target, buf, bytes, items);
+	for (convey_rsp_item& it : items) {
+		/* A good reply also means the request came through. */
+		if ('+' == it.kind || ('$' == it.kind && it.ok)) {
+			std::lock_guard<std::mutex> lk(rsp.target_lock);
+			rsp.target_unacked.waiting = false;
+		}
+		if ('+' == it.kind) {
+			continue;
+		}
+		if ('-' == it.kind) {
+			target_resend = true;
+			continue;
+		}
+		if ('$' != it.kind) {
+			to_gdb += it.kind ? std::string(1, it.kind) : it.data;
+			continue;
+		}
+		if (!it.ok) {
+			stats.rsp_bad++;
+			to_target += '-';
+			continue;
+		}
+		stats.rsp_packets++;
+		to_target += '+';
+		std::string reply, retry;
+		{
+			std::lock_guard<std::mutex> lk(rsp.cache_lock);
+			if (rsp.qsupported.exchange(false)) {
+				convey_rsp_packet_size(rsp.cache, it.data);
+				reply = convey_rsp_offer_noack(it.data);
+			} else {
+				reply = convey_rsp_reply(rsp.cache, it.data, retry);
+			}
+		}
+		if (!retry.empty()) {
+			target_pkt = convey_rsp_packet(retry);
+			to_target += target_pkt;
+			continue;
+		}
+		gdb_pkt = convey_rsp_packet(reply);
+		to_gdb += gdb_pkt;
+	}
+
+	return convey_rsp_write(epipe, rsp.target_lock, rsp.target_last, &rsp.target_unacked, target_resend, to_target, target_pkt, e_pipe_w, er)
+		&& convey_rsp_write(bpipe, rsp.gdb_lock, rsp.gdb_last, nullptr, false, to_gdb, gdb_pkt, e_out, er);
+}/*}}}*/
+
+/* From the bridge watchdog, every so often. Sends the unacked packet to
+ * the stub again once its time is up, allowing on a serial line for the
+ * time the packet takes at the baud rate. False when the write failed or
+ * the resends ran out. */
+static bool convey_rsp_tick(DWORD& er)
+{/*{{{*/
+	std::lock_guard<std::mutex> lk(rsp.target_lock);
+	convey_rsp_unacked& u = rsp.target_unacked;
+	if (!u.waiting) {
+		return true;
+	}
+	ULONGLONG wait = RSP_ACK_TIMEOUT_MS;
+	if (convey_is_serial(epipe)) {
+		wait += rsp.target_last.size() * 10 * 1000ULL / conf.baud;
+	}
+	ULONGLONG now = GetTickCount64();
+	if (now - u.sent_at < wait) {
+		return true;
+	}
+	if (u.tries >= RSP_ACK_RETRIES) {
+		std::cerr << "convey: gdb, the stub acked nothing after " << RSP_ACK_RETRIES << " resends" << std::endl;
+		u.waiting = false;
+		return false;
+	}
+	u.tries++;
+	u.sent_at = now;
+	stats.rsp_resends++;
+	DWORD bytes = static_cast<DWORD>(rsp.target_last.size());
+	return convey_write_pipe(epipe, rsp.target_last.data(), &bytes, e_pipe_w, er);
+}/*}}}*/
+
+/* The serial protocol of the Windows kernel debugger, for --kd. A packet
+ * is a 16 byte header, the data and a trailing 0xaa. The header starts
+ * with a leader of four equal bytes, 0000 for data and iiii for control
+ * packets like the ack and the resend request, which have no data and no
+ * trailer. It goes on with the type, the data size, the packet id and the
+ * sum of the data bytes, little endian. A lone b from the debugger breaks
+ * into the target. The relay changes nothing, it keeps each packet
+ * together in one write and counts what goes by. */
+#define KD_LEADER_DATA '0'
+#define KD_LEADER_CONTROL 'i'
+#define KD_BREAKIN 'b'
+#define KD_TRAILER '\xaa'
+#define KD_HEADER_SIZE 16
+#define KD_MAX_DATA 4000
+#define KD_TYPE_ACK 4
+#define KD_TYPE_RESEND 5
+
+/* A packet, the breakin or bytes outside of packets. */
+struct convey_kd_item {
+	char kind;	/* KD_LEADER_DATA, KD_LEADER_CONTROL, KD_BREAKIN or 0 */
+	std::string bytes;	/* all of it, as it goes on */
+	uint16_t type;
+	uint32_t id;
+	bool ok;	/* the checksum and the trailer matched */
+};
+
+struct convey_kd_parser {
+	std::string held;	/* a packet not complete yet */
+	size_t want;
+};
+
+static uint32_t convey_kd_le(const std::string& s, size_t off, size_t n)
+{/*{{{*/
+	uint32_t v = 0;
+	for (size_t i = n; i > 0; i--) {
+		v = (v << 8) | static_cast<uint8_t>(s[off + i - 1]);
+	}
+	return v;
+}/*}}}*/
+
+static void convey_kd_noise(std::vector<convey_kd_item>& out, const char* p, size_t n)
+{/*{{{*/
+	if (out.empty() || 0 != out.back().kind) {
+		out.push_back(convey_kd_item{0, std::string(), 0, 0, true});
+	}
+	out.back().bytes.append(p, n);
+}/*}}}*/
+
+/* Packets may be split across reads, the parser holds the start of one
+ * until the rest arrived. */
+static void convey_kd_parse(convey_kd_parser& p, const char* buf, DWORD bytes, std::vector<convey_kd_item>& out)
+{/*{{{*/
+	for (DWORD i = 0; i < bytes; i++) {
+		char c = buf[i];
+		if (p.held.empty()) {
+			if (KD_LEADER_DATA == c || KD_LEADER_CONTROL == c) {
+				p.held = c;
+				p.want = KD_HEADER_SIZE;
+			} else if (KD_BREAKIN == c) {
+				out.push_back(convey_kd_item{KD_BREAKIN, std::string(1, c), 0, 0, true});
+			} else {
+				convey_kd_noise(out, &c, 1);
+			}
+			continue;
+		}
+		if (p.held.size() < 4 && c != p.held[0]) {
+			/* Not a leader after all, look at this byte again. */
+			convey_kd_noise(out, p.held.data(), p.held.size());
+			p.held.clear();
+			i--;
+			continue;
+		}
+		p.held += c;
+		if (KD_HEADER_SIZE == p.held.size() && KD_LEADER_DATA == p.held[0]) {
+			uint32_t count = convey_kd_le(p.held, 6, 2);
+			if (count > KD_MAX_DATA) {
+				convey_kd_noise(out, p.held.data(), p.held.size());
+				p.held.clear();
+				continue;
+			}
+			p.want = KD_HEADER_SIZE + count + 1;
+		}
+		if (p.held.size() == p.want) {
+			convey_kd_item it{p.held[0], std::move(p.held), 0, 0, true};
+			it.type = static_cast<uint16_t>(convey_kd_le(it.bytes, 4, 2));
+			it.id = convey_kd_le(it.bytes, 8, 4);
+			if (KD_LEADER_DATA == it.kind) {
+				uint32_t sum = 0;
+				for (size_t j = KD_HEADER_SIZE; j < it.bytes.size() - 1; j++) {
+					sum += static_cast<uint8_t>(it.bytes[j]);
+				}
+				it.ok = sum == convey_kd_le(it.bytes, 12, 4) && KD_TRAILER == it.bytes.back();
+			}
+			out.push_back(std::move(it));
+			p.held.clear();
+		}
+	}
+}/*}}}*/
+
+/* What one side of the bridge sent, 0 the debugger and 1 the target. The
+ * time a data packet went out is kept until the other side acks it. */
+struct convey_kd_side {
+	convey_kd_parser parser;
+	bool sent;
+	bool awaiting_ack;
+	uint32_t last_id;
+	std::chrono::steady_clock::time_point sent_at;
+};
+
+struct convey_kd_relay {
+	convey_kd_side side[2];
+	std::mutex lock;
+};
+
+static convey_kd_relay kd;
+
+static void convey_kd_reset(void)
+{/*{{{*/
+	std::lock_guard<std::mutex> lk(kd.lock);
+	kd.side[0] = convey_kd_side{};
+	kd.side[1] = convey_kd_side{};
+}/*}}}*/
+
+static void convey_kd_packet_seen(int from, const convey_kd_item& it)
+{/*{{{*/
+	convey_kd_side& me = kd.side[from];
+	convey_kd_side& peer = kd.side[!from];
+	std::lock_guard<std::mutex> lk(kd.lock);
+
+	stats.kd_packets++;
+	if (!it.ok) {
+		stats.kd_bad++;
+	}
+	if (KD_LEADER_DATA == it.kind) {
+		/* The ids alternate, the same one again went out on a timeout. */
+		if (me.sent && it.id == me.last_id) {
+			stats.kd_repeats++;
+		}
+		me.sent = true;
+		me.awaiting_ack = true;
+		me.last_id = it.id;
+		me.sent_at = std::chrono::steady_clock::now();
+	} else if (KD_TYPE_ACK == it.type && peer.awaiting_ack && it.id == peer.last_id) {
+		uint64_t us = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - peer.sent_at).count();
+		peer.awaiting_ack = false;
+		stats.kd_acks++;
+		stats.kd_ack_us_total += us;
+		if (us > stats.kd_ack_us_max) {
+			stats.kd_ack_us_max = us;
+		}
+	} else if (KD_TYPE_RESEND == it.type) {
+		stats.kd_resends++;
+	}
+}/*}}}*/
+
+/* Forwards what the parser made whole from one read in a single write,
+ * from 0 the debugger toward the target, from 1 the other way. */
+static bool convey_kd_forward(int from, const char* buf, DWORD bytes, DWORD& er)
+{/*{{{*/
+	std::vector<convey_kd_item> items;
+	std::string out;
+
+	convey_kd_parse(kd.side[from].parser, buf, bytes, items);
+	for (convey_kd_item& it : items) {
+		out += it.bytes;
+		if (KD_BREAKIN == it.kind) {
+			if (0 == from) {
+				stats.kd_breakins++;
+			}
+		} else if (it.kind) {
+			convey_kd_packet_seen(from, it);
+		}
+	}
+	if (out.empty()) {
+		return true;
+	}
+
+	DWORD n = static_cast<DWORD>(out.size());
+	return from ? convey_write_pipe(bpipe, out.data(), &n, e_out, er) : convey_write_pipe(epipe, out.data(), &n, e_pipe_w, er);
+}/*}}}*/
+
+static void convey_stats_print(void)
+{/*{{{*/
+	if (convey_transport_is_tcp()) {
+		int snd = conf.sndbuf, rcv = conf.rcvbuf;
+		if (SOCKBUF_AUTO == conf.sndbuf) {
+			snd = stats.sndbuf;
+		}
+		if (SOCKBUF_AUTO == conf.rcvbuf) {
+			rcv = stats.rcvbuf;
+		}
+		std::cerr << "convey: send buffer " << (snd ? std::to_string(snd) : "default")
+			<< ", receive buffer " << (rcv ? std::to_string(rcv) : "default") << std::endl;
+	}
+	if (convey_tp_tcp_client == conf.transport || convey_tp_rfc2217 == conf.transport || convey_tp_udp_client == conf.transport) {
+		std::cerr << "convey: " << stats.resolves << " lookups, " << stats.resolve_hits << " cache hits, last "
+			<< stats.resolve_last_ms << " ms, total " << stats.resolve_total_ms << " ms" << std::endl;
+	}
+	if (stats.uring_enters) {
+		std::cerr << "convey: io_uring, " << stats.uring_cqes << " completions in "
+			<< stats.uring_enters << " system calls" << std::endl;
+	}
+	if (stdin_pump_started) {
+		std::lock_guard<std::mutex> lk(outq.lock);
+		std::cerr << "convey: " << outq.bytes << " bytes queued, " << outq.dropped << " dropped" << std::endl;
+	}
+	if (conf.gdb) {
+		std::cerr << "convey: gdb, " << stats.rsp_packets << " packets, " << stats.rsp_bad << " bad checksums, "
+			<< stats.rsp_resends << " resends, " << stats.rsp_cache_hits << " cache hits" << std::endl;
+	}
+	if (conf.kd) {
+		std::cerr << "convey: kd, " << stats.kd_packets << " packets, " << stats.kd_bad << " bad checksums, "
+			<< stats.kd_resends << " resend requests, " << stats.kd_repeats << " repeated, " << stats.kd_breakins << " breakins" << std::endl;
+		std::cerr << "convey: kd, " << stats.kd_acks << " acks, latency avg "
+			<< (stats.kd_acks ? stats.kd_ack_us_total / stats.kd_acks : 0) << " us, max " << stats.kd_ack_us_max << " us" << std::endl;
+	}
+	if (!conf.mux.empty()) {
+		std::cerr << "convey: mux, " << stats.mux_frames_out << " frames sent, " << stats.mux_frames_in << " received, "
+			<< stats.mux_bad << " bad, " << stats.mux_lost << " bytes lost" << std::endl;
+	}
+	if (conf.compress) {
+		std::cerr << "convey: compression, " << stats.lz_raw_out << " bytes sent as " << stats.lz_wire_out << ", "
+			<< stats.lz_wire_in << " received as " << stats.lz_raw_in << ", " << stats.lz_bad << " bad blocks" << std::endl;
+	}
+	if (conf.resume) {
+		std::cerr << "convey: resume, " << stats.resume_replayed << " bytes sent again, "
+			<< stats.resume_dropped << " dropped when the other end started anew" << std::endl;
+	}
+}/*}}}*/
+
+static void convey_quit(void)
+{/*{{{*/
+	if (conf.verbose) {
+		std::cout << std::endl << "convey: ctrl-a q sent, exit" << std::endl;
+	}
+	convey_shutdown();
+	convey_final_cleanup();
+	std::cout.flush();
+#ifdef _WIN32
+	ExitProcess(0);
+#else
+	_exit(0);
+#endif
+}/*}}}*/
+
+#ifndef _WIN32
+/* Screen style command keys in the stdin stream of a raw terminal:
+ * ctrl-a q quits, ctrl-a a sends a ctrl-a, anything else after ctrl-a
+ * is dropped. Returns the bytes left to send. */
+static DWORD convey_ctrl_filter(char* buf, DWORD bytes, bool& pending, bool& quit)
+{/*{{{*/
+	DWORD o = 0;
+
+	for (DWORD i = 0; i < bytes; ++i) {
+		char c = buf[i];
+		if (pending) {
+			pending = false;
+			if ('q' == c || 'Q' == c) {
+				quit = true;
+				return o;
+			} else if ('a' == c) {
+				buf[o++] = '\x01';
+			}
+		} else if ('\x01' == c) {
+			pending = true;
+		} else {
+			buf[o++] = c;
+		}
+	}
+
+	return o;
+}/*}}}*/
+#endif
+
+/* The part of a stdin read that goes to the endpoint. */
+static DWORD convey_stdin_filter(char* buf, DWORD bytes)
+{/*{{{*/
+#ifdef _WIN32
+	/* Do not send bytes typed in the ctrl mode. */
+	if (ctrl_mode) {
+		return 0;
+	}
+#else
+	if (is_console && !conf.no_xterm) {
+		bool pending = ctrl_mode, quit = false;
+		bytes = convey_ctrl_filter(buf, bytes, pending, quit);
+		ctrl_mode = pending;
+		if (quit) {
+			convey_quit();
+		}
+	}
+#endif
+	if (conf.no_xterm) {
+		bytes = convey_trim_crlf(buf, bytes);
+	}
+	return bytes;
+}/*}}}*/
+
+/* Reads stdin into the outbound queue for the life of the process, so
+ * input keeps being accepted while the session reconnects. */
+static void convey_stdin_pump(void)
+{/*{{{*/
+#ifdef _WIN32
+	HANDLE e = CreateEvent(nullptr, false, false, nullptr);
+#else
+	/* Not cancelled with the session. */
+	HANDLE e = INVALID_HANDLE_VALUE;
+#endif
+
+	while (true) {
+		char buf[BUF_SIZE];
+		DWORD bytes{0}, er{0};
+		bool rc = false;
+
+		if (in_is_pipe) {
+			rc = convey_read_pipe(in, buf, &bytes, e, er);
+		} else {
+#ifdef _WIN32
+			rc = ReadFile(in, buf, sizeof buf, &bytes, nullptr);
+			er = GetLastError();
+#endif
+		}
+		if (!rc) {
+			convey_error(er);
+			break;
+		}
+#ifndef _WIN32
+		if (!bytes) {
+			/* End of input. */
+			break;
+		}
+#endif
+
+		bytes = convey_stdin_filter(buf, bytes);
+		if (bytes) {
+			convey_outq_push(outq, buf, bytes);
+		} else {
+			std::this_thread::sleep_for(std::chrono::milliseconds(3));
+		}
+	}
+
+#ifdef _WIN32
+	CloseHandle(e);
+#endif
+
+	std::lock_guard<std::mutex> lk(outq.lock);
+	outq.eof = true;
+	outq.cv.notify_all();
+}/*}}}*/
+
+static void convey_stdin_pump_start(void)
+{/*{{{*/
+	if (stdin_pump_started || conf.bridge || conf.read_only || !conf.queue_limit) {
+		return;
+	}
+	outq.limit = conf.queue_limit;
+	outq.drop = conf.queue_drop;
+	stdin_pump_started = true;
+	std::thread(convey_stdin_pump).detach();
+}/*}}}*/
+
+static void convey_stamp_lines(const char* buf, DWORD bytes, bool& at_line_start, std::string& out)
+{/*{{{*/
+	for (DWORD i = 0; i < bytes; ++i) {
+		if (at_line_start) {
+			char stamp[16];
+#ifdef _WIN32
+			SYSTEMTIME st;
+			GetLocalTime(&st);
+			int n = snprintf(stamp, sizeof stamp, "[%02u:%02u:%02u] ", st.wHour, st.wMinute, st.wSecond);
+#else
+			struct tm tm;
+			time_t now = time(nullptr);
+			localtime_r(&now, &tm);
+			int n = snprintf(stamp, sizeof stamp, "[%02d:%02d:%02d] ", tm.tm_hour, tm.tm_min, tm.tm_sec);
+#endif
+			out.append(stamp, n);
+			at_line_start = false;
+		}
+		out.push_back(buf[i]);
+		if ('\n' == buf[i]) {
+			at_line_start = true;
+		}
+	}
+}/*}}}*/
+
+static void convey_hexdump(const char* buf, DWORD bytes, size_t& offset, std::string& out)
+{/*{{{*/
+	DWORD i = 0;
+	while (i < bytes) {
+		DWORD row = (bytes - i < 16) ? (bytes - i) : 16;
+		char head[16];
+		int n = snprintf(head, sizeof head, "%08lx  ", (unsigned long)offset);
+		out.append(head, n);
+		for (DWORD j = 0; j < 16; ++j) {
+			if (j < row) {
+				char hb[8];
+				int m = snprintf(hb, sizeof hb, "%02x ", (unsigned char)buf[i + j]);
+				out.append(hb, m);
+			} else {
+				out.append("   ", 3);
+			}
+			if (7 == j) {
+				out.push_back(' ');
+			}
+		}
+		out.append("|", 1);
+		for (DWORD j = 0; j < row; ++j) {
+			unsigned char c = (unsigned char)buf[i + j];
+			out.push_back((c >= 0x20 && c < 0x7f) ? (char)c : '.');
+		}
+		out.append("|\n", 2);
+		offset += row;
+		i += row;
+	}
+}/*}}}*/
+#undef OV_E
+/* }}} */
+
+#ifdef CONVEY_HAVE_URING
+/* {{{ io_uring engine */
+/* Both directions of a session on one thread and one ring. The endpoint
+ * read stays posted on a pool of provided buffers, the writes to the
+ * peer, to the endpoint and to the logs go through the same ring, so a
+ * busy session takes one system call per batch instead of a few per
+ * chunk. Written against the raw interface, liburing isn't needed. */
+
+#define CONVEY_URING_ENTRIES 64
+/* Per direction, a power of two. An exhausted pool holds the reads back
+ * until the writes caught up. */
+#define CONVEY_URING_BUFS 8
+
+enum convey_uring_op {
+	convey_uring_op_ep_read = 1,
+	convey_uring_op_peer_read,
+	convey_uring_op_write,
+	convey_uring_op_timeout,
+	convey_uring_op_cancel,
+	convey_uring_op_drain
+};
+
+enum convey_uring_sink_id {
+	convey_uring_sink_ep,
+	convey_uring_sink_peer,
+	convey_uring_sink_log,
+	convey_uring_sink_log_recv,
+	convey_uring_sink_log_send,
+	convey_uring_sinks
+};
+
+struct convey_uring {
+	int fd;
+	unsigned entries;
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe* sqes;
+	struct io_uring_cqe* cqes;
+	void* sq_map;
+	void* cq_map;
+	size_t sq_len, cq_len, sqes_len;
+	unsigned tail;		/* prepared up to here, published on enter */
+	unsigned inflight;	/* submitted and not completed yet */
+};
+
+/* The ring is addressed as a plain array with the tail in bufs[0].resv,
+ * as C++ lays out the flexible array in io_uring_buf_ring differently. */
+struct convey_uring_pool {
+	struct io_uring_buf* ring;
+	size_t ring_len;
+	char* data;
+	DWORD size;
+	uint16_t bgid;
+	uint16_t tail;
+	int refs[CONVEY_URING_BUFS];
+	bool starved;
+};
+
+/* A pending write. It holds a reference on the pool buffer it came from,
+ * the data is either in that buffer or, when transformed, owned. */
+struct convey_uring_item {
+	convey_uring_pool* pool;
+	int bid;
+	std::string own;
+	const char* p;
+	DWORD len;
+	DWORD off;
+};
+
+struct convey_uring_sink {
+	HANDLE fd;
+	std::deque<convey_uring_item> q;
+	bool busy;
+};
+
+struct convey_uring_session {
+	convey_uring r;
+	convey_uring_pool ep_pool;
+	convey_uring_pool peer_pool;
+	convey_uring_sink sinks[convey_uring_sinks];
+	HANDLE peer_in;
+	bool ep_socket;
+	bool ep_multishot;
+	bool ep_armed;
+	bool ep_eof;
+	bool peer_armed;
+	bool peer_eof;
+	bool closing;
+	convey_autotune at_r;
+	convey_autotune at_w;
+	struct __kernel_timespec tick;
+	struct __kernel_timespec drain_limit;
+};
+
+static bool convey_uring_init(convey_uring& r)
+{/*{{{*/
+	struct io_uring_params p;
+	memset(&p, 0, sizeof p);
+	memset(&r, 0, sizeof r);
+	r.sq_map = r.cq_map = MAP_FAILED;
+
+	r.fd = static_cast<int>(syscall(__NR_io_uring_setup, CONVEY_URING_ENTRIES, &p));
+	if (r.fd < 0) {
+		return false;
+	}
+	/* Reads at the current position and no lost completions, 5.6 and up. */
+	if (!(p.features & IORING_FEAT_RW_CUR_POS) || !(p.features & IORING_FEAT_NODROP)) {
+		close(r.fd);
+		return false;
+	}
+
+	r.entries = p.sq_entries;
+	r.sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	r.cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		r.sq_len = r.cq_len = (r.sq_len > r.cq_len) ? r.sq_len : r.cq_len;
+	}
+	r.sq_map = mmap(nullptr, r.sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r.fd, IORING_OFF_SQ_RING);
+	if (MAP_FAILED == r.sq_map) {
+		close(r.fd);
+		return false;
+	}
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		r.cq_map = r.sq_map;
+	} else {
+		r.cq_map = mmap(nullptr, r.cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r.fd, IORING_OFF_CQ_RING);
+	}
+	r.sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+	void* sqes = mmap(nullptr, r.sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r.fd, IORING_OFF_SQES);
+	if (MAP_FAILED == r.cq_map || MAP_FAILED == sqes) {
+		if (MAP_FAILED != sqes) {
+			munmap(sqes, r.sqes_len);
+		}
+		if (MAP_FAILED != r.cq_map && r.cq_map != r.sq_map) {
+			munmap(r.cq_map, r.cq_len);
+		}
+		munmap(r.sq_map, r.sq_len);
+		close(r.fd);
+		return false;
+	}
+
+	char* sq = static_cast<char*>(r.sq_map);
+	char* cq = static_cast<char*>(r.cq_map);
+	r.sq_head = reinterpret_cast<unsigned*>(sq + p.sq_off.head);
+	r.sq_tail = reinterpret_cast<unsigned*>(sq + p.sq_off.tail);
+	r.sq_mask = reinterpret_cast<unsigned*>(sq + p.sq_off.ring_mask);
+	r.sq_array = reinterpret_cast<unsigned*>(sq + p.sq_off.array);
+	r.cq_head = reinterpret_cast<unsigned*>(cq + p.cq_off.head);
+	r.cq_tail = reinterpret_cast<unsigned*>(cq + p.cq_off.tail);
+	r.cq_mask = reinterpret_cast<unsigned*>(cq + p.cq_off.ring_mask);
+	r.cqes = reinterpret_cast<struct io_uring_cqe*>(cq + p.cq_off.cqes);
+	r.sqes = static_cast<struct io_uring_sqe*>(sqes);
+	r.tail = *r.sq_tail;
+
+	return true;
+}/*}}}*/
+
+static void convey_uring_fini(convey_uring& r)
+{/*{{{*/
+	munmap(r.sqes, r.sqes_len);
+	if (r.cq_map != r.sq_map) {
+		munmap(r.cq_map, r.cq_len);
+	}
+	munmap(r.sq_map, r.sq_len);
+	close(r.fd);
+}/*}}}*/
+
+/* Publish the prepared entries and, with wait, block for a completion. */
+static bool convey_uring_enter(convey_uring& r, unsigned wait)
+{/*{{{*/
+	unsigned n = r.tail - *r.sq_tail;
+	__atomic_store_n(r.sq_tail, r.tail, __ATOMIC_RELEASE);
+
+	int rc = static_cast<int>(syscall(__NR_io_uring_enter, r.fd, n, wait, wait ? IORING_ENTER_GETEVENTS : 0, nullptr, 0));
+	stats.uring_enters++;
+	if (rc < 0) {
+		/* A busy completion queue only needs reaping. */
+		return EINTR == errno || EBUSY == errno || EAGAIN == errno;
+	}
+	return true;
+}/*}}}*/
+
+static struct io_uring_sqe* convey_uring_prep(convey_uring& r, uint8_t op, int fd, uint64_t user_data)
+{/*{{{*/
+	if (r.tail - __atomic_load_n(r.sq_head, __ATOMIC_ACQUIRE) >= r.entries) {
+		convey_uring_enter(r, 0);
+	}
+
+	unsigned idx = r.tail & *r.sq_mask;
+	struct io_uring_sqe* sqe = &r.sqes[idx];
+	memset(sqe, 0, sizeof *sqe);
+	sqe->opcode = op;
+	sqe->fd = fd;
+	sqe->user_data = user_data;
+	r.sq_array[idx] = idx;
+	r.tail++;
+	r.inflight++;
+
+	return sqe;
+}/*}}}*/
+
+static void convey_uring_pool_put(convey_uring_pool& pool, int bid)
+{/*{{{*/
+	struct io_uring_buf* b = &pool.ring[pool.tail & (CONVEY_URING_BUFS - 1)];
+	b->addr = reinterpret_cast<uint64_t>(pool.data + bid * pool.size);
+	b->len = pool.size;
+	b->bid = static_cast<uint16_t>(bid);
+	pool.tail++;
+	__atomic_store_n(&pool.ring[0].resv, pool.tail, __ATOMIC_RELEASE);
+}/*}}}*/
+
+static bool convey_uring_pool_init(convey_uring& r, convey_uring_pool& pool, uint16_t bgid, DWORD size)
+{/*{{{*/
+	memset(&pool, 0, sizeof pool);
+	pool.bgid = bgid;
+	pool.size = size;
+
+	/* The ring must be page aligned. */
+	pool.ring_len = CONVEY_URING_BUFS * sizeof(struct io_uring_buf);
+	pool.ring = static_cast<struct io_uring_buf*>(mmap(nullptr, pool.ring_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+	if (MAP_FAILED == static_cast<void*>(pool.ring)) {
+		pool.ring = nullptr;
+		return false;
+	}
+	pool.data = static_cast<char*>(mmap(nullptr, CONVEY_URING_BUFS * size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+	if (MAP_FAILED == static_cast<void*>(pool.data)) {
+		munmap(pool.ring, pool.ring_len);
+		pool.ring = nullptr;
+		pool.data = nullptr;
+		return false;
+	}
+
+	struct io_uring_buf_reg reg;
+	memset(&reg, 0, sizeof reg);
+	reg.ring_addr = reinterpret_cast<uint64_t>(pool.ring);
+	reg.ring_entries = CONVEY_URING_BUFS;
+	reg.bgid = bgid;
+	if (0 != syscall(__NR_io_uring_register, r.fd, IORING_REGISTER_PBUF_RING, &reg, 1)) {
+		munmap(pool.data, CONVEY_URING_BUFS * size);
+		munmap(pool.ring, pool.ring_len);
+		pool.ring = nullptr;
+		pool.data = nullptr;
+		return false;
+	}
+
+	for (int i = 0; i < CONVEY_URING_BUFS; ++i) {
+		convey_uring_pool_put(pool, i);
+	}
+
+	return true;
+}/*}}}*/
+
+/* The ring is gone already, so is the registration. */
+static void convey_uring_pool_fini(convey_uring_pool& pool)
+{/*{{{*/
+	if (pool.ring) {
+		munmap(pool.data, CONVEY_URING_BUFS * pool.size);
+		munmap(pool.ring, pool.ring_len);
+	}
+}/*}}}*/
+
+static void convey_uring_fail(void)
+{/*{{{*/
+	if (conf.bridge) {
+		convey_bridge_fail();
+	} else {
+		convey_console_fail();
+	}
+}/*}}}*/
+
+/* An end of input ends the session once what was read before is out,
+ * the threads never read ahead of their writes either. */
+static void convey_uring_close(convey_uring_session& s)
+{/*{{{*/
+	s.closing = true;
+	for (const convey_uring_sink& k : s.sinks) {
+		if (k.busy || !k.q.empty()) {
+			return;
+		}
+	}
+	convey_uring_fail();
+}/*}}}*/
+
+static void convey_uring_arm_ep_read(convey_uring_session& s)
+{/*{{{*/
+	if (s.ep_armed || s.ep_eof || s.ep_pool.starved || is_error) {
+		return;
+	}
+	struct io_uring_sqe* sqe;
+	if (s.ep_socket) {
+		sqe = convey_uring_prep(s.r, IORING_OP_RECV, epipe, convey_uring_op_ep_read);
+		if (s.ep_multishot) {
+			sqe->ioprio = IORING_RECV_MULTISHOT;
+		} else {
+			sqe->len = s.ep_pool.size;
+		}
+	} else {
+		sqe = convey_uring_prep(s.r, IORING_OP_READ, epipe, convey_uring_op_ep_read);
+		sqe->off = static_cast<uint64_t>(-1);
+		sqe->len = s.ep_pool.size;
+	}
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = s.ep_pool.bgid;
+	s.ep_armed = true;
+}/*}}}*/
+
+static void convey_uring_arm_peer_read(convey_uring_session& s)
+{/*{{{*/
+	if (s.peer_armed || s.peer_eof || s.peer_pool.starved || is_error || INVALID_HANDLE_VALUE == s.peer_in) {
+		return;
+	}
+	struct io_uring_sqe* sqe = convey_uring_prep(s.r, IORING_OP_READ, s.peer_in, convey_uring_op_peer_read);
+	sqe->off = static_cast<uint64_t>(-1);
+	sqe->len = s.peer_pool.size;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = s.peer_pool.bgid;
+	s.peer_armed = true;
+}/*}}}*/
+
+static void convey_uring_unref(convey_uring_session& s, convey_uring_pool* pool, int bid)
+{/*{{{*/
+	if (!pool || 0 != --pool->refs[bid]) {
+		return;
+	}
+	convey_uring_pool_put(*pool, bid);
+	if (pool->starved) {
+		pool->starved = false;
+		if (pool == &s.ep_pool) {
+			convey_uring_arm_ep_read(s);
+		} else {
+			convey_uring_arm_peer_read(s);
+		}
+	}
+}/*}}}*/
+
+static void convey_uring_write_next(convey_uring_session& s, int id)
+{/*{{{*/
+	convey_uring_sink& k = s.sinks[id];
+	if (k.busy || k.q.empty()) {
+		return;
+	}
+	const convey_uring_item& it = k.q.front();
+	struct io_uring_sqe* sqe = convey_uring_prep(s.r, IORING_OP_WRITE, k.fd, convey_uring_op_write | (id << 8));
+	sqe->addr = reinterpret_cast<uint64_t>(it.p + it.off);
+	sqe->len = it.len - it.off;
+	sqe->off = static_cast<uint64_t>(-1);
+	k.busy = true;
+}/*}}}*/
+
+static void convey_uring_push(convey_uring_session& s, int id, convey_uring_pool* pool, int bid, const char* p, DWORD len, std::string&& own = std::string())
+{/*{{{*/
+	convey_uring_sink& k = s.sinks[id];
+	if (INVALID_HANDLE_VALUE == k.fd || !len) {
+		return;
+	}
+	pool->refs[bid]++;
+	k.q.push_back({pool, bid, std::move(own), nullptr, len, 0});
+	convey_uring_item& it = k.q.back();
+	it.p = it.own.empty() ? p : it.own.data();
+	convey_uring_write_next(s, id);
+}/*}}}*/
+
+static void convey_uring_sink_clear(convey_uring_session& s, int id)
+{/*{{{*/
+	convey_uring_sink& k = s.sinks[id];
+	/* The one in flight is released on its completion. */
+	while (k.q.size() > (k.busy ? 1 : 0)) {
+		convey_uring_item& it = k.q.back();
+		convey_uring_unref(s, it.pool, it.bid);
+		k.q.pop_back();
+	}
+}/*}}}*/
+
+static void convey_uring_on_ep_data(convey_uring_session& s, int bid, DWORD bytes)
+{/*{{{*/
+	convey_uring_pool* pool = &s.ep_pool;
+	char* buf = pool->data + bid * pool->size;
+
+	if (conf.bridge) {
+		bridge_last_rx = GetTickCount64();
+	}
+	convey_tcp_autotune(epipe, SO_RCVBUF, s.at_r, bytes);
+
+	/* Dispatch reference, so the buffer can't return before all pushes. */
+	pool->refs[bid] = 1;
+	convey_uring_push(s, convey_uring_sink_log_recv, pool, bid, buf, bytes);
+	if (INVALID_HANDLE_VALUE != log_handle) {
+		std::string rec(bytes + 2, '\0');
+		convey_log_session_record(&rec[0], buf, bytes, false);
+		convey_uring_push(s, convey_uring_sink_log, pool, bid, nullptr, bytes + 2, std::move(rec));
+	}
+
+	if (!conf.bridge && (conf.hex || conf.timestamps)) {
+		static size_t hex_offset = 0;
+		static bool ts_line_start = true;
+		std::string hexbuf, tsbuf;
+		const char* wbuf = buf;
+		DWORD wbytes = bytes;
+		if (conf.hex) {
+			convey_hexdump(wbuf, wbytes, hex_offset, hexbuf);
+			wbuf = hexbuf.data();
+			wbytes = (DWORD)hexbuf.size();
+		}
+		if (conf.timestamps) {
+			convey_stamp_lines(wbuf, wbytes, ts_line_start, tsbuf);
+			wbuf = tsbuf.data();
+			wbytes = (DWORD)tsbuf.size();
+		}
+		convey_uring_push(s, convey_uring_sink_peer, pool, bid, nullptr, wbytes, conf.timestamps ? std::move(tsbuf) : std::move(hexbuf));
+	} else {
+		convey_uring_push(s, convey_uring_sink_peer, pool, bid, buf, bytes);
+	}
+
+	convey_uring_unref(s, pool, bid);
+}/*}}}*/
+
+static void convey_uring_on_peer_data(convey_uring_session& s, int bid, DWORD bytes)
+{/*{{{*/
+	convey_uring_pool* pool = &s.peer_pool;
+	char* buf = pool->data + bid * pool->size;
+
+	if (!conf.bridge) {
+		bytes = convey_stdin_filter(buf, bytes);
+	}
+
+	pool->refs[bid] = 1;
+	convey_uring_push(s, convey_uring_sink_log_send, pool, bid, buf, bytes);
+	if (INVALID_HANDLE_VALUE != log_handle && bytes) {
+		std::string rec(bytes + 2, '\0');
+		convey_log_session_record(&rec[0], buf, bytes, true);
+		convey_uring_push(s, convey_uring_sink_log, pool, bid, nullptr, bytes + 2, std::move(rec));
+	}
+	convey_uring_push(s, convey_uring_sink_ep, pool, bid, buf, bytes);
+	convey_uring_unref(s, pool, bid);
+}/*}}}*/
+
+static void convey_uring_complete(convey_uring_session& s, const struct io_uring_cqe& cqe)
+{/*{{{*/
+	int op = static_cast<int>(cqe.user_data & 0xff);
+	int res = cqe.res;
+
+	if (!(cqe.flags & IORING_CQE_F_MORE)) {
+		s.r.inflight--;
+	}
+	stats.uring_cqes++;
+
+	switch (op) {
+	case convey_uring_op_ep_read:
+		if (!(cqe.flags & IORING_CQE_F_MORE)) {
+			s.ep_armed = false;
+		}
+		if (res > 0) {
+			convey_uring_on_ep_data(s, cqe.flags >> IORING_CQE_BUFFER_SHIFT, static_cast<DWORD>(res));
+		} else if (0 == res) {
+			s.ep_eof = true;
+			convey_uring_close(s);
+		} else if (-ENOBUFS == res) {
+			s.ep_pool.starved = true;
+		} else if (-EINVAL == res && s.ep_multishot) {
+			/* No multishot receive before Linux 6.0. */
+			s.ep_multishot = false;
+		} else if (-ECANCELED != res && -EINTR != res && -EAGAIN != res) {
+			if (!is_error) {
+				convey_error(-res);
+			}
+			convey_uring_fail();
+		}
+		convey_uring_arm_ep_read(s);
+		break;
+
+	case convey_uring_op_peer_read:
+		s.peer_armed = false;
+		if (res > 0) {
+			convey_uring_on_peer_data(s, cqe.flags >> IORING_CQE_BUFFER_SHIFT, static_cast<DWORD>(res));
+		} else if (0 == res) {
+			/* The same end of input rules as in the threaded reader. */
+			struct stat st;
+			s.peer_eof = true;
+			if (conf.bridge || (0 == fstat(s.peer_in, &st) && (S_ISFIFO(st.st_mode) || S_ISSOCK(st.st_mode)))) {
+				convey_uring_close(s);
+			}
+		} else if (-ENOBUFS == res) {
+			s.peer_pool.starved = true;
+		} else if (-ECANCELED != res && -EINTR != res && -EAGAIN != res) {
+			if (!is_error) {
+				convey_error(-res);
+			}
+			convey_uring_fail();
+		}
+		convey_uring_arm_peer_read(s);
+		break;
+
+	case convey_uring_op_write: {
+		int id = static_cast<int>(cqe.user_data >> 8);
+		convey_uring_sink& k = s.sinks[id];
+		k.busy = false;
+		if (k.q.empty()) {
+			break;
+		}
+		convey_uring_item& it = k.q.front();
+		if (res > 0) {
+			it.off += res;
+			if (convey_uring_sink_ep == id) {
+				convey_tcp_autotune(epipe, SO_SNDBUF, s.at_w, res);
+			}
+		} else if (-EINTR != res && -EAGAIN != res) {
+			if (convey_uring_sink_ep == id || convey_uring_sink_peer == id) {
+				if (!is_error && -ECANCELED != res) {
+					convey_error(res ? -res : ERROR_BROKEN_PIPE);
+				}
+				convey_uring_fail();
+				convey_uring_sink_clear(s, id);
+			}
+			/* A failing log never stops the session, just drop the chunk. */
+			it.off = it.len;
+		}
+		if (it.off >= it.len) {
+			convey_uring_unref(s, it.pool, it.bid);
+			k.q.pop_front();
+		}
+		if (!is_error) {
+			convey_uring_write_next(s, id);
+			if (s.closing) {
+				convey_uring_close(s);
+			}
+		}
+		break;
+	}
+
+	case convey_uring_op_timeout:
+		/* Silence from the endpoint for too long means a dead link. */
+		if (GetTickCount64() - bridge_last_rx >= conf.silence_timeout * 1000ULL) {
+			if (conf.verbose) {
+				std::cerr << "convey: endpoint silent for " << conf.silence_timeout << " seconds, reconnecting" << std::endl;
+			}
+			convey_bridge_fail();
+		} else if (!is_error) {
+			struct io_uring_sqe* sqe = convey_uring_prep(s.r, IORING_OP_TIMEOUT, -1, convey_uring_op_timeout);
+			sqe->addr = reinterpret_cast<uint64_t>(&s.tick);
+			sqe->len = 1;
+		}
+		break;
+
+	default:
+		break;
+	}
+}/*}}}*/
+
+static void convey_uring_reap(convey_uring_session& s)
+{/*{{{*/
+	unsigned head = *s.r.cq_head;
+	while (head != __atomic_load_n(s.r.cq_tail, __ATOMIC_ACQUIRE)) {
+		struct io_uring_cqe cqe = s.r.cqes[head & *s.r.cq_mask];
+		head++;
+		__atomic_store_n(s.r.cq_head, head, __ATOMIC_RELEASE);
+		convey_uring_complete(s, cqe);
+	}
+}/*}}}*/
+
+/* Run the session between the endpoint and the peer (stdin and stdout,
+ * or the bridge peer) until it fails. Returns false when the engine
+ * isn't usable here, the caller runs the threads then. */
+static bool convey_uring_session_run(HANDLE peer_in, HANDLE peer_out)
+{/*{{{*/
+	/* The shared memory ring has no descriptor to hand to the kernel, and
+	 * the Telnet layer of RFC 2217, the WebSocket frames, the datagram
+	 * batches, the --gdb and --kd relays, the --resume frames and the pty
+	 * flush live in the read and write paths. */
+	if (convey_io_engine_threads == conf.io_engine || stdin_pump_started || conf.resume || !conf.pty_link.empty() || convey_tp_shm == conf.transport
+			|| convey_tp_rfc2217 == conf.transport || !conf.rfc2217_port.empty() || convey_tp_ws_server == conf.transport
+			|| convey_tp_udp_client == conf.transport || convey_tp_udp_server == conf.transport || conf.gdb || conf.kd) {
+		return false;
+	}
+
+	convey_uring_session s;
+	if (!convey_uring_init(s.r)) {
+		if (convey_io_engine_uring == conf.io_engine) {
+			std::cerr << "convey: io_uring is not available, using threads" << std::endl;
+		}
+		return false;
+	}
+	/* The buffer rings need Linux 5.19. */
+	if (!convey_uring_pool_init(s.r, s.ep_pool, 0, RECV_BUF_SIZE)
+			|| !convey_uring_pool_init(s.r, s.peer_pool, 1, BUF_SIZE)) {
+		convey_uring_fini(s.r);
+		convey_uring_pool_fini(s.ep_pool);
+		if (convey_io_engine_uring == conf.io_engine) {
+			std::cerr << "convey: io_uring buffer rings are not available, using threads" << std::endl;
+		}
+		return false;
+	}
+
+	s.sinks[convey_uring_sink_ep].fd = epipe;
+	s.sinks[convey_uring_sink_peer].fd = peer_out;
+	s.sinks[convey_uring_sink_log].fd = log_handle;
+	s.sinks[convey_uring_sink_log_recv].fd = log_recv_handle;
+	s.sinks[convey_uring_sink_log_send].fd = log_send_handle;
+	for (convey_uring_sink& k : s.sinks) {
+		k.busy = false;
+	}
+	s.peer_in = (conf.bridge || !conf.read_only) ? peer_in : INVALID_HANDLE_VALUE;
+	s.ep_socket = convey_transport_is_socket();
+	s.ep_multishot = s.ep_socket;
+	s.ep_armed = s.ep_eof = s.peer_armed = s.peer_eof = s.closing = false;
+	s.at_r = s.at_w = {0, 0, 0};
+	s.tick = {0, 250 * 1000000LL};
+	s.drain_limit = {1, 0};
+
+	convey_uring_arm_ep_read(s);
+	convey_uring_arm_peer_read(s);
+	if (conf.bridge && conf.silence_timeout) {
+		bridge_last_rx = GetTickCount64();
+		struct io_uring_sqe* sqe = convey_uring_prep(s.r, IORING_OP_TIMEOUT, -1, convey_uring_op_timeout);
+		sqe->addr = reinterpret_cast<uint64_t>(&s.tick);
+		sqe->len = 1;
+	}
+
+	while (!is_error && !shutting_down) {
+		if (!convey_uring_enter(s.r, 1)) {
+			if (!is_error) {
+				convey_error();
+			}
+			convey_uring_fail();
+			break;
+		}
+		convey_uring_reap(s);
+	}
+
+	/* Cancel what's still posted and wait for it, the buffers go next.
+	 * A write that can't be cancelled gets a second to finish. When the
+	 * cancel or the timeout fail, nothing tells when the rest is done. */
+	struct io_uring_sqe* sqe = convey_uring_prep(s.r, IORING_OP_ASYNC_CANCEL, -1, convey_uring_op_cancel);
+	sqe->cancel_flags = IORING_ASYNC_CANCEL_ANY | IORING_ASYNC_CANCEL_ALL;
+	sqe = convey_uring_prep(s.r, IORING_OP_TIMEOUT, -1, convey_uring_op_drain);
+	sqe->addr = reinterpret_cast<uint64_t>(&s.drain_limit);
+	sqe->len = 1;
+	bool drained = false, stuck = false;
+	while (convey_uring_enter(s.r, 1)) {
+		unsigned head = *s.r.cq_head;
+		while (head != __atomic_load_n(s.r.cq_tail, __ATOMIC_ACQUIRE)) {
+			const struct io_uring_cqe& cqe = s.r.cqes[head & *s.r.cq_mask];
+			if (!(cqe.flags & IORING_CQE_F_MORE)) {
+				s.r.inflight--;
+			}
+			uint64_t op = cqe.user_data & 0xff;
+			if (convey_uring_op_cancel == op && cqe.res < 0 && -ENOENT != cqe.res) {
+				stuck = true;
+			}
+			if (convey_uring_op_drain == op) {
+				drained = true;
+				if (-ETIME != cqe.res) {
+					stuck = true;
+				}
+			}
+			head++;
+		}
+		__atomic_store_n(s.r.cq_head, head, __ATOMIC_RELEASE);
+		if (drained || stuck || 1 == s.r.inflight) {
+			break;
+		}
+	}
+
+	convey_uring_fini(s.r);
+	if (0 == s.r.inflight || (!drained && !stuck && 1 == s.r.inflight)) {
+		convey_uring_pool_fini(s.ep_pool);
+		convey_uring_pool_fini(s.peer_pool);
+	}
+	/* Otherwise a stuck write may still touch its buffer, leave them be. */
+
+	return true;
+}/*}}}*/
+/* }}} */
+#else
+static bool convey_uring_session_run(HANDLE, HANDLE)
+{/*{{{*/
+	return false;
+}/*}}}*/
+#endif
+
+/* {{{ File transfer */
+/* ZMODEM with YMODEM and XMODEM for the other end that only speaks
+ * those, for --zsend and --zrecv. The sender streams and only looks at
+ * the back channel between subpackets, a window bounds how far it runs
+ * ahead of the acks. A receiver that finds part of the file from a broken
+ * transfer asks for the rest. */
+
+#define XFER_TIMEOUT -1
+#define XFER_EOF -2
+#define XFER_CANCEL -3
+#define XFER_BAD -4
+#define XFER_GOT_C -5
+#define XFER_GOT_NAK -6
+
+#define ZM_PAD '*'
+#define ZM_DLE 0x18
+#define ZM_BIN 'A'
+#define ZM_HEX 'B'
+#define ZM_BIN32 'C'
+
+#define ZM_RQINIT 0
+#define ZM_RINIT 1
+#define ZM_SINIT 2
+#define ZM_ACK 3
+#define ZM_FILE 4
+#define ZM_SKIP 5
+#define ZM_NAK 6
+#define ZM_ABORT 7
+#define ZM_FIN 8
+#define ZM_RPOS 9
+#define ZM_DATA 10
+#define ZM_EOF 11
+#define ZM_FERR 12
+#define ZM_CRC 13
+#define ZM_CHALLENGE 14
+#define ZM_CAN 16
+
+/* The ends of a data subpacket. */
+#define ZM_CRCE 'h'
+#define ZM_CRCG 'i'
+#define ZM_CRCQ 'j'
+#define ZM_CRCW 'k'
+#define ZM_RUB0 'l'
+#define ZM_RUB1 'm'
+
+/* ZF0 of ZRINIT and ZFILE, the flags byte is the last of the header. */
+#define ZM_CANFDX 0x01
+#define ZM_CANOVIO 0x02
+#define ZM_CANFC32 0x20
+#define ZM_ESCCTL 0x40
+#define ZM_CRESUM 3
+
+#define ZM_BLOCK 1024
+#define ZM_WINDOW (64 * 1024)
+
+#define XM_SOH 0x01
+#define XM_STX 0x02
+#define XM_EOT 0x04
+#define XM_ACK 0x06
+#define XM_NAK 0x15
+#define XM_CAN 0x18
+#define XM_SUB 0x1a
+
+#define XFER_RETRIES 10
+
+static uint16_t convey_crc16(uint16_t crc, const void* buf, size_t n)
+{/*{{{*/
+	const uint8_t* p = static_cast<const uint8_t*>(buf);
+	for (size_t i = 0; i < n; i++) {
+		crc = static_cast<uint16_t>(crc ^ (p[i] << 8));
+		for (int b = 0; b < 8; b++) {
+			crc = static_cast<uint16_t>((crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1);
+		}
+	}
+	return crc;
+}/*}}}*/
+
+static uint32_t convey_crc32(uint32_t crc, const void* buf, size_t n)
+{/*{{{*/
+	static uint32_t table[256];
+	static std::once_flag once;
+	std::call_once(once, []() {
+		for (uint32_t i = 0; i < 256; i++) {
+			uint32_t c = i;
+			for (int b = 0; b < 8; b++) {
+				c = (c & 1) ? (c >> 1) ^ 0xedb88320 : c >> 1;
+			}
+			table[i] = c;
+		}
+	});
+
+	const uint8_t* p = static_cast<const uint8_t*>(buf);
+	crc = ~crc;
+	for (size_t i = 0; i < n; i++) {
+		crc = table[(crc ^ p[i]) & 0xff] ^ (crc >> 8);
+	}
+	return ~crc;
+}/*}}}*/
+
+/* What the other end sent, for a protocol that waits with timeouts and
+ * peeks at the back channel while it streams. A reader thread feeds it
+ * from the endpoint, the unit tests from the other side of a transfer. */
+struct convey_xfer_link {
+	std::mutex lock;
+	std::condition_variable cv;
+	std::string in;
+	size_t pos;
+	bool eof;
+	bool (*write)(convey_xfer_link& l, const char* buf, size_t n);
+	void* ctx;
+};
+
+static void convey_xfer_feed(convey_xfer_link& l, const char* buf, size_t n, bool eof)
+{/*{{{*/
+	std::lock_guard<std::mutex> lk(l.lock);
+	if (l.pos == l.in.size()) {
+		l.in.clear();
+		l.pos = 0;
+	}
+	l.in.append(buf, n);
+	l.eof = l.eof || eof;
+	l.cv.notify_all();
+}/*}}}*/
+
+/* A byte, or XFER_TIMEOUT or XFER_EOF. */
+static int convey_xfer_getc(convey_xfer_link& l, int timeout_ms)
+{/*{{{*/
+	std::unique_lock<std::mutex> lk(l.lock);
+	if (l.pos == l.in.size() && !l.eof && timeout_ms > 0) {
+		l.cv.wait_for(lk, std::chrono::milliseconds(timeout_ms), [&l]() { return l.pos < l.in.size() || l.eof; });
+	}
+	if (l.pos < l.in.size()) {
+		return static_cast<uint8_t>(l.in[l.pos++]);
+	}
+	return l.eof ? XFER_EOF : XFER_TIMEOUT;
+}/*}}}*/
+
+static bool convey_xfer_pending(convey_xfer_link& l)
+{/*{{{*/
+	std::lock_guard<std::mutex> lk(l.lock);
+	return l.pos < l.in.size();
+}/*}}}*/
+
+/* Drops what's left of a broken block. */
+static void convey_xfer_purge(convey_xfer_link& l, int quiet_ms)
+{/*{{{*/
+	while (convey_xfer_getc(l, quiet_ms) >= 0) {
+	}
+}/*}}}*/
+
+struct convey_xfer {
+	convey_xfer_link* link;
+	convey_xfer_proto proto;	/* to start with, ZMODEM falls back */
+	int timeout_ms;	/* of one wait for the other end */
+	bool progress;
+	std::string dir;	/* to receive into */
+	/* Counted for -v. */
+	uint64_t files;
+	uint64_t bytes;
+	uint64_t retransmits;
+	/* Of the file in transfer. */
+	std::string name;
+	uint64_t size;
+	uint64_t done;
+	std::chrono::steady_clock::time_point started;
+	std::chrono::steady_clock::time_point shown;
+};
+
+static bool convey_xfer_write(convey_xfer& x, const std::string& s)
+{/*{{{*/
+	return s.empty() || x.link->write(*x.link, s.data(), s.size());
+}/*}}}*/
+
+static void convey_xfer_begin(convey_xfer& x, const std::string& name, uint64_t size, uint64_t at)
+{/*{{{*/
+	x.name = name;
+	x.size = size;
+	x.done = at;
+	x.started = std::chrono::steady_clock::now();
+	x.shown = std::chrono::steady_clock::time_point{};
+}/*}}}*/
+
+/* Four times a second at most, and once more with the file done. */
+static void convey_xfer_show(convey_xfer& x, bool last)
+{/*{{{*/
+	auto now = std::chrono::steady_clock::now();
+	if (!x.progress || (!last && now - x.shown < std::chrono::milliseconds(250))) {
+		return;
+	}
+	x.shown = now;
+	double secs = std::chrono::duration<double>(now - x.started).count();
+	char line[128];
+	snprintf(line, sizeof line, "%llu", static_cast<unsigned long long>(x.done));
+	std::cerr << "\rconvey: " << x.name << " " << line;
+	if (x.size) {
+		std::cerr << "/" << x.size << " bytes, " << (x.done * 100 / x.size) << "%";
+	} else {
+		std::cerr << " bytes";
+	}
+	snprintf(line, sizeof line, ", %.1f KiB/s ", secs > 0 ? x.done / secs / 1024 : 0.0);
+	std::cerr << line;
+	if (last) {
+		std::cerr << std::endl;
+	}
+}/*}}}*/
+
+static void convey_xfer_advance(convey_xfer& x, uint64_t n)
+{/*{{{*/
+	x.done += n;
+	x.bytes += n;
+	convey_xfer_show(x, false);
+}/*}}}*/
+
+/* The name alone, a sender's path means nothing here. */
+static std::string convey_xfer_basename(const std::string& path)
+{/*{{{*/
+	size_t pos = path.find_last_of("/\\");
+	std::string name = std::string::npos == pos ? path : path.substr(pos + 1);
+	if ("." == name || ".." == name) {
+		name.clear();
+	}
+	return name;
+}/*}}}*/
+
+static std::string convey_xfer_path(const convey_xfer& x, const std::string& name)
+{/*{{{*/
+	if (x.dir.empty()) {
+		return name;
+	}
+	char last = x.dir.back();
+	return ('/' == last || '\\' == last) ? x.dir + name : x.dir + "/" + name;
+}/*}}}*/
+
+/* -1 when there's no such file. */
+static int64_t convey_xfer_file_size(const std::string& path)
+{/*{{{*/
+	std::ifstream f(path, std::ios::binary | std::ios::ate);
+	return f ? static_cast<int64_t>(f.tellg()) : -1;
+}/*}}}*/
+
+/* The ZMODEM encoding escapes ZDLE, the flow control characters and
+ * a CR after @, or all control characters when the receiver asks so. */
+static void convey_zm_escape(std::string& out, const char* buf, size_t n, bool escctl)
+{/*{{{*/
+	char last = out.empty() ? 0 : out.back();
+	for (size_t i = 0; i < n; i++) {
+		uint8_t c = static_cast<uint8_t>(buf[i]);
+		bool esc;
+		switch (c & 0x7f) {
+		case ZM_DLE:
+		case 0x10:
+		case 0x11:
+		case 0x13:
+			esc = true;
+			break;
+		case '\r':
+			esc = escctl || '@' == (last & 0x7f);
+			break;
+		default:
+			esc = escctl && 0 == (c & 0x60);
+			break;
+		}
+		if (esc) {
+			out += static_cast<char>(ZM_DLE);
+			out += static_cast<char>(c ^ 0x40);
+		} else {
+			out += static_cast<char>(c);
+		}
+		last = static_cast<char>(c);
+	}
+}/*}}}*/
+
+/* The argument is the position, little endian, or the flags with ZF0 in
+ * the top byte. */
+static void convey_zm_header_bytes(uint8_t* h, int type, uint32_t arg)
+{/*{{{*/
+	h[0] = static_cast<uint8_t>(type);
+	for (int i = 0; i < 4; i++) {
+		h[1 + i] = static_cast<uint8_t>(arg >> (8 * i));
+	}
+}/*}}}*/
+
+static std::string convey_zm_hex_header(int type, uint32_t arg)
+{/*{{{*/
+	static const char hex[] = "0123456789abcdef";
+	uint8_t h[7];
+	convey_zm_header_bytes(h, type, arg);
+	uint16_t crc = convey_crc16(0, h, 5);
+	h[5] = static_cast<uint8_t>(crc >> 8);
+	h[6] = static_cast<uint8_t>(crc);
+
+	std::string out = "**\x18" "B";
+	for (uint8_t b : h) {
+		out += hex[b >> 4];
+		out += hex[b & 0xf];
+	}
+	out += "\r\n";
+	/* Undo an XOFF the line may be stuck in, except at the end. */
+	if (ZM_ACK != type && ZM_FIN != type) {
+		out += '\x11';
+	}
+	return out;
+}/*}}}*/
+
+static std::string convey_zm_bin_header(int type, uint32_t arg, bool crc32, bool escctl)
+{/*{{{*/
+	uint8_t h[9];
+	size_t n = 5;
+	convey_zm_header_bytes(h, type, arg);
+	if (crc32) {
+		uint32_t crc = convey_crc32(0, h, 5);
+		for (int i = 0; i < 4; i++) {
+			h[n++] = static_cast<uint8_t>(crc >> (8 * i));
+		}
+	} else {
+		uint16_t crc = convey_crc16(0, h, 5);
+		h[n++] = static_cast<uint8_t>(crc >> 8);
+		h[n++] = static_cast<uint8_t>(crc);
+	}
+
+	std::string out = "*\x18";
+	out += crc32 ? ZM_BIN32 : ZM_BIN;
+	convey_zm_escape(out, reinterpret_cast<const char*>(h), n, escctl);
+	return out;
+}/*}}}*/
+
+static void convey_zm_subpacket(std::string& out, const char* buf, size_t n, char end, bool crc32, bool escctl)
+{/*{{{*/
+	uint8_t c[4];
+	size_t cn = 0;
+	convey_zm_escape(out, buf, n, escctl);
+	out += static_cast<char>(ZM_DLE);
+	out += end;
+	if (crc32) {
+		uint32_t crc = convey_crc32(convey_crc32(0, buf, n), &end, 1);
+		for (int i = 0; i < 4; i++) {
+			c[cn++] = static_cast<uint8_t>(crc >> (8 * i));
+		}
+	} else {
+		uint16_t crc = convey_crc16(convey_crc16(0, buf, n), &end, 1);
+		c[cn++] = static_cast<uint8_t>(crc >> 8);
+		c[cn++] = static_cast<uint8_t>(crc);
+	}
+	convey_zm_escape(out, reinterpret_cast<const char*>(c), cn, escctl);
+}/*}}}*/
+
+/* A byte of a binary header or subpacket, 0x100 | the end of a
+ * subpacket, or an error. Flow control characters on the line are
+ * skipped, five CANs in a row cancel. */
+static int convey_zm_getc(convey_xfer& x)
+{/*{{{*/
+	int c;
+	while (true) {
+		c = convey_xfer_getc(*x.link, x.timeout_ms);
+		if (c < 0) {
+			return c;
+		}
+		if (0x11 == (c & 0x7f) || 0x13 == (c & 0x7f)) {
+			continue;
+		}
+		if (ZM_DLE != c) {
+			return c;
+		}
+		break;
+	}
+
+	for (int cans = 1;; cans++) {
+		c = convey_xfer_getc(*x.link, x.timeout_ms);
+		if (c < 0) {
+			return c;
+		}
+		if (ZM_DLE != c) {
+			break;
+		}
+		if (cans >= 4) {
+			return XFER_CANCEL;
+		}
+	}
+	if (c >= ZM_CRCE && c <= ZM_CRCW) {
+		return 0x100 | c;
+	} else if (ZM_RUB0 == c) {
+		return 0x7f;
+	} else if (ZM_RUB1 == c) {
+		return 0xff;
+	} else if (0x40 == (c & 0x60)) {
+		return c ^ 0x40;
+	}
+	return XFER_BAD;
+}/*}}}*/
+
+static int convey_zm_hex_digit(convey_xfer& x)
+{/*{{{*/
+	int c = convey_xfer_getc(*x.link, x.timeout_ms);
+	if (c < 0) {
+		return c;
+	}
+	int v = convey_rsp_hex(static_cast<char>(c & 0x7f));
+	return v < 0 ? XFER_BAD : v;
+}/*}}}*/
+
+struct convey_zm_header {
+	int type;
+	uint32_t arg;
+	bool crc32;	/* the sender's subpackets carry a CRC-32 */
+};
+
+/* The next header, skipping anything before it. The first byte is
+ * waited for first_ms, the rest of the header the usual timeout. With
+ * want_x, the C or NAK of a YMODEM or XMODEM receiver is returned too. */
+static int convey_zm_read_header(convey_xfer& x, convey_zm_header& h, int first_ms, bool want_x)
+{/*{{{*/
+	auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(first_ms);
+	int cans = 0;
+
+	while (true) {
+		int left = static_cast<int>(std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now()).count());
+		int c = convey_xfer_getc(*x.link, std::max(left, 0));
+		if (c < 0) {
+			return c;
+		}
+		if (ZM_DLE == c) {
+			if (++cans >= 5) {
+				return XFER_CANCEL;
+			}
+			continue;
+		}
+		cans = 0;
+		if (want_x && 'C' == c) {
+			return XFER_GOT_C;
+		}
+		if (want_x && XM_NAK == c) {
+			return XFER_GOT_NAK;
+		}
+		if (ZM_PAD != c) {
+			continue;
+		}
+
+		do {
+			c = convey_xfer_getc(*x.link, x.timeout_ms);
+		} while (ZM_PAD == c);
+		if (c < 0) {
+			return c;
+		}
+		if (ZM_DLE != c) {
+			continue;
+		}
+		int fmt = convey_xfer_getc(*x.link, x.timeout_ms);
+		if (fmt < 0) {
+			return fmt;
+		}
+
+		uint8_t b[9];
+		size_t n = (ZM_BIN32 == fmt) ? 9 : 7;
+		if (ZM_HEX == fmt) {
+			for (size_t i = 0; i < n; i++) {
+				int hi = convey_zm_hex_digit(x), lo = hi < 0 ? hi : convey_zm_hex_digit(x);
+				if (lo < 0) {
+					return lo;
+				}
+				b[i] = static_cast<uint8_t>((hi << 4) | lo);
+			}
+		} else if (ZM_BIN == fmt || ZM_BIN32 == fmt) {
+			for (size_t i = 0; i < n; i++) {
+				c = convey_zm_getc(x);
+				if (c < 0) {
+					return c;
+				}
+				if (c & 0x100) {
+					return XFER_BAD;
+				}
+				b[i] = static_cast<uint8_t>(c);
+			}
+		} else {
+			continue;
+		}
+
+		bool ok;
+		if (ZM_BIN32 == fmt) {
+			uint32_t crc = convey_crc32(0, b, 5);
+			ok = crc == (b[5] | (b[6] << 8) | (b[7] << 16) | (static_cast<uint32_t>(b[8]) << 24));
+		} else {
+			ok = convey_crc16(0, b, 5) == ((b[5] << 8) | b[6]);
+		}
+		if (!ok) {
+			return XFER_BAD;
+		}
+		h.type = b[0];
+		h.arg = b[1] | (b[2] << 8) | (b[3] << 16) | (static_cast<uint32_t>(b[4]) << 24);
+		h.crc32 = ZM_BIN32 == fmt;
+		return h.type;
+	}
+}/*}}}*/
+
+/* A data subpacket into out, returns how it ended or an error. */
+static int convey_zm_read_data(convey_xfer& x, bool crc32, std::string& out)
+{/*{{{*/
+	out.clear();
+	while (true) {
+		int c = convey_zm_getc(x);
+		if (c < 0) {
+			return c;
+		}
+		if (!(c & 0x100)) {
+			if (out.size() >= 8 * ZM_BLOCK) {
+				return XFER_BAD;
+			}
+			out += static_cast<char>(c);
+			continue;
+		}
+
+		char end = static_cast<char>(c & 0xff);
+		uint8_t b[4];
+		size_t n = crc32 ? 4 : 2;
+		for (size_t i = 0; i < n; i++) {
+			c = convey_zm_getc(x);
+			if (c < 0) {
+				return c;
+			}
+			if (c & 0x100) {
+				return XFER_BAD;
+			}
+			b[i] = static_cast<uint8_t>(c);
+		}
+		bool ok;
+		if (crc32) {
+			uint32_t crc = convey_crc32(convey_crc32(0, out.data(), out.size()), &end, 1);
+			ok = crc == (b[0] | (b[1] << 8) | (b[2] << 16) | (static_cast<uint32_t>(b[3]) << 24));
+		} else {
+			ok = convey_crc16(convey_crc16(0, out.data(), out.size()), &end, 1) == ((b[0] << 8) | b[1]);
+		}
+		return ok ? end : XFER_BAD;
+	}
+}/*}}}*/
+
+static bool convey_zm_fail(convey_xfer& x, const char* why)
+{/*{{{*/
+	/* Eight CANs and as many backspaces stop any ZMODEM program. */
+	convey_xfer_write(x, std::string(8, '\x18') + std::string(8, '\b'));
+	std::cerr << std::endl << "convey: zmodem: " << why << std::endl;
+	return false;
+}/*}}}*/
+
+/* A file from a ZFILE subpacket, name NUL size and more, and the offset
+ * to start at. Returns false for a file to skip. */
+static bool convey_zm_open(convey_xfer& x, const std::string& info, bool resume, std::ofstream& f, uint64_t& off)
+{/*{{{*/
+	std::string name = convey_xfer_basename(info.c_str());
+	size_t nul = info.find('\0');
+	uint64_t size = (std::string::npos != nul) ? strtoull(info.c_str() + nul + 1, nullptr, 10) : 0;
+	if (name.empty()) {
+		std::cerr << "convey: zmodem: no usable name in '" << info.c_str() << "', skipped" << std::endl;
+		return false;
+	}
+
+	std::string path = convey_xfer_path(x, name);
+	int64_t have = convey_xfer_file_size(path);
+	off = 0;
+	if (resume && have > 0 && size) {
+		if (static_cast<uint64_t>(have) >= size) {
+			std::cerr << "convey: " << name << " is complete already, skipped" << std::endl;
+			return false;
+		}
+		off = static_cast<uint64_t>(have);
+	}
+	f.open(path, off ? std::ios::binary | std::ios::in | std::ios::out : std::ios::binary | std::ios::trunc);
+	if (!f) {
+		std::cerr << "convey: can't write '" << path << "', skipped" << std::endl;
+		return false;
+	}
+	f.seekp(static_cast<std::streamoff>(off));
+	convey_xfer_begin(x, name, size, off);
+	return true;
+}/*}}}*/
+
+/* Receives files until the sender ends the session. Sets fallback when
+ * nothing answered, the sender may be a YMODEM or XMODEM program. */
+static bool convey_zmodem_recv(convey_xfer& x, bool& fallback)
+{/*{{{*/
+	const std::string rinit = convey_zm_hex_header(ZM_RINIT, static_cast<uint32_t>(ZM_CANFDX | ZM_CANOVIO | ZM_CANFC32) << 24);
+	std::ofstream f;
+	uint64_t off = 0;
+	bool heard = false;
+	int tries = 0;
+	std::string data;
+
+	fallback = false;
+	if (!convey_xfer_write(x, rinit)) {
+		return convey_zm_fail(x, "write failed");
+	}
+	while (true) {
+		convey_zm_header h;
+		/* Shorter while a YMODEM sender may wait for its C instead. */
+		int t = convey_zm_read_header(x, h, heard ? x.timeout_ms : x.timeout_ms / 3, false);
+		if (XFER_EOF == t) {
+			return convey_zm_fail(x, "the endpoint closed");
+		} else if (XFER_CANCEL == t) {
+			return convey_zm_fail(x, "cancelled by the sender");
+		} else if (XFER_TIMEOUT == t || XFER_BAD == t) {
+			if (!heard && XFER_TIMEOUT == t && ++tries >= 3) {
+				fallback = true;
+				return false;
+			}
+			if (heard && ++tries > XFER_RETRIES) {
+				return convey_zm_fail(x, "the sender went silent");
+			}
+			x.retransmits += f.is_open();
+			convey_xfer_write(x, f.is_open() ? convey_zm_hex_header(ZM_RPOS, static_cast<uint32_t>(off)) : rinit);
+			continue;
+		}
+		heard = true;
+		tries = 0;
+
+		switch (t) {
+		case ZM_RQINIT:
+			convey_xfer_write(x, rinit);
+			break;
+		case ZM_SINIT:
+			if (convey_zm_read_data(x, h.crc32, data) < 0) {
+				convey_xfer_write(x, convey_zm_hex_header(ZM_NAK, 0));
+				break;
+			}
+			convey_xfer_write(x, convey_zm_hex_header(ZM_ACK, 0));
+			break;
+		case ZM_FILE: {
+			if (convey_zm_read_data(x, h.crc32, data) < 0) {
+				convey_xfer_write(x, rinit);
+				break;
+			}
+			if (f.is_open()) {
+				f.close();
+			}
+			if (!convey_zm_open(x, data, ZM_CRESUM == (h.arg >> 24), f, off)) {
+				convey_xfer_write(x, convey_zm_hex_header(ZM_SKIP, 0));
+				break;
+			}
+			convey_xfer_write(x, convey_zm_hex_header(ZM_RPOS, static_cast<uint32_t>(off)));
+			break;
+		}
+		case ZM_DATA: {
+			if (!f.is_open()) {
+				convey_xfer_write(x, rinit);
+				break;
+			}
+			if (h.arg != static_cast<uint32_t>(off)) {
+				/* Data after a lost subpacket, the sender starts over. */
+				convey_xfer_write(x, convey_zm_hex_header(ZM_RPOS, static_cast<uint32_t>(off)));
+				break;
+			}
+			while (true) {
+				int end = convey_zm_read_data(x, h.crc32, data);
+				if (end < 0) {
+					if (XFER_CANCEL == end) {
+						return convey_zm_fail(x, "cancelled by the sender");
+					}
+					/* The rest of the frame is skipped as garbage. */
+					x.retransmits++;
+					convey_xfer_write(x, convey_zm_hex_header(ZM_RPOS, static_cast<uint32_t>(off)));
+					break;
+				}
+				if (!f.write(data.data(), data.size())) {
+					return convey_zm_fail(x, "can't write the file");
+				}
+				off += data.size();
+				convey_xfer_advance(x, data.size());
+				if (ZM_CRCW == end || ZM_CRCQ == end) {
+					convey_xfer_write(x, convey_zm_hex_header(ZM_ACK, static_cast<uint32_t>(off)));
+				}
+				if (ZM_CRCW == end || ZM_CRCE == end) {
+					break;
+				}
+			}
+			break;
+		}
+		case ZM_EOF:
+			/* One from before a resend, the data isn't all here. */
+			if (!f.is_open() || h.arg != static_cast<uint32_t>(off)) {
+				break;
+			}
+			f.close();
+			x.files++;
+			convey_xfer_show(x, true);
+			convey_xfer_write(x, rinit);
+			break;
+		case ZM_FIN:
+			convey_xfer_write(x, convey_zm_hex_header(ZM_FIN, 0));
+			/* Over and out, if the sender says so. */
+			for (int i = 0; i < 2 && 'O' == convey_xfer_getc(*x.link, 500); i++) {
+			}
+			return true;
+		case ZM_FERR:
+		case ZM_ABORT:
+		case ZM_CAN:
+			return convey_zm_fail(x, "aborted by the sender");
+		default:
+			break;
+		}
+	}
+}/*}}}*/
+
+/* Receiver flags from its ZRINIT. */
+struct convey_zm_peer {
+	bool crc32;
+	bool escctl;
+	uint32_t rxbuf;	/* stop and wait each this many bytes, 0 streams */
+};
+
+/* Waits out the ZRINIT of a receiver, or what it is when it isn't a
+ * ZMODEM one. */
+static int convey_zm_handshake(convey_xfer& x, convey_zm_peer& peer)
+{/*{{{*/
+	for (int tries = 0; tries < XFER_RETRIES; tries++) {
+		if (!convey_xfer_write(x, convey_zm_hex_header(ZM_RQINIT, 0))) {
+			return XFER_EOF;
+		}
+		while (true) {
+			convey_zm_header h;
+			int t = convey_zm_read_header(x, h, x.timeout_ms, true);
+			if (XFER_GOT_C == t || XFER_GOT_NAK == t || XFER_EOF == t || XFER_CANCEL == t) {
+				return t;
+			}
+			if (XFER_TIMEOUT == t) {
+				break;
+			}
+			if (ZM_RINIT == t) {
+				uint8_t flags = static_cast<uint8_t>(h.arg >> 24);
+				peer.crc32 = flags & ZM_CANFC32;
+				peer.escctl = flags & ZM_ESCCTL;
+				peer.rxbuf = h.arg & 0xffff;
+				if (!(flags & ZM_CANOVIO) && !peer.rxbuf) {
+					peer.rxbuf = ZM_BLOCK;
+				}
+				return ZM_RINIT;
+			}
+			if (ZM_CHALLENGE == t) {
+				convey_xfer_write(x, convey_zm_hex_header(ZM_ACK, h.arg));
+			}
+			/* Anything else, like our own ZRQINIT echoed by a shell,
+			 * waits for the receiver. */
+		}
+	}
+	return XFER_TIMEOUT;
+}/*}}}*/
+
+/* Sends a file from off on, until the receiver has all of it. */
+static bool convey_zm_stream(convey_xfer& x, const convey_zm_peer& peer, std::ifstream& f, uint64_t size, uint64_t off)
+{/*{{{*/
+	uint64_t first = off, acked = off, asked = off;
+	int waits = 0;
+	std::string out;
+	char buf[ZM_BLOCK];
+
+	bool restart = true;
+	while (true) {
+		if (restart) {
+			restart = false;
+			f.clear();
+			f.seekg(static_cast<std::streamoff>(off));
+			out += convey_zm_bin_header(ZM_DATA, static_cast<uint32_t>(off), peer.crc32, peer.escctl);
+		}
+
+		size_t n = static_cast<size_t>(std::min<uint64_t>(ZM_BLOCK, size - off));
+		if (n && !f.read(buf, n)) {
+			return convey_zm_fail(x, "can't read the file");
+		}
+		bool last = off + n >= size;
+		char end = ZM_CRCG;
+		if (last) {
+			end = ZM_CRCE;
+		} else if (peer.rxbuf && off + n - acked >= peer.rxbuf) {
+			end = ZM_CRCW;
+		} else if (off + n - asked >= ZM_WINDOW / 4) {
+			end = ZM_CRCQ;
+			asked = off + n;
+		}
+		convey_zm_subpacket(out, buf, n, end, peer.crc32, peer.escctl);
+		off += n;
+		if (last) {
+			out += convey_zm_bin_header(ZM_EOF, static_cast<uint32_t>(off), peer.crc32, peer.escctl);
+		}
+		if (!convey_xfer_write(x, out)) {
+			return convey_zm_fail(x, "write failed");
+		}
+		out.clear();
+		x.done = off;
+		convey_xfer_show(x, false);
+
+		/* Streaming, only look at what's there; at the end of the frame
+		 * or the window, wait for the receiver. */
+		bool wait = last || ZM_CRCW == end || off - acked >= ZM_WINDOW;
+		while (wait || convey_xfer_pending(*x.link)) {
+			convey_zm_header h;
+			int t = convey_zm_read_header(x, h, wait ? x.timeout_ms : 0, false);
+			if (XFER_EOF == t) {
+				return convey_zm_fail(x, "the endpoint closed");
+			} else if (XFER_CANCEL == t) {
+				return convey_zm_fail(x, "cancelled by the receiver");
+			} else if (XFER_TIMEOUT == t) {
+				if (!wait) {
+					break;
+				}
+				if (++waits > XFER_RETRIES) {
+					return convey_zm_fail(x, "the receiver went silent");
+				}
+				if (last) {
+					/* The ZEOF got lost, send it again. */
+					if (!convey_xfer_write(x, convey_zm_bin_header(ZM_EOF, static_cast<uint32_t>(off), peer.crc32, peer.escctl))) {
+						return convey_zm_fail(x, "write failed");
+					}
+					continue;
+				}
+				/* Go back to what's known to be there. */
+				h.type = ZM_RPOS;
+				h.arg = static_cast<uint32_t>(acked);
+				t = ZM_RPOS;
+			} else if (XFER_BAD == t) {
+				continue;
+			}
+			waits = 0;
+
+			if (ZM_ACK == t) {
+				acked = std::max<uint64_t>(acked, h.arg);
+				if (ZM_CRCW == end && acked >= off) {
+					restart = true;
+					break;
+				}
+				wait = last || ZM_CRCW == end || off - acked >= ZM_WINDOW;
+			} else if (ZM_RPOS == t) {
+				x.retransmits++;
+				if (!last && ZM_CRCW != end) {
+					/* End the frame in flight before the new one. */
+					convey_zm_subpacket(out, nullptr, 0, ZM_CRCE, peer.crc32, peer.escctl);
+				}
+				off = std::min<uint64_t>(h.arg, size);
+				acked = asked = off;
+				restart = true;
+				break;
+			} else if (ZM_RINIT == t && last) {
+				/* The file is complete, the receiver wants the next. */
+				x.files++;
+				x.bytes += size - first;
+				convey_xfer_show(x, true);
+				return true;
+			} else if (ZM_SKIP == t) {
+				convey_xfer_show(x, true);
+				return true;
+			} else if (ZM_FERR == t || ZM_ABORT == t || ZM_CAN == t) {
+				return convey_zm_fail(x, "aborted by the receiver");
+			}
+		}
+	}
+}/*}}}*/
+
+static bool convey_zm_send_file(convey_xfer& x, const convey_zm_peer& peer, const std::string& path)
+{/*{{{*/
+	std::ifstream f(path, std::ios::binary);
+	int64_t size = convey_xfer_file_size(path);
+	if (!f || size < 0) {
+		std::cerr << "convey: can't read '" << path << "'" << std::endl;
+		return false;
+	}
+	std::string name = convey_xfer_basename(path);
+	std::string info = name + '\0' + std::to_string(size) + " 0 0" + '\0';
+
+	for (int tries = 0; tries < XFER_RETRIES; tries++) {
+		std::string out = convey_zm_bin_header(ZM_FILE, static_cast<uint32_t>(ZM_CRESUM) << 24, peer.crc32, peer.escctl);
+		convey_zm_subpacket(out, info.data(), info.size(), ZM_CRCW, peer.crc32, peer.escctl);
+		if (!convey_xfer_write(x, out)) {
+			return convey_zm_fail(x, "write failed");
+		}
+		while (true) {
+			convey_zm_header h;
+			int t = convey_zm_read_header(x, h, x.timeout_ms, false);
+			if (XFER_EOF == t) {
+				return convey_zm_fail(x, "the endpoint closed");
+			} else if (XFER_CANCEL == t) {
+				return convey_zm_fail(x, "cancelled by the receiver");
+			} else if (XFER_TIMEOUT == t || ZM_NAK == t) {
+				/* Not a ZRINIT, that one may answer our ZRQINIT. */
+				break;
+			} else if (ZM_SKIP == t) {
+				std::cerr << "convey: " << name << " skipped by the receiver" << std::endl;
+				return true;
+			} else if (ZM_RPOS == t) {
+				convey_xfer_begin(x, name, static_cast<uint64_t>(size), h.arg);
+				return convey_zm_stream(x, peer, f, static_cast<uint64_t>(size), std::min<uint64_t>(h.arg, size));
+			} else if (ZM_CRC == t) {
+				/* The receiver compares what it has. */
+				std::string all((std::istreambuf_iterator<char>(f)), std::istreambuf_iterator<char>());
+				size_t n = h.arg ? std::min<size_t>(h.arg, all.size()) : all.size();
+				convey_xfer_write(x, convey_zm_hex_header(ZM_CRC, convey_crc32(0, all.data(), n)));
+				f.clear();
+			} else if (ZM_FERR == t || ZM_ABORT == t || ZM_CAN == t) {
+				return convey_zm_fail(x, "aborted by the receiver");
+			}
+		}
+	}
+	return convey_zm_fail(x, "the receiver didn't take the file");
+}/*}}}*/
+
+static void convey_zm_finish(convey_xfer& x)
+{/*{{{*/
+	for (int tries = 0; tries < 3; tries++) {
+		convey_xfer_write(x, convey_zm_hex_header(ZM_FIN, 0));
+		convey_zm_header h;
+		int t;
+		do {
+			t = convey_zm_read_header(x, h, x.timeout_ms, false);
+		} while (t >= 0 && ZM_FIN != t);
+		if (ZM_FIN == t) {
+			convey_xfer_write(x, "OO");
+			return;
+		}
+		if (XFER_TIMEOUT != t) {
+			return;
+		}
+	}
+}/*}}}*/
+
+/* Sends the files, or leaves the YMODEM or XMODEM start of a receiver
+ * in start. The rz is for a shell on the other end. */
+static bool convey_zmodem_send(convey_xfer& x, const std::vector<std::string>& files, int& start)
+{/*{{{*/
+	convey_zm_peer peer{false, false, 0};
+
+	start = 0;
+	if (!convey_xfer_write(x, "rz\r")) {
+		return convey_zm_fail(x, "write failed");
+	}
+	int t = convey_zm_handshake(x, peer);
+	if (XFER_GOT_C == t || XFER_GOT_NAK == t) {
+		start = (XFER_GOT_C == t) ? 'C' : XM_NAK;
+		return false;
+	} else if (ZM_RINIT != t) {
+		return convey_zm_fail(x, XFER_CANCEL == t ? "cancelled by the receiver" : "no receiver answered");
+	}
+
+	for (const std::string& path : files) {
+		if (!convey_zm_send_file(x, peer, path)) {
+			return false;
+		}
+	}
+	convey_zm_finish(x);
+	return true;
+}/*}}}*/
+
+static bool convey_xm_fail(convey_xfer& x, const char* why)
+{/*{{{*/
+	convey_xfer_write(x, std::string(3, XM_CAN));
+	std::cerr << std::endl << "convey: " << (convey_xfer_xmodem == x.proto ? "xmodem: " : "ymodem: ") << why << std::endl;
+	return false;
+}/*}}}*/
+
+/* A block of 128 or 1024 bytes, padded. */
+static std::string convey_xm_block(uint8_t seq, const char* buf, size_t n, size_t len, bool crc, char pad)
+{/*{{{*/
+	std::string out;
+	out += static_cast<char>(128 == len ? XM_SOH : XM_STX);
+	out += static_cast<char>(seq);
+	out += static_cast<char>(~seq);
+	size_t at = out.size();
+	out.append(buf, n);
+	out.append(len - n, pad);
+	if (crc) {
+		uint16_t c = convey_crc16(0, out.data() + at, len);
+		out += static_cast<char>(c >> 8);
+		out += static_cast<char>(c);
+	} else {
+		uint8_t sum = 0;
+		for (size_t i = at; i < at + len; i++) {
+			sum = static_cast<uint8_t>(sum + static_cast<uint8_t>(out[i]));
+		}
+		out += static_cast<char>(sum);
+	}
+	return out;
+}/*}}}*/
+
+/* Sends until the receiver acks. */
+static bool convey_xm_send_block(convey_xfer& x, const std::string& block)
+{/*{{{*/
+	for (int tries = 0; tries < XFER_RETRIES; tries++) {
+		if (tries) {
+			x.retransmits++;
+		}
+		if (!convey_xfer_write(x, block)) {
+			return convey_xm_fail(x, "write failed");
+		}
+		int c, cans = 0;
+		do {
+			c = convey_xfer_getc(*x.link, x.timeout_ms);
+			cans = (XM_CAN == c) ? cans + 1 : 0;
+		} while (c >= 0 && XM_ACK != c && XM_NAK != c && 'C' != c && cans < 2);
+		if (XM_ACK == c) {
+			return true;
+		}
+		if (cans >= 2) {
+			return convey_xm_fail(x, "cancelled by the receiver");
+		}
+		if (XFER_EOF == c) {
+			return convey_xm_fail(x, "the endpoint closed");
+		}
+	}
+	return convey_xm_fail(x, "too many errors");
+}/*}}}*/
+
+/* The C or NAK a receiver asks for blocks with, or XFER_CANCEL. */
+static int convey_xm_wait_start(convey_xfer& x)
+{/*{{{*/
+	int cans = 0;
+	for (int tries = 0; tries < XFER_RETRIES; tries++) {
+		int c;
+		while ((c = convey_xfer_getc(*x.link, x.timeout_ms)) >= 0) {
+			if ('C' == c || XM_NAK == c) {
+				return c;
+			}
+			cans = (XM_CAN == c) ? cans + 1 : 0;
+			if (cans >= 2) {
+				return XFER_CANCEL;
+			}
+		}
+		if (XFER_EOF == c) {
+			return c;
+		}
+	}
+	return XFER_TIMEOUT;
+}/*}}}*/
+
+/* YMODEM sends a header block ahead of each file and an empty one at the
+ * end, XMODEM just the data of one file. C asks for CRC-16 and 1024 byte
+ * blocks, NAK for a checksum and 128 bytes. YMODEM always asks with C, so
+ * a receiver that starts with NAK is a plain XMODEM one. An XMODEM-CRC or
+ * 1K receiver starts with C, too, and needs --xfer-protocol xmodem. */
+static bool convey_ymodem_send(convey_xfer& x, const std::vector<std::string>& files, int start)
+{/*{{{*/
+	bool ymodem = convey_xfer_xmodem != x.proto, first = true;
+
+	for (const std::string& path : files) {
+		std::ifstream f(path, std::ios::binary);
+		int64_t size = convey_xfer_file_size(path);
+		if (!f || size < 0) {
+			std::cerr << "convey: can't read '" << path << "'" << std::endl;
+			return convey_xm_fail(x, "no file to send");
+		}
+		if (!start) {
+			start = convey_xm_wait_start(x);
+		}
+		if ('C' != start && XM_NAK != start) {
+			return convey_xm_fail(x, XFER_TIMEOUT == start ? "no receiver answered" : "cancelled by the receiver");
+		}
+		bool crc = 'C' == start;
+		start = 0;
+		if (first && ymodem && !crc) {
+			x.proto = convey_xfer_xmodem;
+			ymodem = false;
+		}
+		if (first && !ymodem && files.size() > 1) {
+			std::cerr << "convey: xmodem takes one file, sending only '" << files[0] << "'" << std::endl;
+		}
+		first = false;
+
+		std::string name = convey_xfer_basename(path);
+		if (ymodem) {
+			std::string info = name + '\0' + std::to_string(size) + " 0 0";
+			if (!convey_xm_send_block(x, convey_xm_block(0, info.data(), info.size(), info.size() < 128 ? 128 : 1024, crc, 0))) {
+				return false;
+			}
+			int c = convey_xm_wait_start(x);
+			if ('C' != c && XM_NAK != c) {
+				return convey_xm_fail(x, "the receiver didn't ask for the data");
+			}
+		}
+
+		convey_xfer_begin(x, name, static_cast<uint64_t>(size), 0);
+		uint8_t seq = 1;
+		char buf[1024];
+		size_t len = crc ? 1024 : 128;
+		for (uint64_t off = 0; off < static_cast<uint64_t>(size); seq++) {
+			size_t n = static_cast<size_t>(std::min<uint64_t>(len, size - off));
+			if (!f.read(buf, n)) {
+				return convey_xm_fail(x, "can't read the file");
+			}
+			/* A short tail goes in a short block. */
+			size_t blen = (n <= 128) ? 128 : len;
+			if (!convey_xm_send_block(x, convey_xm_block(seq, buf, n, blen, crc, XM_SUB))) {
+				return false;
+			}
+			off += n;
+			convey_xfer_advance(x, n);
+		}
+		if (!convey_xm_send_block(x, std::string(1, XM_EOT))) {
+			return false;
+		}
+		x.files++;
+		convey_xfer_show(x, true);
+		if (!ymodem) {
+			return true;
+		}
+	}
+
+	int c = convey_xm_wait_start(x);
+	if ('C' != c && XM_NAK != c) {
+		return convey_xm_fail(x, "the receiver didn't ask for the end");
+	}
+	return convey_xm_send_block(x, convey_xm_block(0, nullptr, 0, 128, 'C' == c, 0));
+}/*}}}*/
+
+/* Reads a block after its SOH or STX, false when it's broken. */
+static bool convey_xm_read_block(convey_xfer& x, int head, bool crc, uint8_t& seq, std::string& data)
+{/*{{{*/
+	size_t len = (XM_SOH == head) ? 128 : 1024;
+	size_t n = 2 + len + (crc ? 2 : 1);
+	std::string b;
+	for (size_t i = 0; i < n; i++) {
+		int c = convey_xfer_getc(*x.link, x.timeout_ms);
+		if (c < 0) {
+			return false;
+		}
+		b += static_cast<char>(c);
+	}
+	seq = static_cast<uint8_t>(b[0]);
+	if (static_cast<uint8_t>(~b[1]) != seq) {
+		return false;
+	}
+	data.assign(b, 2, len);
+	if (crc) {
+		uint16_t want = static_cast<uint16_t>((static_cast<uint8_t>(b[2 + len]) << 8) | static_cast<uint8_t>(b[3 + len]));
+		return convey_crc16(0, data.data(), len) == want;
+	}
+	uint8_t sum = 0;
+	for (char c : data) {
+		sum = static_cast<uint8_t>(sum + static_cast<uint8_t>(c));
+	}
+	return sum == static_cast<uint8_t>(b[2 + len]);
+}/*}}}*/
+
+/* Receives YMODEM batches, or one XMODEM file when the first block is
+ * data. An XMODEM file has no name and keeps its padding. */
+static bool convey_ymodem_recv(convey_xfer& x)
+{/*{{{*/
+	std::ofstream f;
+	uint64_t size = 0, off = 0;
+	uint8_t expect = 0;
+	bool crc = true, header = true, started = false;
+	int errors = 0, polls = 0, cans = 0;
+	std::string data;
+
+	convey_xfer_write(x, "C");
+	while (true) {
+		int c = convey_xfer_getc(*x.link, x.timeout_ms);
+		if (XFER_EOF == c) {
+			return convey_xm_fail(x, "the endpoint closed");
+		}
+		if (XFER_TIMEOUT == c) {
+			if (!started) {
+				/* Three times C, then try the checksum. */
+				crc = ++polls < 3;
+				if (polls > XFER_RETRIES) {
+					return convey_xm_fail(x, "no sender answered");
+				}
+				convey_xfer_write(x, std::string(1, crc ? 'C' : XM_NAK));
+			} else {
+				if (++errors > XFER_RETRIES) {
+					return convey_xm_fail(x, "the sender went silent");
+				}
+				convey_xfer_write(x, std::string(1, header ? 'C' : XM_NAK));
+			}
+			continue;
+		}
+		cans = (XM_CAN == c) ? cans + 1 : 0;
+		if (cans >= 2) {
+			return convey_xm_fail(x, "cancelled by the sender");
+		}
+
+		if (XM_EOT == c && f.is_open()) {
+			convey_xfer_write(x, std::string(1, XM_ACK));
+			f.close();
+			x.files++;
+			convey_xfer_show(x, true);
+			if (convey_xfer_xmodem == x.proto) {
+				return true;
+			}
+			header = true;
+			expect = 0;
+			convey_xfer_write(x, "C");
+			continue;
+		}
+		if (XM_SOH != c && XM_STX != c) {
+			continue;
+		}
+
+		uint8_t seq;
+		if (!convey_xm_read_block(x, c, crc, seq, data)) {
+			x.retransmits++;
+			if (++errors > XFER_RETRIES) {
+				return convey_xm_fail(x, "too many errors");
+			}
+			convey_xfer_purge(*x.link, 50);
+			convey_xfer_write(x, std::string(1, XM_NAK));
+			continue;
+		}
+		errors = 0;
+
+		if (header && !started && 1 == seq) {
+			/* No header block, an XMODEM sender. */
+			x.proto = convey_xfer_xmodem;
+			std::string path = convey_xfer_path(x, "xmodem.bin");
+			f.open(path, std::ios::binary | std::ios::trunc);
+			if (!f) {
+				return convey_xm_fail(x, "can't write the file");
+			}
+			convey_xfer_begin(x, "xmodem.bin", 0, 0);
+			header = false;
+			expect = 1;
+			size = off = 0;
+		}
+		started = true;
+
+		if (header) {
+			if (0 != seq) {
+				continue;
+			}
+			convey_xfer_write(x, std::string(1, XM_ACK));
+			if (!data[0]) {
+				/* The empty header ends the batch. */
+				return true;
+			}
+			std::string name = convey_xfer_basename(data.c_str());
+			size = strtoull(data.c_str() + strlen(data.c_str()) + 1, nullptr, 10);
+			std::string path = convey_xfer_path(x, name.empty() ? "ymodem.bin" : name);
+			f.open(path, std::ios::binary | std::ios::trunc);
+			if (!f) {
+				return convey_xm_fail(x, "can't write the file");
+			}
+			convey_xfer_begin(x, name, size, 0);
+			header = false;
+			expect = 1;
+			off = 0;
+			convey_xfer_write(x, std::string(1, crc ? 'C' : XM_NAK));
+			continue;
+		}
+
+		if (seq == static_cast<uint8_t>(expect - 1)) {
+			/* Our ack got lost. */
+			convey_xfer_write(x, std::string(1, XM_ACK));
+			continue;
+		}
+		if (seq != expect) {
+			return convey_xm_fail(x, "blocks out of order");
+		}
+		size_t n = data.size();
+		if (size) {
+			n = static_cast<size_t>(std::min<uint64_t>(n, size - off));
+		}
+		if (!f.write(data.data(), n)) {
+			return convey_xm_fail(x, "can't write the file");
+		}
+		off += n;
+		expect++;
+		convey_xfer_advance(x, n);
+		convey_xfer_write(x, std::string(1, XM_ACK));
+	}
+}/*}}}*/
+
+static bool convey_xfer_send(convey_xfer& x, const std::vector<std::string>& files)
+{/*{{{*/
+	int start = 0;
+	if (convey_xfer_zmodem == x.proto) {
+		if (convey_zmodem_send(x, files, start)) {
+			return true;
+		}
+		if (!start) {
+			return false;
+		}
+		x.proto = convey_xfer_ymodem;
+	}
+	return convey_ymodem_send(x, files, start);
+}/*}}}*/
+
+static bool convey_xfer_recv(convey_xfer& x)
+{/*{{{*/
+	if (convey_xfer_zmodem == x.proto) {
+		bool fallback;
+		if (convey_zmodem_recv(x, fallback)) {
+			return true;
+		}
+		if (!fallback) {
+			return false;
+		}
+		x.proto = convey_xfer_ymodem;
+	}
+	return convey_ymodem_recv(x);
+}/*}}}*/
+
+/* --send-file and --recv-file move the bytes as they are, for a shell on
+ * the other end running cat or dd. The file is read in whole blocks and
+ * written in slices of 10 ms of line time, each slice no earlier than the
+ * line can have sent the ones before. A serial port buffers way more than
+ * its FIFO holds, but a virtual one or a USB adapter takes the data as
+ * fast as it comes and drops what the other UART can't take. */
+#define RAW_BLOCK (64 * 1024)
+#define RAW_SLICE_MS 10
+#define RAW_WAIT_MS 1000
+
+struct convey_raw_pace {
+	double rate;	/* bytes per second, 0 doesn't pace */
+	std::chrono::steady_clock::time_point start;
+	uint64_t sent;
+};
+
+/* The bytes a line moves per second, start, data, parity and stop bits. */
+static double convey_raw_rate(uint32_t baud, uint8_t byte_size, uint8_t parity, uint8_t stop_bits)
+{/*{{{*/
+	double bits = 1.0 + byte_size + (NOPARITY == parity ? 0 : 1)
+		+ (ONESTOPBIT == stop_bits ? 1.0 : ONE5STOPBITS == stop_bits ? 1.5 : 2.0);
+	return baud / bits;
+}/*}}}*/
+
+static size_t convey_raw_slice(const convey_raw_pace& p)
+{/*{{{*/
+	if (p.rate <= 0) {
+		return RAW_BLOCK;
+	}
+	size_t n = static_cast<size_t>(p.rate * RAW_SLICE_MS / 1000);
+	return std::min<size_t>(std::max<size_t>(n, 1), RAW_BLOCK);
+}/*}}}*/
+
+/* The time the line needs for what went out so far, from the start. */
+static std::chrono::steady_clock::time_point convey_raw_due(const convey_raw_pace& p)
+{/*{{{*/
+	auto us = std::chrono::microseconds(static_cast<int64_t>(p.sent * 1000000.0 / p.rate));
+	return p.start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(us);
+}/*}}}*/
+
+static bool convey_raw_send(convey_xfer& x, const std::string& path, double rate)
+{/*{{{*/
+	std::ifstream f(path, std::ios::binary);
+	int64_t size = convey_xfer_file_size(path);
+	if (!f || size < 0) {
+		std::cerr << "convey: can't read '" << path << "'" << std::endl;
+		return false;
+	}
+	convey_xfer_begin(x, convey_xfer_basename(path), static_cast<uint64_t>(size), 0);
+	convey_raw_pace p{rate, std::chrono::steady_clock::now(), 0};
+	size_t slice = convey_raw_slice(p);
+	std::vector<char> block(RAW_BLOCK);
+	while (f) {
+		f.read(block.data(), RAW_BLOCK);
+		size_t n = static_cast<size_t>(f.gcount());
+		for (size_t off = 0; off < n; off += slice) {
+			size_t len = std::min(slice, n - off);
+			if (p.rate > 0) {
+				std::this_thread::sleep_until(convey_raw_due(p));
+			}
+			if (!x.link->write(*x.link, block.data() + off, len)) {
+				return false;
+			}
+			p.sent += len;
+			convey_xfer_advance(x, len);
+		}
+	}
+	if (f.bad()) {
+		std::cerr << "convey: can't read '" << path << "'" << std::endl;
+		return false;
+	}
+	x.files++;
+	convey_xfer_show(x, true);
+	return true;
+}/*}}}*/
+
+/* Up to max bytes that arrived, their count, or XFER_TIMEOUT or XFER_EOF. */
+static int convey_xfer_take(convey_xfer_link& l, std::string& out, size_t max, int timeout_ms)
+{/*{{{*/
+	std::unique_lock<std::mutex> lk(l.lock);
+	if (l.pos == l.in.size() && !l.eof && timeout_ms > 0) {
+		l.cv.wait_for(lk, std::chrono::milliseconds(timeout_ms), [&l]() { return l.pos < l.in.size() || l.eof; });
+	}
+	if (l.pos < l.in.size()) {
+		size_t n = std::min(max, l.in.size() - l.pos);
+		out.assign(l.in, l.pos, n);
+		l.pos += n;
+		return static_cast<int>(n);
+	}
+	return l.eof ? XFER_EOF : XFER_TIMEOUT;
+}/*}}}*/
+
+/* Until the other end closes, or was silent for idle_ms when not 0. */
+static bool convey_raw_recv(convey_xfer& x, const std::string& path, int idle_ms)
+{/*{{{*/
+	std::ofstream f(path, std::ios::binary | std::ios::trunc);
+	if (!f) {
+		std::cerr << "convey: can't write '" << path << "'" << std::endl;
+		return false;
+	}
+	convey_xfer_begin(x, convey_xfer_basename(path), 0, 0);
+	std::string buf;
+	while (true) {
+		int n = convey_xfer_take(*x.link, buf, RAW_BLOCK, idle_ms ? idle_ms : RAW_WAIT_MS);
+		if (XFER_TIMEOUT == n && !idle_ms) {
+			continue;
+		}
+		if (n < 0) {
+			break;
+		}
+		/* Flushed, what came before an interrupt is on disk. */
+		f.write(buf.data(), n);
+		f.flush();
+		if (!f) {
+			std::cerr << "convey: can't write '" << path << "'" << std::endl;
+			return false;
+		}
+		convey_xfer_advance(x, n);
+	}
+	x.files++;
+	convey_xfer_show(x, true);
+	return true;
+}/*}}}*/
+
+#ifndef CONVEY_LIBRARY
+static convey_xfer_link xfer_link;
+
+static bool convey_xfer_write_endpoint(convey_xfer_link&, const char* buf, size_t n)
+{/*{{{*/
+	DWORD er{0};
+	while (n) {
+		DWORD bytes = static_cast<DWORD>(std::min<size_t>(n, BUF_SIZE));
+		convey_log_sent(buf, bytes);
+		if (!convey_write_pipe(epipe, buf, &bytes, e_pipe_w, er)) {
+			convey_error(er);
+			return false;
+		}
+		buf += bytes;
+		n -= bytes;
+	}
+	return true;
+}/*}}}*/
+
+/* A plain stream socket takes the file straight from the page cache,
+ * unless the log wants to see the bytes. false with handled unset when
+ * the system can't, the copying send takes over. */
+static bool convey_raw_send_zero_copy(convey_xfer& x, const std::string& path, bool& handled)
+{/*{{{*/
+	handled = false;
+	if (!convey_transport_is_socket() || convey_tp_rfc2217 == conf.transport || convey_tp_ws_server == conf.transport
+			|| convey_tp_udp_client == conf.transport || convey_tp_udp_server == conf.transport
+			|| INVALID_HANDLE_VALUE != log_handle || INVALID_HANDLE_VALUE != log_send_handle) {
+		return false;
+	}
+	int64_t size = convey_xfer_file_size(path);
+	if (size < 0) {
+		return false;
+	}
+#ifdef _WIN32
+	SOCKET s = reinterpret_cast<SOCKET>(epipe);
+	LPFN_TRANSMITFILE transmit = nullptr;
+	GUID id = WSAID_TRANSMITFILE;
+	DWORD ret = 0;
+	if (0 != WSAIoctl(s, SIO_GET_EXTENSION_FUNCTION_POINTER, &id, sizeof id, &transmit, sizeof transmit, &ret, nullptr, nullptr)) {
+		return false;
+	}
+	HANDLE fh = CreateFile(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+	if (INVALID_HANDLE_VALUE == fh) {
+		return false;
+	}
+	handled = true;
+	convey_xfer_begin(x, convey_xfer_basename(path), static_cast<uint64_t>(size), 0);
+	uint64_t off = 0;
+	while (off < static_cast<uint64_t>(size)) {
+		/* In pieces, for the progress. */
+		DWORD n = static_cast<DWORD>(std::min<uint64_t>(static_cast<uint64_t>(size) - off, 256 * RAW_BLOCK)), sent = 0, er;
+		OVERLAPPED ov;
+		memset(&ov, 0, sizeof ov);
+		ov.hEvent = e_pipe_w;
+		ov.Offset = static_cast<DWORD>(off);
+		ov.OffsetHigh = static_cast<DWORD>(off >> 32);
+		bool rc = transmit(s, fh, n, 0, &ov, nullptr, 0);
+		er = GetLastError();
+		rc = convey_get_ov_result(epipe, &ov, &sent, rc, er);
+		if (!rc || !sent) {
+			CloseHandle(fh);
+			if (!rc) {
+				convey_error(er);
+			}
+			return false;
+		}
+		off += sent;
+		convey_xfer_advance(x, sent);
+	}
+	CloseHandle(fh);
+#elif defined(__linux__)
+	int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		return false;
+	}
+	off_t off = 0;
+	DWORD er = 0;
+	while (off < size) {
+		if (!convey_poll(epipe, POLLOUT, e_pipe_w, er)) {
+			close(fd);
+			handled = true;
+			convey_error(er);
+			return false;
+		}
+		ssize_t n = sendfile(epipe, fd, &off, static_cast<size_t>(std::min<int64_t>(size - off, 256 * RAW_BLOCK)));
+		if (n < 0 && (EINTR == errno || EAGAIN == errno)) {
+			continue;
+		}
+		if (n < 0 && !handled && (EINVAL == errno || ENOSYS == errno)) {
+			close(fd);
+			return false;
+		}
+		if (!handled) {
+			handled = true;
+			convey_xfer_begin(x, convey_xfer_basename(path), static_cast<uint64_t>(size), 0);
+		}
+		if (n <= 0) {
+			er = n < 0 ? errno : 0;
+			close(fd);
+			if (er) {
+				convey_error(er);
+			}
+			return false;
+		}
+		convey_xfer_advance(x, static_cast<uint64_t>(n));
+	}
+	close(fd);
+	if (!handled) {
+		handled = true;
+		convey_xfer_begin(x, convey_xfer_basename(path), 0, 0);
+	}
+#else
+	return false;
+#endif
+	x.files++;
+	convey_xfer_show(x, true);
+	return true;
+}/*}}}*/
+
+/* What a serial line moves, the rest isn't paced. */
+static double convey_raw_endpoint_rate(void)
+{/*{{{*/
+	if (convey_tp_pipe == conf.transport || convey_tp_rfc2217 == conf.transport) {
+		return convey_raw_rate(conf.baud, conf.byte_size, conf.parity, conf.stop_bits);
+	}
+	return 0;
+}/*}}}*/
+
+static bool convey_raw_run(convey_xfer& x)
+{/*{{{*/
+	if (!conf.recv_file.empty()) {
+		return convey_raw_recv(x, conf.recv_file, static_cast<int>(conf.silence_timeout * 1000));
+	}
+	bool handled;
+	bool ok = convey_raw_send_zero_copy(x, conf.send_file, handled);
+	if (!handled) {
+		ok = convey_raw_send(x, conf.send_file, convey_raw_endpoint_rate());
+	}
+#ifndef _WIN32
+	/* Closing the line mustn't cut off what's still in the UART. */
+	if (ok && isatty(epipe)) {
+		tcdrain(epipe);
+	}
+#endif
+	return ok;
+}/*}}}*/
+
+/* Runs a transfer on the connected endpoint. */
+static int convey_xfer_run(void)
+{/*{{{*/
+	xfer_link.write = convey_xfer_write_endpoint;
+	/* Left blocked in its read when the transfer is over. */
+	std::thread([]() {
+		while (true) {
+			char buf[RECV_BUF_SIZE];
+			DWORD bytes{0}, er{0};
+			if (!convey_read_pipe(epipe, buf, &bytes, e_pipe_r, er) || convey_endpoint_eof(bytes)) {
+				convey_xfer_feed(xfer_link, nullptr, 0, true);
+				return;
+			}
+			convey_log_recv(buf, bytes);
+			/* An echo of a sent file isn't kept, it's as large as the file. */
+			if (conf.send_file.empty()) {
+				convey_xfer_feed(xfer_link, buf, bytes, false);
+			}
+		}
+	}).detach();
+
+	convey_xfer x{};
+	x.link = &xfer_link;
+	x.proto = conf.xfer_proto;
+	x.timeout_ms = 10000;
+	x.progress = true;
+	x.dir = conf.zrecv_dir;
+	bool ok;
+	if (!conf.send_file.empty() || !conf.recv_file.empty()) {
+		ok = convey_raw_run(x);
+	} else {
+		ok = conf.zsend_files.empty() ? convey_xfer_recv(x) : convey_xfer_send(x, conf.zsend_files);
+	}
+
+	if (conf.verbose) {
+		std::cerr << "convey: transfer, " << x.files << " files, " << x.bytes << " bytes, "
+			<< x.retransmits << " retransmits" << std::endl;
+	}
+	convey_shutdown();
+	return ok ? 0 : 1;
+}/*}}}*/
+#endif
+/* }}} */
+
+/* {{{ Compression */
+/* LZ4's sequences, a token with the literal count and the match length
+ * less four in its nibbles, a nibble of 15 continued in bytes up to 255,
+ * the literals and a two byte offset back to the match. The last one has
+ * no match. Only the format is kept, matches may run to the end.
+ *
+ * The window runs over the blocks, both ends keep what went through the
+ * last 64 KiB and matches reach back into it. A keystroke compresses to
+ * a few bytes this way and the line it echoes back into a match. */
+#define LZ_MIN_MATCH 4
+#define LZ_HISTORY 65536
+#define LZ_HASH_BITS 14
+
+struct convey_lz {
+	std::string hist;	/* the window */
+	uint32_t base;	/* the stream position of hist[0] */
+	std::vector<uint32_t> table;	/* hash to the position + 1 */
+};
+
+static void convey_lz_reset(convey_lz& z)
+{/*{{{*/
+	z.hist.clear();
+	z.base = 0;
+	z.table.assign(1 << LZ_HASH_BITS, 0);
+}/*}}}*/
+
+/* Keeps the window, not all that went through. */
+static void convey_lz_trim(convey_lz& z)
+{/*{{{*/
+	if (z.hist.size() > 2 * LZ_HISTORY) {
+		size_t n = z.hist.size() - LZ_HISTORY;
+		z.hist.erase(0, n);
+		z.base += static_cast<uint32_t>(n);
+	}
+}/*}}}*/
+
+static void convey_lz_len(std::string& out, size_t n)
+{/*{{{*/
+	for (n -= 15; n >= 255; n -= 255) {
+		out += static_cast<char>(255);
+	}
+	out += static_cast<char>(n);
+}/*}}}*/
+
+static void convey_lz_literals(std::string& out, const uint8_t* lit, size_t n, size_t match)
+{/*{{{*/
+	out += static_cast<char>(std::min<size_t>(n, 15) << 4 | std::min<size_t>(match, 15));
+	if (n >= 15) {
+		convey_lz_len(out, n);
+	}
+	out.append(reinterpret_cast<const char*>(lit), n);
+}/*}}}*/
+
+/* Greedy, the first match the hash finds is taken, the line is slower
+ * than any search for a better one would pay back. */
+static void convey_lz_compress(convey_lz& z, const char* in, size_t n, std::string& out)
+{/*{{{*/
+	size_t i = z.hist.size(), anchor = i;
+	z.hist.append(in, n);
+	const uint8_t* h = reinterpret_cast<const uint8_t*>(z.hist.data());
+	size_t end = z.hist.size();
+
+	while (i + LZ_MIN_MATCH <= end) {
+		uint32_t v;
+		memcpy(&v, h + i, sizeof v);
+		uint32_t slot = (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+		uint32_t cand = z.table[slot];
+		z.table[slot] = z.base + static_cast<uint32_t>(i) + 1;
+		size_t c = cand - 1 - z.base;
+		if (cand <= z.base || i - c > 0xffff || memcmp(h + c, h + i, LZ_MIN_MATCH)) {
+			i++;
+			continue;
+		}
+		size_t len = LZ_MIN_MATCH;
+		while (i + len < end && h[c + len] == h[i + len]) {
+			len++;
+		}
+		convey_lz_literals(out, h + anchor, i - anchor, len - LZ_MIN_MATCH);
+		out += static_cast<char>(i - c);
+		out += static_cast<char>((i - c) >> 8);
+		if (len - LZ_MIN_MATCH >= 15) {
+			convey_lz_len(out, len - LZ_MIN_MATCH);
+		}
+		i += len;
+		anchor = i;
+	}
+	convey_lz_literals(out, h + anchor, end - anchor, 0);
+	convey_lz_trim(z);
+}/*}}}*/
+
+static bool convey_lz_count(const uint8_t* in, size_t n, size_t& i, size_t& len)
+{/*{{{*/
+	uint8_t b;
+	do {
+		if (i >= n) {
+			return false;
+		}
+		b = in[i++];
+		len += b;
+	} while (255 == b);
+	return true;
+}/*}}}*/
+
+/* False on a block that doesn't decode, or to more than max. */
+static bool convey_lz_decompress(convey_lz& z, const char* buf, size_t n, std::string& out, size_t max)
+{/*{{{*/
+	const uint8_t* in = reinterpret_cast<const uint8_t*>(buf);
+	size_t start = z.hist.size(), i = 0;
+
+	while (i < n) {
+		uint8_t token = in[i++];
+		size_t lit = token >> 4;
+		if (15 == lit && !convey_lz_count(in, n, i, lit)) {
+			return false;
+		}
+		if (lit > n - i || z.hist.size() - start + lit > max) {
+			return false;
+		}
+		z.hist.append(buf + i, lit);
+		i += lit;
+		if (i == n) {
+			break;
+		}
+		if (n - i < 2) {
+			return false;
+		}
+		size_t off = in[i] | static_cast<size_t>(in[i + 1]) << 8;
+		i += 2;
+		size_t len = token & 15;
+		if (15 == len && !convey_lz_count(in, n, i, len)) {
+			return false;
+		}
+		len += LZ_MIN_MATCH;
+		if (!off || off > z.hist.size() || z.hist.size() - start + len > max) {
+			return false;
+		}
+		/* Byte by byte, the match may overlap what it adds. */
+		size_t from = z.hist.size() - off;
+		for (size_t k = 0; k < len; k++) {
+			z.hist += z.hist[from + k];
+		}
+	}
+	out.append(z.hist, start, std::string::npos);
+	convey_lz_trim(z);
+	return true;
+}/*}}}*/
+/* }}} */
+
+/* {{{ Channel multiplexer */
+/* --mux carries the channels over the endpoint to a convey at the other
+ * end doing the same, both listing them in the same order. A frame is
+ * the channel, its type, a position and the payload with a CRC-16, put
+ * between flags and escaped like HDLC, so a broken frame is dropped and
+ * the next flag starts over. There are no resends, the bytes of a broken
+ * data frame are lost and counted.
+ *
+ * Each direction of a channel runs at most a window ahead of what the
+ * other end handed on, the credit frames carry the position it reached.
+ * Positions instead of increments, a lost credit frame is made up by the
+ * next. Data frames are short and the writer takes the first channel with
+ * data and credit for each, so a keystroke waits for one frame of a bulk
+ * transfer at most. */
+#define MUX_FLAG 0x7e
+#define MUX_ESC 0x7d
+#define MUX_FRAME 256	/* payload of a data frame at most */
+#define MUX_WINDOW (16 * 1024)
+#define MUX_HEAD 6	/* channel, type, position */
+#define MUX_LINK 0xff	/* the channel of hellos */
+
+#define MUX_HELLO 'H'	/* the position is the instance, a new one resets */
+#define MUX_DATA 'D'	/* at the position in the stream */
+#define MUX_CREDIT 'C'	/* handed on up to the position */
+#define MUX_CLOSE 'X'	/* the local end closed */
+
+struct convey_mux_item {
+	uint8_t chan;
+	char type;
+	uint32_t pos;
+	std::string data;
+};
+
+struct convey_mux_parser {
+	std::string body;
+	bool in;	/* past a flag */
+	bool esc;
+};
+
+/* Data read from the local end, waiting for credit. */
+struct convey_mux_tx {
+	std::string q;
+	uint32_t sent;
+	uint32_t credit;
+};
+
+struct convey_mux_rx {
+	uint32_t pos;
+	uint64_t lost;
+};
+
+static void convey_mux_put(std::string& out, uint8_t c)
+{/*{{{*/
+	if (MUX_FLAG == c || MUX_ESC == c) {
+		out += static_cast<char>(MUX_ESC);
+		c ^= 0x20;
+	}
+	out += static_cast<char>(c);
+}/*}}}*/
+
+/* The body with its CRC-16, escaped between flags. */
+static void convey_mux_wrap(std::string& out, const std::string& body)
+{/*{{{*/
+	uint16_t crc = convey_crc16(0, body.data(), body.size());
+	out += static_cast<char>(MUX_FLAG);
+	for (char c : body) {
+		convey_mux_put(out, static_cast<uint8_t>(c));
+	}
+	convey_mux_put(out, static_cast<uint8_t>(crc >> 8));
+	convey_mux_put(out, static_cast<uint8_t>(crc));
+	out += static_cast<char>(MUX_FLAG);
+}/*}}}*/
+
+static void convey_mux_frame(std::string& out, uint8_t chan, char type, uint32_t pos, const char* data, size_t n)
+{/*{{{*/
+	std::string body;
+	body.reserve(MUX_HEAD + n);
+	body += static_cast<char>(chan);
+	body += type;
+	for (int i = 0; i < 4; i++) {
+		body += static_cast<char>(pos >> (8 * i));
+	}
+	body.append(data, n);
+	convey_mux_wrap(out, body);
+}/*}}}*/
+
+/* The bodies between flags with a good CRC, without it, the rest counts
+ * as bad. Bytes before the first flag are line noise, like the boot
+ * messages still in the UART. */
+static void convey_mux_bodies(convey_mux_parser& p, const char* buf, size_t n, size_t max, std::vector<std::string>& bodies, uint64_t& bad)
+{/*{{{*/
+	for (size_t i = 0; i < n; i++) {
+		uint8_t c = static_cast<uint8_t>(buf[i]);
+		if (MUX_FLAG == c) {
+			std::string& b = p.body;
+			if (b.size() > 2) {
+				uint16_t crc = static_cast<uint16_t>(static_cast<uint8_t>(b[b.size() - 2]) << 8 | static_cast<uint8_t>(b[b.size() - 1]));
+				if (crc == convey_crc16(0, b.data(), b.size() - 2)) {
+					b.resize(b.size() - 2);
+					bodies.push_back(std::move(b));
+				} else {
+					bad++;
+				}
+			} else if (!b.empty()) {
+				bad++;
+			}
+			p.body.clear();
+			p.in = true;
+			p.esc = false;
+		} else if (!p.in) {
+			continue;
+		} else if (MUX_ESC == c) {
+			p.esc = true;
+		} else {
+			p.body += static_cast<char>(p.esc ? c ^ 0x20 : c);
+			p.esc = false;
+			if (p.body.size() > max + 2) {
+				/* Two frames with the flag between lost, wait for the next. */
+				bad++;
+				p.body.clear();
+				p.in = false;
+			}
+		}
+	}
+}/*}}}*/
+
+static void convey_mux_parse(convey_mux_parser& p, const char* buf, size_t n, std::vector<convey_mux_item>& items)
+{/*{{{*/
+	std::vector<std::string> bodies;
+	uint64_t bad = 0;
+	convey_mux_bodies(p, buf, n, MUX_HEAD + MUX_FRAME, bodies, bad);
+	for (const std::string& b : bodies) {
+		if (b.size() < MUX_HEAD) {
+			bad++;
+			continue;
+		}
+		convey_mux_item it{static_cast<uint8_t>(b[0]), b[1], 0, b.substr(MUX_HEAD)};
+		for (int k = 0; k < 4; k++) {
+			it.pos |= static_cast<uint32_t>(static_cast<uint8_t>(b[2 + k])) << (8 * k);
+		}
+		items.push_back(std::move(it));
+		stats.mux_frames_in++;
+	}
+	stats.mux_bad += bad;
+}/*}}}*/
+
+/* What the channel may send before the other end hands more on. */
+static size_t convey_mux_room(const convey_mux_tx& t)
+{/*{{{*/
+	uint32_t used = t.sent - t.credit;
+	return used >= MUX_WINDOW ? 0 : MUX_WINDOW - used;
+}/*}}}*/
+
+/* The first channel with data and room, the order is the priority. */
+static int convey_mux_pick(const convey_mux_tx* tx, size_t n)
+{/*{{{*/
+	for (size_t i = 0; i < n; i++) {
+		if (!tx[i].q.empty() && convey_mux_room(tx[i])) {
+			return static_cast<int>(i);
+		}
+	}
+	return -1;
+}/*}}}*/
+
+/* A credit older than the last one, or past what was sent, is stale. */
+static void convey_mux_credit(convey_mux_tx& t, uint32_t pos)
+{/*{{{*/
+	if (static_cast<int32_t>(pos - t.credit) > 0 && static_cast<int32_t>(t.sent - pos) >= 0) {
+		t.credit = pos;
+	}
+}/*}}}*/
+
+/* A data frame at pos, a gap before it was a broken frame. */
+static void convey_mux_rx_data(convey_mux_rx& r, uint32_t pos, size_t n)
+{/*{{{*/
+	int32_t gap = static_cast<int32_t>(pos - r.pos);
+	if (gap > 0) {
+		r.lost += static_cast<uint32_t>(gap);
+		stats.mux_lost += static_cast<uint32_t>(gap);
+	}
+	r.pos = pos + static_cast<uint32_t>(n);
+}/*}}}*/
+
+/* With --compress the frames go in blocks, a flags byte and the frames
+ * compressed, with a CRC-16 between flags like a frame. A block that
+ * doesn't get smaller goes as it is, into the window all the same. After
+ * a broken block the receiving window is behind, what comes is dropped
+ * until a block starts the window over, which the receiver asks for. */
+#define MUX_Z_BLOCK (16 * 1024)	/* frames collected for a block at most */
+#define MUX_Z_SLICE_MS 50
+#define MUX_Z_PACKED 1
+#define MUX_Z_RESET 2	/* the window starts over */
+#define MUX_RESYNC 'R'	/* on the link channel, start the window over */
+
+struct convey_mux_zrx {
+	convey_mux_parser p;
+	convey_lz z;
+	bool synced;
+};
+
+/* What the link writer collects before it writes, it never waits for
+ * more. A paced line gets a single frame so the next pick is made as late
+ * as possible, compressed what goes out in a slice at the ratio of the
+ * last block, so a keystroke doesn't wait long behind a block either. */
+static size_t convey_mux_fill(double rate, bool compress, double ratio)
+{/*{{{*/
+	if (!compress) {
+		return rate > 0 ? 1 : BUF_SIZE;
+	}
+	if (rate <= 0) {
+		return MUX_Z_BLOCK;
+	}
+	double n = rate * MUX_Z_SLICE_MS / 1000 * ratio;
+	return static_cast<size_t>(std::max(1.0, std::min<double>(n, MUX_Z_BLOCK)));
+}/*}}}*/
+
+static void convey_mux_zblock(convey_lz& z, bool reset, const std::string& raw, std::string& out)
+{/*{{{*/
+	/* Before the positions in the table wrap around, too. */
+	if (reset || z.table.empty() || z.base > (1u << 30)) {
+		convey_lz_reset(z);
+		reset = true;
+	}
+	std::string body(1, static_cast<char>(reset ? MUX_Z_RESET : 0));
+	convey_lz_compress(z, raw.data(), raw.size(), body);
+	if (body.size() - 1 >= raw.size()) {
+		body.resize(1);
+		body += raw;
+	} else {
+		body[0] |= MUX_Z_PACKED;
+	}
+	size_t before = out.size();
+	convey_mux_wrap(out, body);
+	stats.lz_raw_out += raw.size();
+	stats.lz_wire_out += out.size() - before;
+}/*}}}*/
+
+/* The frames out of the blocks, false while the window is broken. A
+ * block is cut after the frame that fills it, so it may run over. */
+static bool convey_mux_zunblock(convey_mux_zrx& r, const char* buf, size_t n, std::string& out)
+{/*{{{*/
+	std::vector<std::string> bodies;
+	uint64_t bad = 0;
+	convey_mux_bodies(r.p, buf, n, 1 + 2 * MUX_Z_BLOCK, bodies, bad);
+	if (bad) {
+		stats.lz_bad += bad;
+		r.synced = false;
+	}
+	stats.lz_wire_in += n;
+	for (const std::string& b : bodies) {
+		uint8_t flags = static_cast<uint8_t>(b[0]);
+		if (flags & MUX_Z_RESET) {
+			convey_lz_reset(r.z);
+			r.synced = true;
+		}
+		if (!r.synced) {
+			continue;
+		}
+		size_t before = out.size();
+		if (flags & MUX_Z_PACKED) {
+			if (!convey_lz_decompress(r.z, b.data() + 1, b.size() - 1, out, 2 * MUX_Z_BLOCK)) {
+				stats.lz_bad++;
+				r.synced = false;
+				continue;
+			}
+		} else {
+			r.z.hist.append(b, 1, std::string::npos);
+			convey_lz_trim(r.z);
+			out.append(b, 1, std::string::npos);
+		}
+		stats.lz_raw_in += out.size() - before;
+	}
+	return r.synced;
+}/*}}}*/
+/* }}} */
+
+/* {{{ Session resume */
+/* --resume puts the stream between two convey instances in frames. The
+ * hello names the instance, the instance it talked to last and what came
+ * from that one so far. Data goes at its position in the stream, acks
+ * tell what was written out. What was sent stays in the replay buffer
+ * until it's acked, after a reconnect the hello of the other end says
+ * where to pick up. An instance the other end doesn't know starts its
+ * stream over, there's nothing to resume. */
+#define RESUME_MAGIC "CVYR"
+#define RESUME_HELLO 'H'
+#define RESUME_DATA 'D'
+#define RESUME_ACK 'A'
+#define RESUME_HELLO_LEN 29	/* type, magic, the two instances, position */
+#define RESUME_HEAD 11	/* type, position, length */
+#define RESUME_ACK_MS 250
+
+struct convey_resume {
+	std::mutex lock;
+	std::condition_variable cv;	/* the writer waits here */
+	uint64_t self;
+	uint64_t peer;	/* 0 while not known */
+	std::string replay;	/* sent and not acked, from acked on */
+	uint64_t acked;
+	uint64_t sent;
+	uint64_t received;	/* handed on to the output */
+	uint64_t ack_sent;
+	std::chrono::steady_clock::time_point ack_at;
+	std::string in;	/* a frame not complete yet */
+	bool hello;	/* the other end's came over this connection */
+	bool fresh;	/* the other end didn't know this instance */
+};
+
+/* Lives across the reconnects, unlike conf. */
+static convey_resume resume;
+
+static void convey_resume_put64(std::string& out, uint64_t v)
+{/*{{{*/
+	for (int i = 0; i < 8; i++) {
+		out += static_cast<char>(v >> (8 * i));
+	}
+}/*}}}*/
+
+static uint64_t convey_resume_get64(const char* p)
+{/*{{{*/
+	uint64_t v = 0;
+	for (int i = 0; i < 8; i++) {
+		v |= static_cast<uint64_t>(static_cast<uint8_t>(p[i])) << (8 * i);
+	}
+	return v;
+}/*}}}*/
+
+static void convey_resume_hello(std::string& out, uint64_t self, uint64_t peer, uint64_t received)
+{/*{{{*/
+	out += RESUME_HELLO;
+	out += RESUME_MAGIC;
+	convey_resume_put64(out, self);
+	convey_resume_put64(out, peer);
+	convey_resume_put64(out, received);
+}/*}}}*/
+
+static void convey_resume_data(std::string& out, uint64_t pos, const char* data, size_t n)
+{/*{{{*/
+	while (n) {
+		size_t k = std::min<size_t>(n, RESUME_FRAME);
+		out += RESUME_DATA;
+		convey_resume_put64(out, pos);
+		out += static_cast<char>(k);
+		out += static_cast<char>(k >> 8);
+		out.append(data, k);
+		data += k;
+		pos += k;
+		n -= k;
+	}
+}/*}}}*/
+
+static void convey_resume_ack(std::string& out, uint64_t pos)
+{/*{{{*/
+	out += RESUME_ACK;
+	convey_resume_put64(out, pos);
+}/*}}}*/
+
+/* The other end has all up to pos, that much leaves the replay buffer. */
+static bool convey_resume_acked_locked(convey_resume& r, uint64_t pos)
+{/*{{{*/
+	if (pos < r.acked || pos > r.sent) {
+		return false;
+	}
+	r.replay.erase(0, static_cast<size_t>(pos - r.acked));
+	r.acked = pos;
+	return true;
+}/*}}}*/
+
+static bool convey_resume_ack_due_locked(const convey_resume& r, size_t buffer, std::chrono::steady_clock::time_point now)
+{/*{{{*/
+	uint64_t ahead = r.received - r.ack_sent;
+	return ahead && (ahead >= buffer / 4 || now - r.ack_at >= std::chrono::milliseconds(RESUME_ACK_MS));
+}/*}}}*/
+
+/* Takes the frames out of what came, the data past what was handed on
+ * goes to data. False with err on what isn't a --resume stream, then only
+ * this connection is to blame, or with mismatch on positions the replay
+ * buffer and what came can't be brought together again. */
+static bool convey_resume_recv_locked(convey_resume& r, const char* buf, size_t n, std::string& data, std::string& err, bool& mismatch)
+{/*{{{*/
+	mismatch = false;
+	r.in.append(buf, n);
+	size_t i = 0;
+	while (i < r.in.size()) {
+		const char* f = r.in.data() + i;
+		size_t left = r.in.size() - i;
+		size_t len;
+		if (RESUME_HELLO == f[0]) {
+			len = RESUME_HELLO_LEN;
+		} else if (RESUME_DATA == f[0]) {
+			len = left < RESUME_HEAD ? RESUME_HEAD : RESUME_HEAD + (static_cast<uint8_t>(f[9]) | static_cast<size_t>(static_cast<uint8_t>(f[10])) << 8);
+		} else if (RESUME_ACK == f[0]) {
+			len = 9;
+		} else {
+			err = "the other end doesn't run with --resume";
+			return false;
+		}
+		if (left < len) {
+			break;
+		}
+		i += len;
+
+		if (RESUME_HELLO == f[0]) {
+			if (memcmp(f + 1, RESUME_MAGIC, 4)) {
+				err = "the other end doesn't run with --resume";
+				return false;
+			}
+			uint64_t id = convey_resume_get64(f + 5), known = convey_resume_get64(f + 13), pos = convey_resume_get64(f + 21);
+			if (id != r.peer) {
+				/* Its stream starts anew. */
+				r.peer = id;
+				r.received = r.ack_sent = 0;
+			}
+			r.fresh = known != r.self;
+			if (r.fresh) {
+				stats.resume_dropped += r.replay.size();
+				r.replay.clear();
+				r.acked = r.sent = 0;
+			} else if (!convey_resume_acked_locked(r, pos)) {
+				err = "the other end is at " + std::to_string(pos) + ", the replay buffer holds "
+					+ std::to_string(r.acked) + " to " + std::to_string(r.sent);
+				mismatch = true;
+				return false;
+			}
+			r.hello = true;
+		} else if (!r.hello) {
+			err = "the other end sent before its hello";
+			return false;
+		} else if (RESUME_ACK == f[0]) {
+			if (!convey_resume_acked_locked(r, convey_resume_get64(f + 1))) {
+				err = "an ack past what was sent";
+				mismatch = true;
+				return false;
+			}
+		} else {
+			uint64_t pos = convey_resume_get64(f + 1);
+			size_t k = len - RESUME_HEAD;
+			if (pos > r.received) {
+				err = "data at " + std::to_string(pos) + ", past the " + std::to_string(r.received) + " that came";
+				mismatch = true;
+				return false;
+			}
+			/* Whatever of it was handed on already isn't again. */
+			if (pos + k > r.received) {
+				size_t skip = static_cast<size_t>(r.received - pos);
+				data.append(f + RESUME_HEAD + skip, k - skip);
+				r.received = pos + k;
+			}
+		}
+	}
+	r.in.erase(0, i);
+	return true;
+}/*}}}*/
+/* }}} */
+
+#ifndef CONVEY_UNIT_TEST
+/* {{{ Multi-session server */
+/* --serve links many listen endpoints to their targets in one process.
+ * A session is its handles and two small buffers, a few workers move
+ * the data of all sessions, and a pool of opener threads makes the
+ * blocking connects. The pool grows while all of them are busy, so a
+ * slow target holds up only its own session. With
+ * --control, a further thread takes commands to add, remove and inspect
+ * sessions while the others keep running. */
+
+enum convey_serve_state {
+	convey_serve_listening,
+	convey_serve_opening,
+	convey_serve_linked,
+	convey_serve_closing
+};
+
+/* One direction of a session, filled by a read and drained by writes. */
+struct convey_serve_buf {
+	char data[BUF_SIZE];
+	DWORD len;
+	DWORD off;
+};
+
+#ifdef _WIN32
+enum convey_serve_op_kind {
+	convey_serve_op_accept,
+	convey_serve_op_opened,
+	convey_serve_op_client_read,
+	convey_serve_op_client_write,
+	convey_serve_op_ep_read,
+	convey_serve_op_ep_write,
+	convey_serve_ops
+};
+
+struct convey_serve_op {
+	OVERLAPPED ov;
+	convey_serve_op_kind kind;
+};
+#endif
+
+struct convey_serve_session {
+	convey_serve_spec spec;
+	std::atomic<convey_serve_state> state;
+	/* Set by the control thread, the owner of the session frees it. */
+	std::atomic<bool> removed{false};
+	std::atomic<uint64_t> clients{0};
+	std::atomic<uint64_t> up_bytes{0};
+	std::atomic<uint64_t> down_bytes{0};
+	std::mutex log_lock;
+	HANDLE log{INVALID_HANDLE_VALUE};
+	std::string log_path;
+	/* How the log shows the data, as --hex and --timestamps would. */
+	bool log_hex{false};
+	bool log_stamps{false};
+	size_t hex_offset[2]{0, 0};	/* down, up */
+	bool line_start[2]{true, true};
+	SOCKET lsock;
+	HANDLE client;
+	HANDLE ep;
+	DWORD open_err;
+	int family{AF_UNSPEC};	/* of the last connect, tried first */
+	convey_serve_buf up;	/* client to endpoint */
+	convey_serve_buf down;	/* endpoint to client */
+#ifdef _WIN32
+	/* Completions of one session may run on any worker. */
+	std::mutex lock;
+	convey_serve_op ops[convey_serve_ops];
+	int pending;
+	bool ep_serial;
+	SOCKET accept_sock;
+	LPFN_ACCEPTEX acceptex;
+	char accept_addrs[2 * (sizeof(struct sockaddr_storage) + 16)];
+#else
+	size_t shard;
+#endif
+};
+
+/* The list is guarded by serve_lock, each session by its owner. */
+static std::vector<std::unique_ptr<convey_serve_session>> serve_sessions;
+static std::mutex serve_lock;
+static std::condition_variable serve_changed;
+static std::atomic<bool> serve_stop{false};
+
+/* Opener threads at most, more targets than that being slow at once
+ * wait in the queue. */
+#define SERVE_OPENERS 16
+
+struct convey_serve_opener {
+	std::mutex lock;
+	std::condition_variable cv;
+	std::deque<convey_serve_session*> q;
+	size_t threads;
+	size_t idle;
+	bool stop;
+};
+
+/* Never freed, an opener stuck in a connect may still use it when the
+ * process exits. */
+static convey_serve_opener& serve_opener = *new convey_serve_opener();
+
+static void convey_serve_opened(convey_serve_session* s);
+static bool convey_serve_add(const convey_serve_spec& sp, std::string& err);
+static void convey_serve_detach(convey_serve_session* s);
+
+static bool convey_serve_client_is_socket(const convey_serve_session* s)
+{/*{{{*/
+	return convey_tp_pipe != s->spec.lts.kind;
+}/*}}}*/
+
+static bool convey_serve_ep_is_socket(const convey_serve_session* s)
+{/*{{{*/
+	return convey_tp_tcp_client == s->spec.ets.kind || convey_tp_unix_client == s->spec.ets.kind || convey_tp_vsock_client == s->spec.ets.kind;
+}/*}}}*/
+
+static void convey_serve_close(HANDLE& h, bool is_socket)
+{/*{{{*/
+	if (INVALID_HANDLE_VALUE == h) {
+		return;
+	}
+	if (is_socket) {
+		closesocket(reinterpret_cast<SOCKET>(h));
+	} else {
+		CloseHandle(h);
+	}
+	h = INVALID_HANDLE_VALUE;
+}/*}}}*/
+
+/* The family is the address family hint of the session. */
+static HANDLE convey_serve_open(const convey_serve_spec& sp, int& family, DWORD& err)
+{/*{{{*/
+	if (convey_tp_tcp_client == sp.ets.kind) {
+		SOCKET s = convey_tcp_connect(sp.ets.host, sp.ets.port, family, err);
+		return (INVALID_SOCKET == s) ? INVALID_HANDLE_VALUE : reinterpret_cast<HANDLE>(s);
+	}
+	if (convey_tp_unix_client == sp.ets.kind) {
+		SOCKET s = convey_unix_connect(sp.ets.path, err);
+		return (INVALID_SOCKET == s) ? INVALID_HANDLE_VALUE : reinterpret_cast<HANDLE>(s);
+	}
+	if (convey_tp_vsock_client == sp.ets.kind) {
+		SOCKET s = convey_vsock_connect(sp.ets.host, sp.ets.port, err);
+		return (INVALID_SOCKET == s) ? INVALID_HANDLE_VALUE : reinterpret_cast<HANDLE>(s);
+	}
+
+#ifdef _WIN32
+	HANDLE h = CreateFile(sp.endpoint.c_str(), GENERIC_READ | GENERIC_WRITE, 0, nullptr, OPEN_EXISTING, FILE_FLAG_OVERLAPPED, nullptr);
+#else
+	HANDLE h = open(sp.endpoint.c_str(), O_RDWR | O_NOCTTY | O_CLOEXEC);
+#endif
+	if (INVALID_HANDLE_VALUE == h) {
+		err = GetLastError();
+		return INVALID_HANDLE_VALUE;
+	}
+	if (convey_is_serial(h)) {
+		if (!convey_serial_setup(h)) {
+			CloseHandle(h);
+			err = ERROR_INVALID_PARAMETER;
+			return INVALID_HANDLE_VALUE;
+		}
+#ifdef _WIN32
+		/* Wait up to a second for the first byte instead of completing
+		 * empty at once, so an idle port doesn't keep a worker spinning. */
+		COMMTIMEOUTS timeouts = {0};
+		timeouts.ReadIntervalTimeout = MAXDWORD;
+		timeouts.ReadTotalTimeoutMultiplier = MAXDWORD;
+		timeouts.ReadTotalTimeoutConstant = 1000;
+		SetCommTimeouts(h, &timeouts);
+#endif
+	}
+
+	return h;
+}/*}}}*/
+
+/* An opener opens on a copy of the spec, and once stopped leaves the
+ * session alone, it may be gone by the time the open returns. */
+static void convey_serve_open_loop(void)
+{/*{{{*/
+	std::unique_lock<std::mutex> lk(serve_opener.lock);
+	while (true) {
+		serve_opener.idle++;
+		serve_opener.cv.wait(lk, []() { return serve_opener.stop || !serve_opener.q.empty(); });
+		serve_opener.idle--;
+		if (serve_opener.stop) {
+			break;
+		}
+		convey_serve_session* s = serve_opener.q.front();
+		serve_opener.q.pop_front();
+		convey_serve_spec sp = s->spec;
+		int family = s->family;
+		lk.unlock();
+
+		DWORD err = 0;
+		HANDLE h = convey_serve_open(sp, family, err);
+
+		lk.lock();
+		if (serve_opener.stop) {
+			convey_serve_close(h, convey_tp_tcp_client == sp.ets.kind || convey_tp_unix_client == sp.ets.kind
+				|| convey_tp_vsock_client == sp.ets.kind);
+			break;
+		}
+		s->ep = h;
+		s->open_err = err;
+		s->family = family;
+		convey_serve_opened(s);
+	}
+	serve_opener.threads--;
+}/*}}}*/
+
+static void convey_serve_open_async(convey_serve_session* s)
+{/*{{{*/
+	if (conf.verbose) {
+		std::cout << s->spec.listen << ": client connected, opening '" << s->spec.endpoint << "'" << std::endl;
+	}
+	s->clients++;
+	s->state = convey_serve_opening;
+	{
+		std::lock_guard<std::mutex> lk(serve_opener.lock);
+		serve_opener.q.push_back(s);
+		if (serve_opener.idle < serve_opener.q.size() && serve_opener.threads < SERVE_OPENERS) {
+			serve_opener.threads++;
+			std::thread(convey_serve_open_loop).detach();
+		}
+	}
+	serve_opener.cv.notify_one();
+}/*}}}*/
+
+/* Whether the endpoint could be opened, the session is linked then. */
+static bool convey_serve_link(convey_serve_session* s)
+{/*{{{*/
+	if (INVALID_HANDLE_VALUE == s->ep) {
+		std::cerr << "convey: " << s->spec.listen << ": can't open '" << s->spec.endpoint << "'" << std::endl;
+		convey_error(s->open_err);
+		return false;
+	}
+	s->up.len = s->up.off = 0;
+	s->down.len = s->down.off = 0;
+	s->state = convey_serve_linked;
+	if (conf.verbose) {
+		std::cout << s->spec.listen << ": linked to '" << s->spec.endpoint << "'" << std::endl;
+	}
+	return true;
+}/*}}}*/
+
+/* Count what was read on one side, and log it when asked to. */
+static void convey_serve_account(convey_serve_session* s, const char* buf, DWORD bytes, bool up)
+{/*{{{*/
+	(up ? s->up_bytes : s->down_bytes) += bytes;
+
+	std::lock_guard<std::mutex> lk(s->log_lock);
+	if (INVALID_HANDLE_VALUE == s->log) {
+		return;
+	}
+	if (!s->log_hex && !s->log_stamps) {
+		char rec[BUF_SIZE + 2];
+		convey_log_to(s->log, rec, convey_log_session_record(rec, buf, bytes, up));
+		return;
+	}
+	std::string hexbuf, tsbuf;
+	if (s->log_hex) {
+		convey_hexdump(buf, bytes, s->hex_offset[up], hexbuf);
+		buf = hexbuf.data();
+		bytes = static_cast<DWORD>(hexbuf.size());
+	}
+	if (s->log_stamps) {
+		convey_stamp_lines(buf, bytes, s->line_start[up], tsbuf);
+		buf = tsbuf.data();
+		bytes = static_cast<DWORD>(tsbuf.size());
+	}
+	std::string rec(bytes + 2, '\0');
+	convey_log_to(s->log, &rec[0], convey_log_session_record(&rec[0], buf, bytes, up));
+}/*}}}*/
+
+static SOCKET convey_serve_listen_socket(const convey_serve_spec& sp, DWORD& err)
+{/*{{{*/
+	if (convey_tp_tcp_server == sp.lts.kind) {
+		return convey_tcp_listen(sp.lts.port, err);
+	}
+	if (convey_tp_unix_server == sp.lts.kind) {
+		return convey_unix_listen(sp.lts.path, err);
+	}
+	if (convey_tp_vsock_server == sp.lts.kind) {
+		return convey_vsock_listen(sp.lts.port, err);
+	}
+	return INVALID_SOCKET;
+}/*}}}*/
+
+/* The idle openers go, one in an open isn't waited for, it drops what it
+ * opened once the open returns. */
+static void convey_serve_opener_stop(void)
+{/*{{{*/
+	std::lock_guard<std::mutex> lk(serve_opener.lock);
+	serve_opener.stop = true;
+	serve_opener.q.clear();
+	serve_opener.cv.notify_all();
+}/*}}}*/
+
+static void convey_serve_release(convey_serve_session* s)
+{/*{{{*/
+	convey_serve_close(s->ep, convey_serve_ep_is_socket(s));
+	convey_serve_close(s->client, convey_serve_client_is_socket(s));
+#ifdef _WIN32
+	if (INVALID_SOCKET != s->accept_sock) {
+		closesocket(s->accept_sock);
+		s->accept_sock = INVALID_SOCKET;
+	}
+#endif
+	if (INVALID_SOCKET != s->lsock) {
+		closesocket(s->lsock);
+		s->lsock = INVALID_SOCKET;
+		if (convey_tp_unix_server == s->spec.lts.kind) {
+			DeleteFileA(s->spec.lts.path.c_str());
+		}
+	}
+	convey_serve_close(s->log, false);
+}/*}}}*/
+
+/* Drop a removed session once nothing refers to it anymore. */
+static void convey_serve_forget(convey_serve_session* s)
+{/*{{{*/
+	if (conf.verbose) {
+		std::cout << s->spec.listen << ": removed" << std::endl;
+	}
+	convey_serve_release(s);
+	std::lock_guard<std::mutex> lk(serve_lock);
+	for (auto it = serve_sessions.begin(); it != serve_sessions.end(); ++it) {
+		if (it->get() == s) {
+			serve_sessions.erase(it);
+			break;
+		}
+	}
+	serve_changed.notify_all();
+}/*}}}*/
+
+static void convey_serve_cleanup(void)
+{/*{{{*/
+	for (auto& sp : serve_sessions) {
+		convey_serve_release(sp.get());
+	}
+	serve_sessions.clear();
+}/*}}}*/
+
+/* The caller holds serve_lock. */
+static convey_serve_session* convey_serve_find(const std::string& listen)
+{/*{{{*/
+	for (auto& sp : serve_sessions) {
+		if (convey_same_path(sp->spec.listen, listen)) {
+			return sp.get();
+		}
+	}
+	return nullptr;
+}/*}}}*/
+
+static const char* convey_serve_state_name(convey_serve_state st)
+{/*{{{*/
+	switch (st) {
+	case convey_serve_listening:
+		return "listening";
+	case convey_serve_opening:
+		return "opening";
+	case convey_serve_linked:
+		return "linked";
+	case convey_serve_closing:
+		return "closing";
+	}
+	return "unknown";
+}/*}}}*/
+
+static bool convey_serve_remove(const std::string& listen, std::string& err)
+{/*{{{*/
+	std::unique_lock<std::mutex> lk(serve_lock);
+	convey_serve_session* s = convey_serve_find(listen);
+	if (!s || s->removed) {
+		err = "no session '" + listen + "'";
+		return false;
+	}
+	convey_serve_detach(s);
+	/* Wait for the owner, so the listener can be added again right away. */
+	if (!serve_changed.wait_for(lk, std::chrono::seconds(5), [&]() { return convey_serve_find(listen) != s; })) {
+		err = "'" + listen + "' is still shutting down";
+		return false;
+	}
+	return true;
+}/*}}}*/
+
+static bool convey_serve_set_log(const std::string& listen, const std::string& path, std::string& err)
+{/*{{{*/
+	std::lock_guard<std::mutex> lk(serve_lock);
+	convey_serve_session* s = convey_serve_find(listen);
+	if (!s || s->removed) {
+		err = "no session '" + listen + "'";
+		return false;
+	}
+
+	HANDLE h = INVALID_HANDLE_VALUE;
+	if ("off" != path && !convey_open_log(path, h)) {
+		err = "can't open '" + path + "'";
+		return false;
+	}
+	std::lock_guard<std::mutex> llk(s->log_lock);
+	convey_serve_close(s->log, false);
+	s->log = h;
+	s->log_path = ("off" == path) ? std::string() : path;
+	return true;
+}/*}}}*/
+
+/* hex or timestamps, on or off, for the log of a session. */
+static bool convey_serve_set_format(const std::string& listen, const std::string& what, const std::string& onoff, std::string& err)
+{/*{{{*/
+	if ("on" != onoff && "off" != onoff) {
+		err = "expected " + what + " <listen> on|off";
+		return false;
+	}
+	std::lock_guard<std::mutex> lk(serve_lock);
+	convey_serve_session* s = convey_serve_find(listen);
+	if (!s || s->removed) {
+		err = "no session '" + listen + "'";
+		return false;
+	}
+	std::lock_guard<std::mutex> llk(s->log_lock);
+	("hex" == what ? s->log_hex : s->log_stamps) = "on" == onoff;
+	return true;
+}/*}}}*/
+
+/* Run one line of the control protocol. The reply ends with "ok" or an
+ * "error" line, false is returned when the client said goodbye. */
+static bool convey_serve_command(const std::string& line, std::string& reply)
+{/*{{{*/
+	std::istringstream ls(line);
+	std::string cmd, a, b, extra, err;
+	ls >> cmd >> a >> b >> extra;
+	bool ok = true;
+
+	if (cmd.empty()) {
+		return true;
+	} else if ("quit" == cmd) {
+		return false;
+	} else if ("list" == cmd && a.empty()) {
+		std::lock_guard<std::mutex> lk(serve_lock);
+		for (auto& sp : serve_sessions) {
+			convey_serve_session* s = sp.get();
+			std::lock_guard<std::mutex> llk(s->log_lock);
+			reply += s->spec.listen + " " + s->spec.endpoint + " " + convey_serve_state_name(s->state)
+				+ " clients=" + std::to_string(s->clients) + " up=" + std::to_string(s->up_bytes)
+				+ " down=" + std::to_string(s->down_bytes)
+				+ (s->log_path.empty() ? std::string() : " log=" + s->log_path)
+				+ (s->log_hex ? " hex" : "") + (s->log_stamps ? " timestamps" : "") + "\n";
+		}
+	} else if ("stats" == cmd && a.empty()) {
+		uint64_t linked = 0, clients = 0, up = 0, down = 0;
+		std::lock_guard<std::mutex> lk(serve_lock);
+		for (auto& sp : serve_sessions) {
+			linked += convey_serve_linked == sp->state;
+			clients += sp->clients;
+			up += sp->up_bytes;
+			down += sp->down_bytes;
+		}
+		reply += "sessions=" + std::to_string(serve_sessions.size()) + " linked=" + std::to_string(linked)
+			+ " clients=" + std::to_string(clients) + " up=" + std::to_string(up)
+			+ " down=" + std::to_string(down) + "\n";
+	} else if ("add" == cmd && !b.empty() && extra.empty()) {
+		convey_serve_spec sp;
+		sp.listen = a;
+		sp.endpoint = b;
+		ok = convey_serve_check(sp, err);
+		if (ok) {
+			std::lock_guard<std::mutex> lk(serve_lock);
+			if (convey_serve_find(sp.listen)) {
+				err = "'" + sp.listen + "' is in use";
+				ok = false;
+			}
+		}
+		ok = ok && convey_serve_add(sp, err);
+	} else if ("remove" == cmd && !a.empty() && b.empty()) {
+		ok = convey_serve_remove(a, err);
+	} else if ("log" == cmd && !b.empty() && extra.empty()) {
+		ok = convey_serve_set_log(a, b, err);
+	} else if (("hex" == cmd || "timestamps" == cmd) && !b.empty() && extra.empty()) {
+		ok = convey_serve_set_format(a, cmd, b, err);
+	} else {
+		err = "expected add <listen> <endpoint>, remove <listen>, log <listen> <file>|off, hex <listen> on|off, "
+			"timestamps <listen> on|off, list, stats or quit";
+		ok = false;
+	}
+
+	reply += ok ? "ok\n" : "error " + err + "\n";
+	return true;
+}/*}}}*/
+
+/* Split what the control client sent into lines and run them. */
+static bool convey_serve_control_feed(std::string& in, const char* buf, size_t bytes, std::string& reply)
+{/*{{{*/
+	in.append(buf, bytes);
+	size_t eol;
+	while (std::string::npos != (eol = in.find('\n'))) {
+		std::string line = in.substr(0, eol);
+		in.erase(0, eol + 1);
+		if (!line.empty() && '\r' == line.back()) {
+			line.pop_back();
+		}
+		if (!convey_serve_command(line, reply)) {
+			return false;
+		}
+	}
+	if (in.size() > BUF_SIZE) {
+		in.clear();
+		reply += "error line too long\n";
+	}
+	return true;
+}/*}}}*/
+
+#ifdef _WIN32
+static HANDLE serve_port{nullptr};
+
+static void convey_serve_listen(convey_serve_session* s);
+
+/* Start an overlapped read or write on one side, the completion goes to
+ * the port. False when it couldn't even start. */
+static bool convey_serve_io(convey_serve_session* s, convey_serve_op_kind kind)
+{/*{{{*/
+	bool client_side = convey_serve_op_client_read == kind || convey_serve_op_client_write == kind;
+	bool is_write = convey_serve_op_client_write == kind || convey_serve_op_ep_write == kind;
+	HANDLE h = client_side ? s->client : s->ep;
+	bool is_socket = client_side ? convey_serve_client_is_socket(s) : convey_serve_ep_is_socket(s);
+	/* Writes to a side carry what was read from the other one. */
+	convey_serve_buf& b = (client_side == is_write) ? s->down : s->up;
+	convey_serve_op& op = s->ops[kind];
+	memset(&op.ov, 0, sizeof op.ov);
+
+	bool ok;
+	DWORD er;
+	if (is_socket) {
+		WSABUF wb;
+		DWORD flags = 0;
+		wb.buf = is_write ? b.data + b.off : b.data;
+		wb.len = is_write ? b.len - b.off : sizeof b.data;
+		int rc = is_write
+			? WSASend(reinterpret_cast<SOCKET>(h), &wb, 1, nullptr, 0, &op.ov, nullptr)
+			: WSARecv(reinterpret_cast<SOCKET>(h), &wb, 1, nullptr, &flags, &op.ov, nullptr);
+		ok = 0 == rc;
+		er = ok ? 0 : WSAGetLastError();
+	} else {
+		ok = is_write
+			? WriteFile(h, b.data + b.off, b.len - b.off, nullptr, &op.ov)
+			: ReadFile(h, b.data, sizeof b.data, nullptr, &op.ov);
+		er = ok ? 0 : GetLastError();
+	}
+	if (!ok && ERROR_IO_PENDING != er) {
+		return false;
+	}
+
+	/* A synchronous success still queues its completion. */
+	s->pending++;
+	return true;
+}/*}}}*/
+
+static void convey_serve_reset(convey_serve_session* s)
+{/*{{{*/
+	convey_serve_close(s->ep, convey_serve_ep_is_socket(s));
+	if (s->removed) {
+		/* The worker forgets it, closing the rest. */
+		return;
+	}
+	if (convey_serve_client_is_socket(s)) {
+		convey_serve_close(s->client, true);
+	} else if (INVALID_HANDLE_VALUE != s->client) {
+		/* The pipe instance is kept for the next client. */
+		DisconnectNamedPipe(s->client);
+	}
+	convey_serve_listen(s);
+}/*}}}*/
+
+/* Cancel what's in flight, the session starts over once all of it completed. */
+static void convey_serve_unlink(convey_serve_session* s, const char* why)
+{/*{{{*/
+	if (conf.verbose) {
+		std::cout << s->spec.listen << ": " << why << std::endl;
+	}
+	s->state = convey_serve_closing;
+	if (INVALID_HANDLE_VALUE != s->client) {
+		CancelIoEx(s->client, nullptr);
+	}
+	if (INVALID_HANDLE_VALUE != s->ep) {
+		CancelIoEx(s->ep, nullptr);
+	}
+	if (0 == s->pending) {
+		convey_serve_reset(s);
+	}
+}/*}}}*/
+
+static void convey_serve_listen(convey_serve_session* s)
+{/*{{{*/
+	s->state = convey_serve_listening;
+	convey_serve_op& op = s->ops[convey_serve_op_accept];
+	memset(&op.ov, 0, sizeof op.ov);
+
+	if (!convey_serve_client_is_socket(s)) {
+		if (INVALID_HANDLE_VALUE == s->client) {
+			s->client = CreateNamedPipe(s->spec.listen.c_str(),
+				PIPE_ACCESS_DUPLEX | FILE_FLAG_OVERLAPPED,
+				PIPE_TYPE_BYTE | PIPE_READMODE_BYTE | PIPE_WAIT,
+				1, BUF_SIZE, BUF_SIZE, 0, nullptr);
+			if (INVALID_HANDLE_VALUE == s->client
+					|| !CreateIoCompletionPort(s->client, serve_port, reinterpret_cast<ULONG_PTR>(s), 0)) {
+				std::cerr << "convey: " << s->spec.listen << ": can't create the pipe" << std::endl;
+				convey_error();
+				return;
+			}
+		}
+		if (!ConnectNamedPipe(s->client, &op.ov)) {
+			DWORD er = GetLastError();
+			if (ERROR_PIPE_CONNECTED == er) {
+				/* Connected before the call, nothing gets queued for it. */
+				PostQueuedCompletionStatus(serve_port, 0, reinterpret_cast<ULONG_PTR>(s), &op.ov);
+			} else if (ERROR_IO_PENDING != er) {
+				std::cerr << "convey: " << s->spec.listen << ": can't wait for a client" << std::endl;
+				convey_error(er);
+				return;
+			}
+		}
+		s->pending++;
+		return;
+	}
+
+	int family = AF_INET6, proto = IPPROTO_TCP;
+	if (convey_tp_unix_server == s->spec.lts.kind) {
+		family = AF_UNIX;
+		proto = 0;
+	} else if (convey_tp_vsock_server == s->spec.lts.kind) {
+		family = AF_HYPERV;
+		proto = HV_PROTOCOL_RAW;
+	}
+	s->accept_sock = convey_socket(family, SOCK_STREAM, proto);
+	DWORD got = 0;
+	if (INVALID_SOCKET == s->accept_sock
+			|| (!s->acceptex(s->lsock, s->accept_sock, s->accept_addrs, 0,
+				sizeof(struct sockaddr_storage) + 16, sizeof(struct sockaddr_storage) + 16, &got, &op.ov)
+				&& WSA_IO_PENDING != WSAGetLastError())) {
+		std::cerr << "convey: " << s->spec.listen << ": can't accept" << std::endl;
+		convey_error(WSAGetLastError());
+		if (INVALID_SOCKET != s->accept_sock) {
+			closesocket(s->accept_sock);
+			s->accept_sock = INVALID_SOCKET;
+		}
+		return;
+	}
+	s->pending++;
+}/*}}}*/
+
+static void convey_serve_opened(convey_serve_session* s)
+{/*{{{*/
+	PostQueuedCompletionStatus(serve_port, 0, reinterpret_cast<ULONG_PTR>(s), &s->ops[convey_serve_op_opened].ov);
+}/*}}}*/
+
+static void convey_serve_complete(convey_serve_session* s, convey_serve_op_kind kind, bool ok, DWORD bytes)
+{/*{{{*/
+	s->pending--;
+	if (convey_serve_closing == s->state || s->removed) {
+		if (convey_serve_op_opened == kind) {
+			convey_serve_close(s->ep, convey_serve_ep_is_socket(s));
+		}
+		if (0 == s->pending) {
+			convey_serve_reset(s);
+		}
+		return;
+	}
+
+	switch (kind) {
+	case convey_serve_op_accept:
+		if (!ok) {
+			if (INVALID_SOCKET != s->accept_sock) {
+				closesocket(s->accept_sock);
+				s->accept_sock = INVALID_SOCKET;
+			} else {
+				DisconnectNamedPipe(s->client);
+			}
+			convey_serve_listen(s);
+			break;
+		}
+		if (convey_serve_client_is_socket(s)) {
+			setsockopt(s->accept_sock, SOL_SOCKET, SO_UPDATE_ACCEPT_CONTEXT, reinterpret_cast<const char *>(&s->lsock), sizeof s->lsock);
+			if (convey_tp_tcp_server == s->spec.lts.kind) {
+				convey_tcp_tune(s->accept_sock, convey_tcp_opts_conf());
+			}
+			s->client = reinterpret_cast<HANDLE>(s->accept_sock);
+			s->accept_sock = INVALID_SOCKET;
+			CreateIoCompletionPort(s->client, serve_port, reinterpret_cast<ULONG_PTR>(s), 0);
+		}
+		/* The opened notification counts as in flight, too. */
+		s->pending++;
+		convey_serve_open_async(s);
+		break;
+
+	case convey_serve_op_opened:
+		if (!convey_serve_link(s)) {
+			convey_serve_unlink(s, "closed");
+			break;
+		}
+		CreateIoCompletionPort(s->ep, serve_port, reinterpret_cast<ULONG_PTR>(s), 0);
+		s->ep_serial = !convey_serve_ep_is_socket(s) && convey_is_serial(s->ep);
+		if (!convey_serve_io(s, convey_serve_op_client_read) || !convey_serve_io(s, convey_serve_op_ep_read)) {
+			convey_serve_unlink(s, "I/O failed");
+		}
+		break;
+
+	case convey_serve_op_client_read:
+	case convey_serve_op_ep_read: {
+		bool from_client = convey_serve_op_client_read == kind;
+		if (!ok || (0 == bytes && (from_client || !s->ep_serial))) {
+			convey_serve_unlink(s, from_client ? "client closed" : "endpoint closed");
+			break;
+		}
+		convey_serve_buf& b = from_client ? s->up : s->down;
+		b.len = bytes;
+		b.off = 0;
+		convey_serve_account(s, b.data, bytes, from_client);
+		/* An idle serial port completes empty, just read again. */
+		convey_serve_op_kind next = !bytes ? kind
+			: (from_client ? convey_serve_op_ep_write : convey_serve_op_client_write);
+		if (!convey_serve_io(s, next)) {
+			convey_serve_unlink(s, "I/O failed");
+		}
+		break;
+	}
+
+	case convey_serve_op_client_write:
+	case convey_serve_op_ep_write: {
+		bool to_client = convey_serve_op_client_write == kind;
+		if (!ok || !bytes) {
+			convey_serve_unlink(s, to_client ? "client closed" : "endpoint closed");
+			break;
+		}
+		convey_serve_buf& b = to_client ? s->down : s->up;
+		b.off += bytes;
+		convey_serve_op_kind next = (b.off < b.len) ? kind
+			: (to_client ? convey_serve_op_ep_read : convey_serve_op_client_read);
+		if (!convey_serve_io(s, next)) {
+			convey_serve_unlink(s, "I/O failed");
+		}
+		break;
+	}
+
+	default:
+		break;
+	}
+}/*}}}*/
+
+static void convey_serve_worker(void)
+{/*{{{*/
+	while (true) {
+		DWORD bytes = 0;
+		ULONG_PTR key = 0;
+		OVERLAPPED* ov = nullptr;
+		bool ok = GetQueuedCompletionStatus(serve_port, &bytes, &key, &ov, INFINITE);
+		if (!key || !ov) {
+			/* The stop notification, or the port is gone. */
+			return;
+		}
+		convey_serve_session* s = reinterpret_cast<convey_serve_session*>(key);
+		convey_serve_op* op = CONTAINING_RECORD(ov, convey_serve_op, ov);
+		bool gone;
+		{
+			std::lock_guard<std::mutex> lk(s->lock);
+			convey_serve_complete(s, op->kind, ok, bytes);
+			gone = s->removed && 0 == s->pending;
+		}
+		if (gone) {
+			convey_serve_forget(s);
+		}
+	}
+}/*}}}*/
+
+/* Cancel everything of a session, the last completion forgets it. The
+ * caller holds serve_lock. */
+static void convey_serve_detach(convey_serve_session* s)
+{/*{{{*/
+	bool gone;
+	{
+		std::lock_guard<std::mutex> lk(s->lock);
+		s->removed = true;
+		if (INVALID_SOCKET != s->lsock) {
+			CancelIoEx(reinterpret_cast<HANDLE>(s->lsock), nullptr);
+		}
+		if (INVALID_HANDLE_VALUE != s->client) {
+			CancelIoEx(s->client, nullptr);
+		}
+		if (INVALID_HANDLE_VALUE != s->ep) {
+			CancelIoEx(s->ep, nullptr);
+		}
+		gone = 0 == s->pending;
+	}
+	if (gone) {
+		/* Nothing in flight, nobody else will see it again. */
+		serve_lock.unlock();
+		convey_serve_forget(s);
+		serve_lock.lock();
+	}
+}/*}}}*/
+
+static bool convey_serve_add(const convey_serve_spec& sp, std::string& err)
+{/*{{{*/
+	std::unique_ptr<convey_serve_session> s(new convey_serve_session());
+	s->spec = sp;
+	s->lsock = s->accept_sock = INVALID_SOCKET;
+	s->client = s->ep = INVALID_HANDLE_VALUE;
+	for (int i = 0; i < convey_serve_ops; i++) {
+		s->ops[i].kind = static_cast<convey_serve_op_kind>(i);
+	}
+
+	if (convey_serve_client_is_socket(s.get())) {
+		DWORD er = 0, ret = 0;
+		GUID id = WSAID_ACCEPTEX;
+		s->lsock = convey_serve_listen_socket(sp, er);
+		if (INVALID_SOCKET == s->lsock
+				|| !CreateIoCompletionPort(reinterpret_cast<HANDLE>(s->lsock), serve_port, reinterpret_cast<ULONG_PTR>(s.get()), 0)
+				|| 0 != WSAIoctl(s->lsock, SIO_GET_EXTENSION_FUNCTION_POINTER, &id, sizeof id, &s->acceptex, sizeof s->acceptex, &ret, nullptr, nullptr)) {
+			err = "can't listen on '" + sp.listen + "'";
+			std::cerr << "convey: " << err << std::endl;
+			convey_error(er ? er : WSAGetLastError());
+			convey_serve_release(s.get());
+			return false;
+		}
+	}
+
+	convey_serve_session* raw = s.get();
+	{
+		std::lock_guard<std::mutex> lk(serve_lock);
+		serve_sessions.push_back(std::move(s));
+	}
+	std::lock_guard<std::mutex> lk(raw->lock);
+	convey_serve_listen(raw);
+	return true;
+}/*}}}*/
+
+static std::atomic<bool> serve_control_done{false};
+
+/* One control client at a time, over a blocking pipe. Shutdown cancels
+ * the call the thread is blocked in. */
+static void convey_serve_control_loop(HANDLE h)
+{/*{{{*/
+	while (!serve_stop && INVALID_HANDLE_VALUE != h) {
+		if (ConnectNamedPipe(h, nullptr) || ERROR_PIPE_CONNECTED == GetLastError()) {
+			std::string in;
+			bool more = true;
+			while (more && !serve_stop) {
+				char buf[BUF_SIZE];
+				DWORD got = 0;
+				if (!ReadFile(h, buf, sizeof buf, &got, nullptr) || !got) {
+					break;
+				}
+				std::string reply;
+				more = convey_serve_control_feed(in, buf, got, reply);
+				DWORD written = 0;
+				if (!reply.empty() && !WriteFile(h, reply.data(), static_cast<DWORD>(reply.size()), &written, nullptr)) {
+					break;
+				}
+			}
+			FlushFileBuffers(h);
+		}
+		DisconnectNamedPipe(h);
+	}
+	if (INVALID_HANDLE_VALUE != h) {
+		CloseHandle(h);
+	}
+	serve_control_done = true;
+}/*}}}*/
+
+static BOOL WINAPI convey_serve_ctrl(DWORD)
+{/*{{{*/
+	serve_stop = true;
+	for (uint32_t i = 0; i < conf.serve_workers; i++) {
+		PostQueuedCompletionStatus(serve_port, 0, 0, nullptr);
+	}
+	return TRUE;
+}/*}}}*/
+
+static int convey_serve_run(void)
+{/*{{{*/
+	serve_port = CreateIoCompletionPort(INVALID_HANDLE_VALUE, nullptr, 0, 0);
+	if (!serve_port) {
+		convey_error();
+		return 1;
+	}
+
+	HANDLE control = INVALID_HANDLE_VALUE;
+	if (!conf.serve_control.empty()) {
+		control = CreateNamedPipe(conf.serve_control.c_str(), PIPE_ACCESS_DUPLEX,
+			PIPE_TYPE_BYTE | PIPE_READMODE_BYTE | PIPE_WAIT, 1, BUF_SIZE, BUF_SIZE, 0, nullptr);
+		if (INVALID_HANDLE_VALUE == control) {
+			std::cerr << "convey: can't create the control pipe '" << conf.serve_control << "'" << std::endl;
+			convey_error();
+			CloseHandle(serve_port);
+			return 1;
+		}
+	}
+
+	for (const convey_serve_spec& sp : conf.serve) {
+		std::string err;
+		if (!convey_serve_add(sp, err)) {
+			convey_serve_cleanup();
+			if (INVALID_HANDLE_VALUE != control) {
+				CloseHandle(control);
+			}
+			CloseHandle(serve_port);
+			return 1;
+		}
+	}
+
+	if (conf.verbose) {
+		std::cout << "Serving " << serve_sessions.size() << " sessions with " << conf.serve_workers << " workers" << std::endl;
+	}
+
+	std::vector<std::thread> workers;
+	for (uint32_t i = 0; i < conf.serve_workers; i++) {
+		workers.emplace_back(convey_serve_worker);
+	}
+	std::thread ctl(convey_serve_control_loop, control);
+	SetConsoleCtrlHandler(convey_serve_ctrl, TRUE);
+
+	for (std::thread& t : workers) {
+		t.join();
+	}
+	while (!serve_control_done) {
+		CancelSynchronousIo(ctl.native_handle());
+		Sleep(10);
+	}
+	ctl.join();
+	convey_serve_opener_stop();
+	SetConsoleCtrlHandler(convey_serve_ctrl, FALSE);
+
+	convey_serve_cleanup();
+	CloseHandle(serve_port);
+
+	return 0;
+}/*}}}*/
+#else
+/* The sessions are spread over the workers, each polls its own share, so
+ * a session is only ever touched by one thread. A new one goes to the
+ * worker with the fewest. */
+struct convey_serve_shard {
+	std::vector<convey_serve_session*> sessions;
+	std::atomic<size_t> load{0};
+	std::mutex lock;
+	std::vector<convey_serve_session*> opened;
+	std::vector<convey_serve_session*> added;
+	int wake[2];
+};
+
+static std::vector<std::unique_ptr<convey_serve_shard>> serve_shards;
+static int serve_stop_pipe[2] = {-1, -1};
+
+static void convey_serve_wake(convey_serve_shard* sh)
+{/*{{{*/
+	char c = 0;
+	if (write(sh->wake[1], &c, 1)) {
+		/* Level triggered, once is enough. */
+	}
+}/*}}}*/
+
+static void convey_serve_opened(convey_serve_session* s)
+{/*{{{*/
+	convey_serve_shard* sh = serve_shards[s->shard].get();
+	{
+		std::lock_guard<std::mutex> lk(sh->lock);
+		sh->opened.push_back(s);
+	}
+	convey_serve_wake(sh);
+}/*}}}*/
+
+/* The shard forgets it on its next round. The caller holds serve_lock. */
+static void convey_serve_detach(convey_serve_session* s)
+{/*{{{*/
+	s->removed = true;
+	convey_serve_wake(serve_shards[s->shard].get());
+}/*}}}*/
+
+static bool convey_serve_add(const convey_serve_spec& sp, std::string& err)
+{/*{{{*/
+	std::unique_ptr<convey_serve_session> s(new convey_serve_session());
+	s->spec = sp;
+	s->state = convey_serve_listening;
+	s->client = s->ep = INVALID_HANDLE_VALUE;
+
+	DWORD er = 0;
+	s->lsock = convey_serve_listen_socket(sp, er);
+	if (INVALID_SOCKET == s->lsock) {
+		err = "can't listen on '" + sp.listen + "'";
+		std::cerr << "convey: " << err << std::endl;
+		convey_error(er);
+		return false;
+	}
+	convey_set_nonblocking(s->lsock, true);
+
+	s->shard = 0;
+	for (size_t i = 1; i < serve_shards.size(); i++) {
+		if (serve_shards[i]->load < serve_shards[s->shard]->load) {
+			s->shard = i;
+		}
+	}
+	convey_serve_shard* sh = serve_shards[s->shard].get();
+	sh->load++;
+	convey_serve_session* raw = s.get();
+	{
+		std::lock_guard<std::mutex> lk(serve_lock);
+		serve_sessions.push_back(std::move(s));
+	}
+	{
+		std::lock_guard<std::mutex> lk(sh->lock);
+		sh->added.push_back(raw);
+	}
+	convey_serve_wake(sh);
+	return true;
+}/*}}}*/
+
+static void convey_serve_unlink(convey_serve_session* s, const char* why)
+{/*{{{*/
+	if (conf.verbose) {
+		std::cout << s->spec.listen << ": " << why << std::endl;
+	}
+	convey_serve_close(s->ep, convey_serve_ep_is_socket(s));
+	convey_serve_close(s->client, true);
+	s->state = convey_serve_listening;
+}/*}}}*/
+
+/* Move what's ready from one side to the other without blocking. False
+ * once the reading side ended or either side failed. */
+static bool convey_serve_pump(convey_serve_session* s, bool up)
+{/*{{{*/
+	HANDLE from = up ? s->client : s->ep;
+	HANDLE to = up ? s->ep : s->client;
+	convey_serve_buf& b = up ? s->up : s->down;
+
+	if (b.off == b.len) {
+		ssize_t n = read(from, b.data, sizeof b.data);
+		if (0 == n) {
+			return false;
+		}
+		if (n < 0) {
+			return EAGAIN == errno || EWOULDBLOCK == errno || EINTR == errno;
+		}
+		b.len = static_cast<DWORD>(n);
+		b.off = 0;
+		convey_serve_account(s, b.data, b.len, up);
+	}
+	while (b.off < b.len) {
+		ssize_t n = write(to, b.data + b.off, b.len - b.off);
+		if (n < 0) {
+			return EAGAIN == errno || EWOULDBLOCK == errno || EINTR == errno;
+		}
+		b.off += static_cast<DWORD>(n);
+	}
+	return true;
+}/*}}}*/
+
+static void convey_serve_accept(convey_serve_session* s)
+{/*{{{*/
+	SOCKET c = accept(s->lsock, nullptr, nullptr);
+	if (INVALID_SOCKET == c) {
+		return;
+	}
+	fcntl(c, F_SETFD, FD_CLOEXEC);
+	convey_set_nonblocking(c, true);
+	if (convey_tp_tcp_server == s->spec.lts.kind) {
+		convey_tcp_tune(c, convey_tcp_opts_conf());
+	}
+	s->client = c;
+	convey_serve_open_async(s);
+}/*}}}*/
+
+static void convey_serve_shard_loop(convey_serve_shard* sh)
+{/*{{{*/
+	std::vector<struct pollfd> fds;
+	std::vector<convey_serve_session*> owners;
+
+	while (!serve_stop) {
+		fds.clear();
+		owners.clear();
+		fds.push_back({serve_stop_pipe[0], POLLIN, 0});
+		fds.push_back({sh->wake[0], POLLIN, 0});
+		owners.resize(2, nullptr);
+		for (convey_serve_session* s : sh->sessions) {
+			if (convey_serve_listening == s->state) {
+				fds.push_back({s->lsock, POLLIN, 0});
+				owners.push_back(s);
+			} else if (convey_serve_linked == s->state) {
+				/* Read a side only while its buffer is empty, write it
+				 * while the other direction has something for it. */
+				short ce = (s->up.off == s->up.len ? POLLIN : 0) | (s->down.off < s->down.len ? POLLOUT : 0);
+				short ee = (s->down.off == s->down.len ? POLLIN : 0) | (s->up.off < s->up.len ? POLLOUT : 0);
+				fds.push_back({s->client, ce, 0});
+				fds.push_back({s->ep, ee, 0});
+				owners.push_back(s);
+				owners.push_back(s);
+			}
+		}
+
+		if (poll(fds.data(), fds.size(), -1) < 0) {
+			if (EINTR == errno) {
+				continue;
+			}
+			convey_error();
+			serve_stop = true;
+			break;
+		}
+		if (fds[0].revents) {
+			break;
+		}
+
+		if (fds[1].revents) {
+			char drain[64];
+			while (read(sh->wake[0], drain, sizeof drain) == sizeof drain);
+			std::vector<convey_serve_session*> opened;
+			{
+				std::lock_guard<std::mutex> lk(sh->lock);
+				opened.swap(sh->opened);
+				sh->sessions.insert(sh->sessions.end(), sh->added.begin(), sh->added.end());
+				sh->added.clear();
+			}
+			for (convey_serve_session* s : opened) {
+				if (convey_serve_link(s)) {
+					convey_set_nonblocking(s->ep, true);
+				} else {
+					convey_serve_unlink(s, "closed");
+				}
+			}
+		}
+
+		for (size_t i = 2; i < fds.size(); i++) {
+			convey_serve_session* s = owners[i];
+			if (fds[i].fd == s->lsock) {
+				if (fds[i].revents && convey_serve_listening == s->state) {
+					convey_serve_accept(s);
+				}
+				continue;
+			}
+			/* The client and the endpoint entries come in pairs. */
+			bool active = fds[i].revents || fds[i + 1].revents;
+			i++;
+			if (!active || convey_serve_linked != s->state) {
+				continue;
+			}
+			if (!convey_serve_pump(s, true)) {
+				convey_serve_unlink(s, "client closed");
+			} else if (!convey_serve_pump(s, false)) {
+				convey_serve_unlink(s, "endpoint closed");
+			}
+		}
+
+		/* Only now, the poll set above points to the sessions. */
+		for (auto it = sh->sessions.begin(); it != sh->sessions.end(); ) {
+			convey_serve_session* s = *it;
+			if (!s->removed || convey_serve_opening == s->state) {
+				++it;
+				continue;
+			}
+			it = sh->sessions.erase(it);
+			sh->load--;
+			convey_serve_forget(s);
+		}
+	}
+}/*}}}*/
+
+static void convey_serve_signal(int)
+{/*{{{*/
+	serve_stop = true;
+	char c = 0;
+	if (write(serve_stop_pipe[1], &c, 1)) {
+		/* Level triggered, every worker sees it. */
+	}
+}/*}}}*/
+
+/* One control client at a time, next to the workers. */
+static void convey_serve_control_loop(SOCKET lsock)
+{/*{{{*/
+	SOCKET c = INVALID_SOCKET;
+	std::string in;
+
+	while (!serve_stop) {
+		struct pollfd fds[2] = {
+			{serve_stop_pipe[0], POLLIN, 0},
+			{INVALID_SOCKET == c ? lsock : c, POLLIN, 0}
+		};
+		if (poll(fds, 2, -1) < 0) {
+			if (EINTR == errno) {
+				continue;
+			}
+			convey_error();
+			break;
+		}
+		if (fds[0].revents) {
+			break;
+		}
+		if (!fds[1].revents) {
+			continue;
+		}
+
+		if (INVALID_SOCKET == c) {
+			c = accept(lsock, nullptr, nullptr);
+			if (INVALID_SOCKET != c) {
+				fcntl(c, F_SETFD, FD_CLOEXEC);
+			}
+			in.clear();
+			continue;
+		}
+
+		char buf[BUF_SIZE];
+		ssize_t n = read(c, buf, sizeof buf);
+		if (n < 0 && EINTR == errno) {
+			continue;
+		}
+		std::string reply;
+		bool more = n > 0 && convey_serve_control_feed(in, buf, n, reply);
+		for (size_t off = 0; off < reply.size(); ) {
+			ssize_t w = write(c, reply.data() + off, reply.size() - off);
+			if (w < 0 && EINTR == errno) {
+				continue;
+			}
+			if (w <= 0) {
+				more = false;
+				break;
+			}
+			off += w;
+		}
+		if (!more) {
+			closesocket(c);
+			c = INVALID_SOCKET;
+		}
+	}
+
+	if (INVALID_SOCKET != c) {
+		closesocket(c);
+	}
+}/*}}}*/
+
+static int convey_serve_run(void)
+{/*{{{*/
+	/* All of them, the control socket may add sessions later. */
+	size_t n = conf.serve_workers;
+	if (0 != ::pipe2(serve_stop_pipe, O_CLOEXEC)) {
+		convey_error();
+		return 1;
+	}
+	for (size_t i = 0; i < n; i++) {
+		serve_shards.emplace_back(new convey_serve_shard());
+		convey_serve_shard* sh = serve_shards.back().get();
+		if (0 != ::pipe2(sh->wake, O_CLOEXEC | O_NONBLOCK)) {
+			sh->wake[0] = sh->wake[1] = -1;
+			convey_error();
+			serve_stop = true;
+		}
+	}
+
+	int rc = 0;
+	SOCKET control = INVALID_SOCKET;
+	if (!conf.serve_control.empty()) {
+		DWORD err = 0;
+		control = convey_unix_listen(conf.serve_control, err);
+		if (INVALID_SOCKET == control) {
+			std::cerr << "convey: can't listen on the control socket '" << conf.serve_control << "'" << std::endl;
+			convey_error(err);
+			rc = 1;
+		}
+	}
+	for (size_t i = 0; !rc && i < conf.serve.size(); i++) {
+		std::string err;
+		if (!convey_serve_add(conf.serve[i], err)) {
+			rc = 1;
+		}
+	}
+
+	if (!rc) {
+		if (conf.verbose) {
+			std::cout << "Serving " << serve_sessions.size() << " sessions with " << n << " workers" << std::endl;
+		}
+
+		signal(SIGINT, convey_serve_signal);
+		signal(SIGTERM, convey_serve_signal);
+
+		std::vector<std::thread> workers;
+		for (auto& sh : serve_shards) {
+			workers.emplace_back(convey_serve_shard_loop, sh.get());
+		}
+		std::thread ctl;
+		if (INVALID_SOCKET != control) {
+			ctl = std::thread(convey_serve_control_loop, control);
+		}
+		for (std::thread& t : workers) {
+			t.join();
+		}
+		if (ctl.joinable()) {
+			ctl.join();
+		}
+		convey_serve_opener_stop();
+
+		signal(SIGINT, SIG_DFL);
+		signal(SIGTERM, SIG_DFL);
+	}
+
+	if (INVALID_SOCKET != control) {
+		closesocket(control);
+		DeleteFileA(conf.serve_control.c_str());
+	}
+	convey_serve_cleanup();
+	for (auto& sh : serve_shards) {
+		close(sh->wake[0]);
+		close(sh->wake[1]);
+	}
+	serve_shards.clear();
+	close(serve_stop_pipe[0]);
+	close(serve_stop_pipe[1]);
+
+	return rc;
+}/*}}}*/
+#endif
+/* }}} */
+
+#ifndef CONVEY_LIBRARY
+/* {{{ Channel multiplexer session */
+/* Each channel has a thread that owns its local end, it accepts, opens
+ * and reads it and is the only one to close it, and a thread writing to
+ * it what came from the other end. One more writes the frames to the
+ * endpoint, the main thread reads them. */
+struct convey_mux_chunk {
+	std::string data;
+	uint32_t end;	/* the position after it */
+};
+
+struct convey_mux_chan {
+	convey_mux_spec spec;
+	std::condition_variable cv;	/* the local threads wait here */
+	HANDLE h{INVALID_HANDLE_VALUE};
+	bool is_socket;
+	SOCKET lsock{INVALID_SOCKET};
+	bool want_open;	/* data came for an endpoint to connect to */
+	int family{AF_UNSPEC};	/* of the last connect, tried first */
+	bool drop;	/* the local end is to be closed */
+	bool close_after;	/* once what came is written */
+	bool close_pending;	/* tell the other end */
+	bool writing;
+	std::deque<convey_mux_chunk> rxq;
+	uint32_t consumed;	/* written to the local end */
+	uint32_t credit_sent;
+	std::chrono::steady_clock::time_point last_rx;
+	std::chrono::steady_clock::time_point credit_at;
+#ifndef _WIN32
+	int wake[2]{-1, -1};
+#endif
+};
+
+/* All under one lock, the link is slow compared to it. */
+struct convey_mux_state {
+	std::mutex lock;
+	std::condition_variable cv;	/* the link writer waits here */
+	convey_mux_chan ch[MUX_CHANNELS];
+	convey_mux_tx tx[MUX_CHANNELS];
+	convey_mux_rx rx[MUX_CHANNELS];
+	size_t n;
+	uint32_t self;
+	uint32_t peer;
+	bool peer_known;
+	bool hello;
+	bool resync;	/* ask the other end to start the window over */
+	bool zreset;	/* start the window over with the next block */
+	bool done;
+};
+
+/* Never freed, threads blocked on the local ends may still use it when
+ * the process exits. */
+static convey_mux_state& mux = *new convey_mux_state();
+
+static const std::string& convey_mux_name(const convey_mux_chan& c)
+{/*{{{*/
+	return convey_mux_connect == c.spec.kind ? c.spec.sp.endpoint : c.spec.sp.listen;
+}/*}}}*/
+
+static HANDLE convey_mux_event(convey_mux_chan& c)
+{/*{{{*/
+#ifdef _WIN32
+	(void)c;
+	return convey_event_create();
+#else
+	return c.wake[0];
+#endif
+}/*}}}*/
+
+/* Wakes the reader and the writer of the local end, the lock is held. */
+static void convey_mux_cancel(convey_mux_chan& c)
+{/*{{{*/
+#ifdef _WIN32
+	if (INVALID_HANDLE_VALUE != c.h) {
+		CancelIoEx(c.h, nullptr);
+	}
+#else
+	char b = 0;
+	if (write(c.wake[1], &b, 1)) {
+		/* Level triggered, drained once the end is closed. */
+	}
+#endif
+	c.cv.notify_all();
+}/*}}}*/
+
+/* A read of nothing that wasn't a spurious wake is the end. */
+static bool convey_mux_eof(DWORD bytes, DWORD er)
+{/*{{{*/
+#ifdef _WIN32
+	(void)er;
+	return 0 == bytes;
+#else
+	return 0 == bytes && EAGAIN != er && EWOULDBLOCK != er;
+#endif
+}/*}}}*/
+
+#ifdef _WIN32
+static HANDLE convey_mux_pipe_accept(const std::string& name, HANDLE e, DWORD& err)
+{/*{{{*/
+	HANDLE h = CreateNamedPipe(name.c_str(), PIPE_ACCESS_DUPLEX | FILE_FLAG_OVERLAPPED,
+		PIPE_TYPE_BYTE | PIPE_READMODE_BYTE | PIPE_WAIT, 1, RECV_BUF_SIZE, BUF_SIZE, 0, nullptr);
+	if (INVALID_HANDLE_VALUE == h) {
+		err = GetLastError();
+		return INVALID_HANDLE_VALUE;
+	}
+	OVERLAPPED ov;
+	memset(&ov, 0, sizeof ov);
+	ov.hEvent = e;
+	BOOL connected = ConnectNamedPipe(h, &ov);
+	err = GetLastError();
+	if (!connected && ERROR_IO_PENDING == err) {
+		DWORD n;
+		connected = GetOverlappedResult(h, &ov, &n, true);
+		err = GetLastError();
+	} else if (!connected && ERROR_PIPE_CONNECTED == err) {
+		connected = TRUE;
+	}
+	if (!connected) {
+		CloseHandle(h);
+		return INVALID_HANDLE_VALUE;
+	}
+	return h;
+}/*}}}*/
+#endif
+
+/* The other end started anew, what was in flight is gone for good. */
+static void convey_mux_reset_locked(void)
+{/*{{{*/
+	for (size_t i = 0; i < mux.n; i++) {
+		convey_mux_chan& c = mux.ch[i];
+		mux.tx[i] = convey_mux_tx{};
+		mux.rx[i] = convey_mux_rx{};
+		c.rxq.clear();
+		c.consumed = c.credit_sent = 0;
+		c.want_open = c.close_after = c.close_pending = false;
+		if (INVALID_HANDLE_VALUE != c.h && convey_mux_pty != c.spec.kind && !c.drop) {
+			c.drop = true;
+			convey_mux_cancel(c);
+		}
+		c.cv.notify_all();
+	}
+	mux.zreset = true;
+}/*}}}*/
+
+static void convey_mux_dispatch(const convey_mux_item& it)
+{/*{{{*/
+	std::lock_guard<std::mutex> lk(mux.lock);
+	if (MUX_LINK == it.chan && MUX_HELLO == it.type) {
+		if (!mux.peer_known || it.pos != mux.peer) {
+			if (conf.verbose) {
+				std::cout << "mux: the other end is up" << std::endl;
+			}
+			convey_mux_reset_locked();
+			mux.peer = it.pos;
+			mux.peer_known = true;
+			mux.hello = true;
+			mux.cv.notify_one();
+		}
+		return;
+	}
+	if (MUX_LINK == it.chan && MUX_RESYNC == it.type) {
+		mux.zreset = true;
+		return;
+	}
+	if (it.chan >= mux.n) {
+		stats.mux_bad++;
+		return;
+	}
+	convey_mux_chan& c = mux.ch[it.chan];
+	switch (it.type) {
+	case MUX_DATA:
+		convey_mux_rx_data(mux.rx[it.chan], it.pos, it.data.size());
+		c.last_rx = std::chrono::steady_clock::now();
+		if (convey_mux_listen == c.spec.kind && INVALID_HANDLE_VALUE == c.h) {
+			/* The client is gone, so is this. */
+			c.consumed = mux.rx[it.chan].pos;
+			c.close_pending = true;
+			mux.cv.notify_one();
+			break;
+		}
+		c.rxq.push_back(convey_mux_chunk{it.data, mux.rx[it.chan].pos});
+		if (convey_mux_connect == c.spec.kind && INVALID_HANDLE_VALUE == c.h) {
+			c.want_open = true;
+		}
+		c.cv.notify_all();
+		break;
+	case MUX_CREDIT:
+		convey_mux_credit(mux.tx[it.chan], it.pos);
+		c.cv.notify_all();
+		mux.cv.notify_one();
+		break;
+	case MUX_CLOSE:
+		if (convey_mux_pty == c.spec.kind) {
+			break;
+		}
+		if (INVALID_HANDLE_VALUE != c.h && !c.drop && c.rxq.empty()) {
+			c.drop = true;
+			convey_mux_cancel(c);
+		} else if (!c.rxq.empty() || c.want_open) {
+			c.close_after = true;
+			c.cv.notify_all();
+		}
+		break;
+	default:
+		stats.mux_bad++;
+	}
+}/*}}}*/
+
+static HANDLE convey_mux_open_local(convey_mux_chan& c, HANDLE e, bool& is_socket)
+{/*{{{*/
+	DWORD err = 0;
+	HANDLE h = INVALID_HANDLE_VALUE;
+	is_socket = false;
+	if (convey_mux_listen == c.spec.kind) {
+#ifdef _WIN32
+		if (convey_tp_pipe == c.spec.sp.lts.kind) {
+			h = convey_mux_pipe_accept(c.spec.sp.listen, e, err);
+		} else
+#endif
+		{
+			SOCKET s = accept(c.lsock, nullptr, nullptr);
+			err = WSAGetLastError();
+			h = (INVALID_SOCKET == s) ? INVALID_HANDLE_VALUE : reinterpret_cast<HANDLE>(s);
+			is_socket = true;
+		}
+	} else {
+		{
+			std::unique_lock<std::mutex> lk(mux.lock);
+			c.cv.wait(lk, [&c]() { return c.want_open || mux.done; });
+			if (mux.done) {
+				return INVALID_HANDLE_VALUE;
+			}
+		}
+		h = convey_serve_open(c.spec.sp, c.family, err);
+		is_socket = convey_tp_tcp_client == c.spec.sp.ets.kind || convey_tp_unix_client == c.spec.sp.ets.kind
+			|| convey_tp_vsock_client == c.spec.sp.ets.kind;
+	}
+	(void)e;
+	if (INVALID_HANDLE_VALUE == h) {
+		std::cerr << "convey: mux: can't open '" << convey_mux_name(c) << "'" << std::endl;
+		convey_error(err);
+	}
+	return h;
+}/*}}}*/
+
+/* Opens, reads and closes the local end of a channel. */
+static void convey_mux_local(size_t i)
+{/*{{{*/
+	convey_mux_chan& c = mux.ch[i];
+	HANDLE e = convey_mux_event(c);
+	char buf[BUF_SIZE];
+
+	while (!mux.done) {
+		bool is_socket = false;
+		HANDLE h = c.h;
+		if (convey_mux_pty != c.spec.kind) {
+			h = convey_mux_open_local(c, e, is_socket);
+			std::lock_guard<std::mutex> lk(mux.lock);
+			if (INVALID_HANDLE_VALUE == h) {
+				/* Nobody to take it, tell the other end to close as well. */
+				if (c.want_open) {
+					c.want_open = false;
+					c.rxq.clear();
+					c.consumed = mux.rx[i].pos;
+					c.close_pending = true;
+					mux.cv.notify_one();
+				}
+				continue;
+			}
+			c.h = h;
+			c.is_socket = is_socket;
+			c.drop = false;
+			c.want_open = false;
+			c.cv.notify_all();
+		}
+		if (conf.verbose) {
+			std::cout << "mux " << i << ": '" << convey_mux_name(c) << "' open" << std::endl;
+		}
+
+		while (true) {
+			DWORD bytes = 0, er = 0;
+			bool rc = convey_read_raw(h, buf, sizeof buf, &bytes, e, er);
+			if (!rc && convey_mux_pty == c.spec.kind && !mux.done) {
+				/* A client closing the pty isn't the end of it. */
+				std::this_thread::sleep_for(std::chrono::milliseconds(100));
+				continue;
+			}
+			if (!rc || convey_mux_eof(bytes, er)) {
+				break;
+			}
+			std::unique_lock<std::mutex> lk(mux.lock);
+			c.cv.wait(lk, [&]() { return mux.tx[i].q.size() < MUX_WINDOW || c.drop || mux.done; });
+			if (c.drop || mux.done) {
+				break;
+			}
+			mux.tx[i].q.append(buf, bytes);
+			mux.cv.notify_one();
+		}
+		if (convey_mux_pty == c.spec.kind) {
+			return;
+		}
+
+		{
+			std::unique_lock<std::mutex> lk(mux.lock);
+			if (!c.drop) {
+				c.close_pending = true;
+				c.drop = true;
+				convey_mux_cancel(c);
+			}
+			c.cv.wait(lk, [&c]() { return !c.writing; });
+			mux.tx[i].q.clear();
+			c.rxq.clear();
+			c.close_after = false;
+			c.consumed = mux.rx[i].pos;
+			c.h = INVALID_HANDLE_VALUE;
+			c.cv.notify_all();
+			mux.cv.notify_one();
+		}
+		convey_serve_close(h, is_socket);
+#ifndef _WIN32
+		char drain[16];
+		while (read(c.wake[0], drain, sizeof drain) > 0) {
+		}
+#endif
+		if (conf.verbose) {
+			std::cout << "mux " << i << ": '" << convey_mux_name(c) << "' closed" << std::endl;
+		}
+	}
+}/*}}}*/
+
+/* Writes what came from the other end to the local end of a channel. */
+static void convey_mux_local_writer(size_t i)
+{/*{{{*/
+	convey_mux_chan& c = mux.ch[i];
+	HANDLE e = convey_mux_event(c);
+
+	while (true) {
+		std::unique_lock<std::mutex> lk(mux.lock);
+		c.cv.wait(lk, [&c]() {
+			return mux.done || (INVALID_HANDLE_VALUE != c.h && !c.drop && (!c.rxq.empty() || c.close_after));
+		});
+		if (mux.done) {
+			return;
+		}
+		if (c.rxq.empty()) {
+			c.close_after = false;
+			c.drop = true;
+			convey_mux_cancel(c);
+			continue;
+		}
+		convey_mux_chunk ck = std::move(c.rxq.front());
+		c.rxq.pop_front();
+		HANDLE h = c.h;
+		c.writing = true;
+		lk.unlock();
+
+		DWORD bytes = static_cast<DWORD>(ck.data.size()), er = 0;
+		bool ok = convey_write_raw(h, ck.data.data(), &bytes, e, er);
+
+		lk.lock();
+		c.writing = false;
+		/* Written or not, it's handed on and the credit goes back. */
+		c.consumed = ck.end;
+		if (!ok && !c.drop) {
+			c.drop = true;
+			c.close_pending = true;
+			convey_mux_cancel(c);
+		}
+		c.cv.notify_all();
+		mux.cv.notify_one();
+	}
+}/*}}}*/
+
+/* A credit goes back when a quarter of the window was handed on, or all
+ * that came, and again each second while data comes, in case it broke. */
+static bool convey_mux_credit_due(const convey_mux_chan& c, std::chrono::steady_clock::time_point now)
+{/*{{{*/
+	uint32_t ahead = c.consumed - c.credit_sent;
+	if (ahead && (ahead >= MUX_WINDOW / 4 || c.rxq.empty())) {
+		return true;
+	}
+	return c.credit_sent && now - c.credit_at >= std::chrono::seconds(1) && now - c.last_rx < std::chrono::seconds(5);
+}/*}}}*/
+
+static bool convey_mux_ready_locked(std::chrono::steady_clock::time_point now)
+{/*{{{*/
+	if (mux.hello || mux.resync || convey_mux_pick(mux.tx, mux.n) >= 0) {
+		return true;
+	}
+	for (size_t i = 0; i < mux.n; i++) {
+		if (mux.ch[i].close_pending || convey_mux_credit_due(mux.ch[i], now)) {
+			return true;
+		}
+	}
+	return false;
+}/*}}}*/
+
+/* The control frames and then data frames by priority, until there are
+ * fill bytes. */
+static void convey_mux_collect_locked(std::string& out, size_t fill)
+{/*{{{*/
+	auto now = std::chrono::steady_clock::now();
+	if (mux.hello) {
+		convey_mux_frame(out, MUX_LINK, MUX_HELLO, mux.self, nullptr, 0);
+		stats.mux_frames_out++;
+		mux.hello = false;
+	}
+	if (mux.resync) {
+		convey_mux_frame(out, MUX_LINK, MUX_RESYNC, 0, nullptr, 0);
+		stats.mux_frames_out++;
+		mux.resync = false;
+	}
+	for (size_t i = 0; i < mux.n; i++) {
+		convey_mux_chan& c = mux.ch[i];
+		if (c.close_pending) {
+			convey_mux_frame(out, static_cast<uint8_t>(i), MUX_CLOSE, mux.tx[i].sent, nullptr, 0);
+			stats.mux_frames_out++;
+			c.close_pending = false;
+		}
+		if (convey_mux_credit_due(c, now)) {
+			convey_mux_frame(out, static_cast<uint8_t>(i), MUX_CREDIT, c.consumed, nullptr, 0);
+			stats.mux_frames_out++;
+			c.credit_sent = c.consumed;
+			c.credit_at = now;
+		}
+	}
+	int k;
+	while ((k = convey_mux_pick(mux.tx, mux.n)) >= 0) {
+		convey_mux_tx& t = mux.tx[k];
+		size_t n = std::min<size_t>({MUX_FRAME, t.q.size(), convey_mux_room(t)});
+		convey_mux_frame(out, static_cast<uint8_t>(k), MUX_DATA, t.sent, t.q.data(), n);
+		stats.mux_frames_out++;
+		t.sent += static_cast<uint32_t>(n);
+		t.q.erase(0, n);
+		mux.ch[k].cv.notify_all();
+		if (out.size() >= fill) {
+			break;
+		}
+	}
+}/*}}}*/
+
+static void convey_mux_link_writer(void)
+{/*{{{*/
+	convey_raw_pace pace{convey_raw_endpoint_rate(), std::chrono::steady_clock::now(), 0};
+	convey_lz z{};
+	double ratio = 1.0;
+	std::string out, raw;
+
+	while (true) {
+		out.clear();
+		raw.clear();
+		bool reset;
+		{
+			std::unique_lock<std::mutex> lk(mux.lock);
+			mux.cv.wait_for(lk, std::chrono::seconds(1), []() {
+				return mux.done || convey_mux_ready_locked(std::chrono::steady_clock::now());
+			});
+			if (mux.done) {
+				return;
+			}
+			convey_mux_collect_locked(conf.compress ? raw : out, convey_mux_fill(pace.rate, conf.compress, ratio));
+			reset = mux.zreset;
+			mux.zreset = false;
+		}
+		if (!raw.empty()) {
+			convey_mux_zblock(z, reset, raw, out);
+			ratio = static_cast<double>(raw.size()) / out.size();
+		}
+		if (out.empty()) {
+			continue;
+		}
+		if (pace.rate > 0) {
+			std::this_thread::sleep_until(convey_raw_due(pace));
+		}
+		if (!convey_xfer_write_endpoint(xfer_link, out.data(), out.size())) {
+			return;
+		}
+		pace.sent += out.size();
+	}
+}/*}}}*/
+
+/* Runs --mux on the connected endpoint until it goes away. */
+static int convey_mux_run(void)
+{/*{{{*/
+	mux.n = conf.mux.size();
+	mux.self = std::random_device{}();
+	mux.hello = true;
+	for (size_t i = 0; i < mux.n; i++) {
+		convey_mux_chan& c = mux.ch[i];
+		c.spec = conf.mux[i];
+		DWORD err = 0;
+#ifndef _WIN32
+		if (0 != ::pipe2(c.wake, O_CLOEXEC | O_NONBLOCK)) {
+			convey_error();
+			return 1;
+		}
+		if (convey_mux_pty == c.spec.kind) {
+			int m, sl;
+			if (!convey_pty_make(c.spec.sp.listen, m, sl)) {
+				return 1;
+			}
+			pty_mux_links.push_back(c.spec.sp.listen);
+			c.h = m;
+		}
+#endif
+		if (convey_mux_listen == c.spec.kind && convey_tp_pipe != c.spec.sp.lts.kind) {
+			c.lsock = convey_serve_listen_socket(c.spec.sp, err);
+			if (INVALID_SOCKET == c.lsock) {
+				std::cerr << "convey: mux: can't listen on '" << c.spec.sp.listen << "'" << std::endl;
+				convey_error(err);
+				return 1;
+			}
+		}
+	}
+	for (size_t i = 0; i < mux.n; i++) {
+		std::thread(convey_mux_local, i).detach();
+		std::thread(convey_mux_local_writer, i).detach();
+	}
+	std::thread(convey_mux_link_writer).detach();
+
+	convey_mux_parser p{};
+	convey_mux_zrx zr{};
+	std::string raw;
+	std::vector<convey_mux_item> items;
+	auto resync_at = std::chrono::steady_clock::time_point{};
+	bool ok = true;
+	while (true) {
+		char buf[RECV_BUF_SIZE];
+		DWORD bytes{0}, er{0};
+		if (!convey_read_pipe(epipe, buf, &bytes, e_pipe_r, er)) {
+			ok = false;
+			break;
+		}
+		if (convey_endpoint_eof(bytes)) {
+			break;
+		}
+		convey_log_recv(buf, bytes);
+		items.clear();
+		if (conf.compress) {
+			raw.clear();
+			auto now = std::chrono::steady_clock::now();
+			if (!convey_mux_zunblock(zr, buf, bytes, raw) && now - resync_at >= std::chrono::seconds(1)) {
+				std::lock_guard<std::mutex> lk(mux.lock);
+				mux.resync = true;
+				mux.cv.notify_one();
+				resync_at = now;
+			}
+			convey_mux_parse(p, raw.data(), raw.size(), items);
+		} else {
+			convey_mux_parse(p, buf, bytes, items);
+		}
+		for (const convey_mux_item& it : items) {
+			convey_mux_dispatch(it);
+		}
+	}
+
+	{
+		std::lock_guard<std::mutex> lk(mux.lock);
+		mux.done = true;
+		mux.cv.notify_all();
+		for (size_t i = 0; i < mux.n; i++) {
+			mux.ch[i].cv.notify_all();
+		}
+	}
+	if (conf.verbose) {
+		convey_stats_print();
+	}
+	convey_shutdown();
+	return ok ? 0 : 1;
+}/*}}}*/
+/* }}} */
+
+/* {{{ Resumable session */
+static bool convey_resume_write(const std::string& frames)
+{/*{{{*/
+	DWORD bytes = static_cast<DWORD>(frames.size()), er{0};
+	if (!convey_write_pipe(epipe, frames.data(), &bytes, e_pipe_w, er)) {
+		if (!is_error) {
+			convey_error(er);
 		}
-		off += written;
+		convey_console_fail();
+		return false;
 	}
-
-	*bytes = off;
 	return true;
-}
+}/*}}}*/
 
-static void convey_stamp_lines(const char* buf, DWORD bytes, bool& at_line_start, std::string& out)
+/* Before the session threads, the hello is the first thing to come over
+ * each connection. */
+static void convey_resume_start(void)
 {/*{{{*/
-	for (DWORD i = 0; i < bytes; ++i) {
-		if (at_line_start) {
-			SYSTEMTIME st;
-			GetLocalTime(&st);
-			char stamp[16];
-			int n = wsprintfA(stamp, "[%02u:%02u:%02u] ", st.wHour, st.wMinute, st.wSecond);
-			out.append(stamp, n);
-			at_line_start = false;
-		}
-		out.push_back(buf[i]);
-		if ('\n' == buf[i]) {
-			at_line_start = true;
-		}
+	std::lock_guard<std::mutex> lk(resume.lock);
+	while (!resume.self) {
+		std::random_device rd;
+		resume.self = static_cast<uint64_t>(rd()) << 32 | rd();
 	}
+	resume.hello = false;
+	resume.in.clear();
 }/*}}}*/
 
-static void convey_hexdump(const char* buf, DWORD bytes, size_t& offset, std::string& out)
+/* The session reader's part, false ends the session. Bytes of a client
+ * that isn't a --resume convey only drop its connection, the replay
+ * buffer waits for the next one. A mismatch ends it for good. */
+static bool convey_resume_recv(const char* buf, DWORD bytes, std::string& data)
 {/*{{{*/
-	DWORD i = 0;
-	while (i < bytes) {
-		DWORD row = (bytes - i < 16) ? (bytes - i) : 16;
-		char head[16];
-		int n = wsprintfA(head, "%08lx  ", (unsigned long)offset);
-		out.append(head, n);
-		for (DWORD j = 0; j < 16; ++j) {
-			if (j < row) {
-				char hb[8];
-				int m = wsprintfA(hb, "%02x ", (unsigned char)buf[i + j]);
-				out.append(hb, m);
+	std::string err;
+	bool ack, mismatch;
+	{
+		std::lock_guard<std::mutex> lk(resume.lock);
+		if (!convey_resume_recv_locked(resume, buf, bytes, data, err, mismatch)) {
+			if (mismatch) {
+				std::cerr << "convey: --resume: " << err << std::endl;
+				restart_on_exit = false;
 			} else {
-				out.append("   ", 3);
+				std::cerr << "convey: --resume: " << err << ", dropping the connection" << std::endl;
 			}
-			if (7 == j) {
-				out.push_back(' ');
+			return false;
+		}
+		ack = convey_resume_ack_due_locked(resume, conf.resume_buffer, std::chrono::steady_clock::now());
+		resume.cv.notify_one();
+	}
+	if (ack) {
+		std::lock_guard<std::mutex> lk(outq.lock);
+		outq.kick = true;
+		outq.cv.notify_all();
+	}
+	return true;
+}/*}}}*/
+
+/* The session writer with --resume. It sends the hello, waits for the
+ * other end's and sends again what it missed, then the input and the
+ * acks. A failed write loses nothing, what was sent is in the replay
+ * buffer and goes again after the reconnect. */
+static void convey_resume_writer(void)
+{/*{{{*/
+	std::string out;
+	{
+		std::lock_guard<std::mutex> lk(resume.lock);
+		convey_resume_hello(out, resume.self, resume.peer, resume.received);
+		resume.ack_sent = resume.received;
+		resume.ack_at = std::chrono::steady_clock::now();
+	}
+	if (!convey_resume_write(out)) {
+		return;
+	}
+
+	out.clear();
+	{
+		std::unique_lock<std::mutex> lk(resume.lock);
+		while (!resume.hello && !is_error && !shutting_down) {
+			resume.cv.wait_for(lk, std::chrono::milliseconds(RESUME_ACK_MS));
+		}
+		if (!resume.hello) {
+			return;
+		}
+		if (conf.verbose && !resume.fresh) {
+			std::cout << "Session resumed, " << resume.replay.size() << " bytes to send again" << std::endl;
+		}
+		convey_resume_data(out, resume.acked, resume.replay.data(), resume.replay.size());
+		stats.resume_replayed += resume.replay.size();
+	}
+	if (!out.empty() && !convey_resume_write(out)) {
+		return;
+	}
+
+	/* After the end of the input the acks still go out. */
+	bool input = stdin_pump_started;
+	std::string chunk;
+	while (!is_error && !shutting_down) {
+		out.clear();
+		bool room;
+		{
+			std::unique_lock<std::mutex> lk(resume.lock);
+			auto now = std::chrono::steady_clock::now();
+			if (convey_resume_ack_due_locked(resume, conf.resume_buffer, now)) {
+				convey_resume_ack(out, resume.received);
+				resume.ack_sent = resume.received;
+				resume.ack_at = now;
+			}
+			room = input && resume.replay.size() < conf.resume_buffer;
+			if (out.empty() && !room) {
+				resume.cv.wait_for(lk, std::chrono::milliseconds(RESUME_ACK_MS));
+				continue;
 			}
 		}
-		out.append("|", 1);
-		for (DWORD j = 0; j < row; ++j) {
-			unsigned char c = (unsigned char)buf[i + j];
-			out.push_back((c >= 0x20 && c < 0x7f) ? (char)c : '.');
+		if (!out.empty() && !convey_resume_write(out)) {
+			return;
+		}
+		if (!room) {
+			continue;
+		}
+		if (!convey_outq_pop(outq, chunk)) {
+			input = false;
+			continue;
+		}
+		if (chunk.empty()) {
+			continue;
+		}
+		out.clear();
+		{
+			std::lock_guard<std::mutex> lk(resume.lock);
+			convey_resume_data(out, resume.sent, chunk.data(), chunk.size());
+			resume.replay += chunk;
+			resume.sent += chunk.size();
+		}
+		convey_log_sent(chunk.data(), static_cast<DWORD>(chunk.size()));
+		if (!convey_resume_write(out)) {
+			return;
 		}
-		out.append("|\n", 2);
-		offset += row;
-		i += row;
 	}
 }/*}}}*/
-#undef OV_E
 /* }}} */
+#endif
 
-#ifndef CONVEY_UNIT_TEST
+#ifndef CONVEY_LIBRARY
 int main(int argc, char** argv)
 {/*{{{*/
 
@@ -1069,81 +11104,141 @@ restart:
 			return 0;
 	}
 
+	if (!conf.serve.empty()) {
+		return convey_serve_run();
+	}
+
 	if (conf.bridge) {
 		if (conf.verbose) {
 			std::cout << "Bridging '" << conf.bridge_pipe_name << "' <-> '"
 				<< conf.pipe_path << "'" << std::endl;
 		}
 
-		std::thread b0([]() {
-			while (true) {
-				if (is_error || shutting_down) {
-					return;
-				}
-
-				char buf[BUF_SIZE];
-				DWORD bytes{0}, er{0};
-
-				bool rc = convey_read_pipe(pipe, buf, &bytes, e_pipe_r, er);
-				if (!rc || (convey_transport_is_tcp() && 0 == bytes)) {
-					if (!rc && !is_error) {
-						convey_error(er);
+		if (conf.gdb) {
+			convey_rsp_reset(!conf.pty_link.empty());
+		}
+		if (conf.kd) {
+			convey_kd_reset();
+		}
+		if (!convey_uring_session_run(bpipe, bpipe)) {
+			std::thread b0([]() {
+				convey_autotune at{0, 0, 0};
+				while (true) {
+					if (is_error || shutting_down) {
+						return;
 					}
-					convey_bridge_fail();
-					return;
-				}
 
-				if (bytes) {
-					convey_log_recv(buf, bytes);
-					rc = convey_write_pipe(bpipe, buf, &bytes, e_out, er);
-					if (!rc) {
-						if (!is_error) {
+					char buf[RECV_BUF_SIZE];
+					DWORD bytes{0}, er{0};
+
+					bool rc = convey_read_pipe(epipe, buf, &bytes, e_pipe_r, er);
+					if (!rc || convey_endpoint_eof(bytes)) {
+						if (!rc && !is_error) {
 							convey_error(er);
 						}
 						convey_bridge_fail();
 						return;
 					}
-				}
-			}
-		});
 
-		std::thread b1([]() {
-			while (true) {
-				if (is_error || shutting_down) {
-					return;
+					if (bytes) {
+						bridge_last_rx = GetTickCount64();
+						convey_tcp_autotune(epipe, SO_RCVBUF, at, bytes);
+						convey_log_recv(buf, bytes);
+						if (conf.gdb) {
+							rc = convey_rsp_from_target(buf, bytes, er);
+						} else if (conf.kd) {
+							rc = convey_kd_forward(1, buf, bytes, er);
+						} else {
+							rc = convey_write_pipe(bpipe, buf, &bytes, e_out, er);
+						}
+						if (!rc) {
+							if (!is_error) {
+								convey_error(er);
+							}
+							convey_bridge_fail();
+							return;
+						}
+					}
 				}
+			});
 
-				char buf[BUF_SIZE];
-				DWORD bytes{0}, er{0};
+			std::thread b1([]() {
+				convey_autotune at{0, 0, 0};
+				while (true) {
+					if (is_error || shutting_down) {
+						return;
+					}
 
-				bool rc = convey_read_pipe(bpipe, buf, &bytes, e_in, er);
-				if (!rc) {
-					if (!is_error) {
-						convey_error(er);
+					char buf[BUF_SIZE];
+					DWORD bytes{0}, er{0};
+
+					bool rc = convey_read_pipe(bpipe, buf, &bytes, e_in, er);
+					/* An RFC 2217 client leaving reads as no bytes. */
+					if (!rc || (!bytes && !conf.rfc2217_port.empty())) {
+						if (!rc && !is_error) {
+							convey_error(er);
+						}
+						convey_bridge_fail();
+						return;
 					}
-					convey_bridge_fail();
-					return;
-				}
 
-				if (bytes) {
-					convey_log_sent(buf, bytes);
-					rc = convey_write_pipe(pipe, buf, &bytes, e_pipe_w, er);
-					if (!rc) {
-						if (!is_error) {
+					if (bytes) {
+						convey_log_sent(buf, bytes);
+						if (conf.gdb) {
+							rc = convey_rsp_from_gdb(buf, bytes, er);
+						} else if (conf.kd) {
+							rc = convey_kd_forward(0, buf, bytes, er);
+						} else {
+							rc = convey_write_pipe(epipe, buf, &bytes, e_pipe_w, er);
+						}
+						if (!rc) {
+							if (!is_error) {
+								convey_error(er);
+							}
+							convey_bridge_fail();
+							return;
+						}
+						convey_tcp_autotune(epipe, SO_SNDBUF, at, bytes);
+					}
+				}
+			});
+
+			bridge_last_rx = GetTickCount64();
+			std::thread b2([]() {
+				/* Silence from the endpoint for too long means a dead link,
+				 * even when TCP didn't notice yet. A gdb packet the stub
+				 * didn't ack goes out again from here. */
+				while ((conf.silence_timeout || conf.gdb) && !is_error && !shutting_down) {
+					if (conf.silence_timeout && GetTickCount64() - bridge_last_rx >= conf.silence_timeout * 1000ULL) {
+						if (conf.verbose) {
+							std::cerr << "convey: endpoint silent for " << conf.silence_timeout << " seconds, reconnecting" << std::endl;
+						}
+						convey_bridge_fail();
+						return;
+					}
+					DWORD er = 0;
+					if (conf.gdb && !convey_rsp_tick(er)) {
+						if (er && !is_error) {
 							convey_error(er);
 						}
 						convey_bridge_fail();
 						return;
 					}
+					std::this_thread::sleep_for(std::chrono::milliseconds(250));
 				}
-			}
-		});
+			});
 
-		b0.join();
-		b1.join();
+			b0.join();
+			b1.join();
+			b2.join();
+		}
 
 		convey_shutdown();
 
+		if (conf.verbose) {
+			convey_stats_print();
+		}
+
 		if (restart_on_exit) {
 			is_error = false;
 			shutting_down = false;
@@ -1154,41 +11249,65 @@ restart:
 		return 0;
 	}
 
-	std::thread t0([]() {
-		if (conf.read_only) {
-			return;
-		}
-		while (true) {
-			if (is_error || shutting_down) {
-				return;
-			}
+	if (!conf.zsend_files.empty() || !conf.zrecv_dir.empty() || !conf.send_file.empty() || !conf.recv_file.empty()) {
+		return convey_xfer_run();
+	}
+	if (!conf.mux.empty()) {
+		return convey_mux_run();
+	}
 
-			char buf[BUF_SIZE];
-			DWORD bytes{0}, er{0};
-			bool rc;
+	convey_stdin_pump_start();
+	if (conf.resume) {
+		convey_resume_start();
+	}
 
-			if (in_is_pipe) {
-				rc = convey_read_pipe(in, buf, &bytes, e_in, er);
-			} else {
-				rc = ReadFile(in, buf, sizeof buf, &bytes, nullptr);
-				er = GetLastError();
+	if (!convey_uring_session_run(in, out)) {
+		std::thread t0([]() {
+			if (conf.resume) {
+				convey_resume_writer();
+				return;
 			}
-			if (!rc) {
-				if (!is_error) {
-					convey_error(er);
+			if (conf.read_only) {
+				return;
+			}
+			if (stdin_pump_started) {
+				/* Send what the stdin reader queued, a failed write puts the rest back. */
+				convey_autotune at{0, 0, 0};
+				std::string chunk;
+				while (convey_outq_pop(outq, chunk)) {
+					DWORD bytes = (DWORD)chunk.size(), er{0};
+					bool rc = convey_write_pipe(epipe, chunk.data(), &bytes, e_pipe_w, er);
+					convey_log_sent(chunk.data(), bytes);
+					if (!rc) {
+						convey_outq_unget(outq, chunk.substr(bytes));
+						if (!is_error) {
+							convey_error(er);
+						}
+						convey_console_fail();
+						return;
+					}
+					convey_tcp_autotune(epipe, SO_SNDBUF, at, bytes);
 				}
-				convey_console_fail();
 				return;
 			}
-
-			/* Do not send bytes typed in the ctrl mode. */
-			if (bytes && !ctrl_mode) {
-				if (conf.no_xterm) {
-					bytes = convey_trim_crlf(buf, bytes);
+			convey_autotune at{0, 0, 0};
+			while (true) {
+				if (is_error || shutting_down) {
+					return;
 				}
 
-				convey_log_sent(buf, bytes);
-				rc = convey_write_pipe(pipe, buf, &bytes, e_pipe_w, er);
+				char buf[BUF_SIZE];
+				DWORD bytes{0}, er{0};
+				bool rc = false;
+
+				if (in_is_pipe) {
+					rc = convey_read_pipe(in, buf, &bytes, e_in, er);
+				} else {
+#ifdef _WIN32
+					rc = ReadFile(in, buf, sizeof buf, &bytes, nullptr);
+					er = GetLastError();
+#endif
+				}
 				if (!rc) {
 					if (!is_error) {
 						convey_error(er);
@@ -1196,63 +11315,53 @@ restart:
 					convey_console_fail();
 					return;
 				}
-			} else {
-				std::this_thread::sleep_for(std::chrono::milliseconds(3));
-			}
-		}
-		return;
-	});
-
-	stdin_thread = t0.native_handle();
+#ifndef _WIN32
+				if (!bytes) {
+					/* As on Windows, a closed input pipe ends the session,
+					 * the end of a file only stops this direction. */
+					struct stat st;
+					if (0 == fstat(in, &st) && (S_ISFIFO(st.st_mode) || S_ISSOCK(st.st_mode))) {
+						convey_console_fail();
+					}
+					return;
+				}
+#endif
 
-	std::thread t1([]() {
-		while (true) {
-			if (is_error || shutting_down) {
-				return;
+				bytes = convey_stdin_filter(buf, bytes);
+				if (bytes) {
+					convey_log_sent(buf, bytes);
+					rc = convey_write_pipe(epipe, buf, &bytes, e_pipe_w, er);
+					if (!rc) {
+						if (!is_error) {
+							convey_error(er);
+						}
+						convey_console_fail();
+						return;
+					}
+					convey_tcp_autotune(epipe, SO_SNDBUF, at, bytes);
+				} else {
+					std::this_thread::sleep_for(std::chrono::milliseconds(3));
+				}
 			}
+			return;
+		});
 
-			char buf[BUF_SIZE];
-			DWORD bytes{0}, er{0};
-			bool rc;
+#ifdef _WIN32
+		stdin_thread = t0.native_handle();
+#endif
 
-			rc = convey_read_pipe(pipe, buf, &bytes, e_pipe_r, er);
-			if (!rc) {
-				if (!is_error) {
-					convey_error(er);
+		std::thread t1([]() {
+			convey_autotune at{0, 0, 0};
+			while (true) {
+				if (is_error || shutting_down) {
+					return;
 				}
-				convey_console_fail();
-				return;
-			}
 
-			if (convey_transport_is_tcp() && 0 == bytes) {
-				convey_console_fail();
-				return;
-			}
+				char buf[RECV_BUF_SIZE];
+				DWORD bytes{0}, er{0};
+				bool rc;
 
-			if (bytes) {
-				convey_log_recv(buf, bytes);
-				const char* wbuf = buf;
-				DWORD wbytes = bytes;
-				std::string hexbuf, tsbuf;
-				if (conf.hex) {
-					static size_t hex_offset = 0;
-					convey_hexdump(wbuf, wbytes, hex_offset, hexbuf);
-					wbuf = hexbuf.data();
-					wbytes = (DWORD)hexbuf.size();
-				}
-				if (conf.timestamps) {
-					static bool ts_line_start = true;
-					convey_stamp_lines(wbuf, wbytes, ts_line_start, tsbuf);
-					wbuf = tsbuf.data();
-					wbytes = (DWORD)tsbuf.size();
-				}
-				DWORD wb = wbytes;
-				if (out_is_pipe) {
-					rc = convey_write_pipe(out, wbuf, &wb, e_out, er);
-				} else {
-					rc = WriteFile(out, wbuf, wbytes, &wb, nullptr);
-					er = GetLastError();
-				}
+				rc = convey_read_pipe(epipe, buf, &bytes, e_pipe_r, er);
 				if (!rc) {
 					if (!is_error) {
 						convey_error(er);
@@ -1260,44 +11369,104 @@ restart:
 					convey_console_fail();
 					return;
 				}
-			} else {
-				std::this_thread::sleep_for(std::chrono::milliseconds(3));
-			}
-		}
-	});
 
-	std::thread t2([]() {
-		// Watch keystrokes to mimic screen/minicom command approach.
-		// TODO yet it's simple, but integrating some curses for better control would be great.
-		while (true) {
-			if (is_error || shutting_down) {
-				return;
-			}
-			if (!ctrl_mode && (GetAsyncKeyState(VK_CONTROL) & 0x8000)) {
-				ctrl_mode = true;
-				if (!(GetAsyncKeyState('A') & 0x8000)) {
-					ctrl_mode = false;
+				if (convey_endpoint_eof(bytes)) {
+					convey_console_fail();
+					return;
+				}
+
+				/* With --resume the data comes out of the frames, a read
+				 * of only an ack or a resent part has none. */
+				const char* rbuf = buf;
+				std::string rdata;
+				if (conf.resume && bytes) {
+					if (!convey_resume_recv(buf, bytes, rdata)) {
+						convey_console_fail();
+						return;
+					}
+					rbuf = rdata.data();
+					bytes = static_cast<DWORD>(rdata.size());
+					if (!bytes) {
+						continue;
+					}
+				}
+
+				if (bytes) {
+					convey_tcp_autotune(epipe, SO_RCVBUF, at, bytes);
+					convey_log_recv(rbuf, bytes);
+					const char* wbuf = rbuf;
+					DWORD wbytes = bytes;
+					std::string hexbuf, tsbuf;
+					if (conf.hex) {
+						static size_t hex_offset = 0;
+						convey_hexdump(wbuf, wbytes, hex_offset, hexbuf);
+						wbuf = hexbuf.data();
+						wbytes = (DWORD)hexbuf.size();
+					}
+					if (conf.timestamps) {
+						static bool ts_line_start = true;
+						convey_stamp_lines(wbuf, wbytes, ts_line_start, tsbuf);
+						wbuf = tsbuf.data();
+						wbytes = (DWORD)tsbuf.size();
+					}
+					DWORD wb = wbytes;
+					if (out_is_pipe) {
+						rc = convey_write_pipe(out, wbuf, &wb, e_out, er);
+					} else {
+#ifdef _WIN32
+						rc = WriteFile(out, wbuf, wbytes, &wb, nullptr);
+						er = GetLastError();
+#endif
+					}
+					if (!rc) {
+						if (!is_error) {
+							convey_error(er);
+						}
+						convey_console_fail();
+						return;
+					}
+				} else {
+					std::this_thread::sleep_for(std::chrono::milliseconds(3));
 				}
 			}
-			if (ctrl_mode && (GetAsyncKeyState('Q') & 0x8000)) {
-				ctrl_mode = false;
-				if (conf.verbose) {
-					std::cout << std::endl << "convey: ctrl-a q sent, exit" << std::endl;
+		});
+
+#ifdef _WIN32
+		std::thread t2([]() {
+			// Watch keystrokes to mimic screen/minicom command approach.
+			// TODO yet it's simple, but integrating some curses for better control would be great.
+			while (true) {
+				if (is_error || shutting_down) {
+					return;
+				}
+				if (!ctrl_mode && (GetAsyncKeyState(VK_CONTROL) & 0x8000)) {
+					ctrl_mode = true;
+					if (!(GetAsyncKeyState('A') & 0x8000)) {
+						ctrl_mode = false;
+					}
 				}
-				convey_shutdown();
-				convey_final_cleanup();
-				ExitProcess(0);
+				if (ctrl_mode && (GetAsyncKeyState('Q') & 0x8000)) {
+					ctrl_mode = false;
+					convey_quit();
+				}
+				std::this_thread::sleep_for(std::chrono::milliseconds(128));
 			}
-			std::this_thread::sleep_for(std::chrono::milliseconds(128));
-		}
-	});
+		});
+#endif
 
-	t0.join();
-	t1.join();
-	t2.join();
+		t0.join();
+		t1.join();
+#ifdef _WIN32
+		t2.join();
+#endif
+	}
 
 	convey_shutdown();
 
+	if (conf.verbose) {
+		convey_stats_print();
+	}
+
 	if (restart_on_exit) {
 		is_error = false;
 		shutting_down = false;
@@ -1308,4 +11477,5 @@ restart:
 	return 0;
 }/*}}}*/
 #endif
+#endif
 
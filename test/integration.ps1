@@ -109,6 +109,46 @@ function Test-TcpListenIPv6 {
 }
 #endregion
 
+#region Unix socket transport
+function Test-UnixListenRoundTrip {
+    if (-not ('System.Net.Sockets.UnixDomainSocketEndPoint' -as [type])) {
+        Write-Host "SKIP: unix-listen round trip, no UnixDomainSocketEndPoint"
+        return
+    }
+    $path = Join-Path ([System.IO.Path]::GetTempPath()) ("convey_" + ([guid]::NewGuid().ToString('N').Substring(0, 8)) + ".sock")
+    $toSocket = "from-stdin-" + ([guid]::NewGuid().ToString('N').Substring(0, 8))
+    $toStdout = "from-socket-" + ([guid]::NewGuid().ToString('N').Substring(0, 8))
+    $inFile = [System.IO.Path]::GetTempFileName()
+    $outFile = [System.IO.Path]::GetTempFileName()
+    [System.IO.File]::WriteAllText($inFile, $toSocket)
+
+    $p = Start-Process -FilePath $Convey -ArgumentList "unix-listen:$path", "--no-xterm" `
+        -RedirectStandardInput $inFile -RedirectStandardOutput $outFile -PassThru -NoNewWindow
+    try {
+        Start-Sleep -Milliseconds 600
+        $sock = [System.Net.Sockets.Socket]::new([System.Net.Sockets.AddressFamily]::Unix,
+            [System.Net.Sockets.SocketType]::Stream, [System.Net.Sockets.ProtocolType]::Unspecified)
+        $sock.Connect([System.Net.Sockets.UnixDomainSocketEndPoint]::new($path))
+        $stream = [System.Net.Sockets.NetworkStream]::new($sock, $true)
+
+        Start-Sleep -Milliseconds 400
+        Assert-Equal $toSocket (Read-Text $stream 256 3000) 'unix-listen: stdin -> socket'
+
+        $bytes = [System.Text.Encoding]::ASCII.GetBytes($toStdout)
+        $stream.Write($bytes, 0, $bytes.Length)
+        $stream.Flush()
+        Start-Sleep -Milliseconds 500
+        $stream.Close()
+    } finally {
+        Stop-Proc $p
+    }
+
+    Start-Sleep -Milliseconds 200
+    Assert-Equal $toStdout ([System.IO.File]::ReadAllText($outFile).Trim()) 'unix-listen: socket -> stdout'
+    Remove-Item $inFile, $outFile, $path -ErrorAction SilentlyContinue
+}
+#endregion
+
 #region Bridge
 function Test-Bridge {
     $port = Get-FreePort
@@ -196,6 +236,50 @@ function Test-TcpClientReconnect {
         $listener.Stop()
     }
 }
+
+function Test-TcpClientQueue {
+    # With --queue-limit, stdin written while the link is down must be
+    # delivered in order on the next connection.
+    $port = Get-FreePort
+    $listener = [System.Net.Sockets.TcpListener]::new([System.Net.IPAddress]::Loopback, $port)
+    $listener.Start()
+
+    $psi = [System.Diagnostics.ProcessStartInfo]::new()
+    $psi.FileName = $Convey
+    $psi.Arguments = "tcp:127.0.0.1:$port --reconnect --poll 10 --queue-limit 65536 --no-xterm"
+    $psi.UseShellExecute = $false
+    $psi.RedirectStandardInput = $true
+    $psi.RedirectStandardOutput = $true
+    $proc = [System.Diagnostics.Process]::Start($psi)
+    try {
+        $t1 = $listener.AcceptTcpClientAsync()
+        if (-not $t1.Wait(3000)) { Assert-Equal 'accepted' 'timeout' 'queue: first connection'; return }
+        $c1 = $t1.Result
+
+        # Take the link down, then feed stdin while nothing is listening.
+        $listener.Stop()
+        $c1.Close()
+        Start-Sleep -Milliseconds 300
+        $m = "queued-" + ([guid]::NewGuid().ToString('N').Substring(0, 8))
+        $proc.StandardInput.Write($m)
+        $proc.StandardInput.Flush()
+        Start-Sleep -Milliseconds 500
+
+        $listener = [System.Net.Sockets.TcpListener]::new([System.Net.IPAddress]::Loopback, $port)
+        $listener.Start()
+        $t2 = $listener.AcceptTcpClientAsync()
+        $ok = $t2.Wait(5000)
+        Assert-Equal $true $ok 'queue: second connection accepted'
+        if ($ok) {
+            $c2 = $t2.Result
+            Assert-Equal $m (Read-Text $c2.GetStream() 256 3000) 'queue: input sent while down arrives after reconnect'
+            $c2.Close()
+        }
+    } finally {
+        if (-not $proc.HasExited) { $proc.Kill() }
+        $listener.Stop()
+    }
+}
 #endregion
 
 #region Console
@@ -393,12 +477,50 @@ function Test-Log {
 }
 #endregion
 
+#region Server
+function Test-Serve {
+    # --serve relays each listener to its endpoint, one process for all.
+    $vmPort = Get-FreePort
+    $lPort = Get-FreePort
+    $vm = [System.Net.Sockets.TcpListener]::new([System.Net.IPAddress]::Loopback, $vmPort)
+    $vm.Start()
+    $conf = [System.IO.Path]::GetTempFileName()
+    [System.IO.File]::WriteAllText($conf, "# one session`ntcp-listen:$lPort tcp:127.0.0.1:$vmPort`n")
+
+    $p = Start-Process -FilePath $Convey -ArgumentList "--serve", $conf -PassThru -NoNewWindow
+    try {
+        Start-Sleep -Milliseconds 600
+        $client = [System.Net.Sockets.TcpClient]::new()
+        $client.Connect('127.0.0.1', $lPort)
+        $t = $vm.AcceptTcpClientAsync()
+        if (-not $t.Wait(3000)) { Assert-Equal 'accepted' 'timeout' 'serve: endpoint opened on connect'; return }
+        $peer = $t.Result
+        $up = "up-" + ([guid]::NewGuid().ToString('N').Substring(0, 8))
+        $down = "down-" + ([guid]::NewGuid().ToString('N').Substring(0, 8))
+        $b = [System.Text.Encoding]::ASCII.GetBytes($up)
+        $client.GetStream().Write($b, 0, $b.Length)
+        Assert-Equal $up (Read-Text $peer.GetStream() 256 3000) 'serve: client bytes reach the endpoint'
+        $b = [System.Text.Encoding]::ASCII.GetBytes($down)
+        $peer.GetStream().Write($b, 0, $b.Length)
+        Assert-Equal $down (Read-Text $client.GetStream() 256 3000) 'serve: endpoint bytes reach the client'
+        $client.Close()
+        $peer.Close()
+    } finally {
+        Stop-Proc $p
+        $vm.Stop()
+    }
+    Remove-Item $conf -ErrorAction SilentlyContinue
+}
+#endregion
+
 #region Runner
 $tests = @(
     'Test-TcpListenRoundTrip'
     'Test-TcpListenIPv6'
+    'Test-UnixListenRoundTrip'
     'Test-Bridge'
     'Test-TcpClientReconnect'
+    'Test-TcpClientQueue'
     'Test-ReadOnly'
     'Test-Timestamps'
     'Test-Hex'
@@ -406,6 +528,7 @@ $tests = @(
     'Test-LogSend'
     'Test-LogConflict'
     'Test-Log'
+    'Test-Serve'
 )
 
 Write-Host "Testing $Convey"
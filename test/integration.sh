@@ -0,0 +1,614 @@
+#!/bin/sh
+# Integration tests for convey on POSIX systems.
+# Drives the real convey binary over loopback, with convey itself as the
+# peer, and checks byte round-trips. The counterpart of integration.ps1.
+
+CONVEY=${1:-$(dirname "$0")/../convey}
+
+if [ ! -x "$CONVEY" ]; then
+	echo "convey not found at '$CONVEY'; build it first."
+	exit 2
+fi
+
+failures=0
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+port=$((20000 + $$ % 20000))
+
+# {{{ Helpers
+assert_equal() {
+	if [ "$1" = "$2" ]; then
+		echo "PASS: $3"
+	else
+		echo "FAIL: $3"
+		echo "  expected: '$1'"
+		echo "  actual:   '$2'"
+		failures=$((failures + 1))
+	fi
+}
+
+next_port() {
+	port=$((port + 1))
+}
+
+hex_of() {
+	od -An -tx1 "$1" | tr -d ' \n'
+}
+# }}}
+
+# {{{ TCP transport
+test_tcp_listen_round_trip() {
+	next_port
+	# Files, a closed input pipe would end the session before the reply.
+	printf 'from-server' > "$tmp/srv.in"
+	printf 'from-client' > "$tmp/cli.in"
+	timeout 2 "$CONVEY" tcp-listen:$port < "$tmp/srv.in" > "$tmp/srv.out" &
+	sleep 0.5
+	timeout 1 "$CONVEY" tcp:127.0.0.1:$port < "$tmp/cli.in" > "$tmp/cli.out"
+	wait
+	assert_equal 'from-client' "$(cat "$tmp/srv.out")" 'tcp-listen: socket -> stdout'
+	assert_equal 'from-server' "$(cat "$tmp/cli.out")" 'tcp: socket -> stdout'
+}
+
+# The same with the threaded data path, where the default is io_uring.
+test_tcp_threads_round_trip() {
+	next_port
+	printf 'from-server' > "$tmp/srv.in"
+	printf 'from-client' > "$tmp/cli.in"
+	timeout 2 "$CONVEY" --io-engine threads tcp-listen:$port < "$tmp/srv.in" > "$tmp/srv.out" &
+	sleep 0.5
+	timeout 1 "$CONVEY" --io-engine threads tcp:127.0.0.1:$port < "$tmp/cli.in" > "$tmp/cli.out"
+	wait
+	assert_equal 'from-client' "$(cat "$tmp/srv.out")" 'threads: socket -> stdout'
+	assert_equal 'from-server' "$(cat "$tmp/cli.out")" 'threads: socket -> stdout, other side'
+}
+
+test_tcp_bulk() {
+	next_port
+	head -c 1048576 /dev/urandom > "$tmp/bulk.in"
+	timeout 5 "$CONVEY" tcp-listen:$port < "$tmp/bulk.in" > /dev/null &
+	sleep 0.5
+	timeout 2 "$CONVEY" tcp:127.0.0.1:$port < /dev/null > "$tmp/bulk.out"
+	wait
+	assert_equal 'same' "$(cmp -s "$tmp/bulk.in" "$tmp/bulk.out" && echo same || echo differ)" 'tcp: 1 MiB arrives intact'
+}
+
+test_tcp_client_queue() {
+	next_port
+	mkfifo "$tmp/in"
+	timeout 8 "$CONVEY" --reconnect --poll 5 --queue-limit 65536 tcp:127.0.0.1:$port < "$tmp/in" > /dev/null 2>&1 &
+	cli=$!
+	exec 7> "$tmp/in"
+	printf 'queued ' >&7
+	sleep 0.5
+	timeout 1 "$CONVEY" tcp-listen:$port < /dev/null > "$tmp/q1.out" &
+	sleep 0.5
+	printf 'live' >&7
+	wait $!
+	timeout 1 "$CONVEY" tcp-listen:$port < /dev/null > "$tmp/q2.out" &
+	sleep 0.5
+	printf 'resent' >&7
+	wait $!
+	exec 7>&-
+	kill $cli 2> /dev/null
+	wait $cli
+	assert_equal 'queued live' "$(cat "$tmp/q1.out")" 'queue: input before the connect is sent'
+	assert_equal 'resent' "$(cat "$tmp/q2.out")" 'queue: input after a reconnect is sent'
+}
+
+test_hex() {
+	next_port
+	timeout 5 "$CONVEY" --hex tcp-listen:$port < /dev/null > "$tmp/hex.out" &
+	sleep 0.5
+	printf 'AB' | timeout 5 "$CONVEY" tcp:127.0.0.1:$port > /dev/null
+	wait
+	assert_equal '00000000  41 42                                            |AB|' "$(cat "$tmp/hex.out")" '--hex: dump of the received bytes'
+}
+# }}}
+
+# {{{ WebSocket transport
+# convey itself plays the browser: the upgrade request, then a masked
+# binary frame with a zero key, so the payload reads as it is.
+test_ws_listen_round_trip() {
+	next_port
+	printf 'to-browser' > "$tmp/ws-srv.in"
+	printf 'GET / HTTP/1.1\r\nHost: localhost\r\nUpgrade: websocket\r\nConnection: Upgrade\r\nSec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\nSec-WebSocket-Version: 13\r\n\r\n\202\202\0\0\0\0hi' > "$tmp/ws-cli.in"
+	timeout 2 "$CONVEY" ws-listen:$port < "$tmp/ws-srv.in" > "$tmp/ws-srv.out" &
+	sleep 0.5
+	timeout 1 "$CONVEY" tcp:127.0.0.1:$port < "$tmp/ws-cli.in" > "$tmp/ws-cli.out"
+	wait
+	assert_equal 'hi' "$(cat "$tmp/ws-srv.out")" 'ws-listen: frame -> stdout'
+	assert_equal '1' "$(grep -c 'Sec-WebSocket-Accept: s3pPLMBiTxaQ9kYGzzhZRbK+xOo=' "$tmp/ws-cli.out")" 'ws-listen: handshake accepted'
+	assert_equal '820a746f2d62726f77736572' "$(hex_of "$tmp/ws-cli.out" | tail -c 24)" 'ws-listen: stdin -> binary frame'
+}
+
+# A client that connected first and sends nothing doesn't hold up the
+# browser behind it, and an unmasked frame is answered with close 1002.
+test_ws_listen_idle_client() {
+	next_port
+	printf 'GET / HTTP/1.1\r\nHost: localhost\r\nUpgrade: websocket\r\nConnection: Upgrade\r\nSec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\nSec-WebSocket-Version: 13\r\n\r\n\202\002hi' > "$tmp/ws-bare.in"
+	sleep 2 | timeout 3 "$CONVEY" ws-listen:$port > "$tmp/ws-bare.out" &
+	sleep 0.3
+	sleep 3 | timeout 3 "$CONVEY" tcp:127.0.0.1:$port > /dev/null 2>&1 &
+	sleep 0.2
+	(cat "$tmp/ws-bare.in"; sleep 1) | timeout 2 "$CONVEY" tcp:127.0.0.1:$port > "$tmp/ws-bare-cli.out" 2> /dev/null
+	wait
+	assert_equal '' "$(cat "$tmp/ws-bare.out")" 'ws-listen: unmasked frame dropped'
+	assert_equal '880203ea' "$(hex_of "$tmp/ws-bare-cli.out" | tail -c 8)" 'ws-listen: close 1002 after an idle client'
+}
+# }}}
+
+# {{{ Unix socket transport
+test_unix_listen_round_trip() {
+	timeout 5 "$CONVEY" unix-listen:"$tmp/u.sock" < /dev/null > "$tmp/u.out" &
+	sleep 0.5
+	printf 'over-unix' | timeout 5 "$CONVEY" unix:"$tmp/u.sock" > /dev/null
+	wait
+	assert_equal 'over-unix' "$(cat "$tmp/u.out")" 'unix-listen: socket -> stdout'
+	assert_equal 'gone' "$([ -e "$tmp/u.sock" ] && echo left || echo gone)" 'unix-listen: socket file removed on exit'
+}
+
+# A socket somebody still listens on is not taken over, one left over by
+# a killed run is.
+test_unix_listen_in_use() {
+	next_port
+	printf 'tcp-listen:%s tcp:127.0.0.1:%s\n' $port $port > "$tmp/busy.conf"
+	timeout 2 "$CONVEY" --serve "$tmp/busy.conf" --control "$tmp/busy.sock" > /dev/null 2>&1 &
+	sleep 0.3
+	timeout 1 "$CONVEY" unix-listen:"$tmp/busy.sock" < /dev/null > /dev/null 2>&1
+	assert_equal '1' "$?" 'unix-listen: a socket in use is not taken over'
+	wait
+	"$CONVEY" unix-listen:"$tmp/left.sock" < /dev/null > /dev/null 2>&1 &
+	sleep 0.3
+	kill -9 $!
+	wait
+	timeout 0.5 "$CONVEY" unix-listen:"$tmp/left.sock" < /dev/null > /dev/null 2>&1
+	assert_equal '124' "$?" 'unix-listen: a socket left over is replaced'
+}
+
+# A regular file at the path is left alone, the listen fails.
+test_unix_listen_regular_file() {
+	printf 'keep' > "$tmp/u.file"
+	timeout 2 "$CONVEY" unix-listen:"$tmp/u.file" < /dev/null > /dev/null 2>&1
+	assert_equal 'keep' "$(cat "$tmp/u.file")" 'unix-listen: a regular file is not removed'
+}
+# }}}
+
+# {{{ UDP transport
+# Three datagrams in, one log record each, and the answer goes back to
+# the sender.
+test_udp_round_trip() {
+	next_port
+	(sleep 1.2; printf 'pong'; sleep 1) | timeout 2.5 "$CONVEY" --log "$tmp/udp.log" udp-listen:$port > "$tmp/udp-srv.out" &
+	sleep 0.3
+	printf 'a\n' > "$tmp/udp1.in"
+	printf 'bc\n' > "$tmp/udp2.in"
+	timeout 0.3 "$CONVEY" udp:127.0.0.1:$port < "$tmp/udp1.in" > /dev/null
+	timeout 0.3 "$CONVEY" udp:127.0.0.1:$port < "$tmp/udp2.in" > /dev/null
+	printf 'end' > "$tmp/udp3.in"
+	timeout 1.5 "$CONVEY" udp:127.0.0.1:$port < "$tmp/udp3.in" > "$tmp/udp-cli.out"
+	wait
+	assert_equal "$(printf 'a\nbc\nend')" "$(cat "$tmp/udp-srv.out")" 'udp-listen: datagrams -> stdout'
+	assert_equal "$(printf '< a\n< bc\n< end> pong')" "$(cat "$tmp/udp.log")" 'udp-listen: a log record per datagram'
+	assert_equal 'pong' "$(cat "$tmp/udp-cli.out")" 'udp-listen: stdin -> last sender'
+}
+# }}}
+
+# {{{ vsock transport
+# Runs over the loopback CID, which needs the vsock_loopback module.
+test_vsock_round_trip() {
+	if [ ! -d /sys/module/vsock_loopback ]; then
+		echo "SKIP: vsock: no loopback transport"
+		return
+	fi
+	next_port
+	timeout 5 "$CONVEY" vsock-listen:$port < /dev/null > "$tmp/vs.out" &
+	sleep 0.5
+	printf 'over-vsock' | timeout 5 "$CONVEY" vsock:1:$port > /dev/null
+	wait
+	assert_equal 'over-vsock' "$(cat "$tmp/vs.out")" 'vsock-listen: socket -> stdout'
+}
+# }}}
+
+# {{{ Shared memory transport
+test_shm_round_trip() {
+	name="convey-test-$$"
+	timeout 5 "$CONVEY" shm:$name < /dev/null > "$tmp/shm.out" &
+	sleep 0.3
+	printf 'over-shm' | timeout 5 "$CONVEY" shm:$name > /dev/null
+	wait
+	assert_equal 'over-shm' "$(cat "$tmp/shm.out")" 'shm: ring -> stdout'
+	assert_equal 'gone' "$([ -e /dev/shm/convey-shm-$name ] && echo left || echo gone)" 'shm: region removed on exit'
+}
+# }}}
+
+# {{{ Bridge
+test_pty_bridge() {
+	next_port
+	timeout 5 "$CONVEY" tcp-listen:$port < /dev/null > "$tmp/pty.out" &
+	srv=$!
+	sleep 0.3
+	timeout 5 "$CONVEY" --pty-link "$tmp/pty" tcp:127.0.0.1:$port > /dev/null 2>&1 &
+	bridge=$!
+	sleep 0.5
+	printf 'via-pty' | timeout 2 "$CONVEY" "$tmp/pty" > /dev/null
+	sleep 0.5
+	kill $srv $bridge 2> /dev/null
+	wait
+	assert_equal 'via-pty' "$(cat "$tmp/pty.out")" '--pty-link: pty -> socket'
+}
+
+# What came while no client had the pty open isn't handed to the next.
+test_pty_stale_flush() {
+	case "$(uname)" in Linux) ;; *) return ;; esac
+	next_port
+	(printf 'stale'; sleep 1.5; printf 'fresh'; sleep 1) | timeout 4 "$CONVEY" tcp-listen:$port > /dev/null &
+	sleep 0.3
+	timeout 4 "$CONVEY" --pty-link "$tmp/pty-stale" tcp:127.0.0.1:$port > /dev/null 2>&1 &
+	sleep 0.7
+	sleep 2 | timeout 2 "$CONVEY" "$tmp/pty-stale" > "$tmp/pty-stale.out"
+	wait
+	assert_equal 'fresh' "$(cat "$tmp/pty-stale.out")" '--pty-link: stale output flushed on open'
+}
+# }}}
+
+# {{{ GDB remote protocol relay
+# tcp-listen stands in for kgdb: --gdb acks its reply, turns away a
+# broken packet, and offers gdb no-ack mode on its behalf.
+test_gdb_relay() {
+	next_port
+	(sleep 1.5; printf '+$PacketSize=4000#f4$T05#00'; sleep 1.5) | timeout 4 "$CONVEY" tcp-listen:$port > "$tmp/stub.out" &
+	sleep 0.3
+	timeout 4 "$CONVEY" --gdb --pty-link "$tmp/gdb-pty" tcp:127.0.0.1:$port > /dev/null 2>&1 &
+	sleep 0.5
+	(printf '$qSupported#37'; sleep 2) | timeout 2.5 "$CONVEY" "$tmp/gdb-pty" > "$tmp/gdb.out"
+	wait
+	assert_equal '$qSupported#37+-' "$(cat "$tmp/stub.out")" '--gdb: packet forwarded, reply acked, bad packet refused'
+	assert_equal '+$PacketSize=4000;QStartNoAckMode+#0a' "$(cat "$tmp/gdb.out")" '--gdb: packet acked, no-ack mode offered'
+}
+
+# A stub that never acks gets the packet again, gdb in no-ack mode
+# wouldn't resend it.
+test_gdb_resend() {
+	next_port
+	sleep 4 | timeout 4 "$CONVEY" tcp-listen:$port > "$tmp/stub2.out" &
+	sleep 0.3
+	timeout 4 "$CONVEY" --gdb --pty-link "$tmp/gdb-pty2" tcp:127.0.0.1:$port > /dev/null 2>&1 &
+	sleep 0.5
+	(printf '$g#67'; sleep 3) | timeout 3 "$CONVEY" "$tmp/gdb-pty2" > /dev/null
+	wait
+	assert_equal '$g#67$g#67$g#67' "$(head -c 15 "$tmp/stub2.out")" '--gdb: unacked packet sent again'
+}
+# }}}
+
+# {{{ File transfer
+# --zsend and --zrecv on both ends of a TCP link, then a broken copy is
+# completed from where it ends.
+test_zmodem_transfer() {
+	mkdir -p "$tmp/zsrc" "$tmp/zdst"
+	head -c 300000 /dev/urandom > "$tmp/zsrc/blob.bin"
+	next_port
+	timeout 10 "$CONVEY" --zrecv "$tmp/zdst" tcp-listen:$port > /dev/null 2>&1 &
+	sleep 0.3
+	timeout 10 "$CONVEY" --zsend "$tmp/zsrc/blob.bin" tcp:127.0.0.1:$port > /dev/null 2>&1
+	wait
+	assert_equal 'same' "$(cmp -s "$tmp/zsrc/blob.bin" "$tmp/zdst/blob.bin" && echo same)" 'zmodem: file received'
+
+	head -c 100000 "$tmp/zsrc/blob.bin" > "$tmp/zdst/blob.bin"
+	next_port
+	timeout 10 "$CONVEY" --zrecv "$tmp/zdst" tcp-listen:$port > /dev/null 2>&1 &
+	sleep 0.3
+	timeout 10 "$CONVEY" -v --zsend "$tmp/zsrc/blob.bin" tcp:127.0.0.1:$port > /dev/null 2> "$tmp/zsend.err"
+	wait
+	assert_equal 'same' "$(cmp -s "$tmp/zsrc/blob.bin" "$tmp/zdst/blob.bin" && echo same)" 'zmodem: broken file completed'
+	assert_equal '1' "$(grep -c 'transfer, 1 files, 200000 bytes' "$tmp/zsend.err")" 'zmodem: only the rest sent'
+}
+
+# --send-file into --recv-file, once straight from the file and once
+# copied, for --log-send to see the bytes.
+test_raw_transfer() {
+	mkdir -p "$tmp/rsrc" "$tmp/rdst"
+	head -c 3000000 /dev/urandom > "$tmp/rsrc/blob.bin"
+	next_port
+	timeout 10 "$CONVEY" --recv-file "$tmp/rdst/blob.bin" tcp-listen:$port > /dev/null 2>&1 &
+	sleep 0.3
+	timeout 10 "$CONVEY" -v --send-file "$tmp/rsrc/blob.bin" tcp:127.0.0.1:$port > /dev/null 2> "$tmp/rsend.err"
+	wait
+	assert_equal 'same' "$(cmp -s "$tmp/rsrc/blob.bin" "$tmp/rdst/blob.bin" && echo same)" 'raw: file received'
+	assert_equal '1' "$(grep -c 'transfer, 1 files, 3000000 bytes' "$tmp/rsend.err")" 'raw: all of it sent'
+
+	rm -f "$tmp/rdst/blob.bin"
+	next_port
+	timeout 10 "$CONVEY" --recv-file "$tmp/rdst/blob.bin" tcp-listen:$port > /dev/null 2>&1 &
+	sleep 0.3
+	timeout 10 "$CONVEY" --log-send "$tmp/rsend.log" --send-file "$tmp/rsrc/blob.bin" tcp:127.0.0.1:$port > /dev/null 2>&1
+	wait
+	assert_equal 'same' "$(cmp -s "$tmp/rsrc/blob.bin" "$tmp/rdst/blob.bin" && echo same)" 'raw: copied file received'
+	assert_equal 'same' "$(cmp -s "$tmp/rsrc/blob.bin" "$tmp/rsend.log" && echo same)" 'raw: copied file logged'
+}
+# }}}
+
+# {{{ Channel multiplexer
+# Two channels over one link between two --mux instances, each reaching
+# its own convey at the far end, both ways.
+test_mux_channels() {
+	next_port; link=$port
+	next_port; l1=$port
+	next_port; l2=$port
+	next_port; s1=$port
+	next_port; s2=$port
+	printf 'from-one' > "$tmp/s1.in"
+	printf 'from-two' > "$tmp/s2.in"
+	printf 'to-one' > "$tmp/c1.in"
+	printf 'to-two' > "$tmp/c2.in"
+	timeout 4 "$CONVEY" tcp-listen:$s1 < "$tmp/s1.in" > "$tmp/s1.out" &
+	timeout 4 "$CONVEY" tcp-listen:$s2 < "$tmp/s2.in" > "$tmp/s2.out" &
+	timeout 4 "$CONVEY" --mux tcp-listen:$l1 --mux tcp-listen:$l2 tcp-listen:$link > /dev/null 2>&1 &
+	sleep 0.3
+	timeout 4 "$CONVEY" --mux tcp:127.0.0.1:$s1 --mux tcp:127.0.0.1:$s2 tcp:127.0.0.1:$link > /dev/null 2>&1 &
+	sleep 0.3
+	timeout 2 "$CONVEY" tcp:127.0.0.1:$l1 < "$tmp/c1.in" > "$tmp/c1.out" &
+	timeout 2 "$CONVEY" tcp:127.0.0.1:$l2 < "$tmp/c2.in" > "$tmp/c2.out"
+	wait
+	assert_equal 'to-one' "$(cat "$tmp/s1.out")" 'mux: first channel out'
+	assert_equal 'from-one' "$(cat "$tmp/c1.out")" 'mux: first channel back'
+	assert_equal 'to-two' "$(cat "$tmp/s2.out")" 'mux: second channel out'
+	assert_equal 'from-two' "$(cat "$tmp/c2.out")" 'mux: second channel back'
+}
+
+# A boot log through --compress goes over the link in a third or less.
+test_mux_compressed() {
+	next_port; link=$port
+	next_port; l1=$port
+	next_port; s1=$port
+	awk 'BEGIN { for (i = 0; i < 4000; i++) printf "[%12.6f] usb 1-%d: new high-speed USB device number %d using xhci_hcd\n", i / 997, i % 4, i % 16 }' \
+		> "$tmp/boot.log"
+	sleep 3 | timeout 4 "$CONVEY" tcp-listen:$s1 > "$tmp/zs1.out" &
+	timeout 5 "$CONVEY" -v --compress --mux tcp-listen:$l1 tcp-listen:$link > /dev/null 2> "$tmp/zmux.err" &
+	sleep 0.3
+	timeout 3 "$CONVEY" --compress --mux tcp:127.0.0.1:$s1 tcp:127.0.0.1:$link > /dev/null 2>&1 &
+	sleep 0.3
+	timeout 2 "$CONVEY" tcp:127.0.0.1:$l1 < "$tmp/boot.log" > /dev/null
+	wait
+	cmp -s "$tmp/boot.log" "$tmp/zs1.out"
+	assert_equal 0 $? '--compress: log passed'
+	set -- $(sed -n 's/^convey: compression, \([0-9]*\) bytes sent as \([0-9]*\),.*/\1 \2/p' "$tmp/zmux.err")
+	assert_equal 1 "$([ -n "$2" ] && [ $(($2 * 3)) -lt $1 ] && echo 1)" '--compress: a third on the wire'
+}
+# }}}
+
+# {{{ Resumable sessions
+# A --serve relay between a tcp-listen: and a tcp: convey with --resume
+# is killed twice while lines go both ways, none may be lost or doubled.
+test_resume_reconnect() {
+	next_port; srv=$port
+	next_port; rel=$port
+	printf 'tcp-listen:%s tcp:127.0.0.1:%s\n' $rel $srv > "$tmp/resume.conf"
+	lines() {
+		i=0
+		while [ $i -lt 200 ]; do
+			i=$((i + 1))
+			echo "$1 line $i"
+			sleep 0.01
+		done
+		sleep 5
+	}
+	lines server | timeout 9 "$CONVEY" --reconnect --resume tcp-listen:$srv > "$tmp/resume-srv.out" 2> /dev/null &
+	sleep 0.2
+	timeout 9 "$CONVEY" --serve "$tmp/resume.conf" > /dev/null 2>&1 &
+	relay=$!
+	sleep 0.2
+	lines client | timeout 8 "$CONVEY" -p 5 --reconnect --resume tcp:127.0.0.1:$rel > "$tmp/resume-cli.out" 2> /dev/null &
+	sleep 1
+	kill $relay
+	sleep 0.5
+	timeout 8 "$CONVEY" --serve "$tmp/resume.conf" > /dev/null 2>&1 &
+	relay=$!
+	sleep 1
+	kill $relay
+	sleep 0.3
+	timeout 7 "$CONVEY" --serve "$tmp/resume.conf" > /dev/null 2>&1 &
+	wait
+	assert_equal "$(seq 200 | sed 's/^/server line /')" "$(cat "$tmp/resume-cli.out")" '--resume: server to client whole'
+	assert_equal "$(seq 200 | sed 's/^/client line /')" "$(cat "$tmp/resume-srv.out")" '--resume: client to server whole'
+}
+
+# A client that doesn't speak --resume only loses its own connection,
+# the listener takes the next one.
+test_resume_stray_client() {
+	next_port; srv=$port
+	(echo server; sleep 4) | timeout 5 "$CONVEY" --reconnect --resume tcp-listen:$srv > "$tmp/stray-srv.out" 2> "$tmp/stray-srv.err" &
+	sleep 0.2
+	(printf 'GET / HTTP/1.0\r\n\r\n'; sleep 1) | timeout 2 "$CONVEY" tcp:127.0.0.1:$srv > /dev/null 2>&1
+	(echo client; sleep 2) | timeout 3 "$CONVEY" --reconnect --resume tcp:127.0.0.1:$srv > "$tmp/stray-cli.out" 2> /dev/null
+	wait
+	assert_equal server "$(cat "$tmp/stray-cli.out")" '--resume: served after a stray client'
+	assert_equal client "$(cat "$tmp/stray-srv.out")" '--resume: heard after a stray client'
+	grep -q 'dropping the connection' "$tmp/stray-srv.err"
+	assert_equal 0 $? '--resume: stray client dropped'
+}
+# }}}
+
+# {{{ Windows kernel debugger relay
+# tcp-listen stands in for the target: --kd passes a data packet, the
+# debugger's ack and a breakin as they are, and counts them.
+test_kd_relay() {
+	next_port
+	(sleep 1; printf '0000\002\060\003\000\000\000\200\200\006\000\000\000\001\002\003\252'; sleep 2) \
+		| timeout 3.5 "$CONVEY" tcp-listen:$port > "$tmp/kd-target.out" &
+	sleep 0.3
+	timeout 4 "$CONVEY" -v --kd --pty-link "$tmp/kd-pty" tcp:127.0.0.1:$port > /dev/null 2> "$tmp/kd.err" &
+	sleep 0.5
+	(sleep 0.8; printf 'iiii\004\000\000\000\000\000\200\200\000\000\000\000b'; sleep 1) \
+		| timeout 2 "$CONVEY" "$tmp/kd-pty" > "$tmp/kd-debugger.out"
+	wait
+	assert_equal '30303030023003000000808006000000010203aa' "$(hex_of "$tmp/kd-debugger.out")" '--kd: data packet passed'
+	assert_equal '6969696904000000000080800000000062' "$(hex_of "$tmp/kd-target.out")" '--kd: ack and breakin passed'
+	assert_equal 'convey: kd, 2 packets, 0 bad checksums, 0 resend requests, 0 repeated, 1 breakins' \
+		"$(grep -m1 '^convey: kd,' "$tmp/kd.err")" '--kd: packets counted'
+	assert_equal ' 1 acks' "$(grep -m1 '^convey: kd, [0-9]* acks, latency' "$tmp/kd.err" | cut -d, -f2)" '--kd: ack latency recorded'
+}
+# }}}
+
+# {{{ RFC 2217
+# A pty stands in for the serial port: tcp-listen <- --pty-link <- pty
+# <- --rfc2217-listen <- rfc2217: client, with IAC bytes both ways.
+test_rfc2217_round_trip() {
+	next_port
+	data_port=$port
+	next_port
+	(sleep 1.5; printf 'to\377client'; sleep 1.5) | timeout 5 "$CONVEY" tcp-listen:$data_port > "$tmp/rfc.port" &
+	srv=$!
+	sleep 0.3
+	timeout 5 "$CONVEY" --pty-link "$tmp/rfc-pty" tcp:127.0.0.1:$data_port > /dev/null 2>&1 &
+	bridge=$!
+	sleep 0.5
+	timeout 5 "$CONVEY" --rfc2217-listen $port "$tmp/rfc-pty" > /dev/null 2>&1 &
+	telnet=$!
+	sleep 0.5
+	(printf 'to\377port'; sleep 2) | timeout 3 "$CONVEY" --baud 9600 rfc2217:127.0.0.1:$port > "$tmp/rfc.client" &
+	sleep 1
+	speed=$(stty -F "$tmp/rfc-pty" speed 2> /dev/null || stty -f "$tmp/rfc-pty" speed 2> /dev/null)
+	sleep 1.5
+	kill $srv $bridge $telnet 2> /dev/null
+	wait
+	assert_equal '746fff706f7274' "$(hex_of "$tmp/rfc.port")" 'rfc2217: client -> port, IAC kept'
+	assert_equal '746fff636c69656e74' "$(hex_of "$tmp/rfc.client")" 'rfc2217: port -> client, IAC kept'
+	assert_equal '9600' "$speed" 'rfc2217: the client set the baud rate of the port'
+}
+# }}}
+
+# {{{ Server
+test_serve_two_sessions() {
+	next_port
+	p1=$port
+	next_port
+	printf '# listen endpoint\ntcp-listen:%s tcp:127.0.0.1:%s\nunix-listen:%s unix:%s\n' \
+		$p1 $port "$tmp/s2.sock" "$tmp/vm2.sock" > "$tmp/serve.conf"
+	printf 'vm1' > "$tmp/vm1.in"
+	printf 'vm2' > "$tmp/vm2.in"
+	timeout 5 "$CONVEY" tcp-listen:$port < "$tmp/vm1.in" > "$tmp/vm1.out" &
+	vm1=$!
+	timeout 5 "$CONVEY" unix-listen:"$tmp/vm2.sock" < "$tmp/vm2.in" > "$tmp/vm2.out" &
+	vm2=$!
+	sleep 0.3
+	timeout 5 "$CONVEY" --serve "$tmp/serve.conf" > /dev/null 2>&1 &
+	srv=$!
+	sleep 0.3
+	printf 'c1' > "$tmp/c1.in"
+	printf 'c2' > "$tmp/c2.in"
+	timeout 1 "$CONVEY" tcp:127.0.0.1:$p1 < "$tmp/c1.in" > "$tmp/c1.out"
+	timeout 1 "$CONVEY" unix:"$tmp/s2.sock" < "$tmp/c2.in" > "$tmp/c2.out"
+	sleep 0.3
+	kill $srv $vm1 $vm2 2> /dev/null
+	wait
+	assert_equal 'c1' "$(cat "$tmp/vm1.out")" 'serve: client -> tcp endpoint'
+	assert_equal 'vm1' "$(cat "$tmp/c1.out")" 'serve: tcp endpoint -> client'
+	assert_equal 'c2' "$(cat "$tmp/vm2.out")" 'serve: client -> unix endpoint'
+	assert_equal 'vm2' "$(cat "$tmp/c2.out")" 'serve: unix endpoint -> client'
+	assert_equal 'gone' "$([ -e "$tmp/s2.sock" ] && echo left || echo gone)" 'serve: socket file removed on exit'
+}
+
+# A unix target whose listener has a full backlog keeps its connect
+# waiting. The other session is opened meanwhile, and SIGTERM doesn't
+# wait for the stuck connect.
+test_serve_stuck_target() {
+	next_port
+	p1=$port
+	next_port
+	printf 'unix-listen:%s unix:%s\ntcp-listen:%s tcp:127.0.0.1:%s\n' \
+		"$tmp/s3.sock" "$tmp/full.sock" $p1 $port > "$tmp/stuck.conf"
+	sleep 6 | timeout 6 "$CONVEY" unix-listen:"$tmp/full.sock" > /dev/null 2>&1 &
+	sleep 0.3
+	for i in 1 2 3; do
+		sleep 6 | timeout 6 "$CONVEY" unix:"$tmp/full.sock" > /dev/null 2>&1 &
+	done
+	printf 'vm3' > "$tmp/vm3.in"
+	printf 'c3' > "$tmp/c3.in"
+	timeout 6 "$CONVEY" tcp-listen:$port < "$tmp/vm3.in" > "$tmp/vm3.out" &
+	sleep 0.3
+	timeout 8 "$CONVEY" --connect-timeout 30 --serve "$tmp/stuck.conf" > /dev/null 2>&1 &
+	srv=$!
+	sleep 0.3
+	sleep 3 | timeout 3 "$CONVEY" unix:"$tmp/s3.sock" > /dev/null 2>&1 &
+	sleep 0.3
+	timeout 1 "$CONVEY" tcp:127.0.0.1:$p1 < "$tmp/c3.in" > "$tmp/c3.out"
+	kill -TERM $srv
+	sleep 0.5
+	assert_equal 'exited' "$(kill -0 $srv 2> /dev/null && echo running || echo exited)" 'serve: SIGTERM with a connect stuck'
+	wait
+	assert_equal 'c3' "$(cat "$tmp/vm3.out")" 'serve: opened beside a stuck target'
+	assert_equal 'vm3' "$(cat "$tmp/c3.out")" 'serve: linked beside a stuck target'
+}
+
+test_serve_control() {
+	next_port
+	p1=$port
+	next_port
+	printf 'tcp-listen:%s tcp:127.0.0.1:%s\n' $p1 $port > "$tmp/ctl.conf"
+	printf 'vm' > "$tmp/vm.in"
+	timeout 5 "$CONVEY" tcp-listen:$port < "$tmp/vm.in" > "$tmp/vm.out" &
+	vm=$!
+	timeout 5 "$CONVEY" --verbose --workers 3 --serve "$tmp/ctl.conf" --control "$tmp/ctl.sock" > "$tmp/ctl.log" 2>&1 &
+	srv=$!
+	sleep 0.3
+	printf 'add unix-listen:%s tcp:127.0.0.1:%s\nlog unix-listen:%s %s\nhex unix-listen:%s on\nlist\n' \
+		"$tmp/s3.sock" $port "$tmp/s3.sock" "$tmp/s3.log" "$tmp/s3.sock" > "$tmp/ctl1.in"
+	timeout 1 "$CONVEY" unix:"$tmp/ctl.sock" < "$tmp/ctl1.in" > "$tmp/ctl1.out"
+	printf 'c3' > "$tmp/c3.in"
+	timeout 1 "$CONVEY" unix:"$tmp/s3.sock" < "$tmp/c3.in" > "$tmp/c3.out"
+	printf 'remove unix-listen:%s\nstats\n' "$tmp/s3.sock" > "$tmp/ctl2.in"
+	timeout 1 "$CONVEY" unix:"$tmp/ctl.sock" < "$tmp/ctl2.in" > "$tmp/ctl2.out"
+	sock_left=$([ -e "$tmp/s3.sock" ] && echo left || echo gone)
+	kill $srv $vm 2> /dev/null
+	wait
+	assert_equal '1' "$(grep -c '^Serving 1 sessions with 3 workers' "$tmp/ctl.log")" 'control: all workers started for a one-line file'
+	assert_equal 'ok' "$(head -n 1 "$tmp/ctl1.out")" 'control: add'
+	assert_equal '1' "$(grep -c "^unix-listen:$tmp/s3.sock tcp:127.0.0.1:$port listening .* hex$" "$tmp/ctl1.out")" 'control: list shows the new session'
+	assert_equal '1' "$(grep -c '^> 00000000  63 33 ' "$tmp/s3.log")" 'control: hex log of the session'
+	assert_equal 'c3' "$(cat "$tmp/vm.out")" 'control: added session relays client -> endpoint'
+	assert_equal 'vm' "$(cat "$tmp/c3.out")" 'control: added session relays endpoint -> client'
+	assert_equal 'ok' "$(head -n 1 "$tmp/ctl2.out")" 'control: remove'
+	assert_equal '1' "$(grep -c '^sessions=1 ' "$tmp/ctl2.out")" 'control: stats after remove'
+	assert_equal 'gone' "$sock_left" 'control: removed listener closed'
+}
+# }}}
+
+# {{{ Runner
+echo "Testing $CONVEY"
+test_tcp_listen_round_trip
+test_tcp_threads_round_trip
+test_tcp_bulk
+test_tcp_client_queue
+test_hex
+test_ws_listen_round_trip
+test_ws_listen_idle_client
+test_unix_listen_round_trip
+test_unix_listen_in_use
+test_unix_listen_regular_file
+test_udp_round_trip
+test_vsock_round_trip
+test_shm_round_trip
+test_pty_bridge
+test_pty_stale_flush
+test_gdb_relay
+test_gdb_resend
+test_kd_relay
+test_zmodem_transfer
+test_raw_transfer
+test_mux_channels
+test_mux_compressed
+test_resume_reconnect
+test_resume_stray_client
+test_rfc2217_round_trip
+test_serve_two_sessions
+test_serve_stuck_target
+test_serve_control
+
+if [ $failures -gt 0 ]; then
+	echo "$failures test(s) failed."
+	exit 1
+fi
+echo "All tests passed."
+exit 0
+# }}}
@@ -0,0 +1,106 @@
+/* Tests for the libconvey C API, built as C against libconvey.h. A
+ * listen session and a client session talk to each other in process. */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../libconvey.h"
+
+static int g_fail = 0;
+#define EXPECT(c) do { \
+	if (!(c)) { printf("FAIL: %s\n", #c); ++g_fail; } \
+	else { printf("PASS: %s\n", #c); } \
+} while (0)
+
+struct collect {
+	char buf[128];
+	size_t len;
+};
+
+/* Stops the run once "pong" arrived, in however many pieces. */
+static int collect_cb(void* ctx, const char* buf, size_t len)
+{
+	struct collect* c = (struct collect*)ctx;
+	if (c->len + len < sizeof c->buf) {
+		memcpy(c->buf + c->len, buf, len);
+		c->len += len;
+	}
+	return c->len >= 4;
+}
+
+int main(void)
+{
+	char listen_ep[32], connect_ep[48], buf[64];
+	int port = 20000 + (int)(time(NULL) % 20000);
+	const char* log_opts[] = { "--log", "convey_libtest.log" };
+	const char* bad_opts[] = { "--read-only" };
+	const char* hex_opts[] = { "--hex" };
+	const char* resume_opts[] = { "--reconnect", "--resume" };
+	const char* xfer_opts[] = { "--recv-file", "convey_libtest.bin" };
+	struct collect c = { { 0 }, 0 };
+	convey_session *srv, *cli;
+	FILE* f;
+
+	snprintf(listen_ep, sizeof listen_ep, "tcp-listen:%d", port);
+	snprintf(connect_ep, sizeof connect_ep, "tcp:127.0.0.1:%d", port);
+
+	EXPECT(convey_version() && *convey_version());
+	EXPECT(convey_open("tcp:nowhere", 0, NULL) == NULL);
+	EXPECT(convey_open(connect_ep, 1, bad_opts) == NULL);
+	EXPECT(convey_open(connect_ep, 2, resume_opts) == NULL);
+	EXPECT(convey_open(connect_ep, 2, xfer_opts) == NULL);
+
+	srv = convey_open(listen_ep, 2, log_opts);
+	EXPECT(srv != NULL);
+	cli = convey_open(connect_ep, 0, NULL);
+	EXPECT(cli != NULL);
+	if (!srv || !cli) {
+		return 1;
+	}
+
+	// nothing sent yet, the read times out
+	EXPECT(convey_read(cli, buf, sizeof buf, 100) == 0);
+
+	EXPECT(convey_write(cli, "ping", 4, 1000) == 4);
+	EXPECT(convey_read(srv, buf, sizeof buf, 1000) == 4 && memcmp(buf, "ping", 4) == 0);
+
+	EXPECT(convey_write(srv, "po", 2, 1000) == 2);
+	EXPECT(convey_write(srv, "ng", 2, 1000) == 2);
+	EXPECT(convey_run(cli, collect_cb, &c, 1000) == 1);
+	EXPECT(c.len == 4 && memcmp(c.buf, "pong", 4) == 0);
+
+	// the peer going away ends the session
+	convey_close(cli);
+	EXPECT(convey_read(srv, buf, sizeof buf, 1000) == -1);
+	convey_close(srv);
+
+	// --hex formats what the callback gets
+	srv = convey_open(listen_ep, 0, NULL);
+	cli = convey_open(connect_ep, 1, hex_opts);
+	EXPECT(srv != NULL && cli != NULL);
+	if (srv && cli) {
+		memset(&c, 0, sizeof c);
+		EXPECT(convey_write(srv, "pong", 4, 1000) == 4);
+		EXPECT(convey_run(cli, collect_cb, &c, 1000) == 1);
+		EXPECT(c.len > 22 && memcmp(c.buf, "00000000  70 6f 6e 67 ", 22) == 0);
+	}
+	convey_close(cli);
+	convey_close(srv);
+
+	// the log options apply per session
+	f = fopen("convey_libtest.log", "rb");
+	EXPECT(f != NULL);
+	if (f) {
+		size_t n = fread(buf, 1, sizeof buf, f);
+		fclose(f);
+		EXPECT(n == 14 && memcmp(buf, "< ping> po> ng", 14) == 0);
+	}
+	remove("convey_libtest.log");
+
+	if (g_fail) {
+		printf("%d test(s) failed.\n", g_fail);
+		return 1;
+	}
+	printf("All library tests passed.\n");
+	return 0;
+}
@@ -3,6 +3,7 @@
 // and exercises its static functions directly.
 #define CONVEY_UNIT_TEST
 #include "../main.cxx"
+#include <filesystem>
 
 static int g_fail = 0;
 #define EXPECT(c) do { \
@@ -22,6 +23,55 @@ static convey_setup_status run_setup(std::vector<const char*> args)
 	return convey_conf_setup(static_cast<int>(argv.size()), argv.data());
 }
 
+// Two ends of a transfer, each writing into the other's link. The
+// garbling one flips a byte of the stream once, past garble_at.
+static size_t garble_at = 0;
+static bool xfer_pipe(convey_xfer_link& l, const char* buf, size_t n)
+{
+	convey_xfer_feed(*static_cast<convey_xfer_link*>(l.ctx), buf, n, false);
+	return true;
+}
+static bool xfer_garble(convey_xfer_link& l, const char* buf, size_t n)
+{
+	std::string s(buf, n);
+	if (garble_at && garble_at < n) {
+		s[garble_at] ^= 0x01;
+		garble_at = 0;
+	} else if (garble_at) {
+		garble_at -= n;
+	}
+	return xfer_pipe(l, s.data(), s.size());
+}
+
+// Sends the files from one end, receives them into dir on the other.
+static bool xfer_run(const std::vector<std::string>& files, convey_xfer_proto sp, convey_xfer_proto rp, bool garble,
+		convey_xfer& tx, convey_xfer& rx)
+{
+	convey_xfer_link a{}, b{};
+	a.write = garble ? xfer_garble : xfer_pipe;
+	a.ctx = &b;
+	b.write = xfer_pipe;
+	b.ctx = &a;
+	tx.link = &a;
+	tx.proto = sp;
+	tx.timeout_ms = 300;
+	rx.link = &b;
+	rx.proto = rp;
+	rx.timeout_ms = 300;
+	rx.dir = "convey_unit_rx";
+	bool sent = false;
+	std::thread t([&]() { sent = convey_xfer_send(tx, files); });
+	bool got = convey_xfer_recv(rx);
+	t.join();
+	return sent && got;
+}
+
+static std::string slurp(const std::string& path)
+{
+	std::ifstream f(path, std::ios::binary);
+	return std::string((std::istreambuf_iterator<char>(f)), std::istreambuf_iterator<char>());
+}
+
 int main()
 {
 	{
@@ -73,6 +123,61 @@ int main()
 		EXPECT(s.kind == convey_tp_tcp_server);
 	}
 
+	{
+		convey_transport_spec s = convey_parse_transport("unix:/tmp/vm0.sock");
+		EXPECT(s.ok);
+		EXPECT(s.kind == convey_tp_unix_client);
+		EXPECT(s.path == "/tmp/vm0.sock");
+	}
+	{
+		convey_transport_spec s = convey_parse_transport("unix-listen:C:\\run\\console.sock");
+		EXPECT(s.ok);
+		EXPECT(s.kind == convey_tp_unix_server);
+		EXPECT(s.path == "C:\\run\\console.sock");
+	}
+	{
+		convey_transport_spec s = convey_parse_transport("unix:");
+		EXPECT(!s.ok);
+		EXPECT(s.kind == convey_tp_unix_client);
+	}
+	{
+		// the path must fit into sun_path
+		convey_transport_spec s = convey_parse_transport("unix-listen:/" + std::string(200, 'x'));
+		EXPECT(!s.ok);
+		EXPECT(s.kind == convey_tp_unix_server);
+	}
+
+	{
+		convey_transport_spec s = convey_parse_transport("shm:vm0-console");
+		EXPECT(s.ok);
+		EXPECT(s.kind == convey_tp_shm);
+		EXPECT(s.path == "vm0-console");
+	}
+	{
+		convey_transport_spec s = convey_parse_transport("shm:");
+		EXPECT(!s.ok);
+		EXPECT(s.kind == convey_tp_shm);
+	}
+	{
+		// a name, not a path
+		convey_transport_spec s = convey_parse_transport("shm:run/vm0");
+		EXPECT(!s.ok);
+		EXPECT(s.kind == convey_tp_shm);
+	}
+
+	{
+		convey_transport_spec s = convey_parse_transport("rfc2217:ts1.lab:7001");
+		EXPECT(s.ok);
+		EXPECT(s.kind == convey_tp_rfc2217);
+		EXPECT(s.host == "ts1.lab");
+		EXPECT(s.port == "7001");
+	}
+	{
+		convey_transport_spec s = convey_parse_transport("rfc2217:ts1.lab");
+		EXPECT(!s.ok);
+		EXPECT(s.kind == convey_tp_rfc2217);
+	}
+
 	EXPECT(convey_parity_from_string("even") == EVENPARITY);
 	EXPECT(convey_parity_from_string("NO") == NOPARITY);
 	EXPECT(convey_parity_from_string("Space") == SPACEPARITY);
@@ -162,6 +267,866 @@ int main()
 		EXPECT(out.find("00000002") != std::string::npos);
 	}
 
+	{
+		// data without IAC passes the Telnet layer untouched
+		convey_telnet t;
+		convey_telnet_init(t, false, convey_rfc2217_line{CBR_9600, 8, NOPARITY, ONESTOPBIT, convey_flow_control_none, false, true, true, 0});
+		t.reply.clear();
+		char buf[] = "plain";
+		std::string esc;
+		EXPECT(convey_telnet_decode(t, buf, 5) == 5);
+		EXPECT(std::string(buf, 5) == "plain");
+		EXPECT(!convey_telnet_escape(buf, 5, esc));
+		EXPECT(t.reply.empty());
+	}
+	{
+		// IAC is doubled on the way out and undone on the way in
+		std::string esc;
+		EXPECT(convey_telnet_escape("a\xff" "b", 3, esc));
+		EXPECT(esc == "a\xff\xff" "b");
+		convey_telnet t;
+		convey_telnet_init(t, false, convey_rfc2217_line{});
+		EXPECT(convey_telnet_decode(t, &esc[0], (DWORD)esc.size()) == 3);
+		EXPECT(esc.substr(0, 3) == "a\xff" "b");
+	}
+	{
+		// commands split across reads are taken out, refused options answered
+		convey_telnet t;
+		convey_telnet_init(t, false, convey_rfc2217_line{});
+		t.reply.clear();
+		char a[] = "x\xff";
+		char b[] = "\xfd\x18y\xff\xfb";
+		char c[] = "\x00z";
+		EXPECT(convey_telnet_decode(t, a, 2) == 1);
+		EXPECT(convey_telnet_decode(t, b, 5) == 1);
+		EXPECT(b[0] == 'y');
+		EXPECT(t.reply == "\xff\xfc\x18");
+		EXPECT(convey_telnet_decode(t, c, 2) == 1);
+		EXPECT(c[0] == 'z');
+		// BINARY was asked for already, its WILL needs no answer
+		EXPECT(t.reply == "\xff\xfc\x18");
+	}
+	{
+		// the client sends its line settings once the server takes the option
+		convey_telnet t;
+		convey_telnet_init(t, false, convey_rfc2217_line{CBR_9600, 7, EVENPARITY, TWOSTOPBITS, convey_flow_control_rtscts, false, true, true, 0});
+		EXPECT(t.reply.find("\xff\xfb\x2c") != std::string::npos);
+		t.reply.clear();
+		char buf[] = "\xff\xfd\x2c";
+		EXPECT(convey_telnet_decode(t, buf, 3) == 0);
+		EXPECT(t.reply.find(std::string("\xff\xfa\x2c\x01\x00\x00\x25\x80\xff\xf0", 10)) != std::string::npos);
+		EXPECT(t.reply.find(std::string("\xff\xfa\x2c\x02\x07\xff\xf0", 7)) != std::string::npos);
+		EXPECT(t.reply.find(std::string("\xff\xfa\x2c\x03\x03\xff\xf0", 7)) != std::string::npos);
+		EXPECT(t.reply.find(std::string("\xff\xfa\x2c\x04\x02\xff\xf0", 7)) != std::string::npos);
+		EXPECT(t.reply.find(std::string("\xff\xfa\x2c\x05\x03\xff\xf0", 7)) != std::string::npos);
+		// and only once
+		t.reply.clear();
+		EXPECT(convey_telnet_decode(t, buf, 3) == 0);
+		EXPECT(t.reply.empty());
+	}
+	{
+		// a subnegotiation is collected whole, IAC IAC inside it included
+		convey_telnet t;
+		convey_telnet_init(t, true, convey_rfc2217_line{});
+		char buf[] = "\xff\xfa\x2c\x01\x00\x00\xff\xff\xff\xf0" "d";
+		EXPECT(convey_telnet_decode(t, buf, 11) == 1);
+		EXPECT(buf[0] == 'd');
+		EXPECT(t.commands.size() == 1);
+		EXPECT(t.commands[0] == std::string("\x01\x00\x00\xff", 4));
+	}
+	{
+		// the server takes valid settings and answers with what's in effect
+		convey_rfc2217_line line{CBR_115200, 8, NOPARITY, ONESTOPBIT, convey_flow_control_none, false, true, true, 0};
+		std::string reply;
+		EXPECT(convey_rfc2217_command(line, std::string("\x01\x00\x00\x25\x80", 5), reply));
+		EXPECT(line.baud == CBR_9600);
+		EXPECT(reply == std::string("\xff\xfa\x2c\x65\x00\x00\x25\x80\xff\xf0", 10));
+		reply.clear();
+		EXPECT(!convey_rfc2217_command(line, std::string("\x01\x00\x00\x00\x07", 5), reply));
+		EXPECT(line.baud == CBR_9600);
+		reply.clear();
+		EXPECT(convey_rfc2217_command(line, std::string("\x03\x03", 2), reply));
+		EXPECT(line.parity == EVENPARITY);
+		EXPECT(reply == std::string("\xff\xfa\x2c\x67\x03\xff\xf0", 7));
+		reply.clear();
+		EXPECT(!convey_rfc2217_command(line, std::string("\x02\x00", 2), reply));
+		EXPECT(reply == std::string("\xff\xfa\x2c\x66\x08\xff\xf0", 7));
+		reply.clear();
+		EXPECT(convey_rfc2217_command(line, std::string("\x05\x02", 2), reply));
+		EXPECT(line.flow_control == convey_flow_control_xonxoff);
+		reply.clear();
+		EXPECT(!convey_rfc2217_command(line, std::string("\x05\x09", 2), reply));
+		EXPECT(!line.dtr);
+		EXPECT(line.signal == 9);
+		EXPECT(reply == std::string("\xff\xfa\x2c\x69\x09\xff\xf0", 7));
+	}
+
+	{
+		convey_transport_spec s = convey_parse_transport("vsock:3:1024");
+		EXPECT(s.ok);
+		EXPECT(s.kind == convey_tp_vsock_client);
+		EXPECT(s.host == "3");
+		EXPECT(s.port == "1024");
+	}
+	{
+		convey_transport_spec s = convey_parse_transport("vsock:8a2d5f3e-1c4b-4f7a-9e21-0d6c3b9a7f10:5000");
+		EXPECT(s.ok);
+		EXPECT(s.host == "8a2d5f3e-1c4b-4f7a-9e21-0d6c3b9a7f10");
+		EXPECT(s.port == "5000");
+	}
+	{
+		convey_transport_spec s = convey_parse_transport("vsock-listen:1024");
+		EXPECT(s.ok);
+		EXPECT(s.kind == convey_tp_vsock_server);
+		EXPECT(s.port == "1024");
+	}
+	{
+		// vsock ports are numbers of 32 bits
+		EXPECT(!convey_parse_transport("vsock:3").ok);
+		EXPECT(!convey_parse_transport("vsock::1024").ok);
+		EXPECT(!convey_parse_transport("vsock:3:console").ok);
+		EXPECT(!convey_parse_transport("vsock-listen:4294967296").ok);
+		EXPECT(convey_parse_transport("vsock-listen:4294967295").ok);
+	}
+#ifdef _WIN32
+	{
+		SOCKADDR_HV sa;
+		EXPECT(convey_vsock_addr("{8A2D5F3E-1C4B-4F7A-9E21-0D6C3B9A7F10}", "5000", sa));
+		EXPECT(sa.VmId.Data1 == 0x8a2d5f3e && sa.VmId.Data2 == 0x1c4b && sa.VmId.Data4[7] == 0x10);
+		EXPECT(sa.ServiceId.Data1 == 5000 && sa.ServiceId.Data2 == 0xfacb);
+		EXPECT(!convey_vsock_addr("3", "5000", sa));
+	}
+#elif defined(CONVEY_HAVE_VSOCK)
+	{
+		struct sockaddr_vm sa;
+		EXPECT(convey_vsock_addr("1", "5000", sa));
+		EXPECT(sa.svm_cid == 1 && sa.svm_port == 5000);
+		EXPECT(convey_vsock_addr("", "5000", sa));
+		EXPECT(sa.svm_cid == VMADDR_CID_ANY);
+		EXPECT(!convey_vsock_addr("host", "5000", sa));
+	}
+#endif
+
+	{
+		convey_transport_spec s = convey_parse_transport("udp:10.0.0.7:6666");
+		EXPECT(s.ok);
+		EXPECT(s.kind == convey_tp_udp_client);
+		EXPECT(s.host == "10.0.0.7");
+		EXPECT(s.port == "6666");
+	}
+	{
+		convey_transport_spec s = convey_parse_transport("udp-listen:6666");
+		EXPECT(s.ok);
+		EXPECT(s.kind == convey_tp_udp_server);
+		EXPECT(s.port == "6666");
+		EXPECT(!convey_parse_transport("udp-listen:").ok);
+		EXPECT(!convey_parse_transport("udp:6666").ok);
+	}
+
+	{
+		convey_transport_spec s = convey_parse_transport("ws-listen:8080");
+		EXPECT(s.ok);
+		EXPECT(s.kind == convey_tp_ws_server);
+		EXPECT(s.port == "8080");
+	}
+	{
+		convey_transport_spec s = convey_parse_transport("ws-listen:");
+		EXPECT(!s.ok);
+		EXPECT(s.kind == convey_tp_ws_server);
+	}
+
+	{
+		// the sample handshake of RFC 6455
+		std::string answer;
+		EXPECT(convey_ws_handshake("GET /chat HTTP/1.1\r\nHost: server.example.com\r\nupgrade: WebSocket\r\n"
+			"Connection: Upgrade\r\nSec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n\r\n", answer));
+		EXPECT(0 == answer.find("HTTP/1.1 101 "));
+		EXPECT(answer.find("Sec-WebSocket-Accept: s3pPLMBiTxaQ9kYGzzhZRbK+xOo=\r\n") != std::string::npos);
+		answer.clear();
+		EXPECT(!convey_ws_handshake("GET / HTTP/1.1\r\nHost: x\r\n\r\n", answer));
+		EXPECT(0 == answer.find("HTTP/1.1 400 "));
+		const uint8_t foo[] = {'f', 'o', 'o'};
+		EXPECT(convey_base64(foo, 1) == "Zg==");
+		EXPECT(convey_base64(foo, 3) == "Zm9v");
+	}
+	{
+		// a masked frame split across reads, then a ping
+		convey_ws w;
+		convey_ws_init(w);
+		char a[] = "\x82\x85\x01\x02\x03\x04" "i";
+		char b[] = "go" "ko";
+		a[6] ^= 0x01;
+		b[0] ^= 0x02; b[1] ^= 0x03; b[2] ^= 0x04; b[3] ^= 0x01;
+		EXPECT(convey_ws_decode(w, a, 7) == 1);
+		EXPECT(a[0] == 'i');
+		EXPECT(convey_ws_decode(w, b, 4) == 4);
+		EXPECT(std::string(b, 4) == "goko");
+		char ping[] = "\x89\x82\x01\x02\x03\x04" "ik";
+		EXPECT(convey_ws_decode(w, ping, 8) == 0);
+		EXPECT(w.reply == "\x8a\x02hi");
+		EXPECT(!w.closed);
+		char close[] = "\x88\x82\0\0\0\0\x03\xe8";
+		w.reply.clear();
+		EXPECT(convey_ws_decode(w, close, 8) == 0);
+		EXPECT(w.closed);
+		EXPECT(w.reply == std::string("\x88\x02\x03\xe8", 4));
+		// an unmasked frame from the client fails the connection with 1002
+		convey_ws_init(w);
+		char bare[] = "\x82\x02hi";
+		EXPECT(convey_ws_decode(w, bare, 4) == 0);
+		EXPECT(w.closed);
+		EXPECT(w.reply == std::string("\x88\x02\x03\xea", 4));
+		std::string hdr;
+		convey_ws_frame_header(hdr, WS_OP_BINARY, 200000);
+		EXPECT(hdr == std::string("\x82\x7f\x00\x00\x00\x00\x00\x03\x0d\x40", 10));
+	}
+
+	{
+		// a packet split across reads, acks, the interrupt and console noise
+		convey_rsp_parser p{};
+		std::vector<convey_rsp_item> items;
+		convey_rsp_parse(p, "boot\r\n+$qSupp", 13, items);
+		convey_rsp_parse(p, "orted#3", 7, items);
+		EXPECT(items.size() == 2);
+		convey_rsp_parse(p, "7-\x03$g#00", 8, items);
+		EXPECT(items.size() == 6);
+		EXPECT(items[0].kind == 0 && items[0].data == "boot\r\n");
+		EXPECT(items[1].kind == '+');
+		EXPECT(items[2].kind == '$' && items[2].ok && items[2].data == "qSupported");
+		EXPECT(items[3].kind == '-');
+		EXPECT(items[4].kind == RSP_INTERRUPT);
+		EXPECT(items[5].kind == '$' && !items[5].ok && items[5].data == "g");
+		EXPECT(convey_rsp_packet("g") == "$g#67");
+		EXPECT(convey_rsp_packet("OK") == "$OK#9a");
+		// no-ack mode is offered on the stub's behalf
+		EXPECT(convey_rsp_offer_noack("PacketSize=4000") == "PacketSize=4000;QStartNoAckMode+");
+		EXPECT(convey_rsp_offer_noack("") == "QStartNoAckMode+");
+		EXPECT(convey_rsp_offer_noack("QStartNoAckMode-;PacketSize=400") == "QStartNoAckMode+;PacketSize=400");
+	}
+
+	{
+		// gdb's own reads are cached as they are, and only those
+		convey_rsp_cache c{};
+		std::string answer, retry;
+		EXPECT(convey_rsp_request(c, "m1004,4", answer) == "m1004,4");
+		EXPECT(convey_rsp_reply(c, "04050607", retry) == "04050607");
+		EXPECT(convey_rsp_request(c, "m1004,4", answer).empty() && answer == "04050607");
+		EXPECT(convey_rsp_request(c, "m1008,4", answer) == "m1008,4");
+		EXPECT(convey_rsp_reply(c, "E14", retry) == "E14");
+		EXPECT(retry.empty());
+		EXPECT(convey_rsp_request(c, "m1008,4", answer) == "m1008,4");
+		EXPECT(convey_rsp_request(c, "c", answer) == "c");
+		EXPECT(convey_rsp_request(c, "m1004,4", answer) == "m1004,4");
+		// with --gdb-widen a small read is widened to whole blocks, and the next is answered here
+		c = convey_rsp_cache{};
+		c.widen = true;
+		convey_rsp_packet_size(c, "PacketSize=400;QStartNoAckMode+");
+		EXPECT(c.max_read == 448);
+		convey_rsp_packet_size(c, "swbreak+");
+		EXPECT(c.max_read == RSP_DEFAULT_READ);
+		EXPECT(convey_rsp_request(c, "m1004,4", answer) == "m1000,100");
+		std::string mem;
+		for (int i = 0; i < 256; i++) {
+			mem += convey_rsp_tohex(reinterpret_cast<const char*>(&i), 1);
+		}
+		EXPECT(convey_rsp_reply(c, mem, retry) == "04050607");
+		EXPECT(retry.empty());
+		EXPECT(c.mem.size() == 4);
+		EXPECT(convey_rsp_request(c, "m10fc,4", answer).empty() && answer == "fcfdfeff");
+		// past the cached blocks is a miss, widened from its own block
+		EXPECT(convey_rsp_request(c, "m10fe,4", answer) == "m10c0,100");
+		// run length encoding of the stub, 0* is 0 repeated 3 more times
+		EXPECT(convey_rsp_expand("0* 1") == "00001");
+		// running or writing drops it all
+		EXPECT(convey_rsp_request(c, "c", answer) == "c");
+		EXPECT(c.mem.empty());
+		EXPECT(convey_rsp_request(c, "g", answer) == "g");
+		EXPECT(convey_rsp_reply(c, "00112233", retry) == "00112233");
+		EXPECT(convey_rsp_request(c, "g", answer).empty() && answer == "00112233");
+		EXPECT(convey_rsp_request(c, "vCont;c", answer) == "vCont;c");
+		EXPECT(convey_rsp_reply(c, "T05thread:01;", retry) == "T05thread:01;");
+		EXPECT(c.regs.empty());
+		EXPECT(convey_rsp_request(c, "g", answer) == "g");
+		EXPECT(convey_rsp_reply(c, "00112233", retry) == "00112233");
+		EXPECT(convey_rsp_request(c, "M2000,1:00", answer) == "M2000,1:00");
+		EXPECT(convey_rsp_request(c, "g", answer) == "g");
+		// a widened read over unmapped memory falls back to gdb's own
+		EXPECT(convey_rsp_request(c, "m3ff0,8", answer) == "m3fc0,40");
+		EXPECT(convey_rsp_reply(c, "E14", retry).empty());
+		EXPECT(retry == "m3ff0,8");
+		EXPECT(convey_rsp_reply(c, "E14", retry) == "E14");
+		EXPECT(retry.empty());
+		// --gdb-no-cache passes reads on as they are, and their replies too
+		c = convey_rsp_cache{};
+		c.off = true;
+		EXPECT(convey_rsp_request(c, "m1004,4", answer) == "m1004,4");
+		EXPECT(convey_rsp_reply(c, "04050607", retry) == "04050607");
+		EXPECT(c.mem.empty());
+		EXPECT(convey_rsp_request(c, "m1004,4", answer) == "m1004,4");
+		EXPECT(convey_rsp_request(c, "g", answer) == "g");
+		EXPECT(convey_rsp_reply(c, "00112233", retry) == "00112233");
+		EXPECT(convey_rsp_request(c, "g", answer) == "g");
+	}
+
+	{
+		// a data packet split across reads, then an ack, the breakin and noise
+		const char data[] = "0000\x02\x30\x03\x00\x00\x00\x80\x80\x06\x00\x00\x00\x01\x02\x03\xaa";
+		const char ack[] = "iiii\x04\x00\x00\x00\x00\x00\x80\x80\x00\x00\x00\x00";
+		convey_kd_parser p{};
+		std::vector<convey_kd_item> items;
+		convey_kd_parse(p, "ok\r\n00", 6, items);
+		EXPECT(items.size() == 1 && items[0].kind == 0 && items[0].bytes == "ok\r\n");
+		convey_kd_parse(p, data + 2, 10, items);
+		EXPECT(items.size() == 1);
+		convey_kd_parse(p, data + 12, 8, items);
+		EXPECT(items.size() == 2);
+		EXPECT(items[1].kind == KD_LEADER_DATA && items[1].ok && items[1].bytes == std::string(data, 20));
+		EXPECT(items[1].type == 0x3002 && items[1].id == 0x80800000);
+		convey_kd_parse(p, ack, 16, items);
+		convey_kd_parse(p, "b00x", 4, items);
+		EXPECT(items.size() == 5);
+		EXPECT(items[2].kind == KD_LEADER_CONTROL && items[2].type == KD_TYPE_ACK && items[2].id == 0x80800000);
+		EXPECT(items[3].kind == KD_BREAKIN);
+		EXPECT(items[4].kind == 0 && items[4].bytes == "00x");
+		// a bad sum still goes on, counted
+		std::string bad(data, 20);
+		bad[17] = 9;
+		items.clear();
+		convey_kd_parse(p, bad.data(), 20, items);
+		EXPECT(items.size() == 1 && !items[0].ok);
+		// a size no packet has isn't one
+		items.clear();
+		convey_kd_parse(p, "0000\x02\x30\xff\xff\x00\x00\x80\x80\x00\x00\x00\x00", 16, items);
+		EXPECT(items.size() == 1 && items[0].kind == 0 && items[0].bytes.size() == 16);
+	}
+
+	{
+		// the check values of both CRCs
+		EXPECT(convey_crc16(0, "123456789", 9) == 0x31c3);
+		EXPECT(convey_crc32(0, "123456789", 9) == 0xcbf43926);
+		EXPECT(convey_crc32(convey_crc32(0, "1234", 4), "56789", 5) == 0xcbf43926);
+		// ZMODEM headers and escapes
+		EXPECT(convey_zm_hex_header(ZM_RQINIT, 0) == "**\x18" "B00000000000000\r\n\x11");
+		EXPECT(convey_zm_hex_header(ZM_FIN, 0).back() == '\n');
+		std::string esc;
+		convey_zm_escape(esc, "\x18\x11" "a\x8d" "@\r", 6, false);
+		EXPECT(esc == "\x18\x58\x18\x51" "a\x8d" "@\x18\x4d");
+		esc.clear();
+		convey_zm_escape(esc, "\x01 ", 2, true);
+		EXPECT(esc == "\x18\x41 ");
+		EXPECT(convey_xfer_basename("../../etc/passwd") == "passwd");
+		EXPECT(convey_xfer_basename("C:\\boot\\..").empty());
+	}
+
+	{
+		// file transfers between both ends, in memory
+		std::string data;
+		uint32_t r = 1;
+		for (int i = 0; i < 200000; i++) {
+			r = r * 1103515245 + 12345;
+			data += static_cast<char>(r >> 16);
+		}
+		std::ofstream("convey_unit_xfer.bin", std::ios::binary) << data;
+		std::ofstream("convey_unit_xfer2.bin", std::ios::binary) << "small";
+		std::filesystem::remove_all("convey_unit_rx");
+		std::filesystem::create_directory("convey_unit_rx");
+		const std::string got = "convey_unit_rx/convey_unit_xfer.bin";
+
+		convey_xfer tx{}, rx{};
+		EXPECT(xfer_run({"convey_unit_xfer.bin", "convey_unit_xfer2.bin"}, convey_xfer_zmodem, convey_xfer_zmodem, false, tx, rx));
+		EXPECT(slurp(got) == data);
+		EXPECT(slurp("convey_unit_rx/convey_unit_xfer2.bin") == "small");
+		EXPECT(rx.files == 2 && tx.files == 2);
+		EXPECT(rx.retransmits == 0);
+
+		// a broken subpacket is sent again from where it broke
+		std::filesystem::remove(got);
+		tx = convey_xfer{};
+		rx = convey_xfer{};
+		garble_at = 50000;
+		EXPECT(xfer_run({"convey_unit_xfer.bin"}, convey_xfer_zmodem, convey_xfer_zmodem, true, tx, rx));
+		EXPECT(slurp(got) == data);
+		EXPECT(tx.retransmits >= 1 && rx.retransmits >= 1);
+
+		// a partial file is completed, not sent again
+		std::ofstream(got, std::ios::binary) << data.substr(0, 70000);
+		tx = convey_xfer{};
+		rx = convey_xfer{};
+		EXPECT(xfer_run({"convey_unit_xfer.bin"}, convey_xfer_zmodem, convey_xfer_zmodem, false, tx, rx));
+		EXPECT(slurp(got) == data);
+		EXPECT(tx.bytes == data.size() - 70000);
+
+		// a YMODEM receiver gets YMODEM
+		std::filesystem::remove(got);
+		tx = convey_xfer{};
+		rx = convey_xfer{};
+		EXPECT(xfer_run({"convey_unit_xfer.bin"}, convey_xfer_zmodem, convey_xfer_ymodem, false, tx, rx));
+		EXPECT(slurp(got) == data);
+		EXPECT(tx.proto == convey_xfer_ymodem && rx.files == 1);
+
+		// an XMODEM sender is taken after the ZMODEM receiver heard nothing,
+		// the file keeps its padding
+		tx = convey_xfer{};
+		rx = convey_xfer{};
+		EXPECT(xfer_run({"convey_unit_xfer.bin"}, convey_xfer_xmodem, convey_xfer_zmodem, false, tx, rx));
+		std::string x = slurp("convey_unit_rx/xmodem.bin");
+		EXPECT(x.size() == 200704 && 0 == x.compare(0, data.size(), data));
+		EXPECT(x.back() == XM_SUB);
+
+		// a receiver that asks with NAK gets XMODEM, 128 byte blocks from
+		// 1 with a checksum, no header block and no end of a batch
+		{
+			convey_xfer_link a{}, b{};
+			a.write = xfer_pipe;
+			a.ctx = &b;
+			b.write = xfer_pipe;
+			b.ctx = &a;
+			tx = convey_xfer{};
+			tx.link = &a;
+			tx.proto = convey_xfer_zmodem;
+			tx.timeout_ms = 300;
+			bool sent = false;
+			std::thread t([&]() { sent = convey_xfer_send(tx, {"convey_unit_xfer.bin"}); });
+			std::string rxd;
+			uint8_t expect = 1;
+			bool ok = true, eot = false;
+			b.write(b, "\x15", 1);
+			for (int naks = 0; ok && !eot;) {
+				int c = convey_xfer_getc(b, 300);
+				if (XFER_TIMEOUT == c && rxd.empty() && ++naks < 10) {
+					b.write(b, "\x15", 1);
+				} else if (XM_EOT == c) {
+					eot = true;
+					b.write(b, "\x06", 1);
+				} else if (XM_SOH == c) {
+					std::string blk;
+					while (ok && blk.size() < 131) {
+						int d = convey_xfer_getc(b, 300);
+						ok = d >= 0;
+						blk += static_cast<char>(d);
+					}
+					uint8_t sum = 0;
+					for (size_t i = 2; i < 130; i++) {
+						sum = static_cast<uint8_t>(sum + static_cast<uint8_t>(blk[i]));
+					}
+					ok = ok && static_cast<uint8_t>(blk[0]) == expect++ && static_cast<uint8_t>(blk[130]) == sum;
+					rxd.append(blk, 2, 128);
+					b.write(b, "\x06", 1);
+				} else if (XM_STX == c || c < 0) {
+					ok = false;
+				}
+			}
+			t.join();
+			EXPECT(ok && eot && sent);
+			EXPECT(tx.proto == convey_xfer_xmodem && tx.files == 1);
+			EXPECT(rxd.size() == 200064 && 0 == rxd.compare(0, data.size(), data));
+			EXPECT(XFER_TIMEOUT == convey_xfer_getc(b, 50));
+		}
+
+		// raw, the bytes as they are, until the sender closes
+		convey_xfer_link a{}, b{};
+		a.write = xfer_pipe;
+		a.ctx = &b;
+		tx = convey_xfer{};
+		tx.link = &a;
+		EXPECT(convey_raw_send(tx, "convey_unit_xfer.bin", 0));
+		convey_xfer_feed(b, nullptr, 0, true);
+		rx = convey_xfer{};
+		rx.link = &b;
+		EXPECT(convey_raw_recv(rx, "convey_unit_rx/raw.bin", 0));
+		EXPECT(slurp("convey_unit_rx/raw.bin") == data);
+		EXPECT(tx.bytes == data.size() && rx.bytes == data.size() && rx.files == 1);
+		EXPECT(!convey_raw_send(tx, "convey_unit_rx/none.bin", 0));
+
+		// or until it was silent for long enough
+		convey_xfer_link c{};
+		convey_xfer_feed(c, "abc", 3, false);
+		rx = convey_xfer{};
+		rx.link = &c;
+		EXPECT(convey_raw_recv(rx, "convey_unit_rx/raw.bin", 50));
+		EXPECT(slurp("convey_unit_rx/raw.bin") == "abc");
+
+		// paced to the line, 10 ms of it at a time
+		EXPECT(convey_raw_rate(9600, 8, NOPARITY, ONESTOPBIT) == 960);
+		EXPECT(convey_raw_rate(9600, 8, EVENPARITY, ONE5STOPBITS) == 9600 / 11.5);
+		convey_raw_pace pace{11520, {}, 0};
+		EXPECT(convey_raw_slice(pace) == 115);
+		pace.rate = 50;
+		EXPECT(convey_raw_slice(pace) == 1);
+		pace.rate = 0;
+		EXPECT(convey_raw_slice(pace) == RAW_BLOCK);
+		std::ofstream("convey_unit_xfer2.bin", std::ios::binary) << data.substr(0, 3000);
+		convey_xfer_link d{}, e{};
+		d.write = xfer_pipe;
+		d.ctx = &e;
+		tx = convey_xfer{};
+		tx.link = &d;
+		auto t0 = std::chrono::steady_clock::now();
+		EXPECT(convey_raw_send(tx, "convey_unit_xfer2.bin", 30000));
+		EXPECT(std::chrono::steady_clock::now() - t0 >= std::chrono::milliseconds(85));
+		EXPECT(e.in == data.substr(0, 3000));
+
+		std::filesystem::remove_all("convey_unit_rx");
+		std::remove("convey_unit_xfer.bin");
+		std::remove("convey_unit_xfer2.bin");
+	}
+
+	{
+		// mux frames survive flags and escapes in the data, noise before
+		// the first flag is skipped and a broken frame is dropped
+		std::string out = "boot noise";
+		convey_mux_frame(out, 2, MUX_DATA, 0x01020304, "a\x7e" "b\x7d", 4);
+		convey_mux_frame(out, 0, MUX_CREDIT, 512, nullptr, 0);
+		EXPECT(std::string::npos == out.find("a\x7e"));
+		convey_mux_parser p{};
+		std::vector<convey_mux_item> items;
+		uint64_t bad = stats.mux_bad;
+		convey_mux_parse(p, out.data(), 7, items);
+		convey_mux_parse(p, out.data() + 7, out.size() - 7, items);
+		EXPECT(items.size() == 2 && stats.mux_bad == bad);
+		EXPECT(items[0].chan == 2 && items[0].type == MUX_DATA && items[0].pos == 0x01020304 && items[0].data == "a\x7e" "b\x7d");
+		EXPECT(items[1].chan == 0 && items[1].type == MUX_CREDIT && items[1].pos == 512 && items[1].data.empty());
+		std::string broken;
+		convey_mux_frame(broken, 1, MUX_DATA, 0, "xyz", 3);
+		broken[9] ^= 0x01;
+		items.clear();
+		convey_mux_parse(p, broken.data(), broken.size(), items);
+		convey_mux_parse(p, out.data() + 10, out.size() - 10, items);
+		EXPECT(items.size() == 2 && stats.mux_bad == bad + 1);
+
+		// the first channel with data and room goes first
+		convey_mux_tx tx[3]{};
+		tx[1].q = "bulk";
+		tx[2].q = "more";
+		EXPECT(convey_mux_pick(tx, 3) == 1);
+		tx[0].q = "k";
+		EXPECT(convey_mux_pick(tx, 3) == 0);
+		tx[0].sent = MUX_WINDOW;
+		EXPECT(convey_mux_room(tx[0]) == 0 && convey_mux_pick(tx, 3) == 1);
+		convey_mux_credit(tx[0], 100);
+		EXPECT(convey_mux_room(tx[0]) == 100 && convey_mux_pick(tx, 3) == 0);
+		// credits are positions, an older one or one past the sent is stale
+		convey_mux_credit(tx[0], 50);
+		convey_mux_credit(tx[0], MUX_WINDOW + 1);
+		EXPECT(tx[0].credit == 100);
+		// and wrap around
+		tx[1].sent = 10;
+		tx[1].credit = 0xfffffff0;
+		EXPECT(convey_mux_room(tx[1]) == MUX_WINDOW - 26);
+		convey_mux_credit(tx[1], 4);
+		EXPECT(tx[1].credit == 4);
+
+		// a gap in the positions was a dropped frame
+		convey_mux_rx rx{};
+		convey_mux_rx_data(rx, 0, 100);
+		convey_mux_rx_data(rx, 356, 10);
+		EXPECT(rx.pos == 366 && rx.lost == 256);
+	}
+
+	{
+		// lz round trips across blocks, overlapping matches and long runs
+		convey_lz tx{}, rx{};
+		convey_lz_reset(tx);
+		convey_lz_reset(rx);
+		std::string log, packed, back;
+		char line[96];
+		for (int i = 0; i < 2000; i++) {
+			snprintf(line, sizeof line, "[    %d.%06d] pci 0000:00:%02x.0: reg 0x10: [mem 0xfe000000-0xfe7fffff pref]\n", i / 1000, i * 37 % 1000000, i % 32);
+			log += line;
+		}
+		log += std::string(1000, 'a');
+		bool ok = true;
+		for (size_t off = 0; off < log.size(); off += 4096) {
+			std::string block;
+			convey_lz_compress(tx, log.data() + off, std::min<size_t>(4096, log.size() - off), block);
+			packed += block;
+			ok = ok && convey_lz_decompress(rx, block.data(), block.size(), back, 4096);
+		}
+		EXPECT(ok && back == log);
+		EXPECT(packed.size() * 3 <= log.size());
+		EXPECT(tx.hist.size() <= 2 * LZ_HISTORY && tx.hist == rx.hist);
+
+		// a keystroke after that is a few bytes
+		std::string key;
+		convey_lz_compress(tx, "l", 1, key);
+		EXPECT(key.size() == 2);
+
+		// a bad offset or a block decoding past the limit fail
+		convey_lz fresh{};
+		convey_lz_reset(fresh);
+		std::string junk;
+		EXPECT(!convey_lz_decompress(fresh, "\x04" "abcd\x10\x00", 7, junk, 100));
+		EXPECT(!convey_lz_decompress(fresh, "\x50" "abcde", 6, junk, 4));
+		EXPECT(convey_lz_decompress(fresh, "\x50" "abcde", 6, junk, 5) && junk == "abcde");
+	}
+
+	{
+		// --compress blocks carry the frames, a broken one drops the
+		// rest until the window starts over
+		convey_lz z{};
+		std::string frames, wire;
+		for (uint32_t i = 0; i < 20; i++) {
+			convey_mux_frame(frames, 0, MUX_DATA, i * 40, "console output console output console ", 40);
+		}
+		convey_mux_zblock(z, false, frames, wire);
+		size_t first = wire.size();
+		convey_mux_zblock(z, false, frames, wire);
+		convey_mux_zblock(z, false, "xyz", wire);
+		EXPECT(first * 3 < frames.size() && wire.size() - first < first);
+
+		convey_mux_zrx zr{};
+		std::string out;
+		uint64_t bad = stats.lz_bad;
+		EXPECT(convey_mux_zunblock(zr, wire.data(), first, out) && out == frames);
+		std::string broken = wire.substr(first);
+		broken[3] ^= 1;
+		out.clear();
+		EXPECT(!convey_mux_zunblock(zr, broken.data(), broken.size(), out) && out.empty());
+		EXPECT(stats.lz_bad == bad + 1);
+
+		wire.clear();
+		convey_mux_zblock(z, true, frames, wire);
+		EXPECT(convey_mux_zunblock(zr, wire.data(), wire.size(), out) && out == frames);
+
+		// a paced line fills blocks by the time they take on the wire
+		EXPECT(convey_mux_fill(11520, false, 1.0) == 1 && convey_mux_fill(0, false, 1.0) == BUF_SIZE);
+		EXPECT(convey_mux_fill(0, true, 1.0) == MUX_Z_BLOCK);
+		EXPECT(convey_mux_fill(11520, true, 1.0) == 576 && convey_mux_fill(11520, true, 4.0) == 2304);
+		EXPECT(convey_mux_fill(1e7, true, 4.0) == MUX_Z_BLOCK);
+	}
+
+	{
+		// --resume: a hello, data split over reads, an ack trims the
+		// replay buffer
+		convey_resume a{}, b{};
+		a.self = 1;
+		b.self = 2;
+		std::string wire, data, err;
+		bool mismatch;
+		convey_resume_hello(wire, 1, 0, 0);
+		std::string big(RESUME_FRAME + 10, 'x');
+		convey_resume_data(wire, 0, big.data(), big.size());
+		EXPECT(wire.size() == RESUME_HELLO_LEN + 2 * RESUME_HEAD + big.size());
+		EXPECT(convey_resume_recv_locked(b, wire.data(), 40, data, err, mismatch) && b.hello && b.peer == 1 && b.fresh);
+		EXPECT(convey_resume_recv_locked(b, wire.data() + 40, wire.size() - 40, data, err, mismatch));
+		EXPECT(data == big && b.received == big.size() && b.in.empty());
+
+		a.replay = big;
+		a.sent = big.size();
+		wire.clear();
+		convey_resume_hello(wire, 2, 1, 0);
+		convey_resume_ack(wire, 100);
+		data.clear();
+		EXPECT(convey_resume_recv_locked(a, wire.data(), wire.size(), data, err, mismatch) && data.empty());
+		EXPECT(a.acked == 100 && a.replay.size() == big.size() - 100);
+
+		// after a reconnect a hello knowing this instance picks up where
+		// it was, what is sent again isn't handed on twice
+		a.hello = false;
+		wire.clear();
+		convey_resume_hello(wire, 2, 1, 500);
+		convey_resume_data(wire, 0, "old", 3);
+		EXPECT(convey_resume_recv_locked(a, wire.data(), wire.size(), data, err, mismatch) && !a.fresh);
+		EXPECT(a.acked == 500 && a.replay.size() == big.size() - 500 && a.received == 3 && data == "old");
+		wire.clear();
+		convey_resume_data(wire, 1, "ldnew", 5);
+		EXPECT(convey_resume_recv_locked(a, wire.data(), wire.size(), data, err, mismatch) && data == "oldnew" && a.received == 6);
+
+		// one that doesn't starts over, a gap is a mismatch, another
+		// stream only an error of its connection
+		a.hello = false;
+		wire.clear();
+		convey_resume_hello(wire, 3, 0, 0);
+		uint64_t dropped = stats.resume_dropped;
+		EXPECT(convey_resume_recv_locked(a, wire.data(), wire.size(), data, err, mismatch) && a.fresh);
+		EXPECT(a.peer == 3 && a.received == 0 && a.sent == 0 && a.replay.empty());
+		EXPECT(stats.resume_dropped == dropped + big.size() - 500);
+		wire.clear();
+		convey_resume_data(wire, 5, "gap", 3);
+		EXPECT(!convey_resume_recv_locked(a, wire.data(), wire.size(), data, err, mismatch) && mismatch);
+		convey_resume c{};
+		EXPECT(!convey_resume_recv_locked(c, "login: ", 7, data, err, mismatch) && !mismatch);
+		c.in.clear();
+		EXPECT(!convey_resume_recv_locked(c, "D\0\0\0\0\0\0\0\0\0\0", 11, data, err, mismatch) && !mismatch);
+		a.hello = false;
+		a.in.clear();
+		wire.clear();
+		convey_resume_hello(wire, 3, a.self, 10);
+		EXPECT(!convey_resume_recv_locked(a, wire.data(), wire.size(), data, err, mismatch) && mismatch);
+
+		// acks go back after a quarter of the buffer, or a while
+		convey_resume d{};
+		auto now = std::chrono::steady_clock::now();
+		d.ack_at = now;
+		d.received = 100;
+		EXPECT(!convey_resume_ack_due_locked(d, 1000, now) && convey_resume_ack_due_locked(d, 400, now));
+		EXPECT(convey_resume_ack_due_locked(d, 1000, now + std::chrono::milliseconds(RESUME_ACK_MS)));
+	}
+
+	{
+		// connect order interleaves families, the hinted one first
+		// (addrlen tags each entry here)
+		convey_addr a6a{}, a6b{}, a4a{}, a4b{};
+		a6a.family = AF_INET6;
+		a6a.addrlen = 1;
+		a6b.family = AF_INET6;
+		a6b.addrlen = 2;
+		a4a.family = AF_INET;
+		a4a.addrlen = 3;
+		a4b.family = AF_INET;
+		a4b.addrlen = 4;
+		std::vector<convey_addr> v = { a6a, a6b, a4a, a4b };
+		convey_connect_order(v, AF_UNSPEC);
+		EXPECT(v.size() == 4);
+		EXPECT(v[0].addrlen == 1);
+		EXPECT(v[1].addrlen == 3);
+		EXPECT(v[2].addrlen == 2);
+		EXPECT(v[3].addrlen == 4);
+
+		v = { a6a, a6b, a4a };
+		convey_connect_order(v, AF_INET);
+		EXPECT(v[0].addrlen == 3);
+		EXPECT(v[1].addrlen == 1);
+		EXPECT(v[2].addrlen == 2);
+	}
+
+	{
+		int sz = 1;
+		EXPECT(convey_sockbuf_from_string("", sz) && sz == 0);
+		EXPECT(convey_sockbuf_from_string("AUTO", sz) && sz == SOCKBUF_AUTO);
+		EXPECT(convey_sockbuf_from_string("65536", sz) && sz == 65536);
+		EXPECT(convey_sockbuf_from_string("256k", sz) && sz == 256 * 1024);
+		EXPECT(convey_sockbuf_from_string("4M", sz) && sz == 4 * 1024 * 1024);
+		EXPECT(!convey_sockbuf_from_string("0", sz));
+		EXPECT(!convey_sockbuf_from_string("k", sz));
+		EXPECT(!convey_sockbuf_from_string("-5", sz));
+		EXPECT(!convey_sockbuf_from_string("4096m", sz));
+	}
+#ifndef __linux__
+	{
+		// auto sizing is twice the bandwidth-delay product, a power of two within bounds, Linux sizes them itself
+		EXPECT(convey_sockbuf_for_bdp(0, 0) == SOCKBUF_AUTO_MIN);
+		EXPECT(convey_sockbuf_for_bdp(1000000, 1000) == SOCKBUF_AUTO_MIN);
+		// 10 MB/s over 100 ms is 1 MB in flight, 2 MB buffered
+		EXPECT(convey_sockbuf_for_bdp(10000000, 100000) == 2 * 1024 * 1024);
+		EXPECT(convey_sockbuf_for_bdp(1000000000, 1000000) == SOCKBUF_AUTO_MAX);
+	}
+#endif
+
+	EXPECT(convey_queue_drop_from_string("block") == convey_queue_drop_block);
+	EXPECT(convey_queue_drop_from_string("Oldest") == convey_queue_drop_oldest);
+	EXPECT(convey_queue_drop_from_string("newest") == convey_queue_drop_newest);
+	EXPECT(convey_queue_drop_from_string("bad") == (convey_queue_drop)-1);
+
+	EXPECT(convey_io_engine_from_string("auto") == convey_io_engine_auto);
+	EXPECT(convey_io_engine_from_string("Threads") == convey_io_engine_threads);
+	EXPECT(convey_io_engine_from_string("io_uring") == convey_io_engine_uring);
+	EXPECT(convey_io_engine_from_string("epoll") == (convey_io_engine)-1);
+
+	{
+		// --serve files: pairs of listen and endpoint, comments and blank lines skipped
+		std::istringstream is("# vm consoles\n\ntcp-listen:5001 \\\\.\\pipe\\vm1\nunix-listen:/run/c2.sock tcp:10.0.0.5:4445  # vm2\n");
+		std::vector<convey_serve_spec> v;
+		std::string err;
+		EXPECT(convey_serve_parse(is, v, err));
+		EXPECT(v.size() == 2);
+		EXPECT(v[0].lts.kind == convey_tp_tcp_server && v[0].lts.port == "5001");
+		EXPECT(v[0].ets.kind == convey_tp_pipe && v[0].endpoint == "\\\\.\\pipe\\vm1");
+		EXPECT(v[1].lts.kind == convey_tp_unix_server && v[1].ets.kind == convey_tp_tcp_client);
+	}
+	{
+		// the listen side must listen, the endpoint must not, and each listen is used once
+		std::vector<convey_serve_spec> v;
+		std::string err;
+		std::istringstream a("tcp:10.0.0.5:1 tcp:10.0.0.5:2\n");
+		EXPECT(!convey_serve_parse(a, v, err) && err.find("line 1") == 0);
+		v.clear();
+		std::istringstream b("tcp-listen:5001 tcp-listen:5002\n");
+		EXPECT(!convey_serve_parse(b, v, err));
+		v.clear();
+		std::istringstream c("tcp-listen:5001 COM1\ntcp-listen:5001 COM2\n");
+		EXPECT(!convey_serve_parse(c, v, err) && err.find("line 2") == 0);
+		v.clear();
+		std::istringstream d("tcp-listen:5001\n");
+		EXPECT(!convey_serve_parse(d, v, err));
+		v.clear();
+		std::istringstream e("tcp-listen:5001 COM1 COM2\n");
+		EXPECT(!convey_serve_parse(e, v, err));
+		v.clear();
+		std::istringstream f("# nothing\n");
+		EXPECT(!convey_serve_parse(f, v, err));
+		v.clear();
+		std::istringstream g("\\\\.\\pipe\\con1 COM1\n");
+#ifdef _WIN32
+		EXPECT(convey_serve_parse(g, v, err));
+#else
+		EXPECT(!convey_serve_parse(g, v, err));
+#endif
+	}
+
+	{
+		// small writes coalesce into one chunk, kept in order
+		convey_outq q;
+		q.limit = 16;
+		EXPECT(convey_outq_put_locked(q, "ab", 2));
+		EXPECT(convey_outq_put_locked(q, "cd", 2));
+		EXPECT(q.bytes == 4);
+		EXPECT(q.chunks.size() == 1);
+		EXPECT(q.chunks.front() == "abcd");
+	}
+	{
+		// block refuses what doesn't fit, but an empty queue takes anything
+		convey_outq q;
+		q.limit = 4;
+		EXPECT(convey_outq_put_locked(q, "abc", 3));
+		EXPECT(!convey_outq_put_locked(q, "de", 2));
+		EXPECT(q.bytes == 3);
+		EXPECT(q.dropped == 0);
+		convey_outq e;
+		e.limit = 2;
+		EXPECT(convey_outq_put_locked(e, "abcdef", 6));
+		EXPECT(e.bytes == 6);
+	}
+	{
+		// newest truncates the incoming chunk to the room left
+		convey_outq q;
+		q.limit = 4;
+		q.drop = convey_queue_drop_newest;
+		EXPECT(convey_outq_put_locked(q, "abc", 3));
+		EXPECT(convey_outq_put_locked(q, "def", 3));
+		EXPECT(q.bytes == 4);
+		EXPECT(q.dropped == 2);
+		EXPECT(q.chunks.front() == "abcd");
+	}
+	{
+		// oldest evicts whole chunks from the front
+		convey_outq q;
+		q.limit = BUF_SIZE + 2;
+		q.drop = convey_queue_drop_oldest;
+		std::string big(BUF_SIZE, 'x');
+		EXPECT(convey_outq_put_locked(q, big.data(), BUF_SIZE));
+		EXPECT(convey_outq_put_locked(q, "ab", 2));
+		EXPECT(convey_outq_put_locked(q, "cd", 2));
+		EXPECT(q.dropped == BUF_SIZE);
+		EXPECT(q.bytes == 4);
+		EXPECT(q.chunks.front() == "abcd");
+	}
+	{
+		// unget puts the unsent rest back in front
+		convey_outq q;
+		q.limit = 16;
+		convey_outq_put_locked(q, "world", 5);
+		convey_outq_unget(q, std::string("hello "));
+		std::string c;
+		EXPECT(convey_outq_pop(q, c));
+		EXPECT(c == "hello ");
+		EXPECT(convey_outq_pop(q, c));
+		EXPECT(c == "world");
+		EXPECT(q.bytes == 0);
+		q.eof = true;
+		EXPECT(!convey_outq_pop(q, c));
+	}
+
 	// --- convey_conf_setup: parser functional-equivalence coverage ---
 	{
 		// Endpoint given as the first positional argument.
@@ -183,6 +1148,15 @@ int main()
 		EXPECT(conf.transport == convey_tp_tcp_server);
 		EXPECT(conf.tcp_port == "5000");
 	}
+	{
+		// unix socket endpoints.
+		EXPECT(run_setup({"convey", "unix:/run/vm0.sock"}) == convey_setup_ok);
+		EXPECT(conf.transport == convey_tp_unix_client);
+		EXPECT(conf.unix_path == "/run/vm0.sock");
+		EXPECT(run_setup({"convey", "unix-listen:/run/c.sock"}) == convey_setup_ok);
+		EXPECT(conf.transport == convey_tp_unix_server);
+		EXPECT(run_setup({"convey", "unix-listen:"}) == convey_setup_exit_err);
+	}
 	{
 		// A missing endpoint is an error.
 		EXPECT(run_setup({"convey"}) == convey_setup_exit_err);
@@ -226,10 +1200,27 @@ int main()
 	{
 		// --bridge requires --pipe-server, then arms the restart loop.
 		EXPECT(run_setup({"convey", "--bridge", "tcp:127.0.0.1:9"}) == convey_setup_exit_err);
+#ifdef _WIN32
 		EXPECT(run_setup({"convey", "--bridge", "--pipe-server", "\\\\.\\pipe\\b", "tcp:127.0.0.1:9"}) == convey_setup_ok);
 		EXPECT(conf.bridge);
 		EXPECT(conf.bridge_pipe_name == "\\\\.\\pipe\\b");
 		EXPECT(restart_on_exit);
+#else
+		// named pipe servers are Windows only
+		EXPECT(run_setup({"convey", "--bridge", "--pipe-server", "/tmp/b", "tcp:127.0.0.1:9"}) == convey_setup_exit_err);
+#endif
+	}
+	{
+		// --pty-link is a bridge to a pseudo terminal, not available on Windows.
+#ifdef _WIN32
+		EXPECT(run_setup({"convey", "--pty-link", "/tmp/vm-pty", "tcp:127.0.0.1:9"}) == convey_setup_exit_err);
+#else
+		EXPECT(run_setup({"convey", "--pty-link", "/tmp/vm-pty", "tcp:127.0.0.1:9"}) == convey_setup_ok);
+		EXPECT(conf.bridge);
+		EXPECT(conf.pty_link == "/tmp/vm-pty");
+		EXPECT(restart_on_exit);
+		EXPECT(run_setup({"convey", "--pty-link", "/tmp/vm-pty", "--pipe-server", "x", "tcp:127.0.0.1:9"}) == convey_setup_exit_err);
+#endif
 	}
 	{
 		// Log options land in the right fields.
@@ -258,6 +1249,242 @@ int main()
 		EXPECT(conf.read_only);
 	}
 
+	{
+		// the per attempt connect timeout defaults to 10 seconds and must be positive
+		EXPECT(run_setup({"convey", "tcp:127.0.0.1:9"}) == convey_setup_ok);
+		EXPECT(conf.connect_timeout == 10.0);
+		EXPECT(run_setup({"convey", "--connect-timeout", "0.5", "tcp:127.0.0.1:9"}) == convey_setup_ok);
+		EXPECT(conf.connect_timeout == 0.5);
+		EXPECT(run_setup({"convey", "--connect-timeout", "0", "tcp:127.0.0.1:9"}) == convey_setup_exit_err);
+	}
+	{
+		// the resolver cache keeps addresses for 30 seconds by default, 0 turns it off
+		EXPECT(run_setup({"convey", "tcp:127.0.0.1:9"}) == convey_setup_ok);
+		EXPECT(conf.dns_ttl == 30.0);
+		EXPECT(run_setup({"convey", "--dns-ttl", "0", "tcp:127.0.0.1:9"}) == convey_setup_ok);
+		EXPECT(conf.dns_ttl == 0.0);
+		EXPECT(run_setup({"convey", "--dns-ttl", "-1", "tcp:127.0.0.1:9"}) == convey_setup_exit_err);
+
+		// by host and port, and a connect none of them took resolves again
+		EXPECT(run_setup({"convey", "tcp:127.0.0.1:9"}) == convey_setup_ok);
+		EXPECT(convey_wsa_init());
+		std::vector<convey_addr> addrs;
+		DWORD err = 0;
+		uint64_t n = stats.resolves;
+		EXPECT(convey_resolve("127.0.0.1", "9", addrs, err) && convey_resolve("127.0.0.1", "7", addrs, err));
+		EXPECT(stats.resolves == n + 2);
+		EXPECT(convey_resolve("127.0.0.1", "9", addrs, err) && convey_resolve("127.0.0.1", "7", addrs, err));
+		EXPECT(stats.resolves == n + 2);
+		int family = AF_UNSPEC;
+		EXPECT(INVALID_SOCKET == convey_tcp_connect("127.0.0.1", "9", family, err));
+		EXPECT(stats.resolves == n + 2);
+		EXPECT(convey_resolve("127.0.0.1", "9", addrs, err) && stats.resolves == n + 3);
+		EXPECT(convey_resolve("127.0.0.1", "7", addrs, err) && stats.resolves == n + 3);
+
+		// with the lookup failing as well, the addresses that were there are kept
+		EXPECT(convey_resolve("127.0.0.1", "9", addrs, err));
+		resolve_cache.entries[std::make_pair(std::string("convey.invalid"), std::string("9"))].addrs = addrs;
+		convey_resolve_expire("convey.invalid", "9");
+		std::vector<convey_addr> kept;
+		EXPECT(convey_resolve("convey.invalid", "9", kept, err) && kept.size() == addrs.size());
+		EXPECT(resolve_cache.entries[std::make_pair(std::string("convey.invalid"), std::string("9"))].stale);
+	}
+	{
+		// keepalive and the user timeout are off unless asked for
+		EXPECT(run_setup({"convey", "tcp:127.0.0.1:9"}) == convey_setup_ok);
+		EXPECT(conf.keepalive_idle == 0);
+		EXPECT(conf.user_timeout == 0);
+		EXPECT(run_setup({"convey", "--keepalive", "5", "--keepalive-interval", "2",
+			"--keepalive-count", "3", "--user-timeout", "10", "tcp:127.0.0.1:9"}) == convey_setup_ok);
+		EXPECT(conf.keepalive_idle == 5);
+		EXPECT(conf.keepalive_interval == 2);
+		EXPECT(conf.keepalive_count == 3);
+		EXPECT(conf.user_timeout == 10);
+		EXPECT(run_setup({"convey", "--keepalive", "5", "--keepalive-count", "0", "tcp:127.0.0.1:9"}) == convey_setup_exit_err);
+	}
+	{
+		// the idle probe only applies to the bridge
+		EXPECT(run_setup({"convey", "--silence-timeout", "30", "tcp:127.0.0.1:9"}) == convey_setup_exit_err);
+#ifdef _WIN32
+		EXPECT(run_setup({"convey", "--bridge", "--pipe-server", "\\\\.\\pipe\\b", "--silence-timeout", "30", "tcp:127.0.0.1:9"}) == convey_setup_ok);
+#else
+		EXPECT(run_setup({"convey", "--pty-link", "/tmp/vm-pty", "--silence-timeout", "30", "tcp:127.0.0.1:9"}) == convey_setup_ok);
+#endif
+		EXPECT(conf.silence_timeout == 30);
+	}
+	{
+		// socket buffers keep the OS default unless asked for
+		EXPECT(run_setup({"convey", "tcp:127.0.0.1:9"}) == convey_setup_ok);
+		EXPECT(conf.sndbuf == 0);
+		EXPECT(conf.rcvbuf == 0);
+		EXPECT(run_setup({"convey", "--sndbuf", "1m", "--rcvbuf", "auto", "tcp:127.0.0.1:9"}) == convey_setup_ok);
+		EXPECT(conf.sndbuf == 1024 * 1024);
+		EXPECT(conf.rcvbuf == SOCKBUF_AUTO);
+		EXPECT(run_setup({"convey", "--rcvbuf", "lots", "tcp:127.0.0.1:9"}) == convey_setup_exit_err);
+	}
+	{
+		// the io engine is picked at run time unless asked for
+		EXPECT(run_setup({"convey", "tcp:127.0.0.1:9"}) == convey_setup_ok);
+		EXPECT(conf.io_engine == convey_io_engine_auto);
+		EXPECT(run_setup({"convey", "--io-engine", "threads", "tcp:127.0.0.1:9"}) == convey_setup_ok);
+		EXPECT(conf.io_engine == convey_io_engine_threads);
+		EXPECT(run_setup({"convey", "--io-engine", "epoll", "tcp:127.0.0.1:9"}) == convey_setup_exit_err);
+#ifdef CONVEY_HAVE_URING
+		EXPECT(run_setup({"convey", "--io-engine", "io_uring", "tcp:127.0.0.1:9"}) == convey_setup_ok);
+		EXPECT(conf.io_engine == convey_io_engine_uring);
+#else
+		EXPECT(run_setup({"convey", "--io-engine", "io_uring", "tcp:127.0.0.1:9"}) == convey_setup_exit_err);
+#endif
+	}
+	{
+		// --serve reads the sessions from a file and excludes a target and the bridge
+		const char* path = "convey_unit_serve.conf";
+		std::ofstream(path) << "tcp-listen:5001 tcp:127.0.0.1:9\ntcp-listen:5002 COM1\n";
+		EXPECT(run_setup({"convey", "--serve", path}) == convey_setup_ok);
+		EXPECT(conf.serve.size() == 2);
+		EXPECT(conf.serve_workers == 2);
+		EXPECT(run_setup({"convey", "--serve", path, "--workers", "8"}) == convey_setup_ok);
+		EXPECT(conf.serve_workers == 8);
+		EXPECT(run_setup({"convey", "--serve", path, "--workers", "0"}) == convey_setup_exit_err);
+		EXPECT(run_setup({"convey", "--serve", path, "COM1"}) == convey_setup_exit_err);
+		EXPECT(run_setup({"convey", "--serve", path, "--log", "x.log"}) == convey_setup_exit_err);
+		EXPECT(run_setup({"convey", "--serve", path, "--bridge"}) == convey_setup_exit_err);
+		EXPECT(run_setup({"convey", "--serve", "/nonexistent/convey.conf"}) == convey_setup_exit_err);
+		// --control only goes with --serve, it takes a pipe name on Windows
+		EXPECT(run_setup({"convey", "--control", "convey.ctl", "COM1"}) == convey_setup_exit_err);
+#ifdef _WIN32
+		EXPECT(run_setup({"convey", "--serve", path, "--control", "\\\\.\\pipe\\convey"}) == convey_setup_ok);
+		EXPECT(run_setup({"convey", "--serve", path, "--control", "convey.ctl"}) == convey_setup_exit_err);
+#else
+		EXPECT(run_setup({"convey", "--serve", path, "--control", "/tmp/convey.ctl"}) == convey_setup_ok);
+		EXPECT(conf.serve_control == "/tmp/convey.ctl");
+#endif
+		std::remove(path);
+	}
+	{
+		// the outbound queue is off by default and blocks when full
+		EXPECT(run_setup({"convey", "COM1"}) == convey_setup_ok);
+		EXPECT(conf.queue_limit == 0);
+		EXPECT(conf.queue_drop == convey_queue_drop_block);
+		EXPECT(run_setup({"convey", "--queue-limit", "65536", "--queue-drop", "oldest", "COM1"}) == convey_setup_ok);
+		EXPECT(conf.queue_limit == 65536);
+		EXPECT(conf.queue_drop == convey_queue_drop_oldest);
+		EXPECT(run_setup({"convey", "--queue-drop", "bogus", "COM1"}) == convey_setup_exit_err);
+	}
+	{
+		// --rfc2217-listen bridges a local port to Telnet clients
+		EXPECT(run_setup({"convey", "--rfc2217-listen", "2217", "COM1"}) == convey_setup_ok);
+		EXPECT(conf.bridge);
+		EXPECT(conf.rfc2217_port == "2217");
+		EXPECT(restart_on_exit);
+		EXPECT(run_setup({"convey", "--rfc2217-listen", "2217", "tcp:127.0.0.1:9"}) == convey_setup_exit_err);
+		EXPECT(run_setup({"convey", "--rfc2217-listen", "2217", "--bridge", "--pipe-server", "x", "COM1"}) == convey_setup_exit_err);
+		EXPECT(run_setup({"convey", "rfc2217:127.0.0.1:2217"}) == convey_setup_ok);
+		EXPECT(conf.transport == convey_tp_rfc2217);
+		EXPECT(run_setup({"convey", "rfc2217:2217"}) == convey_setup_exit_err);
+		// --gdb is a bridge mode
+		EXPECT(run_setup({"convey", "--gdb", "COM1"}) == convey_setup_exit_err);
+#ifdef _WIN32
+		EXPECT(run_setup({"convey", "--gdb", "--bridge", "--pipe-server", "\\\\.\\pipe\\kgdb", "COM1"}) == convey_setup_ok);
+#else
+		EXPECT(run_setup({"convey", "--gdb", "--pty-link", "/tmp/kgdb", "COM1"}) == convey_setup_ok);
+#endif
+		EXPECT(conf.gdb && conf.gdb_cache && !conf.gdb_widen);
+#ifndef _WIN32
+		EXPECT(run_setup({"convey", "--gdb", "--gdb-no-cache", "--pty-link", "/tmp/kgdb", "COM1"}) == convey_setup_ok);
+		EXPECT(conf.gdb && !conf.gdb_cache);
+		EXPECT(run_setup({"convey", "--gdb", "--gdb-widen", "--pty-link", "/tmp/kgdb", "COM1"}) == convey_setup_ok);
+		EXPECT(conf.gdb && conf.gdb_widen);
+		EXPECT(run_setup({"convey", "--gdb", "--gdb-widen", "--gdb-no-cache", "--pty-link", "/tmp/kgdb", "COM1"}) == convey_setup_exit_err);
+#endif
+		EXPECT(run_setup({"convey", "--gdb-no-cache", "COM1"}) == convey_setup_exit_err);
+		EXPECT(run_setup({"convey", "--gdb-widen", "COM1"}) == convey_setup_exit_err);
+		EXPECT(run_setup({"convey", "--gdb", "--rfc2217-listen", "2217", "COM1"}) == convey_setup_exit_err);
+		// --kd too, and not along with --gdb
+		EXPECT(run_setup({"convey", "--kd", "COM1"}) == convey_setup_exit_err);
+#ifdef _WIN32
+		EXPECT(run_setup({"convey", "--kd", "--bridge", "--pipe-server", "\\\\.\\pipe\\kd0", "COM1"}) == convey_setup_ok);
+		EXPECT(conf.kd);
+		EXPECT(run_setup({"convey", "--kd", "--gdb", "--bridge", "--pipe-server", "\\\\.\\pipe\\kd0", "COM1"}) == convey_setup_exit_err);
+#else
+		EXPECT(run_setup({"convey", "--kd", "--pty-link", "/tmp/kd0", "COM1"}) == convey_setup_ok);
+		EXPECT(conf.kd);
+		EXPECT(run_setup({"convey", "--kd", "--gdb", "--pty-link", "/tmp/kd0", "COM1"}) == convey_setup_exit_err);
+#endif
+		// a transfer goes one way, on the endpoint alone
+		EXPECT(run_setup({"convey", "--zsend", "a.bin", "--zsend", "b.bin", "COM1"}) == convey_setup_ok);
+		EXPECT(conf.zsend_files.size() == 2 && conf.xfer_proto == convey_xfer_zmodem);
+		EXPECT(run_setup({"convey", "--zrecv", ".", "--xfer-protocol", "YMODEM", "COM1"}) == convey_setup_ok);
+		EXPECT(conf.zrecv_dir == "." && conf.xfer_proto == convey_xfer_ymodem);
+		EXPECT(run_setup({"convey", "--zrecv", ".", "--xfer-protocol", "kermit", "COM1"}) == convey_setup_exit_err);
+		EXPECT(run_setup({"convey", "--zrecv", ".", "--zsend", "a.bin", "COM1"}) == convey_setup_exit_err);
+		EXPECT(run_setup({"convey", "--zrecv", ".", "--read-only", "COM1"}) == convey_setup_exit_err);
+		EXPECT(run_setup({"convey", "--send-file", "initrd.img", "COM1"}) == convey_setup_ok);
+		EXPECT(conf.send_file == "initrd.img");
+		EXPECT(run_setup({"convey", "--recv-file", "dump.bin", "--silence-timeout", "5", "COM1"}) == convey_setup_ok);
+		EXPECT(conf.recv_file == "dump.bin" && conf.silence_timeout == 5);
+		EXPECT(run_setup({"convey", "--send-file", "a.bin", "--recv-file", "b.bin", "COM1"}) == convey_setup_exit_err);
+		EXPECT(run_setup({"convey", "--send-file", "a.bin", "--zsend", "b.bin", "COM1"}) == convey_setup_exit_err);
+		EXPECT(run_setup({"convey", "--send-file", "a.bin", "--read-only", "COM1"}) == convey_setup_exit_err);
+
+		// --mux channels, each a local endpoint
+		EXPECT(run_setup({"convey", "--mux", "tcp-listen:7000", "--mux", "tcp:127.0.0.1:2345", "COM1"}) == convey_setup_ok);
+		EXPECT(conf.mux.size() == 2 && conf.mux[0].kind == convey_mux_listen && conf.mux[1].kind == convey_mux_connect);
+		EXPECT(conf.mux[1].sp.ets.port == "2345");
+		EXPECT(run_setup({"convey", "--mux", "ws-listen:7000", "COM1"}) == convey_setup_exit_err);
+		EXPECT(run_setup({"convey", "--mux", "tcp-listen:7000", "--zsend", "a.bin", "COM1"}) == convey_setup_exit_err);
+		EXPECT(run_setup({"convey", "--mux", "tcp-listen:7000", "--read-only", "COM1"}) == convey_setup_exit_err);
+		EXPECT(run_setup({"convey", "--mux", "tcp-listen:7000", "--compress", "COM1"}) == convey_setup_ok && conf.compress);
+		EXPECT(run_setup({"convey", "--compress", "COM1"}) == convey_setup_exit_err);
+	}
+	{
+		// --resume between tcp: and tcp-listen:, the input queued meanwhile
+		EXPECT(run_setup({"convey", "--reconnect", "--resume", "tcp:127.0.0.1:2345"}) == convey_setup_ok);
+		EXPECT(conf.resume && conf.queue_limit == conf.resume_buffer);
+		EXPECT(run_setup({"convey", "--reconnect", "--resume", "--queue-limit", "4096", "--resume-buffer", "65536", "tcp-listen:2345"}) == convey_setup_ok);
+		EXPECT(conf.queue_limit == 4096 && conf.resume_buffer == 65536);
+		EXPECT(run_setup({"convey", "--resume", "tcp:127.0.0.1:2345"}) == convey_setup_exit_err);
+		EXPECT(run_setup({"convey", "--reconnect", "--resume", "COM1"}) == convey_setup_exit_err);
+		EXPECT(run_setup({"convey", "--reconnect", "--resume", "--resume-buffer", "100", "tcp:127.0.0.1:2345"}) == convey_setup_exit_err);
+		EXPECT(run_setup({"convey", "--reconnect", "--resume", "--mux", "tcp-listen:7000", "tcp:127.0.0.1:2345"}) == convey_setup_exit_err);
+#ifdef _WIN32
+		EXPECT(run_setup({"convey", "--mux", "\\\\.\\pipe\\console", "COM1"}) == convey_setup_ok);
+		EXPECT(conf.mux[0].kind == convey_mux_listen);
+		EXPECT(run_setup({"convey", "--mux", "pty:/tmp/console", "COM1"}) == convey_setup_exit_err);
+#else
+		EXPECT(run_setup({"convey", "--mux", "pty:/tmp/console", "--mux", "/dev/ttyS1", "COM1"}) == convey_setup_ok);
+		EXPECT(conf.mux[0].kind == convey_mux_pty && conf.mux[0].sp.listen == "/tmp/console");
+		EXPECT(conf.mux[1].kind == convey_mux_connect);
+		EXPECT(run_setup({"convey", "--mux", "\\\\.\\pipe\\console", "COM1"}) == convey_setup_exit_err);
+#endif
+		std::vector<const char*> many{"convey"};
+		for (int i = 0; i <= MUX_CHANNELS; i++) {
+			many.push_back("--mux");
+			many.push_back("tcp:127.0.0.1:1");
+		}
+		many.push_back("COM1");
+		EXPECT(run_setup(many) == convey_setup_exit_err);
+	}
+#ifndef _WIN32
+	{
+		// ctrl-a commands are taken out of the raw terminal input
+		char buf[] = "ab\x01" "acd\x01";
+		bool pending = false, quit = false;
+		EXPECT(convey_ctrl_filter(buf, 7, pending, quit) == 5);
+		EXPECT(std::string(buf, 5) == "ab\x01" "cd");
+		EXPECT(pending && !quit);
+		char q[] = "qzz";
+		EXPECT(convey_ctrl_filter(q, 3, pending, quit) == 0);
+		EXPECT(quit);
+	}
+	{
+		// termios speeds exist for the common rates only
+		EXPECT(convey_baud_to_speed(CBR_115200) == B115200);
+		EXPECT(convey_baud_to_speed(CBR_9600) == B9600);
+		EXPECT(convey_baud_to_speed(CBR_14400) == B0);
+	}
+#endif
+
 	if (g_fail) {
 		std::cerr << g_fail << " unit test(s) failed." << std::endl;
 		return 1;